@@ -1,14 +1,37 @@
 #include "express/express.h"
 
+#include "express/arena_pool.h"
+#include "express/batch_kernels.h"
+#include "express/expression_set.h"
+#include "express/filter_program.h"
+#include "express/flat_tree.h"
+#include "express/formula_graph.h"
+#include "express/formula_registry.h"
+#include "express/huge_page_resource.h"
+#include "express/incremental_program.h"
 #include "express/lexer.h"
 #include "express/lexer_delegate.h"
 #include "express/parser.h"
 #include "express/parser_delegate.h"
+#include "express/static_expression.h"
+#include "express/thread_pool.h"
 
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
+#include <memory_resource>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
+
+// Defined by the source generated from generated_formulas.txt.
+void RegisterBenchmarkFormulas(expression::FormulaRegistry& registry);
+
+// Global operator new calls of the current thread, counted by
+// tests/heap_counter.cpp.
+extern thread_local size_t heap_allocation_count;
 
 namespace expression {
 namespace {
@@ -50,15 +73,22 @@ class BenchmarkParserDelegate : public BasicParserDelegate<PolymorphicToken> {
 
  private:
   PolymorphicToken MakeVariableToken(std::string_view name) {
+    // One token per variable lets the parser share subtrees over it.
+    if (auto token = tokens_.find(name); token != tokens_.end())
+      return token->second;
+
     auto i = variables_.find(name);
     if (i == variables_.end())
       throw std::runtime_error{"Unknown variable name"};
 
-    return MakePolymorphicToken<BenchmarkVariableToken>(
+    auto token = MakePolymorphicToken<BenchmarkVariableToken>(
         allocator_, i->first, i->second);
+    tokens_.emplace(i->first, token);
+    return token;
   }
 
   const BenchmarkVariables& variables_;
+  std::unordered_map<std::string_view, PolymorphicToken> tokens_;
 };
 
 class BenchmarkFormatterDelegate : public FormatterDelegate {
@@ -172,6 +202,770 @@ void BM_Evaluate(benchmark::State& state) {
   state.SetLabel(benchmark_case.name);
 }
 
+// Runs one batch kernel over 4096 rows. The first argument selects the
+// kernel, the second the instruction set: scalar, SSE2 or AVX2.
+void BM_BatchKernel(benchmark::State& state) {
+  constexpr size_t kRowCount = 4096;
+  const BatchKernels* const kKernels[] = {
+      &GetScalarBatchKernels(), GetSse2BatchKernels(), GetAvx2BatchKernels()};
+  const BatchKernels* kernels = kKernels[state.range(1)];
+  if (!kernels) {
+    state.SkipWithError("instruction set is not supported");
+    return;
+  }
+
+  std::vector<double> left(kRowCount);
+  std::vector<double> right(kRowCount);
+  std::vector<double> results(kRowCount);
+  for (size_t i = 0; i < kRowCount; ++i) {
+    left[i] = static_cast<double>(i % 17) - 8;
+    right[i] = static_cast<double>(i % 5) + 0.5;
+  }
+
+  static const char* const kNames[] = {"add", "less", "sqrt", "min", "if"};
+  for (auto _ : state) {
+    switch (state.range(0)) {
+      case 0:
+        kernels->add(left.data(), right.data(), results.data(), kRowCount);
+        break;
+      case 1:
+        kernels->less(left.data(), right.data(), results.data(), kRowCount);
+        break;
+      case 2:
+        kernels->sqrt(right.data(), results.data(), kRowCount);
+        break;
+      case 3:
+        kernels->min(left.data(), right.data(), results.data(), kRowCount);
+        break;
+      case 4:
+        kernels->blend(left.data(), left.data(), right.data(), results.data(),
+                       kRowCount);
+        break;
+    }
+    benchmark::DoNotOptimize(results.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kRowCount);
+  state.SetLabel(std::string{kNames[state.range(0)]} + "/" + kernels->name);
+}
+
+void BM_CompiledEvaluate(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  Expression expression;
+  ParseExpression(benchmark_case, expression);
+  expression.Compile();
+  for (auto _ : state) {
+    auto value = expression.Calculate();
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(benchmark_case.name);
+}
+
+void BM_NumericEvaluate(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  Expression expression;
+  ParseExpression(benchmark_case, expression);
+  expression.Compile();
+  if (!expression.is_numeric()) {
+    state.SkipWithError("expression is not numeric");
+    return;
+  }
+  for (auto _ : state) {
+    auto value = expression.CalculateNumber();
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(benchmark_case.name);
+}
+
+// Range 0 walks the tree, range 1 runs the compiled program, which
+// evaluates the repeated hypotenuse once.
+void BM_SharedSubtreeEvaluate(benchmark::State& state) {
+  static const BenchmarkCase kCase = {
+      "shared_hypot",
+      "If(a > b, Sqrt(a * a + b * b), Sqrt(a * a + b * b) / 2) + "
+      "Sqrt(a * a + b * b) * Sqrt(a * a + b * b)",
+      {{"a", 3}, {"b", 4}}};
+  Expression expression;
+  ParseExpression(kCase, expression);
+  if (state.range(0))
+    expression.Compile();
+  for (auto _ : state) {
+    auto value = expression.Calculate();
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(state.range(0) ? "compiled" : "tree");
+}
+
+// Evaluates the variable_heavy formula bound through a SymbolTable. Range 0
+// walks the tree with Value slots, range 1 runs the compiled program and
+// range 2 the numeric program with double slots.
+void BM_SlotEvaluate(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(3);
+  SymbolTable symbol_table;
+  std::vector<Value> values;
+  std::vector<double> numbers;
+  for (const auto& [name, value] : benchmark_case.variables) {
+    const size_t slot = symbol_table.Declare(name, StaticType::Number);
+    values.resize(slot + 1);
+    numbers.resize(slot + 1);
+    values[slot] = value;
+    numbers[slot] = static_cast<double>(value);
+  }
+
+  Expression expression;
+  expression.Parse(benchmark_case.formula, symbol_table);
+  EvaluationContext context;
+  context.values = values.data();
+  if (state.range(0) != 0)
+    expression.Compile();
+  if (state.range(0) == 2) {
+    context.values = nullptr;
+    context.numbers = numbers.data();
+  }
+
+  for (auto _ : state) {
+    if (state.range(0) == 2) {
+      auto value = expression.CalculateNumber(context);
+      benchmark::DoNotOptimize(value);
+    } else {
+      auto value = expression.Calculate(context);
+      benchmark::DoNotOptimize(value);
+    }
+    benchmark::ClobberMemory();
+  }
+  static const char* const kLabels[] = {"tree", "compiled", "numeric"};
+  state.SetLabel(kLabels[state.range(0)]);
+}
+
+// Evaluates numeric formulas over declared number variables. Range 0 picks
+// the formula; range 1 evaluates the tree, the numeric program or the native
+// code.
+void BM_JitEvaluate(benchmark::State& state) {
+  static const char* const kFormulas[] = {
+      "alpha + beta * gamma - delta / epsilon",
+      "If(alpha > beta, Sqrt(alpha * alpha + beta * beta), Abs(gamma - delta)) "
+      "+ Min(alpha, beta, gamma) * Sign(epsilon)",
+      "Max(alpha * 1.5, beta / 2, gamma) ^ 2 + And(alpha < 10, beta >= 0) - "
+      "Sin(delta) * (epsilon = 5)",
+  };
+  const auto& benchmark_case = GetCase(3);
+  SymbolTable symbol_table;
+  std::vector<double> numbers;
+  for (const auto& [name, value] : benchmark_case.variables) {
+    const size_t slot = symbol_table.Declare(name, StaticType::Number);
+    numbers.resize(slot + 1);
+    numbers[slot] = static_cast<double>(value);
+  }
+
+  Expression expression;
+  expression.Parse(kFormulas[state.range(0)], symbol_table);
+  if (state.range(1) == 1)
+    expression.Compile();
+  else if (state.range(1) == 2 && !expression.CompileNative())
+    state.SkipWithError("native code generation is not available");
+  EvaluationContext context;
+  context.numbers = numbers.data();
+
+  for (auto _ : state) {
+    auto value = expression.Calculate(context);
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  static const char* const kLabels[] = {"tree", "numeric", "native"};
+  state.SetLabel(kLabels[state.range(1)]);
+}
+
+// Evaluates BM_JitEvaluate's formulas with native code generated at run
+// time (range 1 = 0) or C++ generated ahead of time (range 1 = 1).
+void BM_GeneratedEvaluate(benchmark::State& state) {
+  static const char* const kFormulas[] = {
+      "alpha + beta * gamma - delta / epsilon",
+      "If(alpha > beta, Sqrt(alpha * alpha + beta * beta), Abs(gamma - delta)) "
+      "+ Min(alpha, beta, gamma) * Sign(epsilon)",
+      "Max(alpha * 1.5, beta / 2, gamma) ^ 2 + And(alpha < 10, beta >= 0) - "
+      "Sin(delta) * (epsilon = 5)",
+  };
+  // Parsing in the order of generated_formulas.txt assigns the slots of the
+  // generated code.
+  SymbolTable symbol_table;
+  for (const char* formula : kFormulas)
+    Expression{}.Parse(formula, symbol_table);
+  std::vector<double> numbers(symbol_table.size());
+  for (const auto& [name, value] : GetCase(3).variables) {
+    if (auto slot = symbol_table.Find(name)) {
+      symbol_table.Declare(name, StaticType::Number);
+      numbers[*slot] = static_cast<double>(value);
+    }
+  }
+
+  const char* formula = kFormulas[state.range(0)];
+  Expression expression;
+  expression.Parse(formula, symbol_table);
+  if (state.range(1) == 0 && !expression.CompileNative())
+    state.SkipWithError("native code generation is not available");
+  EvaluationContext context;
+  context.numbers = numbers.data();
+
+  FormulaRegistry registry;
+  RegisterBenchmarkFormulas(registry);
+  const GeneratedFunction function = registry.Find(formula)->function;
+
+  for (auto _ : state) {
+    const double value = state.range(1) == 0
+                             ? expression.CalculateNumber(context)
+                             : function(numbers.data());
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(state.range(1) == 0 ? "native" : "generated");
+}
+
+// Parses and evaluates a hard-coded formula at run time (range 0), evaluates
+// it parsed and compiled once (range 1), or evaluates the formula parsed at
+// compile time (range 2).
+void BM_StaticExpression(benchmark::State& state) {
+  static constexpr auto kFormula = EXPRESS_STATIC_EXPRESSION(
+      "If(alpha > beta, alpha - beta, beta * 2) + Min(gamma, 3) * 1.5");
+  SymbolTable symbol_table;
+  std::vector<double> numbers;
+  for (size_t slot = 0; slot < kFormula.variable_count(); ++slot) {
+    symbol_table.Declare(kFormula.variable_name(slot), StaticType::Number);
+    numbers.push_back(static_cast<double>(slot + 1));
+  }
+  const std::string text{kFormula.text()};
+  EvaluationContext context;
+  context.numbers = numbers.data();
+
+  Expression compiled;
+  compiled.Parse(text.c_str(), symbol_table);
+  compiled.Compile();
+
+  for (auto _ : state) {
+    double value = 0;
+    if (state.range(0) == 0) {
+      Expression expression;
+      expression.Parse(text.c_str(), symbol_table);
+      value = expression.Calculate(context);
+    } else if (state.range(0) == 1) {
+      value = compiled.CalculateNumber(context);
+    } else {
+      value = kFormula.Calculate(numbers.data());
+    }
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  static const char* const kLabels[] = {"parse", "compiled", "static"};
+  state.SetLabel(kLabels[state.range(0)]);
+}
+
+// Loads the cases with the standard parser delegate. Even ranges parse the
+// text, odd ranges load the serialized image.
+void BM_Deserialize(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0) / 2));
+  SymbolTable symbol_table;
+  for (const auto& [name, value] : benchmark_case.variables)
+    symbol_table.Declare(name, StaticType::Number);
+
+  Expression parsed;
+  parsed.Parse(benchmark_case.formula, symbol_table);
+  const std::string image = parsed.Serialize();
+
+  for (auto _ : state) {
+    Expression expression;
+    if (state.range(0) % 2 == 0)
+      expression.Parse(benchmark_case.formula, symbol_table);
+    else
+      expression.Deserialize(image, symbol_table);
+    benchmark::DoNotOptimize(expression);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(0) % 2 ? "/image" : "/parse"));
+}
+
+// Copies the cases parsed with the standard parser delegate. Range 1
+// selects parsing the text again or cloning the parsed expression.
+void BM_Clone(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  SymbolTable symbol_table;
+  for (const auto& [name, value] : benchmark_case.variables)
+    symbol_table.Declare(name, StaticType::Number);
+
+  Expression parsed;
+  parsed.Parse(benchmark_case.formula, symbol_table);
+
+  for (auto _ : state) {
+    Expression expression;
+    if (state.range(1) == 0)
+      expression.Parse(benchmark_case.formula, symbol_table);
+    else
+      parsed.Clone(expression);
+    benchmark::DoNotOptimize(expression);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(1) ? "/clone" : "/parse"));
+}
+
+// Walks the tree of the cases parsed with the standard parser delegate.
+// Range 1 compacts the arena after parsing.
+void BM_CompactedEvaluate(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  SymbolTable symbol_table;
+  std::vector<Value> values;
+  for (const auto& [name, value] : benchmark_case.variables) {
+    const size_t slot = symbol_table.Declare(name, StaticType::Number);
+    values.resize(std::max(values.size(), slot + 1));
+    values[slot] = value;
+  }
+  EvaluationContext context;
+  context.values = values.data();
+
+  Expression expression;
+  expression.set_compact_on_parse(state.range(1) != 0);
+  expression.Parse(benchmark_case.formula, symbol_table);
+  for (auto _ : state) {
+    auto value = expression.Calculate(context);
+    benchmark::DoNotOptimize(value);
+    benchmark::ClobberMemory();
+  }
+  state.counters["capacity"] =
+      static_cast<double>(expression.allocator().capacity());
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(1) ? "/compacted" : "/parsed"));
+}
+
+// Evaluates many copies of a case parsed into one arena, in an order that
+// jumps across it. Range 1 takes the arena from the heap or from huge pages.
+void BM_HugePageEvaluate(benchmark::State& state) {
+  constexpr size_t kTreeCount = 20000;
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  SymbolTable symbol_table;
+  std::vector<Value> values;
+  for (const auto& [name, value] : benchmark_case.variables) {
+    const size_t slot = symbol_table.Declare(name, StaticType::Number);
+    values.resize(std::max(values.size(), slot + 1));
+    values[slot] = value;
+  }
+  EvaluationContext context;
+  context.values = values.data();
+
+  HugePageResource huge_pages;
+  Allocator allocator{state.range(1) ? &huge_pages
+                                     : std::pmr::new_delete_resource()};
+  const size_t formula_size =
+      std::char_traits<char>::length(benchmark_case.formula);
+  allocator.reserve_bytes(kTreeCount * formula_size * 8);
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_symbol_table(&symbol_table);
+  std::vector<PolymorphicToken> trees;
+  for (size_t i = 0; i < kTreeCount; ++i) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{benchmark_case.formula, lexer_delegate, 0};
+    BasicParser<Lexer, decltype(parser_delegate)> parser{lexer,
+                                                         parser_delegate};
+    trees.push_back(parser.Parse<PolymorphicToken>());
+  }
+  // A stride coprime with the count visits every tree once per pass.
+  std::vector<PolymorphicToken> order;
+  for (size_t i = 0; i < kTreeCount; ++i)
+    order.push_back(trees[i * 7919 % kTreeCount]);
+
+  for (auto _ : state) {
+    for (const auto& tree : order) {
+      auto value = tree.Calculate(&context);
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kTreeCount);
+  state.counters["mapped"] =
+      static_cast<double>(huge_pages.stats().mapped_bytes);
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(1) ? "/huge_pages" : "/heap"));
+}
+
+// Parses and discards the cases with the standard parser delegate. Range 1
+// disables or enables the arena pools of the thread. "allocations" counts
+// global operator new calls per parse.
+void BM_ParseAndDiscard(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  SymbolTable symbol_table;
+  for (const auto& [name, value] : benchmark_case.variables)
+    symbol_table.Declare(name, StaticType::Number);
+
+  ArenaPool& pool = *ArenaPool::ForThread();
+  ArenaPool& scratch_pool = *ArenaPool::ForScratch();
+  const size_t max_arenas =
+      state.range(1) ? ArenaPool::kDefaultMaxArenas : 0;
+  pool.set_max_arenas(max_arenas);
+  scratch_pool.set_max_arenas(max_arenas);
+  AllocatorStats stats;
+  const size_t allocations = heap_allocation_count;
+  for (auto _ : state) {
+    Expression expression;
+    expression.Parse(benchmark_case.formula, symbol_table);
+    stats = expression.allocator().stats();
+    benchmark::ClobberMemory();
+  }
+  state.counters["allocations"] = benchmark::Counter(
+      static_cast<double>(heap_allocation_count - allocations),
+      benchmark::Counter::kAvgIterations);
+  pool.set_max_arenas(ArenaPool::kDefaultMaxArenas);
+  scratch_pool.set_max_arenas(ArenaPool::kDefaultMaxArenas);
+  state.counters["requested"] = static_cast<double>(stats.requested_bytes);
+  state.counters["reserved"] = static_cast<double>(stats.reserved_bytes);
+  state.counters["waste"] = static_cast<double>(stats.alignment_waste);
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(1) ? "/pooled" : "/unpooled"));
+}
+
+// Parses generated formulas of 2000 terms: a sum, nested parentheses and a
+// unary chain over variables. Range 1 parses by recursive descent or with
+// the explicit stacks of BasicParser::Parse.
+void BM_GeneratedParse(benchmark::State& state) {
+  constexpr int kTermCount = 2000;
+  std::string formula;
+  switch (state.range(0)) {
+    case 0:
+      formula = "A";
+      for (int i = 1; i < kTermCount; ++i)
+        formula += i % 2 ? " + B * " + std::to_string(i) : " - A";
+      break;
+    case 1:
+      formula = std::string(kTermCount, '(') + "A";
+      for (int i = 0; i < kTermCount; ++i)
+        formula += " + B)";
+      break;
+    case 2:
+      for (int i = 0; i < kTermCount; ++i)
+        formula += "- ";
+      formula += "A";
+      break;
+  }
+  SymbolTable symbol_table;
+  symbol_table.Declare("A", StaticType::Number);
+  symbol_table.Declare("B", StaticType::Number);
+
+  for (auto _ : state) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{formula.c_str(), lexer_delegate, 0};
+    Allocator allocator;
+    BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+    parser_delegate.set_symbol_table(&symbol_table);
+    BasicParser<Lexer, decltype(parser_delegate)> parser{lexer,
+                                                         parser_delegate};
+    if (state.range(1)) {
+      auto root_token = parser.Parse<PolymorphicToken>();
+      benchmark::DoNotOptimize(root_token);
+    } else {
+      parser.ReadLexem();
+      auto root_token = parser.MakeBinaryOperator<PolymorphicToken>(0);
+      benchmark::DoNotOptimize(root_token);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(formula.size()));
+  static constexpr const char* kShapeNames[] = {"sum", "nested", "unary"};
+  state.SetLabel(std::string{kShapeNames[state.range(0)]} +
+                 (state.range(1) ? "/iterative" : "/recursive"));
+}
+
+// Parses a sum of range 0 numbers, as pasted by a user. Range 1 sets a byte
+// budget of 16 KiB, which rejects the longer sums.
+void BM_BudgetedParse(benchmark::State& state) {
+  std::string formula = "0";
+  for (int64_t i = 1; i < state.range(0); ++i)
+    formula += " + " + std::to_string(i);
+
+  size_t bytes = 0;
+  size_t rejected = 0;
+  for (auto _ : state) {
+    Expression expression;
+    if (state.range(1))
+      expression.set_budget({16 * 1024, kUnlimited});
+    try {
+      expression.Parse(formula.c_str());
+      bytes = expression.usage().bytes;
+    } catch (const BudgetExceededError& error) {
+      bytes = error.usage().bytes;
+      ++rejected;
+    }
+    benchmark::ClobberMemory();
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+  state.counters["rejected"] =
+      benchmark::Counter(static_cast<double>(rejected),
+                         benchmark::Counter::kAvgIterations);
+  state.SetLabel(state.range(1) ? "budget" : "unlimited");
+}
+
+// Parses and discards the cases. Range 1 takes arenas from the heap, from the
+// arena pool of the thread, or uses a 1 KiB inline arena without the pool.
+void BM_InlineArenaParse(benchmark::State& state) {
+  static constexpr const char* kArenaNames[] = {"heap", "pooled", "inline"};
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  SymbolTable symbol_table;
+  for (const auto& [name, value] : benchmark_case.variables)
+    symbol_table.Declare(name, StaticType::Number);
+
+  ArenaPool& pool = *ArenaPool::ForThread();
+  pool.set_max_arenas(state.range(1) == 1 ? ArenaPool::kDefaultMaxArenas : 0);
+  size_t chunk_count = 0;
+  for (auto _ : state) {
+    if (state.range(1) == 2) {
+      BasicExpression<PolymorphicToken, 1024> expression;
+      expression.Parse(benchmark_case.formula, symbol_table);
+      chunk_count = expression.allocator().stats().chunk_count;
+      benchmark::ClobberMemory();
+    } else {
+      Expression expression;
+      expression.Parse(benchmark_case.formula, symbol_table);
+      chunk_count = expression.allocator().stats().chunk_count;
+      benchmark::ClobberMemory();
+    }
+  }
+  pool.set_max_arenas(ArenaPool::kDefaultMaxArenas);
+  state.counters["chunks"] = static_cast<double>(chunk_count);
+  state.SetLabel(std::string{benchmark_case.name} + "/" +
+                 kArenaNames[state.range(1)]);
+}
+
+// Evaluates the variable_heavy formula over columns of rows. Range 0 calls
+// the numeric program once per row, range 1 evaluates block by block.
+void BM_BatchEvaluate(benchmark::State& state) {
+  constexpr size_t kRowCount = 100000;
+  const auto& benchmark_case = GetCase(3);
+  SymbolTable symbol_table;
+  std::vector<std::vector<double>> columns;
+  for (const auto& [name, value] : benchmark_case.variables) {
+    const size_t slot = symbol_table.Declare(name, StaticType::Number);
+    columns.resize(std::max(columns.size(), slot + 1));
+    columns[slot].resize(kRowCount);
+    for (size_t i = 0; i < kRowCount; ++i)
+      columns[slot][i] = static_cast<double>(value) + static_cast<double>(i);
+  }
+  std::vector<const double*> column_data;
+  for (const auto& column : columns)
+    column_data.emplace_back(column.data());
+
+  Expression expression;
+  expression.Parse(benchmark_case.formula, symbol_table);
+  expression.CompileBatch();
+  std::vector<double> results(kRowCount);
+
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      std::vector<double> row(columns.size());
+      EvaluationContext context;
+      context.numbers = row.data();
+      for (size_t i = 0; i < kRowCount; ++i) {
+        for (size_t slot = 0; slot < columns.size(); ++slot)
+          row[slot] = columns[slot][i];
+        results[i] = expression.CalculateNumber(context);
+      }
+    } else {
+      expression.CalculateBatch(column_data.data(), kRowCount,
+                                results.data());
+    }
+    benchmark::DoNotOptimize(results.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kRowCount);
+  state.SetLabel(state.range(0) ? "batch" : "rows");
+}
+
+// Updates one of 256 variables read by 1000 formulas of four variables each
+// and re-evaluates every formula. Range 0 runs the compiled programs, range 1
+// invalidates the slot in every incremental program and only recomputes the
+// paths from the updated variable.
+void BM_IncrementalEvaluate(benchmark::State& state) {
+  constexpr size_t kVariableCount = 256;
+  constexpr size_t kFormulaCount = 1000;
+  SymbolTable symbol_table;
+  for (size_t i = 0; i < kVariableCount; ++i)
+    symbol_table.Declare("v" + std::to_string(i), StaticType::Number);
+  std::vector<double> numbers(kVariableCount, 1);
+
+  std::vector<Expression> expressions(kFormulaCount);
+  std::vector<IncrementalProgram> programs;
+  for (size_t i = 0; i < kFormulaCount; ++i) {
+    std::string formula;
+    for (size_t term = 0; term < 4; ++term) {
+      const std::string name =
+          "v" + std::to_string((i * 7 + term * 61) % kVariableCount);
+      if (term != 0)
+        formula += " + ";
+      formula += "Max(" + name + " * " + name + ", " + name + " / 2 + 1)";
+    }
+    expressions[i].Parse(formula.c_str(), symbol_table);
+    expressions[i].Compile();
+    programs.push_back(
+        IncrementalProgram::Compile(*expressions[i].root_token().token()));
+  }
+  EvaluationContext context;
+  context.numbers = numbers.data();
+  for (auto& program : programs)
+    program.Calculate(&context);
+
+  size_t slot = 0;
+  for (auto _ : state) {
+    slot = (slot + 1) % kVariableCount;
+    numbers[slot] += 1;
+    double total = 0;
+    if (state.range(0) == 0) {
+      for (const auto& expression : expressions)
+        total += static_cast<double>(expression.Calculate(context));
+    } else {
+      for (auto& program : programs) {
+        program.Invalidate(slot);
+        total += static_cast<double>(program.Calculate(&context));
+      }
+    }
+    benchmark::DoNotOptimize(total);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kFormulaCount);
+  state.SetLabel(state.range(0) ? "incremental" : "compiled");
+}
+
+// Evaluates 2000 formulas drawing on 20 common subexpressions. Range 0
+// evaluates separately compiled expressions, range 1 one ExpressionSet where
+// the common subexpressions are shared and computed once.
+void BM_ExpressionSetEvaluate(benchmark::State& state) {
+  constexpr size_t kVariableCount = 64;
+  constexpr size_t kFormulaCount = 2000;
+  SymbolTable symbol_table;
+  for (size_t i = 0; i < kVariableCount; ++i)
+    symbol_table.Declare("v" + std::to_string(i), StaticType::Number);
+  std::vector<double> numbers(kVariableCount);
+  for (size_t i = 0; i < kVariableCount; ++i)
+    numbers[i] = static_cast<double>(i % 9) + 0.5;
+
+  std::vector<Expression> expressions(kFormulaCount);
+  ExpressionSet set{symbol_table};
+  for (size_t i = 0; i < kFormulaCount; ++i) {
+    auto variable = [](size_t index) {
+      return "v" + std::to_string(index % kVariableCount);
+    };
+    const size_t common = i % 20;
+    const std::string formula =
+        "Max(" + variable(common) + ", " + variable(common + 1) + ", " +
+        variable(common + 2) + ") * Sqrt(" + variable(common) + " * " +
+        variable(common) + " + 1) + " + variable(i) + " * " +
+        std::to_string(i);
+    expressions[i].Parse(formula.c_str(), symbol_table);
+    expressions[i].Compile();
+    set.Add(formula.c_str());
+  }
+  set.Compile();
+  EvaluationContext context;
+  context.numbers = numbers.data();
+  std::vector<double> results(kFormulaCount);
+
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      for (size_t i = 0; i < kFormulaCount; ++i)
+        results[i] = expressions[i].CalculateNumber(context);
+    } else {
+      set.CalculateAllNumbers(context, results.data());
+    }
+    benchmark::DoNotOptimize(results.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kFormulaCount);
+  state.SetLabel(state.range(0) ? "set" : "separate");
+}
+
+// Evaluates 20000 formulas in five levels, each referencing two formulas of
+// the level below. Range 0 is the number of pool threads, 0 evaluating on the
+// calling thread only.
+void BM_FormulaGraph(benchmark::State& state) {
+  constexpr size_t kLevelCount = 5;
+  constexpr size_t kLevelSize = 4000;
+  SymbolTable symbol_table;
+  FormulaGraph graph{symbol_table};
+  auto name = [](size_t level, size_t index) {
+    return "f" + std::to_string(level) + "x" + std::to_string(index);
+  };
+  for (size_t index = 0; index < kLevelSize; ++index) {
+    const std::string formula =
+        "Sqrt(in" + std::to_string(index % 64) + " + " + std::to_string(index) +
+        ")";
+    graph.Define(name(0, index), formula.c_str());
+  }
+  for (size_t level = 1; level < kLevelCount; ++level) {
+    for (size_t index = 0; index < kLevelSize; ++index) {
+      const std::string formula =
+          "Max(" + name(level - 1, index) + ", " +
+          name(level - 1, (index * 7 + 1) % kLevelSize) + ") * 0.5 + Sqrt(" +
+          name(level - 1, (index * 13 + 5) % kLevelSize) + ")";
+      graph.Define(name(level, index), formula.c_str());
+    }
+  }
+  graph.Build();
+  std::vector<Value> values(symbol_table.size());
+  for (size_t i = 0; i < 64; ++i)
+    values[*symbol_table.Find("in" + std::to_string(i))] =
+        static_cast<double>(i);
+
+  std::optional<ThreadPool> pool;
+  if (state.range(0) != 0)
+    pool.emplace(static_cast<size_t>(state.range(0)));
+
+  for (auto _ : state) {
+    graph.Calculate(values.data(), pool ? &*pool : nullptr);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * graph.size());
+}
+
+// Selects the rows passing a filter with an expensive right operand. Range 0
+// evaluates the whole expression with CalculateBatch and compacts the
+// results, range 1 runs the selection-vector filter.
+void BM_Filter(benchmark::State& state) {
+  constexpr size_t kRowCount = 100000;
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+  std::vector<double> x(kRowCount);
+  std::vector<double> y(kRowCount);
+  for (size_t i = 0; i < kRowCount; ++i) {
+    x[i] = static_cast<double>(i * 7 % 10);
+    y[i] = static_cast<double>(i % 13);
+  }
+  const double* const columns[] = {x.data(), y.data()};
+
+  Expression expression;
+  expression.Parse("And(x > 8, (y * y + x) ^ 0.5 > 3, Or(y < 4, x ^ y > 9))",
+                   symbol_table);
+  expression.CompileBatch();
+  auto filter = FilterProgram::Compile(*expression.root_token().token());
+  std::vector<double> results(kRowCount);
+  std::vector<uint32_t> selection(kRowCount);
+
+  size_t selected = 0;
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      expression.CalculateBatch(columns, kRowCount, results.data());
+      selected = 0;
+      for (size_t i = 0; i < kRowCount; ++i) {
+        if (results[i] != 0)
+          selection[selected++] = static_cast<uint32_t>(i);
+      }
+    } else {
+      selected = filter.Select(columns, kRowCount, selection.data());
+    }
+    benchmark::DoNotOptimize(selection.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kRowCount);
+  state.counters["selected"] = static_cast<double>(selected);
+  state.SetLabel(state.range(0) ? "selection" : "batch");
+}
+
 void BM_RepeatedEvaluate(benchmark::State& state) {
   const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
   Expression expression;
@@ -267,6 +1061,36 @@ void BM_Traverse(benchmark::State& state) {
   state.SetLabel(benchmark_case.name);
 }
 
+bool CountFlatNodes(const FlatTree& /*tree*/,
+                    size_t /*node*/,
+                    void* param) {
+  ++*static_cast<int*>(param);
+  return true;
+}
+
+// Walks the flattened tree of a case. Range 1 selects Calculate or
+// Traverse.
+void BM_FlatTree(benchmark::State& state) {
+  const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
+  Expression expression;
+  ParseExpression(benchmark_case, expression);
+  const FlatTree flat_tree = expression.Flatten();
+  for (auto _ : state) {
+    if (state.range(1) == 0) {
+      auto value = flat_tree.Calculate(nullptr);
+      benchmark::DoNotOptimize(value);
+    } else {
+      int node_count = 0;
+      flat_tree.Traverse(&CountFlatNodes, &node_count);
+      benchmark::DoNotOptimize(node_count);
+    }
+    benchmark::ClobberMemory();
+  }
+  state.counters["bytes"] = static_cast<double>(flat_tree.memory_usage());
+  state.SetLabel(std::string{benchmark_case.name} +
+                 (state.range(1) ? "/traverse" : "/evaluate"));
+}
+
 void BM_ParseAndEvaluate(benchmark::State& state) {
   const auto& benchmark_case = GetCase(static_cast<int>(state.range(0)));
   for (auto _ : state) {
@@ -294,6 +1118,28 @@ void BM_ParseAndEvaluateReserved(benchmark::State& state) {
 BENCHMARK(BM_Parse)->DenseRange(0, 5);
 BENCHMARK(BM_ParseReserved)->DenseRange(0, 5);
 BENCHMARK(BM_Evaluate)->DenseRange(0, 5);
+BENCHMARK(BM_BatchKernel)->ArgsProduct({{0, 1, 2, 3, 4}, {0, 1, 2}});
+BENCHMARK(BM_CompiledEvaluate)->DenseRange(0, 5);
+BENCHMARK(BM_NumericEvaluate)->DenseRange(0, 2);
+BENCHMARK(BM_SharedSubtreeEvaluate)->DenseRange(0, 1);
+BENCHMARK(BM_SlotEvaluate)->DenseRange(0, 2);
+BENCHMARK(BM_JitEvaluate)->ArgsProduct({{0, 1, 2}, {0, 1, 2}});
+BENCHMARK(BM_GeneratedEvaluate)->ArgsProduct({{0, 1, 2}, {0, 1}});
+BENCHMARK(BM_StaticExpression)->DenseRange(0, 2);
+BENCHMARK(BM_Deserialize)->DenseRange(0, 11);
+BENCHMARK(BM_ParseAndDiscard)->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1}});
+BENCHMARK(BM_GeneratedParse)->ArgsProduct({{0, 1, 2}, {0, 1}});
+BENCHMARK(BM_BudgetedParse)->ArgsProduct({{10, 1000, 100000}, {0, 1}});
+BENCHMARK(BM_HugePageEvaluate)->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1}});
+BENCHMARK(BM_InlineArenaParse)
+    ->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1, 2}});
+BENCHMARK(BM_Clone)->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1}});
+BENCHMARK(BM_CompactedEvaluate)->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1}});
+BENCHMARK(BM_BatchEvaluate)->DenseRange(0, 1);
+BENCHMARK(BM_Filter)->DenseRange(0, 1);
+BENCHMARK(BM_FormulaGraph)->Arg(0)->Arg(1)->Arg(3)->Arg(7)->UseRealTime();
+BENCHMARK(BM_ExpressionSetEvaluate)->DenseRange(0, 1);
+BENCHMARK(BM_IncrementalEvaluate)->DenseRange(0, 1);
 BENCHMARK(BM_RepeatedEvaluate)->DenseRange(0, 5);
 BENCHMARK(BM_Format)->DenseRange(0, 5);
 BENCHMARK(BM_BooleanChainEvaluate)->DenseRange(0, 1);
@@ -301,6 +1147,7 @@ BENCHMARK(BM_FoldedVariadicParse)->DenseRange(0, 1);
 BENCHMARK(BM_FoldedVariadicEvaluate)->DenseRange(0, 1);
 BENCHMARK(BM_FoldedVariadicTraverse)->DenseRange(0, 1);
 BENCHMARK(BM_Traverse)->DenseRange(0, 5);
+BENCHMARK(BM_FlatTree)->ArgsProduct({{0, 1, 2, 3, 4, 5}, {0, 1}});
 BENCHMARK(BM_ParseAndEvaluate)->DenseRange(0, 5);
 BENCHMARK(BM_ParseAndEvaluateReserved)->DenseRange(0, 5);
 
@@ -1,40 +1,92 @@
 #pragma once
 
 #include "express/express_export.h"
+#include "express/parse_budget.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <memory_resource>
 #include <new>
 #include <utility>
 #include <vector>
 
 namespace expression {
 
+struct AllocatorStats {
+  // Bytes asked for by allocate.
+  size_t requested_bytes = 0;
+  // Bytes held in chunks, used or not.
+  size_t reserved_bytes = 0;
+  size_t chunk_count = 0;
+  // Padding inserted before allocations to align them.
+  size_t alignment_waste = 0;
+};
+
+// Arena handing out memory from chunks that are only freed together. When
+// the last chunk is full, the next one is twice as large, up to
+// kMaxGrowthCapacity, or as large as the allocation. Chunks come from an
+// upstream memory resource, by default std::pmr::new_delete_resource().
+// With a byte limit, chunks shrink to the bytes left and allocations that do
+// not fit throw BudgetExceededError.
 class EXPRESS_EXPORT Allocator {
  public:
   Allocator() noexcept {}
 
+  // |upstream| must outlive the allocator.
+  explicit Allocator(std::pmr::memory_resource* upstream) noexcept
+      : upstream_{upstream} {
+    assert(upstream);
+  }
+
+  // Uses |buffer| before allocating chunks. The buffer is not owned, must be
+  // aligned to alignof(std::max_align_t) and must outlive the allocations.
+  Allocator(void* buffer,
+            size_t size,
+            std::pmr::memory_resource* upstream =
+                std::pmr::new_delete_resource()) noexcept
+      : upstream_{upstream}, buffer_{static_cast<std::byte*>(buffer), size} {
+    assert(upstream);
+    assert(reinterpret_cast<uintptr_t>(buffer) % alignof(std::max_align_t) ==
+           0);
+  }
+
   Allocator(const Allocator&) = delete;
   Allocator& operator=(const Allocator&) = delete;
 
-  Allocator(Allocator&& source) noexcept : chunks_{std::move(source.chunks_)} {}
+  Allocator(Allocator&& source) noexcept
+      : upstream_{source.upstream_},
+        buffer_{std::move(source.buffer_)},
+        chunks_{std::move(source.chunks_)},
+        requested_bytes_{std::exchange(source.requested_bytes_, 0)},
+        alignment_waste_{std::exchange(source.alignment_waste_, 0)},
+        overflow_bytes_{std::exchange(source.overflow_bytes_, 0)},
+        byte_limit_{source.byte_limit_} {}
 
   Allocator& operator=(Allocator&& source) noexcept {
+    upstream_ = source.upstream_;
+    buffer_ = std::move(source.buffer_);
     chunks_ = std::move(source.chunks_);
+    requested_bytes_ = std::exchange(source.requested_bytes_, 0);
+    alignment_waste_ = std::exchange(source.alignment_waste_, 0);
+    overflow_bytes_ = std::exchange(source.overflow_bytes_, 0);
+    byte_limit_ = source.byte_limit_;
     return *this;
   }
 
   void* allocate(size_t len,
                  size_t alignment = alignof(std::max_align_t)) {
-    if (!chunks_.empty()) {
-      void* ptr = allocate_from_chunk(chunks_.back(), len, alignment);
+    if (auto* chunk = current_chunk()) {
+      void* ptr = allocate_from_chunk(*chunk, len, alignment);
       if (ptr)
         return ptr;
     }
 
-    auto& chunk = allocate_chunk(len, alignment);
+    auto& chunk = allocate_chunk(
+        std::max(len, std::min(next_chunk_capacity(), remaining_bytes())),
+        alignment);
     auto* ptr = allocate_from_chunk(chunk, len, alignment);
     assert(ptr);
     return ptr;
@@ -45,33 +97,123 @@ class EXPRESS_EXPORT Allocator {
     const size_t normalized_alignment =
         std::max(alignment, alignof(std::max_align_t));
 
-    if (!chunks_.empty()) {
-      auto& chunk = chunks_.back();
-      if (chunk.alignment_ >= normalized_alignment &&
-          chunk.capacity_ - chunk.size_ >= capacity) {
+    if (auto* chunk = current_chunk()) {
+      if (chunk->alignment_ >= normalized_alignment &&
+          chunk->capacity_ - chunk->size_ >= capacity) {
         return;
       }
     }
 
-    allocate_chunk(capacity, normalized_alignment);
+    // Reservations are hints, so they are cut to the limit.
+    capacity = std::min(capacity, remaining_bytes());
+    if (capacity != 0)
+      allocate_chunk(capacity, normalized_alignment);
   }
 
-  void swap(Allocator& other) noexcept { std::swap(chunks_, other.chunks_); }
+  // Like reserve_bytes(), but keeps filling the buffer first: only the
+  // part of |capacity| the buffer cannot hold sizes the first chunk, which
+  // is made once the buffer is full.
+  void reserve_beyond_buffer(size_t capacity) {
+    if (!buffer_.data_ || !chunks_.empty()) {
+      reserve_bytes(capacity);
+      return;
+    }
+    const size_t buffer_room = buffer_.capacity_ - buffer_.size_;
+    overflow_bytes_ = capacity > buffer_room ? capacity - buffer_room : 0;
+  }
+
+  void swap(Allocator& other) noexcept {
+    std::swap(upstream_, other.upstream_);
+    std::swap(buffer_, other.buffer_);
+    std::swap(chunks_, other.chunks_);
+    std::swap(requested_bytes_, other.requested_bytes_);
+    std::swap(alignment_waste_, other.alignment_waste_);
+    std::swap(overflow_bytes_, other.overflow_bytes_);
+    std::swap(byte_limit_, other.byte_limit_);
+  }
 
-  void clear() noexcept { chunks_.clear(); }
+  // Most bytes held in chunks, including the buffer. Existing chunks are
+  // kept when the limit is lowered below capacity().
+  size_t byte_limit() const noexcept { return byte_limit_; }
+  void set_byte_limit(size_t byte_limit) noexcept { byte_limit_ = byte_limit; }
+
+  std::pmr::memory_resource* upstream() const noexcept { return upstream_; }
+
+  // The buffer given on construction, until it is dropped by clear() or
+  // reset().
+  const void* buffer() const noexcept { return buffer_.data_; }
+
+  // Bytes handed out so far, including alignment padding.
+  size_t size() const noexcept {
+    size_t size = buffer_.size_;
+    for (const auto& chunk : chunks_)
+      size += chunk.size_;
+    return size;
+  }
+
+  // Bytes held in chunks, used or not.
+  size_t capacity() const noexcept {
+    size_t capacity = buffer_.capacity_;
+    for (const auto& chunk : chunks_)
+      capacity += chunk.capacity_;
+    return capacity;
+  }
+
+  // Frees every chunk and stops using the buffer.
+  void clear() noexcept {
+    buffer_ = Chunk{nullptr, 0};
+    chunks_.clear();
+    requested_bytes_ = 0;
+    alignment_waste_ = 0;
+    overflow_bytes_ = 0;
+  }
+
+  // Frees every chunk but the largest one, which is emptied for reuse, and
+  // stops using the buffer.
+  void reset() noexcept {
+    buffer_ = Chunk{nullptr, 0};
+    if (chunks_.size() > 1) {
+      auto largest = std::max_element(
+          chunks_.begin(), chunks_.end(), [](const Chunk& a, const Chunk& b) {
+            return a.capacity_ < b.capacity_;
+          });
+      std::swap(*largest, chunks_.front());
+      chunks_.erase(chunks_.begin() + 1, chunks_.end());
+    }
+    if (!chunks_.empty())
+      chunks_.front().size_ = 0;
+    requested_bytes_ = 0;
+    alignment_waste_ = 0;
+    overflow_bytes_ = 0;
+  }
+
+  AllocatorStats stats() const noexcept {
+    AllocatorStats stats;
+    stats.requested_bytes = requested_bytes_;
+    stats.reserved_bytes = capacity();
+    stats.chunk_count = chunks_.size() + (buffer_.data_ ? 1 : 0);
+    stats.alignment_waste = alignment_waste_;
+    return stats;
+  }
+
+  static inline const size_t kMaxGrowthCapacity = 1 << 20;
 
  private:
   struct Chunk {
-    explicit Chunk(size_t capacity, size_t alignment)
-        : data_{static_cast<std::byte*>(::operator new(
-              capacity, std::align_val_t{alignment}))},
+    Chunk(std::pmr::memory_resource* resource,
+          size_t capacity,
+          size_t alignment)
+        : data_{static_cast<std::byte*>(
+              resource->allocate(capacity, alignment))},
           capacity_{capacity},
-          alignment_{alignment} {}
+          alignment_{alignment},
+          resource_{resource} {}
 
-    ~Chunk() {
-      if (data_)
-        ::operator delete(data_, std::align_val_t{alignment_});
-    }
+    // Chunk over memory owned by the caller.
+    Chunk(std::byte* data, size_t capacity)
+        : data_{data}, capacity_{capacity} {}
+
+    ~Chunk() { deallocate(); }
 
     Chunk(const Chunk&) = delete;
     Chunk& operator=(const Chunk&) = delete;
@@ -80,37 +222,75 @@ class EXPRESS_EXPORT Allocator {
         : data_{std::exchange(other.data_, nullptr)},
           size_{std::exchange(other.size_, 0)},
           capacity_{std::exchange(other.capacity_, 0)},
-          alignment_{std::exchange(other.alignment_, alignof(std::max_align_t))} {
-    }
+          alignment_{std::exchange(other.alignment_, alignof(std::max_align_t))},
+          resource_{std::exchange(other.resource_, nullptr)} {}
 
     Chunk& operator=(Chunk&& other) noexcept {
       if (this == &other)
         return *this;
 
-      if (data_)
-        ::operator delete(data_, std::align_val_t{alignment_});
+      deallocate();
 
       data_ = std::exchange(other.data_, nullptr);
       size_ = std::exchange(other.size_, 0);
       capacity_ = std::exchange(other.capacity_, 0);
       alignment_ =
           std::exchange(other.alignment_, alignof(std::max_align_t));
+      resource_ = std::exchange(other.resource_, nullptr);
       return *this;
     }
 
+    void deallocate() noexcept {
+      if (data_ && resource_)
+        resource_->deallocate(data_, capacity_, alignment_);
+    }
+
     std::byte* data_ = nullptr;
     size_t size_ = 0;
     size_t capacity_ = 0;
     size_t alignment_ = alignof(std::max_align_t);
+    // Null for memory owned by the caller.
+    std::pmr::memory_resource* resource_ = nullptr;
   };
 
+  // The buffer serves allocations until the first chunk is made.
+  Chunk* current_chunk() noexcept {
+    if (!chunks_.empty())
+      return &chunks_.back();
+    return buffer_.data_ ? &buffer_ : nullptr;
+  }
+
+  size_t remaining_bytes() const noexcept {
+    const size_t capacity = this->capacity();
+    return capacity < byte_limit_ ? byte_limit_ - capacity : 0;
+  }
+
+  // Chunks are aligned for their first allocation, so |capacity| needs no
+  // room for padding.
   Chunk& allocate_chunk(size_t capacity, size_t alignment) {
+    const size_t remaining = remaining_bytes();
+    capacity = std::max(capacity, std::min(kMinCapacity, remaining));
+    if (capacity > remaining) {
+      throw BudgetExceededError{"memory budget exceeded",
+                                ParseUsage{this->capacity(), 0}};
+    }
     auto& chunk = chunks_.emplace_back(
-        std::max(kMinCapacity, capacity + alignment - 1),
+        upstream_,
+        capacity,
         std::max(alignment, alignof(std::max_align_t)));
     return chunk;
   }
 
+  size_t next_chunk_capacity() const noexcept {
+    if (chunks_.empty()) {
+      return std::max(overflow_bytes_,
+                      std::clamp(buffer_.capacity_ * 2, kMinCapacity,
+                                 kMaxGrowthCapacity));
+    }
+    return std::clamp(chunks_.back().capacity_ * 2, kMinCapacity,
+                      kMaxGrowthCapacity);
+  }
+
   void* allocate_from_chunk(Chunk& chunk,
                             size_t len,
                             size_t alignment) noexcept {
@@ -123,11 +303,22 @@ class EXPRESS_EXPORT Allocator {
       return nullptr;
 
     auto* aligned_ptr = static_cast<std::byte*>(ptr);
+    alignment_waste_ +=
+        static_cast<size_t>(aligned_ptr - (chunk.data_ + chunk.size_));
+    requested_bytes_ += len;
     chunk.size_ = static_cast<size_t>(aligned_ptr - chunk.data_) + len;
     return aligned_ptr;
   }
 
+  std::pmr::memory_resource* upstream_ = std::pmr::new_delete_resource();
+  Chunk buffer_{nullptr, 0};
   std::vector<Chunk> chunks_;
+  size_t requested_bytes_ = 0;
+  size_t alignment_waste_ = 0;
+  // Size of the first chunk made after the buffer, from
+  // reserve_beyond_buffer().
+  size_t overflow_bytes_ = 0;
+  size_t byte_limit_ = kUnlimited;
 
   static inline const size_t kMinCapacity = 64;
 };
@@ -0,0 +1,98 @@
+#include "express/arena_pool.h"
+
+#include <algorithm>
+#include <memory_resource>
+#include <utility>
+
+namespace expression {
+
+namespace {
+
+// Set when the pool of the thread is destroyed. Expressions destroyed later
+// during thread or program exit free their arenas instead.
+thread_local bool thread_pool_destroyed = false;
+
+class ThreadArenaPool {
+ public:
+  ~ThreadArenaPool() { thread_pool_destroyed = true; }
+
+  ArenaPool pool;
+  ArenaPool scratch;
+};
+
+ThreadArenaPool& GetThreadArenaPool() {
+  thread_local ThreadArenaPool thread_pool;
+  return thread_pool;
+}
+
+}  // namespace
+
+ArenaPool::ArenaPool() = default;
+
+ArenaPool::~ArenaPool() = default;
+
+// static
+ArenaPool* ArenaPool::ForThread() {
+  if (thread_pool_destroyed)
+    return nullptr;
+  return &GetThreadArenaPool().pool;
+}
+
+// static
+ArenaPool* ArenaPool::ForScratch() {
+  if (thread_pool_destroyed)
+    return nullptr;
+  return &GetThreadArenaPool().scratch;
+}
+
+// static
+Allocator ArenaPool::AcquireLocal() {
+  auto* pool = ForThread();
+  return pool ? pool->Acquire() : Allocator{};
+}
+
+// static
+void ArenaPool::ReleaseLocal(Allocator allocator) {
+  if (auto* pool = ForThread())
+    pool->Release(std::move(allocator));
+}
+
+Allocator ArenaPool::Acquire() {
+  if (arenas_.empty())
+    return Allocator{};
+  Allocator allocator = std::move(arenas_.back());
+  arenas_.pop_back();
+  return allocator;
+}
+
+void ArenaPool::Release(Allocator allocator) {
+  // Chunks of other memory resources are freed, as the pool cannot tell how
+  // long those resources live.
+  if (allocator.upstream() != std::pmr::new_delete_resource())
+    return;
+  allocator.reset();
+  allocator.set_byte_limit(kUnlimited);
+  const size_t capacity = allocator.capacity();
+  if (capacity == 0 || capacity > max_arena_bytes_ ||
+      arenas_.size() >= max_arenas_) {
+    return;
+  }
+  arenas_.emplace_back(std::move(allocator));
+}
+
+void ArenaPool::set_max_arenas(size_t max_arenas) {
+  max_arenas_ = max_arenas;
+  if (arenas_.size() > max_arenas_)
+    arenas_.erase(arenas_.begin() + max_arenas_, arenas_.end());
+}
+
+void ArenaPool::set_max_arena_bytes(size_t max_arena_bytes) {
+  max_arena_bytes_ = max_arena_bytes;
+  arenas_.erase(std::remove_if(arenas_.begin(), arenas_.end(),
+                               [max_arena_bytes](const Allocator& arena) {
+                                 return arena.capacity() > max_arena_bytes;
+                               }),
+                arenas_.end());
+}
+
+}  // namespace expression
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "express/allocator.h"
+#include "express/express_export.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+namespace expression {
+
+// Emptied arenas kept for reuse. Expressions parse into arenas taken from
+// the pool of the calling thread and give them back on Clear, destruction
+// and failed parses, so a steady stream of parses reuses the same chunks.
+class EXPRESS_EXPORT ArenaPool {
+ public:
+  ArenaPool();
+  ~ArenaPool();
+
+  ArenaPool(const ArenaPool&) = delete;
+  ArenaPool& operator=(const ArenaPool&) = delete;
+
+  // Pool of the calling thread, or null while the thread is exiting.
+  static ArenaPool* ForThread();
+
+  // Separate pool of the calling thread for ScratchArena, so temporary parser
+  // data does not take the arenas expressions keep, or null while the thread
+  // is exiting.
+  static ArenaPool* ForScratch();
+
+  // Take from and give back to the pool of the calling thread. Without one,
+  // Acquire returns an empty allocator and Release frees the arena.
+  static Allocator AcquireLocal();
+  static void ReleaseLocal(Allocator allocator);
+
+  // Returns a pooled arena, or an empty allocator if there is none.
+  Allocator Acquire();
+
+  // Empties |allocator| and keeps its largest chunk unless the pool is full,
+  // the chunk is larger than max_arena_bytes() or it does not come from
+  // std::pmr::new_delete_resource().
+  void Release(Allocator allocator);
+
+  size_t size() const { return arenas_.size(); }
+
+  size_t max_arenas() const { return max_arenas_; }
+  void set_max_arenas(size_t max_arenas);
+
+  size_t max_arena_bytes() const { return max_arena_bytes_; }
+  void set_max_arena_bytes(size_t max_arena_bytes);
+
+  // Frees the pooled arenas.
+  void clear() { arenas_.clear(); }
+
+  static const size_t kDefaultMaxArenas = 16;
+  static const size_t kDefaultMaxArenaBytes = 64 * 1024;
+
+ private:
+  std::vector<Allocator> arenas_;
+  size_t max_arenas_ = kDefaultMaxArenas;
+  size_t max_arena_bytes_ = kDefaultMaxArenaBytes;
+};
+
+// Arena for temporary data, taken from the scratch pool of the calling thread
+// and given back on destruction, so repeated parses reuse its chunks. As a
+// memory resource it serves std::pmr containers, whose memory is only
+// reclaimed with the arena.
+class ScratchArena : public std::pmr::memory_resource {
+ public:
+  ScratchArena() {
+    if (auto* pool = ArenaPool::ForScratch())
+      allocator_ = pool->Acquire();
+  }
+
+  ~ScratchArena() override {
+    if (auto* pool = ArenaPool::ForScratch())
+      pool->Release(std::move(allocator_));
+  }
+
+  ScratchArena(const ScratchArena&) = delete;
+  ScratchArena& operator=(const ScratchArena&) = delete;
+
+  Allocator& allocator() { return allocator_; }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    return allocator_.allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* /*ptr*/,
+                     size_t /*bytes*/,
+                     size_t /*alignment*/) override {}
+
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  Allocator allocator_;
+};
+
+}  // namespace expression
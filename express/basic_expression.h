@@ -1,58 +1,243 @@
 #pragma once
 
 #include "express/allocator.h"
+#include "express/arena_pool.h"
 #include "express/arena_token.h"
+#include "express/batch_program.h"
+#include "express/evaluation_context.h"
+#include "express/flat_tree.h"
+#include "express/jit_program.h"
 #include "express/lexer.h"
 #include "express/lexer_delegate.h"
+#include "express/parse_budget.h"
 #include "express/parser.h"
-
-#include <optional>
-#include <stdexcept>
-#include <string>
-
+#include "express/program.h"
+#include "express/serialization.h"
+#include "express/symbol_table.h"
+#include "express/token.h"
+#include "express/token_walker.h"
+
+#include <cassert>
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
 namespace expression {
-
-class FormatterDelegate;
-class Token;
-
-template <class BasicToken>
-class BasicExpression {
+
+class FormatterDelegate;
+class Token;
+
+// Storage for the first arena chunk of an expression.
+template <size_t kSize>
+struct InlineArena {
+  alignas(std::max_align_t) std::byte inline_arena_[kSize];
+};
+
+template <>
+struct InlineArena<0> {};
+
+// |kInlineArenaBytes| bytes inside the expression serve as the first arena
+// chunk, so trees that fit need no heap memory for their tokens.
+template <class BasicToken, size_t kInlineArenaBytes = 0>
+class BasicExpression : private InlineArena<kInlineArenaBytes> {
  public:
   // BasicToken must be a lightweight arena token such as PolymorphicToken.
   static_assert(kIsArenaToken<BasicToken>,
                 "BasicToken must satisfy the arena token contract.");
   using BasicValue = decltype(std::declval<BasicToken>().Calculate(nullptr));
-
-  BasicExpression() {}
-  ~BasicExpression() { Clear(); }
-
-  BasicExpression(const BasicExpression&) = delete;
-  BasicExpression& operator=(const BasicExpression&) = delete;
-
-  void swap(BasicExpression& other) {
-    allocator_.swap(other.allocator_);
-    std::swap(root_token_, other.root_token_);
-  }
-
-  void Parse(const char* buf);
-
-  template <class Parser>
-  void Parse(Parser& parser, Allocator& allocator);
-
-  BasicValue Calculate(void* data = NULL) const;
-
-  template <class Visitor>
-  void Traverse(const Visitor& visitor) const;
-
-  std::string Format(const FormatterDelegate& delegate) const;
-
-  void Clear();
-
- protected:
-  Allocator allocator_;
-  std::optional<BasicToken> root_token_;
-};
-
+
+  BasicExpression() {}
+  ~BasicExpression() { Clear(); }
+
+  BasicExpression(const BasicExpression&) = delete;
+  BasicExpression& operator=(const BasicExpression&) = delete;
+
+  // Trees in an inline arena are first cloned to the heap, so swapping them
+  // throws std::runtime_error if they have tokens that cannot be cloned.
+  void swap(BasicExpression& other) {
+    if constexpr (kInlineArenaBytes > 0) {
+      LeaveInlineArena();
+      other.LeaveInlineArena();
+    }
+    allocator_.swap(other.allocator_);
+    std::swap(root_token_, other.root_token_);
+    std::swap(program_, other.program_);
+    std::swap(batch_program_, other.batch_program_);
+    std::swap(jit_program_, other.jit_program_);
+    std::swap(node_count_, other.node_count_);
+  }
+
+  // Once the arena pools of the thread are warm, parsing makes no heap
+  // allocation unless it folds strings longer than
+  // Value::kInlineStringCapacity characters. Folding calculates them as
+  // Values, which keep longer strings in new char[] buffers.
+  //
+  // Trees over tokens that describe themselves may be of any depth. Trees
+  // deeper than BasicParser::kMaxDepth, here and in Deserialize, are compiled
+  // right away so Calculate does not recurse over the tokens.
+  void Parse(const char* buf);
+
+  // Binds names that are not functions to |symbol_table| slots.
+  void Parse(const char* buf, SymbolTable& symbol_table);
+
+  template <class Parser>
+  void Parse(Parser& parser, Allocator& allocator);
+
+  // Replaces |clone| with a copy of this expression that shares no memory
+  // with it, without lexing or parsing. The copy is compiled when this
+  // expression is, and is made in the inline arena of |clone| when it fits.
+  // Throws std::runtime_error if a token cannot be cloned, and
+  // BudgetExceededError if the copy exceeds the budget of |clone|, which is
+  // then unchanged.
+  void Clone(BasicExpression& clone) const;
+
+  // Moves the tree into a single block sized to the bytes in use, with
+  // tokens in depth-first order, and frees the rest of the arena. Trees that
+  // fit the inline arena stay in it. Returns false and keeps the expression
+  // unchanged if a token cannot be cloned or the budget is exceeded.
+  bool Compact();
+
+  // Compacts after every successful Parse and Deserialize when set.
+  void set_compact_on_parse(bool compact_on_parse) {
+    compact_on_parse_ = compact_on_parse;
+  }
+
+  // Chunks of later parses, deserializations and clones come from
+  // |memory_resource|, which must outlive the trees. Arenas of other
+  // resources than std::pmr::new_delete_resource() bypass the arena pool.
+  void set_memory_resource(std::pmr::memory_resource* memory_resource) {
+    assert(memory_resource);
+    memory_resource_ = memory_resource;
+  }
+  std::pmr::memory_resource* memory_resource() const {
+    return memory_resource_;
+  }
+
+  // Later parses and deserializations throw BudgetExceededError once they
+  // exceed |budget|, and keep the current tree. The arena reservation made
+  // before parsing stays within the byte limit.
+  void set_budget(const ParseBudget& budget) { budget_ = budget; }
+  const ParseBudget& budget() const { return budget_; }
+
+  // Arena bytes of the tree, and the tokens made for it by the last Parse of
+  // text or Deserialize.
+  ParseUsage usage() const { return {allocator_.capacity(), node_count_}; }
+
+  // Returns a binary image of the parsed tree; see SerializeExpression.
+  std::string Serialize() const;
+
+  // Rebuilds the tree of a Serialize image without lexing or parsing. Images
+  // with variables need the symbol table the names are bound to.
+  void Deserialize(std::string_view image);
+  void Deserialize(std::string_view image, SymbolTable& symbol_table);
+
+  // Returns the parsed tree as a FlatTree, which must not outlive the
+  // expression.
+  FlatTree Flatten() const;
+
+  // Lowers the parsed tree into a Program used by subsequent Calculate calls.
+  // Subtrees shared by the parser are evaluated once per call. Returns false
+  // when BasicToken does not expose its tokens, in which case Calculate keeps
+  // walking the tree.
+  bool Compile();
+
+  // Compiles like Compile() and also generates native code for numeric
+  // expressions when JitProgram::IsAvailable(). Returns true if evaluation
+  // runs native code; other expressions, including those with tokens
+  // JitProgram cannot translate, keep the compiled program.
+  bool CompileNative();
+
+  // Compiles like Compile() unless already compiled, then lowers numeric
+  // expressions into the BatchProgram used by CalculateBatch. Returns false
+  // for other expressions.
+  bool CompileBatch();
+
+  const BasicToken& root_token() const {
+    assert(root_token_.has_value());
+    return *root_token_;
+  }
+
+  // Arena holding the tokens and literals of the expression.
+  const Allocator& allocator() const { return allocator_; }
+
+  // True while the tree has tokens in the inline arena.
+  bool uses_inline_arena() const {
+    if constexpr (kInlineArenaBytes > 0)
+      return allocator_.buffer() == this->inline_arena_;
+    else
+      return false;
+  }
+
+  bool is_compiled() const { return program_.has_value(); }
+
+  bool is_native() const { return jit_program_.has_value(); }
+
+  bool is_batch_compiled() const { return batch_program_.has_value(); }
+
+  const Program& program() const {
+    assert(program_.has_value());
+    return *program_;
+  }
+
+  // True if the compiled program is proven to produce numbers only.
+  bool is_numeric() const { return program_ && program_->is_numeric(); }
+
+  // Throws std::runtime_error if the expression has variables and |data| is
+  // not an EvaluationContext with values or numbers. Without Compile() the
+  // tree is walked and a shared subtree is evaluated once per reference.
+  BasicValue Calculate(void* data = NULL) const;
+
+  // Evaluates an expression parsed with a symbol table.
+  BasicValue Calculate(const EvaluationContext& context) const {
+    return Calculate(const_cast<EvaluationContext*>(&context));
+  }
+
+  // Evaluates a numeric expression without constructing Values. Requires
+  // is_numeric().
+  double CalculateNumber(void* data = NULL) const;
+
+  double CalculateNumber(const EvaluationContext& context) const {
+    return CalculateNumber(const_cast<EvaluationContext*>(&context));
+  }
+
+  // Evaluates a numeric expression over |row_count| rows, one block of rows
+  // per node. |columns| holds a column per SymbolTable slot and |results|
+  // receives a number per row. Requires a successful CompileBatch().
+  void CalculateBatch(const double* const* columns,
+                      size_t row_count,
+                      double* results) const;
+
+  template <class Visitor>
+  void Traverse(const Visitor& visitor) const;
+
+  std::string Format(const FormatterDelegate& delegate) const;
+
+  // Drops the tree and returns the arena to the pool of the calling thread.
+  void Clear();
+
+ protected:
+  Allocator AcquireArena();
+  void LeaveInlineArena();
+  void ParseBuffer(const char* buf, SymbolTable* symbol_table);
+  void DeserializeImage(std::string_view image, SymbolTable* symbol_table);
+  void SetRootToken(BasicToken root_token, Allocator& allocator);
+  void CompileIfDeep(size_t depth);
+
+  Allocator allocator_;
+  std::optional<BasicToken> root_token_;
+  std::optional<Program> program_;
+  std::optional<BatchProgram> batch_program_;
+  std::optional<JitProgram> jit_program_;
+  bool compact_on_parse_ = false;
+  std::pmr::memory_resource* memory_resource_ =
+      std::pmr::new_delete_resource();
+  ParseBudget budget_;
+  size_t node_count_ = 0;
+};
+
 namespace {
 
 inline size_t EstimateReserveBytes(const char* buf) {
@@ -62,69 +247,363 @@ inline size_t EstimateReserveBytes(const char* buf) {
 
 template <class Visitor>
 struct TraverseAdapter {
-  bool Callback(const Token* token) { return visitor_(token); }
-
-  static bool StaticCallback(const Token* token, void* param) {
-    return static_cast<TraverseAdapter*>(param)->Callback(token);
-  }
-
-  const Visitor& visitor_;
-};
-
-}  // namespace
-
-template <class BasicToken>
-void BasicExpression<BasicToken>::Parse(const char* buf) {
+  bool Callback(const Token* token) { return visitor_(token); }
+
+  static bool StaticCallback(const Token* token, void* param) {
+    return static_cast<TraverseAdapter*>(param)->Callback(token);
+  }
+
+  const Visitor& visitor_;
+};
+
+}  // namespace
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::Parse(const char* buf) {
+  ParseBuffer(buf, nullptr);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::Parse(
+    const char* buf, SymbolTable& symbol_table) {
+  ParseBuffer(buf, &symbol_table);
+}
+
+// The inline arena is used unless it still holds the current tree, which
+// stays valid until the new one replaces it.
+template <class BasicToken, size_t kInlineArenaBytes>
+inline Allocator
+BasicExpression<BasicToken, kInlineArenaBytes>::AcquireArena() {
+  if constexpr (kInlineArenaBytes > 0) {
+    if (!uses_inline_arena())
+      return Allocator{this->inline_arena_, kInlineArenaBytes,
+                       memory_resource_};
+  }
+  if (memory_resource_ != std::pmr::new_delete_resource())
+    return Allocator{memory_resource_};
+  Allocator allocator = ArenaPool::AcquireLocal();
+  // Pooled arenas larger than the byte budget stay in the pool.
+  if (allocator.capacity() > budget_.max_bytes) {
+    ArenaPool::ReleaseLocal(std::move(allocator));
+    return Allocator{};
+  }
+  return allocator;
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::LeaveInlineArena() {
+  if (!uses_inline_arena())
+    return;
+  if constexpr (HasTokenAccessor<BasicToken>::value)
+    Clone(*this);
+  else
+    throw std::runtime_error("token cannot be cloned");
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::ParseBuffer(
+    const char* buf, SymbolTable* symbol_table) {
   LexerDelegate lexer_delegate;
   Lexer lexer{buf, lexer_delegate, 0};
-  Allocator allocator;
-  allocator.reserve_bytes(EstimateReserveBytes(buf));
+  Allocator allocator = AcquireArena();
+  allocator.set_byte_limit(budget_.max_bytes);
+  // Cut to the byte limit by the allocator. The inline arena is filled
+  // before the reservation is used.
+  allocator.reserve_beyond_buffer(EstimateReserveBytes(buf));
   BasicParserDelegate<BasicToken> parser_delegate{allocator};
+  parser_delegate.set_symbol_table(symbol_table);
+  parser_delegate.set_node_limit(budget_.max_nodes);
   BasicParser<Lexer, decltype(parser_delegate)> parser{lexer, parser_delegate};
-  Parse(parser, allocator);
-}
-
-template <class BasicToken>
-template <class Parser>
-inline void BasicExpression<BasicToken>::Parse(Parser& parser,
-                                               Allocator& allocator) {
-  std::optional<BasicToken> root_token = parser.template Parse<BasicToken>();
-  if (!root_token.has_value())
-    throw std::runtime_error("expression expected");
-
-  allocator_ = std::move(allocator);
-  root_token_ = std::move(root_token);
-}
-
-template <class BasicToken>
-inline typename BasicExpression<BasicToken>::BasicValue
-BasicExpression<BasicToken>::Calculate(void* data) const {
-  assert(root_token_.has_value());
-  return root_token_->Calculate(data);
-}
-
-template <class BasicToken>
-template <class Visitor>
-inline void BasicExpression<BasicToken>::Traverse(
-    const Visitor& visitor) const {
-  assert(root_token_.has_value());
-  TraverseAdapter<Visitor> adapter{visitor};
-  root_token_->Traverse(&TraverseAdapter<Visitor>::StaticCallback, &adapter);
-}
-
-template <class BasicToken>
-inline std::string BasicExpression<BasicToken>::Format(
-    const FormatterDelegate& delegate) const {
-  assert(root_token_.has_value());
-  std::string str;
-  root_token_->Format(delegate, str);
-  return str;
-}
-
-template <class BasicToken>
-inline void BasicExpression<BasicToken>::Clear() {
-  allocator_.clear();
-  root_token_.reset();
-}
-
-}  // namespace expression
+  if constexpr (HasTokenAccessor<BasicToken>::value)
+    parser.set_max_depth(kUnlimited);
+  try {
+    Parse(parser, allocator);
+  } catch (const BudgetExceededError& error) {
+    ArenaPool::ReleaseLocal(std::move(allocator));
+    throw BudgetExceededError{
+        error.what(),
+        ParseUsage{error.usage().bytes, parser_delegate.node_count()}};
+  } catch (...) {
+    ArenaPool::ReleaseLocal(std::move(allocator));
+    throw;
+  }
+  node_count_ = parser_delegate.node_count();
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+template <class Parser>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::Parse(
+    Parser& parser, Allocator& allocator) {
+  std::optional<BasicToken> root_token = parser.template Parse<BasicToken>();
+  if (!root_token.has_value())
+    throw std::runtime_error("expression expected");
+
+  SetRootToken(std::move(*root_token), allocator);
+  if (compact_on_parse_)
+    Compact();
+  CompileIfDeep(parser.depth());
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::Clone(
+    BasicExpression& clone) const {
+  static_assert(HasTokenAccessor<BasicToken>::value,
+                "Cloning needs tokens that expose their tokens.");
+  assert(root_token_.has_value());
+  const bool compiled = is_compiled();
+  const bool native = is_native();
+  const bool batch = is_batch_compiled();
+  const size_t node_count = node_count_;
+  // Every token is copied once, so large trees fail before copying.
+  if (node_count > clone.budget_.max_nodes) {
+    throw BudgetExceededError{"node budget exceeded",
+                              ParseUsage{0, node_count}};
+  }
+
+  // The copy is made in the free inline arena of |clone| when it fits, or
+  // else in one chunk of the size of this arena.
+  Allocator allocator{clone.memory_resource_};
+  if constexpr (kInlineArenaBytes > 0) {
+    if (!clone.uses_inline_arena() && allocator_.size() <= kInlineArenaBytes)
+      allocator = Allocator{clone.inline_arena_, kInlineArenaBytes,
+                            clone.memory_resource_};
+  }
+  allocator.set_byte_limit(clone.budget_.max_bytes);
+  allocator.reserve_beyond_buffer(std::max<size_t>(64, allocator_.size()));
+  TokenCloner cloner{allocator};
+  BasicToken root_token = cloner.Clone(*root_token_);
+  clone.SetRootToken(std::move(root_token), allocator);
+  clone.node_count_ = node_count;
+  if (native)
+    clone.CompileNative();
+  else if (compiled)
+    clone.Compile();
+  if (batch)
+    clone.CompileBatch();
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline bool BasicExpression<BasicToken, kInlineArenaBytes>::Compact() {
+  assert(root_token_.has_value());
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    if (uses_inline_arena() && allocator_.stats().chunk_count == 1)
+      return true;
+    try {
+      Clone(*this);
+      // The inline arena held the tree while it was copied, and is free now.
+      if constexpr (kInlineArenaBytes > 0) {
+        if (!uses_inline_arena() && allocator_.size() <= kInlineArenaBytes)
+          Clone(*this);
+      }
+    } catch (const std::runtime_error&) {
+      return false;
+    }
+    return true;
+  } else {
+    return false;
+  }
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline std::string
+BasicExpression<BasicToken, kInlineArenaBytes>::Serialize() const {
+  static_assert(HasTokenAccessor<BasicToken>::value,
+                "Serialization needs tokens that describe themselves.");
+  assert(root_token_.has_value());
+  return SerializeExpression(*root_token_->token());
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline FlatTree
+BasicExpression<BasicToken, kInlineArenaBytes>::Flatten() const {
+  static_assert(HasTokenAccessor<BasicToken>::value,
+                "Flattening needs tokens that describe themselves.");
+  assert(root_token_.has_value());
+  return FlatTree::Build(*root_token_->token());
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::Deserialize(
+    std::string_view image) {
+  DeserializeImage(image, nullptr);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::Deserialize(
+    std::string_view image, SymbolTable& symbol_table) {
+  DeserializeImage(image, &symbol_table);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+void BasicExpression<BasicToken, kInlineArenaBytes>::DeserializeImage(
+    std::string_view image, SymbolTable* symbol_table) {
+  const SerializedExpression serialized{image};
+  // Names are only bound with a symbol table, as when parsing.
+  if (serialized.has_variables() && !symbol_table)
+    throw std::runtime_error{"unexpected token"};
+  // Every record makes one token, so large images fail before loading.
+  if (serialized.node_count() > budget_.max_nodes) {
+    throw BudgetExceededError{"node budget exceeded",
+                              ParseUsage{0, serialized.node_count()}};
+  }
+
+  Allocator allocator = AcquireArena();
+  allocator.set_byte_limit(budget_.max_bytes);
+  allocator.reserve_bytes(std::max<size_t>(64, serialized.node_count() * 64));
+  BasicParserDelegate<BasicToken> parser_delegate{allocator};
+  parser_delegate.set_symbol_table(symbol_table);
+  std::optional<BasicToken> root_token;
+  size_t depth = 0;
+  try {
+    root_token =
+        DeserializeExpression<BasicToken>(serialized, parser_delegate, &depth);
+  } catch (const BudgetExceededError& error) {
+    ArenaPool::ReleaseLocal(std::move(allocator));
+    throw BudgetExceededError{
+        error.what(),
+        ParseUsage{error.usage().bytes, parser_delegate.node_count()}};
+  } catch (...) {
+    ArenaPool::ReleaseLocal(std::move(allocator));
+    throw;
+  }
+  SetRootToken(std::move(*root_token), allocator);
+  node_count_ = parser_delegate.node_count();
+  if (compact_on_parse_)
+    Compact();
+  CompileIfDeep(depth);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::SetRootToken(
+    BasicToken root_token, Allocator& allocator) {
+  program_.reset();
+  batch_program_.reset();
+  jit_program_.reset();
+  root_token_ = std::move(root_token);
+  node_count_ = 0;
+  ArenaPool::ReleaseLocal(std::exchange(allocator_, std::move(allocator)));
+}
+
+// Token::Calculate recurses, so trees deeper than BasicParser allows by
+// default are calculated by their compiled program, which does not.
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::CompileIfDeep(
+    size_t depth) {
+  using Parser = BasicParser<Lexer, BasicParserDelegate<BasicToken>>;
+  if (depth > Parser::kMaxDepth && !is_compiled())
+    Compile();
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline bool BasicExpression<BasicToken, kInlineArenaBytes>::Compile() {
+  assert(root_token_.has_value());
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    jit_program_.reset();
+    batch_program_.reset();
+    program_ = Program::Compile(*root_token_->token());
+    return true;
+  } else {
+    return false;
+  }
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline bool BasicExpression<BasicToken, kInlineArenaBytes>::CompileBatch() {
+  if (!is_compiled() && !Compile())
+    return false;
+  if (!program_->is_numeric())
+    return false;
+  if (!batch_program_)
+    batch_program_ = BatchProgram::Compile(*root_token_->token());
+  return true;
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline bool BasicExpression<BasicToken, kInlineArenaBytes>::CompileNative() {
+  if (!Compile())
+    return false;
+  if (!program_->is_numeric() || !JitProgram::IsAvailable())
+    return false;
+  try {
+    jit_program_ = JitProgram::Compile(*root_token_->token());
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  return true;
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline typename BasicExpression<BasicToken, kInlineArenaBytes>::BasicValue
+BasicExpression<BasicToken, kInlineArenaBytes>::Calculate(void* data) const {
+  assert(root_token_.has_value());
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    if (jit_program_.has_value())
+      return CalculateNumber(data);
+    if (program_.has_value())
+      return program_->Calculate(data);
+  }
+  return root_token_->Calculate(data);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline double BasicExpression<BasicToken, kInlineArenaBytes>::CalculateNumber(
+    void* data) const {
+  assert(is_numeric());
+  if (jit_program_.has_value()) {
+    // Native code reads number slots only.
+    if (!jit_program_->reads_variables())
+      return jit_program_->Calculate(nullptr);
+    const auto& context = GetEvaluationContext(data);
+    if (context.numbers)
+      return jit_program_->Calculate(context.numbers);
+  }
+  return program_->CalculateNumber(data);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::CalculateBatch(
+    const double* const* columns,
+    size_t row_count,
+    double* results) const {
+  assert(batch_program_.has_value());
+  batch_program_->Calculate(columns, row_count, results);
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+template <class Visitor>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::Traverse(
+    const Visitor& visitor) const {
+  assert(root_token_.has_value());
+  TraverseAdapter<Visitor> adapter{visitor};
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    TraverseTokens(*root_token_->token(),
+                   &TraverseAdapter<Visitor>::StaticCallback, &adapter);
+  } else {
+    root_token_->Traverse(&TraverseAdapter<Visitor>::StaticCallback,
+                          &adapter);
+  }
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline std::string BasicExpression<BasicToken, kInlineArenaBytes>::Format(
+    const FormatterDelegate& delegate) const {
+  assert(root_token_.has_value());
+  std::string str;
+  if constexpr (HasTokenAccessor<BasicToken>::value)
+    FormatTokens(*root_token_->token(), delegate, str);
+  else
+    root_token_->Format(delegate, str);
+  return str;
+}
+
+template <class BasicToken, size_t kInlineArenaBytes>
+inline void BasicExpression<BasicToken, kInlineArenaBytes>::Clear() {
+  program_.reset();
+  batch_program_.reset();
+  jit_program_.reset();
+  root_token_.reset();
+  node_count_ = 0;
+  ArenaPool::ReleaseLocal(std::move(allocator_));
+}
+
+}  // namespace expression
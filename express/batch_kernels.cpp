@@ -0,0 +1,535 @@
+#include "express/batch_kernels.h"
+
+#include "express/value.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EXPRESS_BATCH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define EXPRESS_TARGET_AVX2
+#else
+#define EXPRESS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace expression {
+
+namespace {
+
+// Scalar kernels. They also finish the rows left over by the vector kernels.
+
+inline bool IsTrue(double value) {
+  return std::fabs(value) >= Value::kPrecision;
+}
+
+inline double ToNumber(bool value) {
+  return value ? 1.0 : 0.0;
+}
+
+template <class Operation>
+inline void Unary(const double* __restrict operand,
+                  double* __restrict result,
+                  size_t count,
+                  Operation operation) {
+  for (size_t i = 0; i < count; ++i)
+    result[i] = operation(operand[i]);
+}
+
+template <class Operation>
+inline void Binary(const double* __restrict left,
+                   const double* __restrict right,
+                   double* __restrict result,
+                   size_t count,
+                   Operation operation) {
+  for (size_t i = 0; i < count; ++i)
+    result[i] = operation(left[i], right[i]);
+}
+
+void Negate(const double* operand, double* result, size_t count) {
+  Unary(operand, result, count, [](double a) { return -a; });
+}
+
+void LogicalNot(const double* operand, double* result, size_t count) {
+  Unary(operand, result, count, [](double a) { return ToNumber(!IsTrue(a)); });
+}
+
+void Abs(const double* operand, double* result, size_t count) {
+  Unary(operand, result, count, [](double a) { return std::fabs(a); });
+}
+
+void Sign(const double* operand, double* result, size_t count) {
+  Unary(operand, result, count, [](double a) {
+    if (std::fabs(a) < Value::kPrecision)
+      return 0.0;
+    return a > 0.0 ? 1.0 : -1.0;
+  });
+}
+
+void Sqrt(const double* operand, double* result, size_t count) {
+  Unary(operand, result, count, [](double a) { return std::sqrt(a); });
+}
+
+void Add(const double* left, const double* right, double* result,
+         size_t count) {
+  Binary(left, right, result, count, [](double a, double b) { return a + b; });
+}
+
+void Subtract(const double* left, const double* right, double* result,
+              size_t count) {
+  Binary(left, right, result, count, [](double a, double b) { return a - b; });
+}
+
+void Multiply(const double* left, const double* right, double* result,
+              size_t count) {
+  Binary(left, right, result, count, [](double a, double b) { return a * b; });
+}
+
+void Divide(const double* left, const double* right, double* result,
+            size_t count) {
+  Binary(left, right, result, count, [](double a, double b) { return a / b; });
+}
+
+void Power(const double* left, const double* right, double* result,
+           size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return std::pow(a, b); });
+}
+
+void Equal(const double* left, const double* right, double* result,
+           size_t count) {
+  Binary(left, right, result, count, [](double a, double b) {
+    return ToNumber(std::fabs(a - b) < Value::kPrecision);
+  });
+}
+
+void Less(const double* left, const double* right, double* result,
+          size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return ToNumber(a < b); });
+}
+
+void Greater(const double* left, const double* right, double* result,
+             size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return ToNumber(b < a); });
+}
+
+void LessEqual(const double* left, const double* right, double* result,
+               size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return ToNumber(!(b < a)); });
+}
+
+void GreaterEqual(const double* left, const double* right, double* result,
+                  size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return ToNumber(!(a < b)); });
+}
+
+void Min(const double* left, const double* right, double* result,
+         size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return b < a ? b : a; });
+}
+
+void Max(const double* left, const double* right, double* result,
+         size_t count) {
+  Binary(left, right, result, count,
+         [](double a, double b) { return a < b ? b : a; });
+}
+
+void LogicalAnd(const double* left, const double* right, double* result,
+                size_t count) {
+  Binary(left, right, result, count, [](double a, double b) {
+    return ToNumber(IsTrue(a) && IsTrue(b));
+  });
+}
+
+void LogicalOr(const double* left, const double* right, double* result,
+               size_t count) {
+  Binary(left, right, result, count, [](double a, double b) {
+    return ToNumber(IsTrue(a) || IsTrue(b));
+  });
+}
+
+void Blend(const double* __restrict condition,
+           const double* __restrict when_true,
+           const double* __restrict when_false,
+           double* __restrict result,
+           size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    result[i] = IsTrue(condition[i]) ? when_true[i] : when_false[i];
+}
+
+#if defined(EXPRESS_BATCH_X86)
+
+// SSE2 kernels. SSE2 is part of x86-64, so they need no detection.
+//
+// Comparisons use the ordered predicates where the scalar code compares
+// directly and the unordered negated ones where it negates a comparison, so
+// NaN rows produce the same results. Min and max rely on minpd/maxpd
+// returning the second operand when the first does not compare.
+
+inline __m128d Sse2Blend(__m128d mask, __m128d when_true, __m128d when_false) {
+  return _mm_or_pd(_mm_and_pd(mask, when_true),
+                   _mm_andnot_pd(mask, when_false));
+}
+
+inline __m128d Sse2Abs(__m128d a) {
+  return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+}
+
+inline __m128d Sse2IsTrue(__m128d a) {
+  return _mm_cmpge_pd(Sse2Abs(a), _mm_set1_pd(Value::kPrecision));
+}
+
+inline __m128d Sse2ToNumber(__m128d mask) {
+  return _mm_and_pd(mask, _mm_set1_pd(1.0));
+}
+
+inline __m128d Sse2Negate(__m128d a) {
+  return _mm_xor_pd(a, _mm_set1_pd(-0.0));
+}
+
+inline __m128d Sse2Not(__m128d a) {
+  return _mm_andnot_pd(Sse2IsTrue(a), _mm_set1_pd(1.0));
+}
+
+inline __m128d Sse2Sign(__m128d a) {
+  const __m128d is_null = _mm_cmplt_pd(Sse2Abs(a), _mm_set1_pd(Value::kPrecision));
+  const __m128d sign = Sse2Blend(_mm_cmpgt_pd(a, _mm_setzero_pd()),
+                                 _mm_set1_pd(1.0), _mm_set1_pd(-1.0));
+  return _mm_andnot_pd(is_null, sign);
+}
+
+inline __m128d Sse2Sqrt(__m128d a) {
+  return _mm_sqrt_pd(a);
+}
+
+inline __m128d Sse2Add(__m128d a, __m128d b) {
+  return _mm_add_pd(a, b);
+}
+
+inline __m128d Sse2Subtract(__m128d a, __m128d b) {
+  return _mm_sub_pd(a, b);
+}
+
+inline __m128d Sse2Multiply(__m128d a, __m128d b) {
+  return _mm_mul_pd(a, b);
+}
+
+inline __m128d Sse2Divide(__m128d a, __m128d b) {
+  return _mm_div_pd(a, b);
+}
+
+inline __m128d Sse2Equal(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_cmplt_pd(Sse2Abs(_mm_sub_pd(a, b)),
+                                   _mm_set1_pd(Value::kPrecision)));
+}
+
+inline __m128d Sse2Less(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_cmplt_pd(a, b));
+}
+
+inline __m128d Sse2Greater(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_cmplt_pd(b, a));
+}
+
+inline __m128d Sse2LessEqual(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_cmpnlt_pd(b, a));
+}
+
+inline __m128d Sse2GreaterEqual(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_cmpnlt_pd(a, b));
+}
+
+inline __m128d Sse2Min(__m128d a, __m128d b) {
+  return _mm_min_pd(b, a);
+}
+
+inline __m128d Sse2Max(__m128d a, __m128d b) {
+  return _mm_max_pd(b, a);
+}
+
+inline __m128d Sse2And(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_and_pd(Sse2IsTrue(a), Sse2IsTrue(b)));
+}
+
+inline __m128d Sse2Or(__m128d a, __m128d b) {
+  return Sse2ToNumber(_mm_or_pd(Sse2IsTrue(a), Sse2IsTrue(b)));
+}
+
+template <__m128d (*Operation)(__m128d), UnaryKernel kTail>
+void Sse2UnaryKernel(const double* operand, double* result, size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(result + i, Operation(_mm_loadu_pd(operand + i)));
+  kTail(operand + i, result + i, count - i);
+}
+
+template <__m128d (*Operation)(__m128d, __m128d), BinaryKernel kTail>
+void Sse2BinaryKernel(const double* left,
+                      const double* right,
+                      double* result,
+                      size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(result + i, Operation(_mm_loadu_pd(left + i),
+                                        _mm_loadu_pd(right + i)));
+  }
+  kTail(left + i, right + i, result + i, count - i);
+}
+
+void Sse2BlendKernel(const double* condition,
+                     const double* when_true,
+                     const double* when_false,
+                     double* result,
+                     size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(result + i,
+                  Sse2Blend(Sse2IsTrue(_mm_loadu_pd(condition + i)),
+                            _mm_loadu_pd(when_true + i),
+                            _mm_loadu_pd(when_false + i)));
+  }
+  Blend(condition + i, when_true + i, when_false + i, result + i, count - i);
+}
+
+// AVX2 kernels, compiled for AVX2 regardless of the build target and only
+// used after runtime detection.
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Abs(__m256d a) {
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2IsTrue(__m256d a) {
+  return _mm256_cmp_pd(Avx2Abs(a), _mm256_set1_pd(Value::kPrecision),
+                       _CMP_GE_OQ);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2ToNumber(__m256d mask) {
+  return _mm256_and_pd(mask, _mm256_set1_pd(1.0));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Negate(__m256d a) {
+  return _mm256_xor_pd(a, _mm256_set1_pd(-0.0));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Not(__m256d a) {
+  return _mm256_andnot_pd(Avx2IsTrue(a), _mm256_set1_pd(1.0));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Sign(__m256d a) {
+  const __m256d is_null = _mm256_cmp_pd(
+      Avx2Abs(a), _mm256_set1_pd(Value::kPrecision), _CMP_LT_OQ);
+  const __m256d sign = _mm256_blendv_pd(
+      _mm256_set1_pd(-1.0), _mm256_set1_pd(1.0),
+      _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ));
+  return _mm256_andnot_pd(is_null, sign);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Sqrt(__m256d a) {
+  return _mm256_sqrt_pd(a);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Add(__m256d a, __m256d b) {
+  return _mm256_add_pd(a, b);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Subtract(__m256d a, __m256d b) {
+  return _mm256_sub_pd(a, b);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Multiply(__m256d a, __m256d b) {
+  return _mm256_mul_pd(a, b);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Divide(__m256d a, __m256d b) {
+  return _mm256_div_pd(a, b);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Equal(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_cmp_pd(Avx2Abs(_mm256_sub_pd(a, b)),
+                                    _mm256_set1_pd(Value::kPrecision),
+                                    _CMP_LT_OQ));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Less(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Greater(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_cmp_pd(b, a, _CMP_LT_OQ));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2LessEqual(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_cmp_pd(b, a, _CMP_NLT_UQ));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2GreaterEqual(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_cmp_pd(a, b, _CMP_NLT_UQ));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Min(__m256d a, __m256d b) {
+  return _mm256_min_pd(b, a);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Max(__m256d a, __m256d b) {
+  return _mm256_max_pd(b, a);
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2And(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_and_pd(Avx2IsTrue(a), Avx2IsTrue(b)));
+}
+
+EXPRESS_TARGET_AVX2 inline __m256d Avx2Or(__m256d a, __m256d b) {
+  return Avx2ToNumber(_mm256_or_pd(Avx2IsTrue(a), Avx2IsTrue(b)));
+}
+
+template <__m256d (*Operation)(__m256d), UnaryKernel kTail>
+EXPRESS_TARGET_AVX2 void Avx2UnaryKernel(const double* operand,
+                                         double* result,
+                                         size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(result + i, Operation(_mm256_loadu_pd(operand + i)));
+  kTail(operand + i, result + i, count - i);
+}
+
+template <__m256d (*Operation)(__m256d, __m256d), BinaryKernel kTail>
+EXPRESS_TARGET_AVX2 void Avx2BinaryKernel(const double* left,
+                                          const double* right,
+                                          double* result,
+                                          size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(result + i, Operation(_mm256_loadu_pd(left + i),
+                                           _mm256_loadu_pd(right + i)));
+  }
+  kTail(left + i, right + i, result + i, count - i);
+}
+
+EXPRESS_TARGET_AVX2 void Avx2BlendKernel(const double* condition,
+                                         const double* when_true,
+                                         const double* when_false,
+                                         double* result,
+                                         size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(result + i,
+                     _mm256_blendv_pd(_mm256_loadu_pd(when_false + i),
+                                      _mm256_loadu_pd(when_true + i),
+                                      Avx2IsTrue(_mm256_loadu_pd(condition + i))));
+  }
+  Blend(condition + i, when_true + i, when_false + i, result + i, count - i);
+}
+
+bool CpuSupportsAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int registers[4];
+  __cpuid(registers, 0);
+  if (registers[0] < 7)
+    return false;
+  __cpuid(registers, 1);
+  const bool os_saves_ymm = (registers[2] & (1 << 27)) &&
+                            (_xgetbv(0) & 0x6) == 0x6;
+  __cpuidex(registers, 7, 0);
+  return os_saves_ymm && (registers[1] & (1 << 5));
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif  // defined(EXPRESS_BATCH_X86)
+
+}  // namespace
+
+const BatchKernels& GetScalarBatchKernels() {
+  static const BatchKernels kKernels = {
+      "scalar",   Negate,       LogicalNot, Abs,        Sign,      Sqrt,
+      Add,        Subtract,     Multiply,   Divide,     Power,     Equal,
+      Less,       Greater,      LessEqual,  GreaterEqual, Min,     Max,
+      LogicalAnd, LogicalOr,    Blend,
+  };
+  return kKernels;
+}
+
+const BatchKernels* GetSse2BatchKernels() {
+#if defined(EXPRESS_BATCH_X86)
+  static const BatchKernels kKernels = {
+      "sse2",
+      Sse2UnaryKernel<Sse2Negate, Negate>,
+      Sse2UnaryKernel<Sse2Not, LogicalNot>,
+      Sse2UnaryKernel<Sse2Abs, Abs>,
+      Sse2UnaryKernel<Sse2Sign, Sign>,
+      Sse2UnaryKernel<Sse2Sqrt, Sqrt>,
+      Sse2BinaryKernel<Sse2Add, Add>,
+      Sse2BinaryKernel<Sse2Subtract, Subtract>,
+      Sse2BinaryKernel<Sse2Multiply, Multiply>,
+      Sse2BinaryKernel<Sse2Divide, Divide>,
+      Power,
+      Sse2BinaryKernel<Sse2Equal, Equal>,
+      Sse2BinaryKernel<Sse2Less, Less>,
+      Sse2BinaryKernel<Sse2Greater, Greater>,
+      Sse2BinaryKernel<Sse2LessEqual, LessEqual>,
+      Sse2BinaryKernel<Sse2GreaterEqual, GreaterEqual>,
+      Sse2BinaryKernel<Sse2Min, Min>,
+      Sse2BinaryKernel<Sse2Max, Max>,
+      Sse2BinaryKernel<Sse2And, LogicalAnd>,
+      Sse2BinaryKernel<Sse2Or, LogicalOr>,
+      Sse2BlendKernel,
+  };
+  return &kKernels;
+#else
+  return nullptr;
+#endif
+}
+
+const BatchKernels* GetAvx2BatchKernels() {
+#if defined(EXPRESS_BATCH_X86)
+  static const BatchKernels kKernels = {
+      "avx2",
+      Avx2UnaryKernel<Avx2Negate, Negate>,
+      Avx2UnaryKernel<Avx2Not, LogicalNot>,
+      Avx2UnaryKernel<Avx2Abs, Abs>,
+      Avx2UnaryKernel<Avx2Sign, Sign>,
+      Avx2UnaryKernel<Avx2Sqrt, Sqrt>,
+      Avx2BinaryKernel<Avx2Add, Add>,
+      Avx2BinaryKernel<Avx2Subtract, Subtract>,
+      Avx2BinaryKernel<Avx2Multiply, Multiply>,
+      Avx2BinaryKernel<Avx2Divide, Divide>,
+      Power,
+      Avx2BinaryKernel<Avx2Equal, Equal>,
+      Avx2BinaryKernel<Avx2Less, Less>,
+      Avx2BinaryKernel<Avx2Greater, Greater>,
+      Avx2BinaryKernel<Avx2LessEqual, LessEqual>,
+      Avx2BinaryKernel<Avx2GreaterEqual, GreaterEqual>,
+      Avx2BinaryKernel<Avx2Min, Min>,
+      Avx2BinaryKernel<Avx2Max, Max>,
+      Avx2BinaryKernel<Avx2And, LogicalAnd>,
+      Avx2BinaryKernel<Avx2Or, LogicalOr>,
+      Avx2BlendKernel,
+  };
+  static const bool kSupported = CpuSupportsAvx2();
+  return kSupported ? &kKernels : nullptr;
+#else
+  return nullptr;
+#endif
+}
+
+const BatchKernels& GetBatchKernels() {
+  static const BatchKernels& kKernels = [] () -> const BatchKernels& {
+    if (const auto* kernels = GetAvx2BatchKernels())
+      return *kernels;
+    if (const auto* kernels = GetSse2BatchKernels())
+      return *kernels;
+    return GetScalarBatchKernels();
+  }();
+  return kKernels;
+}
+
+}  // namespace expression
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <cstddef>
+
+namespace expression {
+
+// Element-wise loops over blocks of rows used by BatchProgram. Every kernel
+// follows the numeric semantics of Program::CalculateNumber, including the
+// precision used by equality and truthiness. Boolean results are 1 or 0.
+using UnaryKernel = void (*)(const double* operand,
+                             double* result,
+                             size_t count);
+using BinaryKernel = void (*)(const double* left,
+                              const double* right,
+                              double* result,
+                              size_t count);
+// result = condition ? when_true : when_false.
+using BlendKernel = void (*)(const double* condition,
+                             const double* when_true,
+                             const double* when_false,
+                             double* result,
+                             size_t count);
+
+struct BatchKernels {
+  const char* name;
+  UnaryKernel negate;
+  UnaryKernel logical_not;
+  UnaryKernel abs;
+  UnaryKernel sign;
+  UnaryKernel sqrt;
+  BinaryKernel add;
+  BinaryKernel subtract;
+  BinaryKernel multiply;
+  BinaryKernel divide;
+  BinaryKernel power;
+  BinaryKernel equal;
+  BinaryKernel less;
+  BinaryKernel greater;
+  BinaryKernel less_equal;
+  BinaryKernel greater_equal;
+  BinaryKernel min;
+  BinaryKernel max;
+  BinaryKernel logical_and;
+  BinaryKernel logical_or;
+  BlendKernel blend;
+};
+
+// Plain loops the compiler is free to vectorize.
+EXPRESS_EXPORT const BatchKernels& GetScalarBatchKernels();
+
+// Explicit SSE2 and AVX2 kernels. Null when the build target or the CPU does
+// not support the instruction set. Power stays scalar.
+EXPRESS_EXPORT const BatchKernels* GetSse2BatchKernels();
+EXPRESS_EXPORT const BatchKernels* GetAvx2BatchKernels();
+
+// The widest kernels supported by the CPU, detected once.
+EXPRESS_EXPORT const BatchKernels& GetBatchKernels();
+
+}  // namespace expression
@@ -0,0 +1,435 @@
+#include "express/batch_program.h"
+
+#include "express/batch_kernels.h"
+#include "express/standard_functions.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+#include "express/type_inference.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+enum class BatchCode : unsigned char {
+  Negate,
+  Not,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Equal,
+  Less,
+  Greater,
+  LessEqual,
+  GreaterEqual,
+  Min,
+  Max,
+  And,
+  Or,
+  Blend,
+  Abs,
+  Sign,
+  Sqrt,
+  Call1,
+  Call2,
+};
+
+}  // namespace
+
+struct BatchProgram::Instruction {
+  BatchCode code;
+  size_t operand_count = 0;
+  std::array<Operand, 3> operands{};
+  // Register receiving the result.
+  size_t result = 0;
+  double (*function1)(double) = nullptr;
+  double (*function2)(double, double) = nullptr;
+};
+
+// Walks the tree with an explicit stack, so trees of any depth compile.
+class BatchProgram::Compiler {
+ public:
+  explicit Compiler(BatchProgram& program) : program_{program} {}
+
+  Operand Emit(const Token& root) {
+    WalkTokens(root, *this);
+    return values_.back();
+  }
+
+  // Maps the register written by every instruction to as few blocks as
+  // possible, reusing the blocks of values that are no longer read.
+  void AllocateRegisters();
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described);
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  Operand EmitToken(const TokenInfo& info, const Operand* operands);
+  Operand EmitInstruction(BatchCode code,
+                          const TokenInfo& info,
+                          const Operand* operands);
+  Operand EmitFold(BatchCode code,
+                   const TokenInfo& info,
+                   const Operand* operands);
+
+  BatchProgram& program_;
+  // Shared tokens are evaluated once.
+  std::unordered_map<const Token*, Operand> operands_;
+  // Operands of the tokens being walked.
+  std::vector<Operand> values_;
+  size_t virtual_register_count_ = 0;
+};
+
+bool BatchProgram::Compiler::Enter(const Token& token,
+                                   const TokenInfo& /*info*/,
+                                   bool described) {
+  auto i = operands_.find(&token);
+  if (i != operands_.end()) {
+    values_.push_back(i->second);
+    return false;
+  }
+  if (!described)
+    throw std::runtime_error{"expression is not numeric"};
+  return true;
+}
+
+void BatchProgram::Compiler::Leave(const Token& token, const TokenInfo& info) {
+  const size_t first = values_.size() - info.operand_count;
+  const Operand operand = EmitToken(info, values_.data() + first);
+  values_.resize(first);
+  values_.push_back(operand);
+  operands_.emplace(&token, operand);
+}
+
+BatchProgram::Operand BatchProgram::Compiler::EmitToken(
+    const TokenInfo& info,
+    const Operand* operands) {
+  Operand operand;
+  switch (info.opcode) {
+    case Opcode::Number:
+      operand.kind = Operand::Kind::Constant;
+      operand.index = program_.constants_.size() / kBlockSize;
+      program_.constants_.insert(program_.constants_.end(), kBlockSize,
+                                 info.number);
+      break;
+    case Opcode::Variable:
+      operand.kind = Operand::Kind::Variable;
+      operand.index = info.slot;
+      if (std::find(program_.slots_.begin(), program_.slots_.end(),
+                    info.slot) == program_.slots_.end()) {
+        program_.slots_.emplace_back(info.slot);
+      }
+      break;
+    case Opcode::Parentheses:
+      operand = operands[0];
+      break;
+    case Opcode::Negate:
+      operand = EmitInstruction(BatchCode::Negate, info, operands);
+      break;
+    case Opcode::Not:
+      operand = EmitInstruction(BatchCode::Not, info, operands);
+      break;
+    case Opcode::Add:
+      operand = EmitInstruction(BatchCode::Add, info, operands);
+      break;
+    case Opcode::Subtract:
+      operand = EmitInstruction(BatchCode::Subtract, info, operands);
+      break;
+    case Opcode::Multiply:
+      operand = EmitInstruction(BatchCode::Multiply, info, operands);
+      break;
+    case Opcode::Divide:
+      operand = EmitInstruction(BatchCode::Divide, info, operands);
+      break;
+    case Opcode::Power:
+      operand = EmitInstruction(BatchCode::Power, info, operands);
+      break;
+    case Opcode::Equal:
+      operand = EmitInstruction(BatchCode::Equal, info, operands);
+      break;
+    case Opcode::Less:
+      operand = EmitInstruction(BatchCode::Less, info, operands);
+      break;
+    case Opcode::Greater:
+      operand = EmitInstruction(BatchCode::Greater, info, operands);
+      break;
+    case Opcode::LessEqual:
+      operand = EmitInstruction(BatchCode::LessEqual, info, operands);
+      break;
+    case Opcode::GreaterEqual:
+      operand = EmitInstruction(BatchCode::GreaterEqual, info, operands);
+      break;
+    case Opcode::If:
+      operand = EmitInstruction(BatchCode::Blend, info, operands);
+      break;
+    case Opcode::And:
+      operand = EmitFold(BatchCode::And, info, operands);
+      break;
+    case Opcode::Or:
+      operand = EmitFold(BatchCode::Or, info, operands);
+      break;
+    case Opcode::Min:
+      operand = EmitFold(BatchCode::Min, info, operands);
+      break;
+    case Opcode::Max:
+      operand = EmitFold(BatchCode::Max, info, operands);
+      break;
+    case Opcode::Function1:
+      // Functions with kernels are recognized by their pointers, so custom
+      // functions reusing a standard name are called.
+      if (info.function1 == functions::abs_)
+        operand = EmitInstruction(BatchCode::Abs, info, operands);
+      else if (info.function1 == functions::sign)
+        operand = EmitInstruction(BatchCode::Sign, info, operands);
+      else if (info.function1 == static_cast<double (*)(double)>(sqrt))
+        operand = EmitInstruction(BatchCode::Sqrt, info, operands);
+      else
+        operand = EmitInstruction(BatchCode::Call1, info, operands);
+      break;
+    case Opcode::Function2:
+      operand = EmitInstruction(BatchCode::Call2, info, operands);
+      break;
+    case Opcode::String:
+      throw std::runtime_error{"expression is not numeric"};
+  }
+
+  return operand;
+}
+
+BatchProgram::Operand BatchProgram::Compiler::EmitInstruction(
+    BatchCode code,
+    const TokenInfo& info,
+    const Operand* operands) {
+  Instruction instruction;
+  instruction.code = code;
+  instruction.operand_count = info.operand_count;
+  for (size_t i = 0; i < info.operand_count; ++i)
+    instruction.operands[i] = operands[i];
+  instruction.function1 = info.function1;
+  instruction.function2 = info.function2;
+  instruction.result = virtual_register_count_++;
+  program_.instructions_.emplace_back(instruction);
+
+  Operand operand;
+  operand.kind = Operand::Kind::Register;
+  operand.index = instruction.result;
+  return operand;
+}
+
+BatchProgram::Operand BatchProgram::Compiler::EmitFold(
+    BatchCode code,
+    const TokenInfo& info,
+    const Operand* operands) {
+  // Single argument folds evaluate to the argument itself.
+  if (info.operand_count == 1)
+    return operands[0];
+  return EmitInstruction(code, info, operands);
+}
+
+void BatchProgram::Compiler::AllocateRegisters() {
+  constexpr size_t kReleased = std::numeric_limits<size_t>::max();
+
+  auto& instructions = program_.instructions_;
+  // Instruction that reads each register last. The program result is read
+  // after the last instruction.
+  std::vector<size_t> last_use(virtual_register_count_, 0);
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const auto& instruction = instructions[i];
+    for (size_t j = 0; j < instruction.operand_count; ++j) {
+      if (instruction.operands[j].kind == Operand::Kind::Register)
+        last_use[instruction.operands[j].index] = i;
+    }
+  }
+  if (program_.result_.kind == Operand::Kind::Register)
+    last_use[program_.result_.index] = instructions.size();
+
+  std::vector<size_t> blocks(virtual_register_count_);
+  std::vector<size_t> free_blocks;
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    auto& instruction = instructions[i];
+    // The result block is taken before the operands are released, so kernels
+    // never write over their own operands.
+    size_t block;
+    if (free_blocks.empty()) {
+      block = program_.register_count_++;
+    } else {
+      block = free_blocks.back();
+      free_blocks.pop_back();
+    }
+    blocks[instruction.result] = block;
+    instruction.result = block;
+
+    for (size_t j = 0; j < instruction.operand_count; ++j) {
+      auto& operand = instruction.operands[j];
+      if (operand.kind != Operand::Kind::Register)
+        continue;
+      const size_t virtual_register = operand.index;
+      operand.index = blocks[virtual_register];
+      if (last_use[virtual_register] == i) {
+        free_blocks.emplace_back(operand.index);
+        last_use[virtual_register] = kReleased;
+      }
+    }
+  }
+
+  if (program_.result_.kind == Operand::Kind::Register)
+    program_.result_.index = blocks[program_.result_.index];
+}
+
+BatchProgram::BatchProgram() = default;
+
+BatchProgram::~BatchProgram() = default;
+
+BatchProgram::BatchProgram(BatchProgram&& source) noexcept = default;
+
+BatchProgram& BatchProgram::operator=(BatchProgram&& source) noexcept =
+    default;
+
+// static
+BatchProgram BatchProgram::Compile(const Token& root) {
+  if (InferType(root) != StaticType::Number)
+    throw std::runtime_error{"expression is not numeric"};
+
+  BatchProgram program;
+  Compiler compiler{program};
+  program.result_ = compiler.Emit(root);
+  compiler.AllocateRegisters();
+  return program;
+}
+
+size_t BatchProgram::instruction_count() const {
+  return instructions_.size();
+}
+
+const double* BatchProgram::Resolve(const Operand& operand,
+                                    const double* const* columns,
+                                    size_t start,
+                                    const double* registers) const {
+  switch (operand.kind) {
+    case Operand::Kind::Constant:
+      return constants_.data() + operand.index * kBlockSize;
+    case Operand::Kind::Variable:
+      return columns[operand.index] + start;
+    case Operand::Kind::Register:
+      return registers + operand.index * kBlockSize;
+  }
+  assert(false);
+  return nullptr;
+}
+
+void BatchProgram::Calculate(const double* const* columns,
+                             size_t row_count,
+                             double* results) const {
+  Calculate(columns, row_count, results, GetBatchKernels());
+}
+
+void BatchProgram::Calculate(const double* const* columns,
+                             size_t row_count,
+                             double* results,
+                             const BatchKernels& kernels) const {
+  std::vector<double> registers(register_count_ * kBlockSize);
+
+  for (size_t start = 0; start < row_count; start += kBlockSize) {
+    const size_t count = std::min(kBlockSize, row_count - start);
+    for (const auto& instruction : instructions_) {
+      std::array<const double*, 3> operands{};
+      for (size_t i = 0; i < instruction.operand_count; ++i) {
+        operands[i] = Resolve(instruction.operands[i], columns, start,
+                              registers.data());
+      }
+      const double* a = operands[0];
+      const double* b = operands[1];
+      double* result = registers.data() + instruction.result * kBlockSize;
+
+      switch (instruction.code) {
+        case BatchCode::Negate:
+          kernels.negate(a, result, count);
+          break;
+        case BatchCode::Not:
+          kernels.logical_not(a, result, count);
+          break;
+        case BatchCode::Add:
+          kernels.add(a, b, result, count);
+          break;
+        case BatchCode::Subtract:
+          kernels.subtract(a, b, result, count);
+          break;
+        case BatchCode::Multiply:
+          kernels.multiply(a, b, result, count);
+          break;
+        case BatchCode::Divide:
+          kernels.divide(a, b, result, count);
+          break;
+        case BatchCode::Power:
+          kernels.power(a, b, result, count);
+          break;
+        case BatchCode::Equal:
+          kernels.equal(a, b, result, count);
+          break;
+        case BatchCode::Less:
+          kernels.less(a, b, result, count);
+          break;
+        case BatchCode::Greater:
+          kernels.greater(a, b, result, count);
+          break;
+        case BatchCode::LessEqual:
+          kernels.less_equal(a, b, result, count);
+          break;
+        case BatchCode::GreaterEqual:
+          kernels.greater_equal(a, b, result, count);
+          break;
+        case BatchCode::Min:
+          kernels.min(a, b, result, count);
+          break;
+        case BatchCode::Max:
+          kernels.max(a, b, result, count);
+          break;
+        case BatchCode::And:
+          kernels.logical_and(a, b, result, count);
+          break;
+        case BatchCode::Or:
+          kernels.logical_or(a, b, result, count);
+          break;
+        case BatchCode::Blend:
+          kernels.blend(a, b, operands[2], result, count);
+          break;
+        case BatchCode::Abs:
+          kernels.abs(a, result, count);
+          break;
+        case BatchCode::Sign:
+          kernels.sign(a, result, count);
+          break;
+        case BatchCode::Sqrt:
+          kernels.sqrt(a, result, count);
+          break;
+        case BatchCode::Call1:
+          for (size_t i = 0; i < count; ++i)
+            result[i] = instruction.function1(a[i]);
+          break;
+        case BatchCode::Call2:
+          for (size_t i = 0; i < count; ++i)
+            result[i] = instruction.function2(a[i], b[i]);
+          break;
+      }
+    }
+
+    const double* result =
+        Resolve(result_, columns, start, registers.data());
+    memcpy(results + start, result, count * sizeof(double));
+  }
+}
+
+}  // namespace expression
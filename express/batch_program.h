@@ -0,0 +1,83 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace expression {
+
+class Token;
+struct BatchKernels;
+
+// Columnar form of a numeric token tree. Every instruction evaluates one node
+// over a block of rows before the next node runs, so dispatch is paid once
+// per block and the arithmetic runs in tight loops over doubles. Both
+// branches of If and both operands of And and Or are evaluated and blended,
+// which is exact because numeric trees have no side effects.
+//
+// The program references tokens owned by the expression allocator only while
+// compiling.
+class EXPRESS_EXPORT BatchProgram {
+ public:
+  static constexpr size_t kBlockSize = 256;
+
+  BatchProgram();
+  ~BatchProgram();
+
+  BatchProgram(BatchProgram&& source) noexcept;
+  BatchProgram& operator=(BatchProgram&& source) noexcept;
+
+  BatchProgram(const BatchProgram&) = delete;
+  BatchProgram& operator=(const BatchProgram&) = delete;
+
+  // Throws std::runtime_error unless type inference proves the tree numeric.
+  static BatchProgram Compile(const Token& root);
+
+  // Evaluates |row_count| rows. |columns| holds a column of |row_count|
+  // numbers for every SymbolTable slot the tree references, and |results|
+  // receives one number per row.
+  // Runs on the widest kernels the CPU supports.
+  void Calculate(const double* const* columns,
+                 size_t row_count,
+                 double* results) const;
+
+  void Calculate(const double* const* columns,
+                 size_t row_count,
+                 double* results,
+                 const BatchKernels& kernels) const;
+
+  size_t instruction_count() const;
+
+  // Number of row blocks kept alive at once for intermediate results.
+  size_t register_count() const { return register_count_; }
+
+  // SymbolTable slots the program reads, in the order of first use.
+  const std::vector<size_t>& slots() const { return slots_; }
+
+ private:
+  // Block a node reads its operand from. Constants index constants_,
+  // variables the SymbolTable slot and registers the scratch blocks.
+  struct Operand {
+    enum class Kind : unsigned char { Constant, Variable, Register };
+    Kind kind = Kind::Constant;
+    size_t index = 0;
+  };
+
+  struct Instruction;
+  class Compiler;
+
+  const double* Resolve(const Operand& operand,
+                        const double* const* columns,
+                        size_t start,
+                        const double* registers) const;
+
+  std::vector<Instruction> instructions_;
+  // A block filled with each constant.
+  std::vector<double> constants_;
+  size_t register_count_ = 0;
+  Operand result_;
+  std::vector<size_t> slots_;
+};
+
+}  // namespace expression
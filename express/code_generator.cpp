@@ -0,0 +1,442 @@
+#include "express/code_generator.h"
+
+#include "express/express.h"
+#include "express/formula_registry.h"
+#include "express/standard_functions.h"
+#include "express/symbol_table.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+struct CppFunction1 {
+  double (*function)(double);
+  const char* name;
+};
+
+struct CppFunction2 {
+  double (*function)(double, double);
+  const char* name;
+};
+
+// Standard functions are recognized by their pointers, so custom functions
+// reusing a standard name are not translated.
+const CppFunction1 kFunctions1[] = {
+    {functions::abs_, "std::fabs"},
+    {functions::not_, "Not"},
+    {functions::sign, "Sign"},
+    {static_cast<double (*)(double)>(sqrt), "std::sqrt"},
+    {static_cast<double (*)(double)>(sin), "std::sin"},
+    {static_cast<double (*)(double)>(cos), "std::cos"},
+    {static_cast<double (*)(double)>(tan), "std::tan"},
+    {static_cast<double (*)(double)>(asin), "std::asin"},
+    {static_cast<double (*)(double)>(acos), "std::acos"},
+    {static_cast<double (*)(double)>(atan), "std::atan"},
+};
+
+const CppFunction2 kFunctions2[] = {
+    {static_cast<double (*)(double, double)>(atan2), "std::atan2"},
+    {functions::xor_, "BitXor"},
+};
+
+// Standard function translated for |info|, or null.
+const char* FindFunction(const TokenInfo& info) {
+  if (info.opcode == Opcode::Function1) {
+    for (const auto& function : kFunctions1) {
+      if (function.function == info.function1)
+        return function.name;
+    }
+  } else {
+    for (const auto& function : kFunctions2) {
+      if (function.function == info.function2)
+        return function.name;
+    }
+  }
+  return nullptr;
+}
+
+// Helpers with the semantics of the operators and functions that have no
+// direct C++ counterpart.
+constexpr const char kPrelude[] =
+    "inline bool IsTrue(double x) {\n"
+    "  return std::fabs(x) >= kPrecision;\n"
+    "}\n"
+    "\n"
+    "inline double FromBool(bool b) {\n"
+    "  return b ? 1.0 : 0.0;\n"
+    "}\n"
+    "\n"
+    "inline double Not(double x) {\n"
+    "  return FromBool(std::fabs(x) < kPrecision);\n"
+    "}\n"
+    "\n"
+    "inline double Sign(double x) {\n"
+    "  return std::fabs(x) < kPrecision ? 0.0 : (0.0 < x ? 1.0 : -1.0);\n"
+    "}\n"
+    "\n"
+    "inline double BitXor(double x, double y) {\n"
+    "  return FromBool((std::fabs(x) < kPrecision) !=\n"
+    "                  (std::fabs(y) < kPrecision));\n"
+    "}\n"
+    "\n"
+    "inline double Min(double a, double b) {\n"
+    "  return b < a ? b : a;\n"
+    "}\n"
+    "\n"
+    "inline double Max(double a, double b) {\n"
+    "  return a < b ? b : a;\n"
+    "}\n";
+
+// Exact C++ spelling of |number|.
+std::string FormatNumber(double number) {
+  if (std::isnan(number))
+    return "std::numeric_limits<double>::quiet_NaN()";
+  if (std::isinf(number)) {
+    return number < 0 ? "(-std::numeric_limits<double>::infinity())"
+                      : "std::numeric_limits<double>::infinity()";
+  }
+
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%a", number);
+  if (buffer[0] == '-')
+    return std::string{"("} + buffer + ")";
+  return buffer;
+}
+
+std::string QuoteString(std::string_view text) {
+  std::string result = "\"";
+  for (char c : text) {
+    switch (c) {
+      case '"':
+      case '\\':
+        result += '\\';
+        result += c;
+        break;
+      case '\n':
+        result += "\\n";
+        break;
+      case '\t':
+        result += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escape[8];
+          std::snprintf(escape, sizeof(escape), "\\%03o",
+                        static_cast<unsigned char>(c));
+          result += escape;
+        } else {
+          result += c;
+        }
+        break;
+    }
+  }
+  result += '"';
+  return result;
+}
+
+// Formula text on a single comment line.
+std::string CommentText(std::string_view text) {
+  std::string result{text};
+  std::replace_if(result.begin(), result.end(),
+                  [](char c) { return c == '\n' || c == '\r'; }, ' ');
+  return result;
+}
+
+}  // namespace
+
+// Translates a token tree to a C++ expression. Subtrees shared by the parser
+// are computed once into locals ahead of the return statement: translated
+// formulas have no side effects, so computing a subtree that a conditional
+// skips changes nothing but time. The tree is walked with an explicit stack.
+class CodeGenerator::Translator {
+ public:
+  explicit Translator(const Token& root) { CountReferences(root); }
+
+  void Translate(const Token& root, Function& function);
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described);
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  void CountReferences(const Token& root);
+  bool CountReference(const Token& token,
+                      const TokenInfo& info,
+                      bool described);
+
+  bool IsShared(const Token& token) const {
+    auto i = references_.find(&token);
+    return i != references_.end() && i->second > 1;
+  }
+
+  std::string TranslateToken(const TokenInfo& info, std::string* operands);
+  static std::string Binary(std::string* operands, const char* oper);
+  static std::string Call(const char* name,
+                          std::string* operands,
+                          size_t operand_count);
+
+  std::unordered_map<const Token*, size_t> references_;
+  std::unordered_map<const Token*, std::string> locals_;
+  std::string statements_;
+  // Translations of the operands walked so far.
+  std::vector<std::string> operands_;
+  bool reads_variables_ = false;
+};
+
+void CodeGenerator::Translator::Translate(const Token& root,
+                                          Function& function) {
+  WalkTokens(root, *this);
+  function.body = statements_ + "  return " + operands_.back() + ";\n";
+  function.reads_variables = reads_variables_;
+}
+
+void CodeGenerator::Translator::CountReferences(const Token& root) {
+  struct Counter {
+    Translator& translator;
+
+    bool Enter(const Token& token, const TokenInfo& info, bool described) {
+      return translator.CountReference(token, info, described);
+    }
+    void Next(const Token&, const TokenInfo&, size_t) {}
+    void Leave(const Token&, const TokenInfo&) {}
+  };
+
+  Counter counter{*this};
+  WalkTokens(root, counter);
+}
+
+bool CodeGenerator::Translator::CountReference(const Token& token,
+                                               const TokenInfo& info,
+                                               bool described) {
+  if (!described)
+    throw std::runtime_error("formula has a token without C++ translation");
+  if (info.opcode == Opcode::Number || info.opcode == Opcode::Variable)
+    return false;
+  return ++references_[&token] == 1;
+}
+
+bool CodeGenerator::Translator::Enter(const Token& token,
+                                      const TokenInfo& info,
+                                      bool /*described*/) {
+  if (IsShared(token)) {
+    auto local = locals_.find(&token);
+    if (local != locals_.end()) {
+      operands_.push_back(local->second);
+      return false;
+    }
+  }
+
+  switch (info.opcode) {
+    case Opcode::String:
+      throw std::runtime_error("formula is not numeric");
+    case Opcode::Variable:
+      if (info.type == StaticType::String)
+        throw std::runtime_error("formula is not numeric");
+      break;
+    case Opcode::Function1:
+    case Opcode::Function2:
+      if (!FindFunction(info)) {
+        throw std::runtime_error("function has no C++ translation: " +
+                                 std::string{info.string});
+      }
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+void CodeGenerator::Translator::Leave(const Token& token,
+                                      const TokenInfo& info) {
+  const size_t first = operands_.size() - info.operand_count;
+  std::string expression = TranslateToken(info, operands_.data() + first);
+  operands_.resize(first);
+  if (IsShared(token)) {
+    std::string name = "t" + std::to_string(locals_.size());
+    statements_ += "  const double " + name + " = " + expression + ";\n";
+    expression = locals_.emplace(&token, std::move(name)).first->second;
+  }
+  operands_.push_back(std::move(expression));
+}
+
+std::string CodeGenerator::Translator::TranslateToken(
+    const TokenInfo& info,
+    std::string* operands) {
+  switch (info.opcode) {
+    case Opcode::Number:
+      return FormatNumber(info.number);
+    case Opcode::Variable:
+      reads_variables_ = true;
+      return "numbers[" + std::to_string(info.slot) + "]";
+    case Opcode::Negate:
+      return "(-" + operands[0] + ")";
+    case Opcode::Not:
+      return "FromBool(!IsTrue(" + operands[0] + "))";
+    case Opcode::Add:
+      return Binary(operands, " + ");
+    case Opcode::Subtract:
+      return Binary(operands, " - ");
+    case Opcode::Multiply:
+      return Binary(operands, " * ");
+    case Opcode::Divide:
+      return Binary(operands, " / ");
+    case Opcode::Power:
+      return Call("std::pow", operands, info.operand_count);
+    case Opcode::Equal:
+      return "FromBool(std::fabs" + Binary(operands, " - ") + " < kPrecision)";
+    case Opcode::Less:
+      return "FromBool(" + Binary(operands, " < ") + ")";
+    case Opcode::Greater:
+      return "FromBool(" + Binary(operands, " > ") + ")";
+    case Opcode::LessEqual:
+      // !(b < a) holds for unordered operands like the interpreter's.
+      return "FromBool(!" + Binary(operands, " > ") + ")";
+    case Opcode::GreaterEqual:
+      return "FromBool(!" + Binary(operands, " < ") + ")";
+    case Opcode::Parentheses:
+      return std::move(operands[0]);
+    case Opcode::If:
+      return "(IsTrue(" + operands[0] + ") ? " + operands[1] + " : " +
+             operands[2] + ")";
+    case Opcode::And:
+      if (info.operand_count == 1)
+        return std::move(operands[0]);
+      return "(IsTrue(" + operands[0] + ") ? FromBool(IsTrue(" + operands[1] +
+             ")) : 0.0)";
+    case Opcode::Or:
+      if (info.operand_count == 1)
+        return std::move(operands[0]);
+      return "(IsTrue(" + operands[0] + ") ? 1.0 : FromBool(IsTrue(" +
+             operands[1] + ")))";
+    case Opcode::Min:
+      if (info.operand_count == 1)
+        return std::move(operands[0]);
+      return Call("Min", operands, info.operand_count);
+    case Opcode::Max:
+      if (info.operand_count == 1)
+        return std::move(operands[0]);
+      return Call("Max", operands, info.operand_count);
+    case Opcode::Function1:
+    case Opcode::Function2:
+      return Call(FindFunction(info), operands, info.operand_count);
+    default:
+      break;
+  }
+
+  assert(false);
+  return {};
+}
+
+// static
+std::string CodeGenerator::Translator::Binary(std::string* operands,
+                                              const char* oper) {
+  return "(" + operands[0] + oper + operands[1] + ")";
+}
+
+// static
+std::string CodeGenerator::Translator::Call(const char* name,
+                                            std::string* operands,
+                                            size_t operand_count) {
+  std::string result = name;
+  result += '(';
+  for (size_t i = 0; i < operand_count; ++i) {
+    if (i != 0)
+      result += ", ";
+    result += operands[i];
+  }
+  result += ')';
+  return result;
+}
+
+CodeGenerator::CodeGenerator(SymbolTable& symbol_table)
+    : symbol_table_{symbol_table} {}
+
+CodeGenerator::~CodeGenerator() = default;
+
+size_t CodeGenerator::Add(std::string_view formula) {
+  auto i = std::find_if(
+      functions_.begin(), functions_.end(),
+      [&](const Function& function) { return function.text == formula; });
+  if (i != functions_.end())
+    return i - functions_.begin();
+
+  Function function;
+  function.text = formula;
+  Expression expression;
+  expression.Parse(function.text.c_str(), symbol_table_);
+  const Token& root = *expression.root_token().token();
+  Translator{root}.Translate(root, function);
+  functions_.push_back(std::move(function));
+  return functions_.size() - 1;
+}
+
+std::string CodeGenerator::Generate(std::string_view register_function) const {
+  std::string source =
+      "// Generated by the express code generator. Do not edit.\n"
+      "\n"
+      "#include \"express/formula_registry.h\"\n"
+      "\n"
+      "#include <cmath>\n"
+      "#include <limits>\n"
+      "\n";
+
+  if (symbol_table_.size() != 0) {
+    source += "// Variables:\n";
+    for (size_t slot = 0; slot < symbol_table_.size(); ++slot) {
+      source += "//   numbers[" + std::to_string(slot) +
+                "]: " + std::string{symbol_table_.name(slot)} + "\n";
+    }
+    source += "\n";
+  }
+
+  source += "namespace {\n\nconstexpr double kPrecision = " +
+            FormatNumber(Value::kPrecision) + ";\n\n" + kPrelude;
+
+  for (size_t i = 0; i < functions_.size(); ++i) {
+    const Function& function = functions_[i];
+    source += "\n// " + CommentText(function.text) + "\n";
+    source += "inline double Formula" + std::to_string(i) + "(const double*" +
+              (function.reads_variables ? " numbers" : "") + ") {\n";
+    source += function.body;
+    source += "}\n";
+  }
+
+  if (!functions_.empty()) {
+    source += "\nconst expression::GeneratedFormula kFormulas[] = {\n";
+    for (size_t i = 0; i < functions_.size(); ++i) {
+      const Function& function = functions_[i];
+      const auto formula_hash =
+          static_cast<unsigned long long>(HashFormula(function.text));
+      char hash[24];
+      std::snprintf(hash, sizeof(hash), "0x%016llxull", formula_hash);
+      source += "    {" + QuoteString(function.text) + ", " + hash +
+                ", &Formula" + std::to_string(i) + "},\n";
+    }
+    source += "};\n";
+  }
+
+  source += "\n}  // namespace\n\nvoid " + std::string{register_function} +
+            "(expression::FormulaRegistry& registry) {\n";
+  if (functions_.empty()) {
+    source += "  (void)registry;\n";
+  } else {
+    source +=
+        "  registry.Register(kFormulas,\n"
+        "                    sizeof(kFormulas) / sizeof(kFormulas[0]));\n";
+  }
+  source += "}\n";
+  return source;
+}
+
+}  // namespace expression
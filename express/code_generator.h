@@ -0,0 +1,55 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class SymbolTable;
+
+// Ahead-of-time translation of numeric formulas to C++. Every formula
+// becomes an inline function computing the same number as
+// Program::CalculateNumber, and the generated source registers a table of
+// them with a FormulaRegistry so the formulas can be looked up by text or
+// hash once the source is compiled and linked in.
+//
+// Formulas may use the operators and the standard functions. Variables are
+// read as numbers from the slots of the symbol table.
+class EXPRESS_EXPORT CodeGenerator {
+ public:
+  explicit CodeGenerator(SymbolTable& symbol_table);
+  ~CodeGenerator();
+
+  CodeGenerator(const CodeGenerator&) = delete;
+  CodeGenerator& operator=(const CodeGenerator&) = delete;
+
+  // Parses and translates |formula|, returning its index. Formulas added
+  // twice keep their first index. Throws std::runtime_error if the formula
+  // does not parse or uses strings or custom functions.
+  size_t Add(std::string_view formula);
+
+  size_t size() const { return functions_.size(); }
+
+  // Returns a source file defining
+  //   void <register_function>(expression::FormulaRegistry& registry);
+  // which registers the formulas in the order they were added.
+  std::string Generate(std::string_view register_function) const;
+
+ private:
+  struct Function {
+    std::string text;
+    std::string body;
+    bool reads_variables = false;
+  };
+
+  class Translator;
+
+  SymbolTable& symbol_table_;
+  std::vector<Function> functions_;
+};
+
+}  // namespace expression
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdexcept>
+
+namespace expression {
+
+class Value;
+
+// Variable values for one evaluation, indexed by SymbolTable slots. One of
+// |values| and |numbers| must be set when the expression has variables.
+//
+// Expressions with variables are calculated with a pointer to the context as
+// Calculate data. Custom tokens of such expressions find their own data in
+// |data|.
+struct EvaluationContext {
+  const Value* values = nullptr;
+  const double* numbers = nullptr;
+  void* data = nullptr;
+};
+
+// Returns the context passed as Calculate data to an expression with
+// variables. Throws std::runtime_error when there is none, e.g. when such an
+// expression is calculated without a context.
+inline const EvaluationContext& GetEvaluationContext(const void* data) {
+  const auto* context = static_cast<const EvaluationContext*>(data);
+  if (!context || (!context->values && !context->numbers))
+    throw std::runtime_error{"evaluation context expected"};
+  return *context;
+}
+
+}  // namespace expression
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "express/allocator.h"
+#include "express/arena_token.h"
+#include "express/evaluation_context.h"
+#include "express/lexer.h"
+#include "express/lexer_delegate.h"
+#include "express/parser.h"
+#include "express/program.h"
+#include "express/symbol_table.h"
+#include "express/token.h"
+
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace expression {
+
+// Many formulas parsed into a single arena by one parser delegate. Identical
+// subtrees and string literals are shared across formulas, and once compiled
+// every formula is evaluated in one pass with each shared node computed once.
+template <class BasicToken>
+class BasicExpressionSet {
+ public:
+  static_assert(kIsArenaToken<BasicToken>,
+                "BasicToken must satisfy the arena token contract.");
+  using BasicValue = decltype(std::declval<BasicToken>().Calculate(nullptr));
+
+  BasicExpressionSet() { parser_delegate_.set_share_across_parses(true); }
+
+  // Binds names that are not functions to |symbol_table| slots.
+  explicit BasicExpressionSet(SymbolTable& symbol_table) {
+    parser_delegate_.set_share_across_parses(true);
+    parser_delegate_.set_symbol_table(&symbol_table);
+  }
+
+  // The parser delegate references the arena, so the set stays in place.
+  BasicExpressionSet(const BasicExpressionSet&) = delete;
+  BasicExpressionSet& operator=(const BasicExpressionSet&) = delete;
+
+  // Parses |buf| and returns the index of the formula. Drops the compiled
+  // program.
+  size_t Add(const char* buf);
+
+  size_t size() const { return root_tokens_.size(); }
+
+  const BasicToken& root_token(size_t index) const {
+    assert(index < root_tokens_.size());
+    return root_tokens_[index];
+  }
+
+  // Lowers every formula into one Program. Returns false when BasicToken does
+  // not expose its tokens, in which case CalculateAll walks the trees.
+  bool Compile();
+
+  bool is_compiled() const { return program_.has_value(); }
+
+  const Program& program() const {
+    assert(program_.has_value());
+    return *program_;
+  }
+
+  // True if the compiled program is proven to produce numbers only.
+  bool is_numeric() const { return program_ && program_->is_numeric(); }
+
+  BasicValue Calculate(size_t index, void* data = NULL) const {
+    return root_token(index).Calculate(data);
+  }
+
+  // Writes the value of every formula into |results|, which must have room
+  // for size() values.
+  void CalculateAll(void* data, BasicValue* results) const;
+
+  void CalculateAll(const EvaluationContext& context,
+                    BasicValue* results) const {
+    CalculateAll(const_cast<EvaluationContext*>(&context), results);
+  }
+
+  // Evaluates numeric formulas without constructing Values. Requires
+  // is_numeric().
+  void CalculateAllNumbers(const EvaluationContext& context,
+                           double* results) const {
+    assert(is_numeric());
+    program_->CalculateAllNumbers(const_cast<EvaluationContext*>(&context),
+                                  results);
+  }
+
+  BasicParserDelegate<BasicToken>& parser_delegate() {
+    return parser_delegate_;
+  }
+
+ private:
+  Allocator allocator_;
+  BasicParserDelegate<BasicToken> parser_delegate_{allocator_};
+  std::vector<BasicToken> root_tokens_;
+  std::optional<Program> program_;
+};
+
+template <class BasicToken>
+inline size_t BasicExpressionSet<BasicToken>::Add(const char* buf) {
+  LexerDelegate lexer_delegate;
+  Lexer lexer{buf, lexer_delegate, 0};
+  BasicParser<Lexer, BasicParserDelegate<BasicToken>> parser{lexer,
+                                                             parser_delegate_};
+  std::optional<BasicToken> root_token = parser.template Parse<BasicToken>();
+  if (!root_token.has_value())
+    throw std::runtime_error("expression expected");
+
+  program_.reset();
+  root_tokens_.emplace_back(std::move(*root_token));
+  return root_tokens_.size() - 1;
+}
+
+template <class BasicToken>
+inline bool BasicExpressionSet<BasicToken>::Compile() {
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    std::vector<const Token*> roots;
+    roots.reserve(root_tokens_.size());
+    for (const auto& root_token : root_tokens_)
+      roots.push_back(root_token.token());
+    program_ = Program::Compile(roots.data(), roots.size());
+    return true;
+  } else {
+    return false;
+  }
+}
+
+template <class BasicToken>
+inline void BasicExpressionSet<BasicToken>::CalculateAll(
+    void* data,
+    BasicValue* results) const {
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    if (program_.has_value() && !root_tokens_.empty()) {
+      program_->CalculateAll(data, results);
+      return;
+    }
+  }
+  for (size_t i = 0; i < root_tokens_.size(); ++i)
+    results[i] = root_tokens_[i].Calculate(data);
+}
+
+using ExpressionSet = BasicExpressionSet<PolymorphicToken>;
+
+}  // namespace expression
@@ -0,0 +1,321 @@
+#include "express/filter_program.h"
+
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/type_inference.h"
+#include "express/value.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+// Rows selected at once. Scratch columns and selection vectors are sized by
+// it, so it bounds the memory a Select call uses.
+constexpr size_t kChunkSize = BatchProgram::kBlockSize * 16;
+
+// Nesting of And, Or and Not nodes. Every level keeps its own selection
+// vectors while Select runs.
+constexpr size_t kMaxNodeDepth = 64;
+
+inline bool IsTrue(double value) {
+  return std::fabs(value) >= Value::kPrecision;
+}
+
+}  // namespace
+
+class FilterProgram::Compiler {
+ public:
+  explicit Compiler(FilterProgram& program) : program_{program} {}
+
+  // |depth| is the number of And, Or and Not nodes above |token|.
+  size_t Add(const Token& token, size_t depth);
+
+ private:
+  // Collects the operands of nested folds of the same operation, which the
+  // parser builds for And and Or over more than two arguments.
+  void Flatten(const Token& token,
+               Opcode opcode,
+               std::vector<size_t>& nodes,
+               size_t depth);
+
+  size_t AddPredicate(const Token& token);
+
+  FilterProgram& program_;
+};
+
+size_t FilterProgram::Compiler::Add(const Token& root, size_t depth) {
+  // Parentheses and single argument folds select the rows of their operand.
+  const Token* token = &root;
+  TokenInfo info;
+  for (;;) {
+    info = TokenInfo{};
+    if (!token->Describe(info))
+      return AddPredicate(*token);
+    if (info.opcode != Opcode::Parentheses &&
+        !((info.opcode == Opcode::And || info.opcode == Opcode::Or) &&
+          info.operand_count == 1)) {
+      break;
+    }
+    token = info.operands[0];
+  }
+
+  // Deeper subtrees are selected as a whole, which bounds the recursion and
+  // the scratch memory of Select.
+  if (depth == kMaxNodeDepth)
+    return AddPredicate(*token);
+
+  switch (info.opcode) {
+    case Opcode::And:
+    case Opcode::Or: {
+      Node node;
+      node.type = info.opcode == Opcode::And ? NodeType::And : NodeType::Or;
+      Flatten(*token, info.opcode, node.children, depth + 1);
+      program_.nodes_.emplace_back(std::move(node));
+      return program_.nodes_.size() - 1;
+    }
+
+    case Opcode::Not: {
+      Node node;
+      node.type = NodeType::Not;
+      node.children.emplace_back(Add(*info.operands[0], depth + 1));
+      program_.nodes_.emplace_back(std::move(node));
+      return program_.nodes_.size() - 1;
+    }
+
+    default:
+      return AddPredicate(*token);
+  }
+}
+
+void FilterProgram::Compiler::Flatten(const Token& token,
+                                      Opcode opcode,
+                                      std::vector<size_t>& nodes,
+                                      size_t depth) {
+  std::vector<const Token*> pending{&token};
+  while (!pending.empty()) {
+    const Token& operand = *pending.back();
+    pending.pop_back();
+    TokenInfo info;
+    if (!operand.Describe(info) || info.opcode != opcode) {
+      nodes.emplace_back(Add(operand, depth));
+      continue;
+    }
+    for (size_t i = info.operand_count; i-- != 0;)
+      pending.push_back(info.operands[i]);
+  }
+}
+
+size_t FilterProgram::Compiler::AddPredicate(const Token& token) {
+  auto& predicate = program_.predicates_.emplace_back(
+      BatchProgram::Compile(token));
+  for (size_t slot : predicate.slots())
+    program_.column_count_ = std::max(program_.column_count_, slot + 1);
+
+  Node node;
+  node.type = NodeType::Predicate;
+  node.predicate = program_.predicates_.size() - 1;
+  program_.nodes_.emplace_back(std::move(node));
+  return program_.nodes_.size() - 1;
+}
+
+// State of a single Select call.
+class FilterProgram::Evaluator {
+ public:
+  Evaluator(const FilterProgram& program, const double* const* columns)
+      : program_{program},
+        columns_{columns},
+        gathered_(program.column_count_),
+        column_pointers_(program.column_count_),
+        results_(kChunkSize) {}
+
+  // Narrows the ascending |selection| of |count| rows to the rows |node| is
+  // true for, keeping the order. Returns the new count.
+  size_t Apply(size_t node, uint32_t* selection, size_t count, size_t depth);
+
+ private:
+  size_t ApplyPredicate(const BatchProgram& predicate,
+                        uint32_t* selection,
+                        size_t count);
+  size_t ApplyOr(const Node& node,
+                 uint32_t* selection,
+                 size_t count,
+                 size_t depth);
+  size_t ApplyNot(const Node& node,
+                  uint32_t* selection,
+                  size_t count,
+                  size_t depth);
+
+  // Selection vectors owned by one level of the node tree.
+  uint32_t* Scratch(size_t depth, size_t index) {
+    const size_t position = depth * 4 + index;
+    if (scratch_.size() <= position)
+      scratch_.resize(position + 1);
+    scratch_[position].resize(kChunkSize);
+    return scratch_[position].data();
+  }
+
+  const FilterProgram& program_;
+  const double* const* columns_;
+  std::vector<std::vector<double>> gathered_;
+  std::vector<const double*> column_pointers_;
+  std::vector<double> results_;
+  std::vector<std::vector<uint32_t>> scratch_;
+};
+
+size_t FilterProgram::Evaluator::Apply(size_t node_index,
+                                       uint32_t* selection,
+                                       size_t count,
+                                       size_t depth) {
+  const Node& node = program_.nodes_[node_index];
+  switch (node.type) {
+    case NodeType::And:
+      for (size_t child : node.children) {
+        if (count == 0)
+          break;
+        count = Apply(child, selection, count, depth + 1);
+      }
+      return count;
+
+    case NodeType::Or:
+      return ApplyOr(node, selection, count, depth);
+
+    case NodeType::Not:
+      return ApplyNot(node, selection, count, depth);
+
+    case NodeType::Predicate:
+      return ApplyPredicate(program_.predicates_[node.predicate], selection,
+                            count);
+  }
+
+  assert(false);
+  return count;
+}
+
+size_t FilterProgram::Evaluator::ApplyPredicate(const BatchProgram& predicate,
+                                                uint32_t* selection,
+                                                size_t count) {
+  if (count == 0)
+    return 0;
+
+  // Consecutive rows are read in place, others are gathered first.
+  const bool dense = selection[count - 1] - selection[0] == count - 1;
+  for (size_t slot : predicate.slots()) {
+    if (dense) {
+      column_pointers_[slot] = columns_[slot] + selection[0];
+      continue;
+    }
+
+    auto& gathered = gathered_[slot];
+    gathered.resize(kChunkSize);
+    const double* column = columns_[slot];
+    for (size_t i = 0; i < count; ++i)
+      gathered[i] = column[selection[i]];
+    column_pointers_[slot] = gathered.data();
+  }
+
+  predicate.Calculate(column_pointers_.data(), count, results_.data());
+
+  size_t selected = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (IsTrue(results_[i]))
+      selection[selected++] = selection[i];
+  }
+  return selected;
+}
+
+size_t FilterProgram::Evaluator::ApplyOr(const Node& node,
+                                         uint32_t* selection,
+                                         size_t count,
+                                         size_t depth) {
+  // Rows no operand accepted yet. Each operand only sees these.
+  uint32_t* remaining = Scratch(depth, 0);
+  uint32_t* accepted = Scratch(depth, 1);
+  uint32_t* merged = Scratch(depth, 2);
+  uint32_t* difference = Scratch(depth, 3);
+  std::copy(selection, selection + count, remaining);
+  size_t remaining_count = count;
+  size_t selected = 0;
+
+  for (size_t child : node.children) {
+    if (remaining_count == 0)
+      break;
+
+    std::copy(remaining, remaining + remaining_count, accepted);
+    const size_t accepted_count =
+        Apply(child, accepted, remaining_count, depth + 1);
+
+    auto* merged_end = std::merge(selection, selection + selected, accepted,
+                                  accepted + accepted_count, merged);
+    selected = static_cast<size_t>(merged_end - merged);
+    std::copy(merged, merged_end, selection);
+
+    // The output of set_difference must not overlap its inputs.
+    auto* difference_end =
+        std::set_difference(remaining, remaining + remaining_count, accepted,
+                            accepted + accepted_count, difference);
+    remaining_count = static_cast<size_t>(difference_end - difference);
+    std::swap(remaining, difference);
+  }
+
+  return selected;
+}
+
+size_t FilterProgram::Evaluator::ApplyNot(const Node& node,
+                                          uint32_t* selection,
+                                          size_t count,
+                                          size_t depth) {
+  uint32_t* accepted = Scratch(depth, 0);
+  std::copy(selection, selection + count, accepted);
+  const size_t accepted_count =
+      Apply(node.children.front(), accepted, count, depth + 1);
+
+  uint32_t* difference = Scratch(depth, 1);
+  auto* end = std::set_difference(selection, selection + count, accepted,
+                                  accepted + accepted_count, difference);
+  std::copy(difference, end, selection);
+  return static_cast<size_t>(end - difference);
+}
+
+FilterProgram::FilterProgram() = default;
+
+FilterProgram::~FilterProgram() = default;
+
+FilterProgram::FilterProgram(FilterProgram&& source) noexcept = default;
+
+FilterProgram& FilterProgram::operator=(FilterProgram&& source) noexcept =
+    default;
+
+// static
+FilterProgram FilterProgram::Compile(const Token& root) {
+  if (InferType(root) != StaticType::Number)
+    throw std::runtime_error{"expression is not numeric"};
+
+  FilterProgram program;
+  Compiler compiler{program};
+  program.root_ = compiler.Add(root, 0);
+  return program;
+}
+
+size_t FilterProgram::Select(const double* const* columns,
+                             size_t row_count,
+                             uint32_t* selection) const {
+  Evaluator evaluator{*this, columns};
+  size_t selected = 0;
+  for (size_t start = 0; start < row_count; start += kChunkSize) {
+    const size_t count = std::min(kChunkSize, row_count - start);
+    uint32_t* chunk = selection + selected;
+    for (size_t i = 0; i < count; ++i)
+      chunk[i] = static_cast<uint32_t>(start + i);
+    selected += evaluator.Apply(root_, chunk, count, 0);
+  }
+  return selected;
+}
+
+}  // namespace expression
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "express/batch_program.h"
+#include "express/express_export.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace expression {
+
+class Token;
+
+// Predicate form of a numeric expression that selects the rows it is true
+// for. And, Or and ! are evaluated on selection vectors: every operand only
+// sees the rows still undecided, so the right side of And is skipped for
+// rows the left side rejected and the right side of Or for rows it
+// accepted. Other subtrees are BatchPrograms run over the gathered rows.
+class EXPRESS_EXPORT FilterProgram {
+ public:
+  FilterProgram();
+  ~FilterProgram();
+
+  FilterProgram(FilterProgram&& source) noexcept;
+  FilterProgram& operator=(FilterProgram&& source) noexcept;
+
+  FilterProgram(const FilterProgram&) = delete;
+  FilterProgram& operator=(const FilterProgram&) = delete;
+
+  // Throws std::runtime_error unless type inference proves the tree numeric.
+  static FilterProgram Compile(const Token& root);
+
+  // Writes the ascending indices of the rows among |row_count| for which the
+  // expression is true into |selection|, which must have room for
+  // |row_count| indices, and returns their number. |columns| holds a column
+  // per SymbolTable slot as for BatchProgram.
+  size_t Select(const double* const* columns,
+                size_t row_count,
+                uint32_t* selection) const;
+
+  // Number of subtrees evaluated as BatchPrograms.
+  size_t predicate_count() const { return predicates_.size(); }
+
+ private:
+  enum class NodeType : unsigned char { And, Or, Not, Predicate };
+
+  struct Node {
+    NodeType type = NodeType::Predicate;
+    // Child nodes for And, Or and Not, predicate index otherwise.
+    std::vector<size_t> children;
+    size_t predicate = 0;
+  };
+
+  class Compiler;
+  class Evaluator;
+
+  std::vector<Node> nodes_;
+  std::vector<BatchProgram> predicates_;
+  size_t root_ = 0;
+  size_t column_count_ = 0;
+};
+
+}  // namespace expression
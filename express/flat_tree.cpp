@@ -0,0 +1,585 @@
+#include "express/flat_tree.h"
+
+#include "express/evaluation_context.h"
+#include "express/formatter_delegate.h"
+#include "express/standard_functions.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+enum NodeFlags : uint8_t {
+  kCustomNode = 1,
+  kConstantNode = 2,
+};
+
+}  // namespace
+
+struct FlatTree::Node {
+  Opcode opcode = Opcode::Number;
+  uint8_t flags = 0;
+  uint8_t operand_count = 0;
+  uint8_t reserved = 0;
+  // Index of the first operand in operands_, or the source node of a folded
+  // constant.
+  uint32_t first = 0;
+  union {
+    double number;
+    // Index into strings_, functions_ or tokens_, and the function name or
+    // variable slot.
+    struct {
+      uint32_t index;
+      uint32_t extra;
+    } ref;
+  };
+};
+
+struct FlatTree::Function {
+  double (*function1)(double) = nullptr;
+  double (*function2)(double, double) = nullptr;
+};
+
+// Adds operands before the tokens using them, walking the tree with an
+// explicit stack.
+class FlatTree::Builder {
+ public:
+  explicit Builder(FlatTree& tree) : tree_{tree} {}
+
+  bool Enter(const Token& token, TokenInfo& info, bool described);
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  uint32_t AddToken(const TokenInfo& info, const uint32_t* operands);
+  uint32_t AddNode(const Node& node);
+  uint32_t AddString(std::string_view str);
+
+  FlatTree& tree_;
+  std::unordered_map<const Token*, uint32_t> indices_;
+  // Function names are compared by storage, as fold tokens compare their
+  // functions when formatting.
+  std::unordered_map<const char*, uint32_t> names_;
+  // Node indices of the operands added so far.
+  std::vector<uint32_t> values_;
+};
+
+bool FlatTree::Builder::Enter(const Token& token,
+                              TokenInfo& info,
+                              bool described) {
+  auto i = indices_.find(&token);
+  if (i != indices_.end()) {
+    values_.push_back(i->second);
+    return false;
+  }
+
+  if (!described) {
+    Node node;
+    node.number = 0;
+    node.flags = kCustomNode;
+    node.ref.index = static_cast<uint32_t>(tree_.tokens_.size());
+    tree_.tokens_.push_back(&token);
+    const uint32_t index = AddNode(node);
+    indices_.emplace(&token, index);
+    values_.push_back(index);
+    return false;
+  }
+
+  if (info.folded_source) {
+    info.operands[0] = info.folded_source;
+    info.operand_count = 1;
+  }
+  return true;
+}
+
+void FlatTree::Builder::Leave(const Token& token, const TokenInfo& info) {
+  const size_t first_value = values_.size() - info.operand_count;
+  const uint32_t index = AddToken(info, values_.data() + first_value);
+  values_.resize(first_value);
+  values_.push_back(index);
+  indices_.emplace(&token, index);
+}
+
+uint32_t FlatTree::Builder::AddToken(const TokenInfo& info,
+                                     const uint32_t* operands) {
+  Node node;
+  node.number = 0;
+  node.opcode = info.opcode;
+  if (info.folded_source) {
+    node.flags = kConstantNode;
+    node.first = operands[0];
+  }
+
+  switch (info.opcode) {
+    case Opcode::Number:
+      node.number = info.number;
+      return AddNode(node);
+    case Opcode::String:
+      node.ref.index = AddString(info.string);
+      return AddNode(node);
+    case Opcode::Variable:
+      assert(info.slot <= UINT32_MAX);
+      node.ref.index = AddString(info.string);
+      node.ref.extra = static_cast<uint32_t>(info.slot);
+      return AddNode(node);
+    default:
+      break;
+  }
+
+  node.operand_count = static_cast<uint8_t>(info.operand_count);
+  node.first = static_cast<uint32_t>(tree_.operands_.size());
+  tree_.operands_.insert(tree_.operands_.end(), operands,
+                         operands + info.operand_count);
+
+  switch (info.opcode) {
+    case Opcode::And:
+    case Opcode::Or:
+    case Opcode::Min:
+    case Opcode::Max: {
+      auto [name, inserted] = names_.emplace(
+          info.string.data(), static_cast<uint32_t>(tree_.strings_.size()));
+      if (inserted)
+        tree_.strings_.push_back(info.string);
+      node.ref.index = name->second;
+      break;
+    }
+    case Opcode::Function1:
+    case Opcode::Function2:
+      node.ref.index = static_cast<uint32_t>(tree_.functions_.size());
+      node.ref.extra = AddString(info.string);
+      tree_.functions_.push_back(Function{info.function1, info.function2});
+      break;
+    default:
+      break;
+  }
+  return AddNode(node);
+}
+
+uint32_t FlatTree::Builder::AddNode(const Node& node) {
+  tree_.nodes_.push_back(node);
+  return static_cast<uint32_t>(tree_.nodes_.size() - 1);
+}
+
+uint32_t FlatTree::Builder::AddString(std::string_view str) {
+  tree_.strings_.push_back(str);
+  return static_cast<uint32_t>(tree_.strings_.size() - 1);
+}
+
+FlatTree::FlatTree() = default;
+
+FlatTree::~FlatTree() = default;
+
+FlatTree::FlatTree(FlatTree&& source) noexcept = default;
+
+FlatTree& FlatTree::operator=(FlatTree&& source) noexcept = default;
+
+// static
+FlatTree FlatTree::Build(const Token& root) {
+  static_assert(sizeof(Node) == 16);
+  FlatTree tree;
+  Builder builder{tree};
+  WalkTokens(root, builder);
+  return tree;
+}
+
+Value FlatTree::Calculate(void* data) const {
+  assert(!nodes_.empty());
+  return Calculate(root(), data);
+}
+
+void FlatTree::Traverse(TraverseCallback callback, void* param) const {
+  assert(!nodes_.empty());
+  Traverse(root(), callback, param);
+}
+
+void FlatTree::Format(const FormatterDelegate& delegate,
+                      std::string& str) const {
+  assert(!nodes_.empty());
+  Format(root(), delegate, str);
+}
+
+size_t FlatTree::node_count() const {
+  return nodes_.size();
+}
+
+size_t FlatTree::memory_usage() const {
+  return nodes_.capacity() * sizeof(Node) +
+         operands_.capacity() * sizeof(uint32_t) +
+         functions_.capacity() * sizeof(Function) +
+         strings_.capacity() * sizeof(std::string_view) +
+         tokens_.capacity() * sizeof(const Token*);
+}
+
+bool FlatTree::is_custom(size_t node) const {
+  return (nodes_[node].flags & kCustomNode) != 0;
+}
+
+bool FlatTree::is_constant(size_t node) const {
+  return (nodes_[node].flags & kConstantNode) != 0;
+}
+
+Opcode FlatTree::opcode(size_t node) const {
+  assert(!is_custom(node));
+  return nodes_[node].opcode;
+}
+
+size_t FlatTree::operand_count(size_t node) const {
+  return nodes_[node].operand_count;
+}
+
+size_t FlatTree::operand(size_t node, size_t index) const {
+  assert(index < nodes_[node].operand_count);
+  return operands_[nodes_[node].first + index];
+}
+
+double FlatTree::number(size_t node) const {
+  assert(opcode(node) == Opcode::Number);
+  return nodes_[node].number;
+}
+
+std::string_view FlatTree::string(size_t node) const {
+  const Node& flat = nodes_[node];
+  switch (opcode(node)) {
+    case Opcode::String:
+    case Opcode::Variable:
+    case Opcode::And:
+    case Opcode::Or:
+    case Opcode::Min:
+    case Opcode::Max:
+      return strings_[flat.ref.index];
+    case Opcode::Function1:
+    case Opcode::Function2:
+      return strings_[flat.ref.extra];
+    case Opcode::If:
+      return "If";
+    default:
+      assert(false);
+      return {};
+  }
+}
+
+size_t FlatTree::slot(size_t node) const {
+  assert(opcode(node) == Opcode::Variable);
+  return nodes_[node].ref.extra;
+}
+
+// Evaluates with explicit stacks of nodes and operand values, so trees of
+// any depth fit. Operands are evaluated in the order and number of times the
+// token tree evaluates them.
+Value FlatTree::Calculate(size_t index, void* data) const {
+  struct Frame {
+    uint32_t node;
+    // Operands evaluated so far.
+    uint32_t step;
+    // Start of the operand values in |values|.
+    size_t first_value;
+  };
+
+  std::vector<Frame> frames;
+  std::vector<Value> values;
+  frames.push_back(Frame{static_cast<uint32_t>(index), 0, 0});
+  for (;;) {
+    Frame& frame = frames.back();
+    const Node& node = nodes_[frame.node];
+    const uint32_t* operands = operands_.data() + node.first;
+    Value* args = values.data() + frame.first_value;
+    size_t next = SIZE_MAX;
+    Value result;
+
+    if (node.flags & kCustomNode) {
+      result = tokens_[node.ref.index]->Calculate(data);
+    } else {
+      switch (node.opcode) {
+        case Opcode::Number:
+          result = node.number;
+          break;
+        case Opcode::String:
+          result = strings_[node.ref.index];
+          break;
+        case Opcode::Variable: {
+          const auto& context = GetEvaluationContext(data);
+          if (context.values)
+            result = context.values[node.ref.extra];
+          else
+            result = context.numbers[node.ref.extra];
+          break;
+        }
+        case Opcode::If:
+          if (frame.step == 0) {
+            next = operands[0];
+          } else if (frame.step == 1) {
+            const bool condition = static_cast<bool>(args[0]);
+            values.pop_back();
+            next = condition ? operands[1] : operands[2];
+          } else {
+            result = args[0];
+          }
+          break;
+        case Opcode::And:
+        case Opcode::Or:
+          if (frame.step < node.operand_count) {
+            // Folds of a single argument evaluate to the argument.
+            const bool short_circuit_value = node.opcode == Opcode::Or;
+            if (frame.step == 1 &&
+                static_cast<bool>(args[0]) == short_circuit_value) {
+              result = functions::bool_to_value(short_circuit_value);
+            } else {
+              next = operands[frame.step];
+            }
+          } else if (node.operand_count == 1) {
+            result = args[0];
+          } else if (node.opcode == Opcode::And) {
+            result = std::logical_and<Value>{}(args[0], args[1]);
+          } else {
+            result = std::logical_or<Value>{}(args[0], args[1]);
+          }
+          break;
+        default:
+          if (frame.step < node.operand_count)
+            next = operands[frame.step];
+          else
+            result = Apply(node, args);
+          break;
+      }
+    }
+
+    if (next != SIZE_MAX) {
+      ++frame.step;
+      frames.push_back(Frame{static_cast<uint32_t>(next), 0, values.size()});
+      continue;
+    }
+    values.resize(frame.first_value);
+    frames.pop_back();
+    if (frames.empty())
+      return result;
+    values.push_back(std::move(result));
+  }
+}
+
+// Applies operators and functions other than If, And and Or to their
+// evaluated operands.
+Value FlatTree::Apply(const Node& node, Value* args) const {
+  switch (node.opcode) {
+    case Opcode::Negate:
+      return -args[0];
+    case Opcode::Not:
+      return !args[0];
+    case Opcode::Add:
+      args[0] += args[1];
+      return args[0];
+    case Opcode::Subtract:
+      args[0] -= args[1];
+      return args[0];
+    case Opcode::Multiply:
+      args[0] *= args[1];
+      return args[0];
+    case Opcode::Divide:
+      args[0] /= args[1];
+      return args[0];
+    case Opcode::Power:
+      return pow((double)args[0], (double)args[1]);
+    case Opcode::Equal:
+      return args[0] == args[1];
+    case Opcode::Less:
+      return args[0] < args[1];
+    case Opcode::Greater:
+      return args[0] > args[1];
+    case Opcode::LessEqual:
+      return args[0] <= args[1];
+    case Opcode::GreaterEqual:
+      return args[0] >= args[1];
+    case Opcode::Parentheses:
+      return args[0];
+    case Opcode::Function1:
+      return functions_[node.ref.index].function1(args[0]);
+    case Opcode::Function2:
+      return functions_[node.ref.index].function2(args[0], args[1]);
+    case Opcode::Min:
+    case Opcode::Max:
+      // Folds of a single argument evaluate to the argument.
+      if (node.operand_count == 1)
+        return args[0];
+      if (node.opcode == Opcode::Min)
+        return functions::Min<Value>{}(args[0], args[1]);
+      return functions::Max<Value>{}(args[0], args[1]);
+    default:
+      assert(false);
+      return Value{};
+  }
+}
+
+void FlatTree::Traverse(size_t index,
+                        TraverseCallback callback,
+                        void* param) const {
+  std::vector<uint32_t> pending{static_cast<uint32_t>(index)};
+  while (!pending.empty()) {
+    index = pending.back();
+    pending.pop_back();
+    const Node& node = nodes_[index];
+    // Folded constants traverse as their source.
+    if (node.flags & kConstantNode) {
+      pending.push_back(node.first);
+      continue;
+    }
+    callback(*this, index, param);
+    for (size_t i = node.operand_count; i-- != 0;)
+      pending.push_back(operands_[node.first + i]);
+  }
+}
+
+void FlatTree::Format(size_t index,
+                      const FormatterDelegate& delegate,
+                      std::string& str) const {
+  // Work left to do, last first.
+  struct Item {
+    enum class Kind {
+      Node,
+      // Argument of the fold |fold|, listed inline if it is a two-argument
+      // fold of the same function, as the fold tokens format it.
+      FoldArgument,
+      // Binary operator of the node.
+      Operator,
+      Text,
+    };
+
+    Kind kind;
+    uint32_t node = 0;
+    uint32_t fold = 0;
+    std::string_view text;
+  };
+
+  std::vector<Item> pending;
+  auto push_node = [&](uint32_t node) {
+    pending.push_back(Item{Item::Kind::Node, node});
+  };
+  auto push_text = [&](std::string_view text) {
+    pending.push_back(Item{Item::Kind::Text, 0, 0, text});
+  };
+
+  push_node(static_cast<uint32_t>(index));
+  while (!pending.empty()) {
+    const Item item = pending.back();
+    pending.pop_back();
+    const Node& node = nodes_[item.node];
+    const uint32_t* operands = operands_.data() + node.first;
+
+    switch (item.kind) {
+      case Item::Kind::Text:
+        str.append(item.text.data(), item.text.size());
+        continue;
+      case Item::Kind::Operator:
+        str += ' ';
+        switch (node.opcode) {
+          case Opcode::LessEqual:
+            str += "<=";
+            break;
+          case Opcode::GreaterEqual:
+            str += ">=";
+            break;
+          default:
+            str += GetOperatorChar(node.opcode);
+            break;
+        }
+        str += ' ';
+        continue;
+      case Item::Kind::FoldArgument: {
+        const Node& fold_node = nodes_[item.fold];
+        if (node.flags == 0 && node.opcode == fold_node.opcode &&
+            node.operand_count == 2 && node.ref.index == fold_node.ref.index) {
+          pending.push_back(
+              Item{Item::Kind::FoldArgument, operands[1], item.fold});
+          push_text(", ");
+          pending.push_back(
+              Item{Item::Kind::FoldArgument, operands[0], item.fold});
+        } else {
+          push_node(item.node);
+        }
+        continue;
+      }
+      case Item::Kind::Node:
+        break;
+    }
+
+    if (node.flags & kCustomNode) {
+      tokens_[node.ref.index]->Format(delegate, str);
+      continue;
+    }
+    if (node.flags & kConstantNode) {
+      push_node(node.first);
+      continue;
+    }
+
+    switch (node.opcode) {
+      case Opcode::Number:
+        delegate.AppendDouble(str, node.number);
+        break;
+      case Opcode::String: {
+        const auto literal = strings_[node.ref.index];
+        str += '"';
+        str.append(literal.data(), literal.size());
+        str += '"';
+        break;
+      }
+      case Opcode::Variable: {
+        const auto name = strings_[node.ref.index];
+        str.append(name.data(), name.size());
+        break;
+      }
+      case Opcode::Negate:
+      case Opcode::Not:
+        str += GetOperatorChar(node.opcode);
+        push_node(operands[0]);
+        break;
+      case Opcode::Parentheses:
+        str += '(';
+        push_text(")");
+        push_node(operands[0]);
+        break;
+      case Opcode::And:
+      case Opcode::Or:
+      case Opcode::Min:
+      case Opcode::Max:
+        str += strings_[node.ref.index];
+        str += '(';
+        push_text(")");
+        if (node.operand_count == 1) {
+          push_node(operands[0]);
+        } else {
+          pending.push_back(
+              Item{Item::Kind::FoldArgument, operands[1], item.node});
+          push_text(", ");
+          pending.push_back(
+              Item{Item::Kind::FoldArgument, operands[0], item.node});
+        }
+        break;
+      case Opcode::If:
+      case Opcode::Function1:
+      case Opcode::Function2:
+        str += string(item.node);
+        str += '(';
+        push_text(")");
+        for (size_t i = node.operand_count; i-- != 0;) {
+          push_node(operands[i]);
+          if (i != 0)
+            push_text(", ");
+        }
+        break;
+      default:
+        push_node(operands[1]);
+        pending.push_back(Item{Item::Kind::Operator, item.node});
+        push_node(operands[0]);
+        break;
+    }
+  }
+}
+
+}  // namespace expression
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "express/express_export.h"
+#include "express/token_info.h"
+#include "express/value.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class FormatterDelegate;
+class Token;
+
+// Token tree stored as one contiguous array of 16-byte nodes in evaluation
+// order: every node follows its operands, which it references by 32-bit
+// index. Nodes carry an opcode tag instead of a vtable, so walks touch
+// adjacent memory instead of chasing arena pointers. Subtrees shared by the
+// parser stay shared.
+//
+// Calculate, Traverse and Format give the same results as the token tree.
+// Tokens that cannot describe themselves stay in the tree as custom nodes
+// calling the token. The tree references tokens and literal storage owned by
+// the expression allocator and must not outlive it.
+class EXPRESS_EXPORT FlatTree {
+ public:
+  // Called for every node reachable from the root in the order
+  // Token::Traverse visits tokens, once per reference. Custom nodes are
+  // visited without the tokens below them.
+  using TraverseCallback = bool (*)(const FlatTree& tree,
+                                    size_t node,
+                                    void* param);
+
+  FlatTree();
+  ~FlatTree();
+
+  FlatTree(FlatTree&& source) noexcept;
+  FlatTree& operator=(FlatTree&& source) noexcept;
+
+  FlatTree(const FlatTree&) = delete;
+  FlatTree& operator=(const FlatTree&) = delete;
+
+  static FlatTree Build(const Token& root);
+
+  Value Calculate(void* data) const;
+
+  void Traverse(TraverseCallback callback, void* param) const;
+
+  void Format(const FormatterDelegate& delegate, std::string& str) const;
+
+  size_t node_count() const;
+
+  // The root is the last node.
+  size_t root() const { return node_count() - 1; }
+
+  // Bytes allocated by the tree for nodes, operand indices, functions,
+  // strings and custom node tokens. Literal text stays in the arena.
+  size_t memory_usage() const;
+
+  // Custom nodes have no opcode and no operands.
+  bool is_custom(size_t node) const;
+
+  // Constants folded by the parser evaluate as Number or String nodes but
+  // traverse and format as their source subtree.
+  bool is_constant(size_t node) const;
+
+  Opcode opcode(size_t node) const;
+  size_t operand_count(size_t node) const;
+  size_t operand(size_t node, size_t index) const;
+
+  double number(size_t node) const;
+
+  // String literal, variable name or function name.
+  std::string_view string(size_t node) const;
+
+  size_t slot(size_t node) const;
+
+ private:
+  struct Node;
+  struct Function;
+  class Builder;
+
+  Value Calculate(size_t node, void* data) const;
+  Value Apply(const Node& node, Value* operands) const;
+  void Traverse(size_t node, TraverseCallback callback, void* param) const;
+  void Format(size_t node,
+              const FormatterDelegate& delegate,
+              std::string& str) const;
+
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> operands_;
+  std::vector<Function> functions_;
+  std::vector<std::string_view> strings_;
+  std::vector<const Token*> tokens_;
+};
+
+}  // namespace expression
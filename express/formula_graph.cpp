@@ -0,0 +1,188 @@
+#include "express/formula_graph.h"
+
+#include "express/evaluation_context.h"
+#include "express/thread_pool.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+namespace expression {
+
+namespace {
+
+constexpr size_t kNoFormula = static_cast<size_t>(-1);
+
+// Collects the slots of the variables read by the walked tokens.
+class SlotCollector {
+ public:
+  explicit SlotCollector(std::vector<size_t>& slots) : slots_{slots} {}
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described) {
+    if (!visited_.insert(&token).second)
+      return false;
+
+    if (!described) {
+      // Custom tokens are searched through Traverse, which reaches the
+      // variables among their operands.
+      token.Traverse(
+          [](const Token* operand, void* param) {
+            TokenInfo operand_info;
+            if (operand->Describe(operand_info) &&
+                operand_info.opcode == Opcode::Variable) {
+              static_cast<std::vector<size_t>*>(param)->push_back(
+                  operand_info.slot);
+            }
+            return true;
+          },
+          &slots_);
+      return false;
+    }
+    if (info.opcode == Opcode::Variable) {
+      slots_.push_back(info.slot);
+      return false;
+    }
+    return true;
+  }
+
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token&, const TokenInfo&) {}
+
+ private:
+  std::vector<size_t>& slots_;
+  std::unordered_set<const Token*> visited_;
+};
+
+}  // namespace
+
+FormulaGraph::FormulaGraph(SymbolTable& symbol_table)
+    : symbol_table_{symbol_table}, expressions_{symbol_table} {}
+
+FormulaGraph::~FormulaGraph() = default;
+
+size_t FormulaGraph::Define(std::string_view name, const char* buf) {
+  if (auto slot = symbol_table_.Find(name)) {
+    if (std::find(slots_.begin(), slots_.end(), *slot) != slots_.end())
+      throw std::runtime_error("formula already defined: " + std::string{name});
+  }
+
+  expressions_.Add(buf);
+  slots_.push_back(symbol_table_.Resolve(name));
+  programs_.clear();
+  levels_.clear();
+  return slots_.size() - 1;
+}
+
+void FormulaGraph::Build() {
+  formulas_.assign(symbol_table_.size(), kNoFormula);
+  for (size_t formula = 0; formula < size(); ++formula)
+    formulas_[slots_[formula]] = formula;
+
+  // Formulas referenced by every formula, and the reverse edges.
+  std::vector<std::vector<size_t>> references(size());
+  std::vector<std::vector<size_t>> dependents(size());
+  for (size_t formula = 0; formula < size(); ++formula) {
+    std::vector<size_t> slots;
+    SlotCollector collector{slots};
+    WalkTokens(*expressions_.root_token(formula).token(), collector);
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+    for (size_t slot : slots) {
+      const size_t reference =
+          slot < formulas_.size() ? formulas_[slot] : kNoFormula;
+      if (reference == kNoFormula)
+        continue;
+      references[formula].push_back(reference);
+      dependents[reference].push_back(formula);
+    }
+  }
+
+  // Kahn's algorithm, one level per round.
+  std::vector<size_t> pending(size());
+  std::vector<size_t> current;
+  for (size_t formula = 0; formula < size(); ++formula) {
+    pending[formula] = references[formula].size();
+    if (pending[formula] == 0)
+      current.push_back(formula);
+  }
+  levels_.clear();
+  size_t ordered = 0;
+  while (!current.empty()) {
+    std::vector<size_t> next;
+    for (size_t formula : current) {
+      for (size_t dependent : dependents[formula]) {
+        if (--pending[dependent] == 0)
+          next.push_back(dependent);
+      }
+    }
+    ordered += current.size();
+    levels_.push_back(std::move(current));
+    std::sort(next.begin(), next.end());
+    current = std::move(next);
+  }
+
+  if (ordered != size()) {
+    // Every formula left references another formula left, so following
+    // those references from any of them runs into a cycle.
+    size_t formula = 0;
+    while (pending[formula] == 0)
+      ++formula;
+    std::vector<size_t> path;
+    std::vector<size_t> position(size(), kNoFormula);
+    while (position[formula] == kNoFormula) {
+      position[formula] = path.size();
+      path.push_back(formula);
+      formula = *std::find_if(
+          references[formula].begin(), references[formula].end(),
+          [&](size_t reference) { return pending[reference] != 0; });
+    }
+
+    std::string message = "circular formula reference: ";
+    for (size_t i = position[formula]; i < path.size(); ++i) {
+      message += name(path[i]);
+      message += " -> ";
+    }
+    message += name(formula);
+    levels_.clear();
+    throw std::runtime_error(message);
+  }
+
+  programs_.clear();
+  programs_.reserve(size());
+  for (size_t formula = 0; formula < size(); ++formula) {
+    programs_.push_back(
+        Program::Compile(*expressions_.root_token(formula).token()));
+  }
+}
+
+void FormulaGraph::Calculate(Value* values, ThreadPool* pool) const {
+  assert(programs_.size() == size());
+  for (const auto& level : levels_) {
+    if (!pool || level.size() == 1) {
+      for (size_t formula : level)
+        CalculateFormula(formula, values);
+      continue;
+    }
+
+    // A few ranges per thread balance formulas of different cost.
+    const size_t grain =
+        std::max<size_t>(1, level.size() / ((pool->thread_count() + 1) * 4));
+    pool->ParallelFor(level.size(), grain, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i)
+        CalculateFormula(level[i], values);
+    });
+  }
+}
+
+void FormulaGraph::CalculateFormula(size_t formula, Value* values) const {
+  EvaluationContext context;
+  context.values = values;
+  values[slots_[formula]] = programs_[formula].Calculate(&context);
+}
+
+}  // namespace expression
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "express/expression_set.h"
+#include "express/express_export.h"
+#include "express/program.h"
+#include "express/symbol_table.h"
+#include "express/value.h"
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class ThreadPool;
+
+// Named formulas that reference each other by name. Every formula owns the
+// SymbolTable slot of its name: references read the slot like a variable
+// and evaluation stores the value of the formula there, so each formula is
+// computed once per Calculate however many formulas reference it.
+//
+// Formulas are grouped into levels that only reference lower levels, and
+// the formulas of one level can run in parallel.
+//
+// References are found through Describe, and through Traverse below custom
+// tokens. A custom token that reads a formula slot by other means, e.g.
+// from the Calculate data directly, is not seen as a reference and may read
+// the slot before the formula is calculated.
+class EXPRESS_EXPORT FormulaGraph {
+ public:
+  explicit FormulaGraph(SymbolTable& symbol_table);
+  ~FormulaGraph();
+
+  FormulaGraph(const FormulaGraph&) = delete;
+  FormulaGraph& operator=(const FormulaGraph&) = delete;
+
+  // Parses formula |name| and returns its index. Formulas may reference
+  // formulas defined later. Throws std::runtime_error if |name| is already
+  // defined.
+  size_t Define(std::string_view name, const char* buf);
+
+  // Orders the formulas by their references and compiles them. Throws
+  // std::runtime_error listing the formulas of a reference cycle.
+  void Build();
+
+  // Evaluates every formula once in topological order. |values| holds a
+  // Value per SymbolTable slot; inputs are read from it and every formula
+  // stores its value at its slot. Levels with several formulas are spread
+  // over |pool| when given. Requires Build().
+  void Calculate(Value* values, ThreadPool* pool = nullptr) const;
+
+  size_t size() const { return slots_.size(); }
+
+  size_t slot(size_t formula) const { return slots_[formula]; }
+
+  std::string_view name(size_t formula) const {
+    return symbol_table_.name(slots_[formula]);
+  }
+
+  size_t level_count() const { return levels_.size(); }
+
+  // Formulas of |level|, which only reference formulas of lower levels.
+  const std::vector<size_t>& level(size_t index) const {
+    return levels_[index];
+  }
+
+ private:
+  void CalculateFormula(size_t formula, Value* values) const;
+
+  SymbolTable& symbol_table_;
+  ExpressionSet expressions_;
+  // Symbol table slot of every formula.
+  std::vector<size_t> slots_;
+  // Formula owning every slot, or npos for inputs.
+  std::vector<size_t> formulas_;
+  std::vector<std::vector<size_t>> levels_;
+  std::vector<Program> programs_;
+};
+
+}  // namespace expression
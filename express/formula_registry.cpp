@@ -0,0 +1,47 @@
+#include "express/formula_registry.h"
+
+#include <stdexcept>
+#include <string>
+
+namespace expression {
+
+uint64_t HashFormula(std::string_view text) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : text) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+FormulaRegistry::FormulaRegistry() = default;
+
+FormulaRegistry::~FormulaRegistry() = default;
+
+void FormulaRegistry::Register(const GeneratedFormula* formulas,
+                               size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    const GeneratedFormula& formula = formulas[i];
+    auto [j, inserted] = formulas_.emplace(formula.hash, &formula);
+    if (inserted)
+      continue;
+    if (std::string_view{j->second->text} == formula.text) {
+      throw std::runtime_error("formula already registered: " +
+                               std::string{formula.text});
+    }
+    throw std::runtime_error("formula hash collision: " +
+                             std::string{formula.text});
+  }
+}
+
+const GeneratedFormula* FormulaRegistry::Find(std::string_view text) const {
+  const GeneratedFormula* formula = FindHash(HashFormula(text));
+  return formula && text == formula->text ? formula : nullptr;
+}
+
+const GeneratedFormula* FormulaRegistry::FindHash(uint64_t hash) const {
+  auto i = formulas_.find(hash);
+  return i != formulas_.end() ? i->second : nullptr;
+}
+
+}  // namespace expression
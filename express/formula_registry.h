@@ -0,0 +1,52 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+
+namespace expression {
+
+// Function generated ahead of time for a numeric formula. Variables are read
+// from |numbers|, indexed by the slots of the symbol table the formulas were
+// generated with.
+using GeneratedFunction = double (*)(const double* numbers);
+
+// Entry of the table emitted by CodeGenerator.
+struct GeneratedFormula {
+  const char* text = nullptr;
+  uint64_t hash = 0;
+  GeneratedFunction function = nullptr;
+};
+
+// 64-bit FNV-1a hash of the formula text, as stored in GeneratedFormula.
+EXPRESS_EXPORT uint64_t HashFormula(std::string_view text);
+
+// Lookup of generated formulas by text or hash. Generated sources register
+// their tables through the function named when they were generated.
+class EXPRESS_EXPORT FormulaRegistry {
+ public:
+  FormulaRegistry();
+  ~FormulaRegistry();
+
+  FormulaRegistry(const FormulaRegistry&) = delete;
+  FormulaRegistry& operator=(const FormulaRegistry&) = delete;
+
+  // Adds the formulas of a generated table, which must outlive the registry.
+  // Throws std::runtime_error if a formula is already registered or two
+  // texts have the same hash.
+  void Register(const GeneratedFormula* formulas, size_t count);
+
+  // Returns null if |text| was not generated.
+  const GeneratedFormula* Find(std::string_view text) const;
+  const GeneratedFormula* FindHash(uint64_t hash) const;
+
+  size_t size() const { return formulas_.size(); }
+
+ private:
+  std::unordered_map<uint64_t, const GeneratedFormula*> formulas_;
+};
+
+}  // namespace expression
@@ -1,28 +1,44 @@
-#pragma once
-
+#pragma once
+
 #include "express/token.h"
 
 #include <algorithm>
+#include <cstddef>
+#include <iterator>
 #include <string_view>
+#include <utility>
 #include <vector>
-
-namespace expression {
-
-class Allocator;
-class Token;
-
-template <class BasicToken>
-class BasicFunction {
- public:
-  BasicFunction(std::string_view name, int params)
-      : name(name), params(params) {}
-
+
+namespace expression {
+
+class Allocator;
+class Token;
+
+template <class BasicToken>
+class BasicFunction {
+ public:
+  BasicFunction(std::string_view name, int params)
+      : name(name), params(params) {}
+
   virtual BasicToken MakeToken(Allocator& allocator,
                                BasicToken* arguments,
                                size_t argument_count) const = 0;
 
   virtual bool SupportsFoldedArguments() const { return false; }
 
+  // Moves from |arguments|. Forwards to the std::vector overload, which
+  // functions written before this one may still override.
+  virtual BasicToken MakeFoldedToken(Allocator& allocator,
+                                     BasicToken* arguments,
+                                     size_t argument_count) const {
+    return MakeFoldedToken(
+        allocator,
+        std::vector<BasicToken>{std::make_move_iterator(arguments),
+                                std::make_move_iterator(arguments +
+                                                        argument_count)});
+  }
+
+  // Deprecated: override the overload taking an argument array.
   virtual BasicToken MakeFoldedToken(Allocator& allocator,
                                      std::vector<BasicToken> arguments) const {
     return MakeToken(allocator, arguments.data(), arguments.size());
@@ -31,5 +47,5 @@ class BasicFunction {
   const std::string_view name;
   const int params = -1;
 };
-
-}  // namespace expression
+
+}  // namespace expression
@@ -0,0 +1,121 @@
+#include "express/huge_page_resource.h"
+
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+#if defined(__linux__)
+#define EXPRESS_HUGE_PAGES 1
+#include <sys/mman.h>
+#endif
+
+namespace expression {
+
+HugePageResource::HugePageResource(std::pmr::memory_resource* upstream,
+                                   size_t huge_page_size)
+    : upstream_{upstream}, huge_page_size_{huge_page_size} {
+  assert(upstream);
+  assert(huge_page_size > 0 && (huge_page_size & (huge_page_size - 1)) == 0);
+}
+
+HugePageResource::~HugePageResource() = default;
+
+// static
+bool HugePageResource::IsAvailable() {
+#if defined(EXPRESS_HUGE_PAGES)
+  return true;
+#else
+  return false;
+#endif
+}
+
+HugePageStats HugePageResource::stats() const {
+  HugePageStats stats;
+  stats.mapped_bytes = mapped_bytes_.load(std::memory_order_relaxed);
+  stats.hugetlb_mappings = hugetlb_mappings_.load(std::memory_order_relaxed);
+  stats.advised_mappings = advised_mappings_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+// Depends on the arguments only, so deallocation takes the same path.
+bool HugePageResource::IsMapped(size_t bytes, size_t alignment) const {
+  return IsAvailable() && bytes >= huge_page_size_ / 2 &&
+         alignment <= huge_page_size_;
+}
+
+size_t HugePageResource::GetMappedSize(size_t bytes) const {
+  return (bytes + huge_page_size_ - 1) & ~(huge_page_size_ - 1);
+}
+
+void* HugePageResource::do_allocate(size_t bytes, size_t alignment) {
+  if (!IsMapped(bytes, alignment))
+    return upstream_->allocate(bytes, alignment);
+
+  const size_t size = GetMappedSize(bytes);
+  void* ptr = Map(size);
+  if (!ptr)
+    throw std::bad_alloc{};
+  mapped_bytes_.fetch_add(size, std::memory_order_relaxed);
+  return ptr;
+}
+
+void HugePageResource::do_deallocate(void* ptr,
+                                     size_t bytes,
+                                     size_t alignment) {
+  if (!IsMapped(bytes, alignment)) {
+    upstream_->deallocate(ptr, bytes, alignment);
+    return;
+  }
+
+  const size_t size = GetMappedSize(bytes);
+#if defined(EXPRESS_HUGE_PAGES)
+  munmap(ptr, size);
+#endif
+  mapped_bytes_.fetch_sub(size, std::memory_order_relaxed);
+}
+
+bool HugePageResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+void* HugePageResource::Map(size_t size) {
+#if defined(EXPRESS_HUGE_PAGES)
+  if (!hugetlb_failed_.load(std::memory_order_relaxed)) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      hugetlb_mappings_.fetch_add(1, std::memory_order_relaxed);
+      return ptr;
+    }
+    hugetlb_failed_.store(true, std::memory_order_relaxed);
+  }
+
+  // Transparent huge pages only back aligned ranges, so one more huge page
+  // is mapped and the ends are unmapped.
+  const size_t padded_size = size + huge_page_size_;
+  void* padded = mmap(nullptr, padded_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (padded == MAP_FAILED)
+    return nullptr;
+  const auto begin = reinterpret_cast<uintptr_t>(padded);
+  const auto aligned =
+      (begin + huge_page_size_ - 1) & ~uintptr_t{huge_page_size_ - 1};
+  if (aligned != begin)
+    munmap(padded, aligned - begin);
+  const size_t tail = begin + padded_size - (aligned + size);
+  if (tail != 0)
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+
+  void* ptr = reinterpret_cast<void*>(aligned);
+  // Without transparent huge pages the mapping still works with small ones.
+  madvise(ptr, size, MADV_HUGEPAGE);
+  advised_mappings_.fetch_add(1, std::memory_order_relaxed);
+  return ptr;
+#else
+  (void)size;
+  return nullptr;
+#endif
+}
+
+}  // namespace expression
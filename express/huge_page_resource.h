@@ -0,0 +1,69 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+
+namespace expression {
+
+struct HugePageStats {
+  // Bytes in live mappings.
+  size_t mapped_bytes = 0;
+  // Mappings made so far with MAP_HUGETLB, and without it but advised to
+  // use transparent huge pages.
+  size_t hugetlb_mappings = 0;
+  size_t advised_mappings = 0;
+};
+
+// Memory resource backing large blocks with huge pages, meant as the
+// upstream of allocators holding big resident trees, where TLB misses show
+// up in evaluation. On Linux, blocks of at least half a huge page are
+// rounded up to whole huge pages and mapped with MAP_HUGETLB. Once that
+// fails, as it does without reserved huge pages, blocks are mapped aligned
+// to the huge page size and advised with MADV_HUGEPAGE instead. Smaller or
+// over-aligned blocks, and all blocks on other systems, come from
+// |upstream|.
+class EXPRESS_EXPORT HugePageResource : public std::pmr::memory_resource {
+ public:
+  static const size_t kDefaultHugePageSize = 2 * 1024 * 1024;
+
+  // |huge_page_size| must be the huge page size of the system. |upstream|
+  // must outlive the resource.
+  explicit HugePageResource(
+      std::pmr::memory_resource* upstream = std::pmr::new_delete_resource(),
+      size_t huge_page_size = kDefaultHugePageSize);
+  ~HugePageResource() override;
+
+  HugePageResource(const HugePageResource&) = delete;
+  HugePageResource& operator=(const HugePageResource&) = delete;
+
+  // False where every block comes from the upstream resource.
+  static bool IsAvailable();
+
+  size_t huge_page_size() const { return huge_page_size_; }
+  std::pmr::memory_resource* upstream() const { return upstream_; }
+
+  HugePageStats stats() const;
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+
+ private:
+  bool IsMapped(size_t bytes, size_t alignment) const;
+  size_t GetMappedSize(size_t bytes) const;
+  void* Map(size_t size);
+
+  std::pmr::memory_resource* upstream_;
+  size_t huge_page_size_;
+  std::atomic<size_t> mapped_bytes_{0};
+  std::atomic<size_t> hugetlb_mappings_{0};
+  std::atomic<size_t> advised_mappings_{0};
+  std::atomic<bool> hugetlb_failed_{false};
+};
+
+}  // namespace expression
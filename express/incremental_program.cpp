@@ -0,0 +1,400 @@
+#include "express/incremental_program.h"
+
+#include "express/evaluation_context.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace expression {
+
+struct IncrementalProgram::Node {
+  // Token calculated directly by nodes that do not describe themselves.
+  const Token* token = nullptr;
+  Opcode opcode = Opcode::Number;
+  bool described = false;
+  bool dirty = true;
+  double number = 0;
+  std::string_view string;
+  double (*function1)(double) = nullptr;
+  double (*function2)(double, double) = nullptr;
+  size_t slot = 0;
+  uint32_t operand_begin = 0;
+  uint32_t operand_count = 0;
+  uint32_t parent_begin = 0;
+  uint32_t parent_count = 0;
+  Value value;
+};
+
+// Evaluation step of a node whose operands are being evaluated.
+struct IncrementalProgram::Frame {
+  uint32_t index;
+  // Operands looked at so far.
+  uint32_t step;
+};
+
+// Adds operands before the nodes using them, walking the tree with an
+// explicit stack.
+class IncrementalProgram::Compiler {
+ public:
+  explicit Compiler(IncrementalProgram& program) : program_{program} {}
+
+  // Returns the node of |root|. Nodes are shared by every reference to their
+  // token.
+  uint32_t Add(const Token& root) {
+    WalkTokens(root, *this);
+    return values_.back();
+  }
+
+  // Fills the parent and slot indices once every node is added.
+  void Link();
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described);
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  uint32_t AddNode(Node&& node);
+
+  IncrementalProgram& program_;
+  std::unordered_map<const Token*, uint32_t> nodes_;
+  // Nodes of the operands added so far.
+  std::vector<uint32_t> values_;
+};
+
+bool IncrementalProgram::Compiler::Enter(const Token& token,
+                                         const TokenInfo& /*info*/,
+                                         bool described) {
+  auto existing = nodes_.find(&token);
+  if (existing != nodes_.end()) {
+    values_.push_back(existing->second);
+    return false;
+  }
+  if (described)
+    return true;
+
+  Node node;
+  node.token = &token;
+  const uint32_t index = AddNode(std::move(node));
+  program_.opaque_nodes_.push_back(index);
+  nodes_.emplace(&token, index);
+  values_.push_back(index);
+  return false;
+}
+
+void IncrementalProgram::Compiler::Leave(const Token& token,
+                                         const TokenInfo& info) {
+  const size_t first = values_.size() - info.operand_count;
+  Node node;
+  node.token = &token;
+  node.described = true;
+  node.opcode = info.opcode;
+  node.number = info.number;
+  node.string = info.string;
+  node.function1 = info.function1;
+  node.function2 = info.function2;
+  node.slot = info.slot;
+  node.operand_begin = static_cast<uint32_t>(program_.operands_.size());
+  node.operand_count = static_cast<uint32_t>(info.operand_count);
+  program_.operands_.insert(program_.operands_.end(), values_.begin() + first,
+                            values_.end());
+
+  const uint32_t index = AddNode(std::move(node));
+  nodes_.emplace(&token, index);
+  values_.resize(first);
+  values_.push_back(index);
+}
+
+uint32_t IncrementalProgram::Compiler::AddNode(Node&& node) {
+  const auto index = static_cast<uint32_t>(program_.nodes_.size());
+  program_.nodes_.emplace_back(std::move(node));
+  return index;
+}
+
+void IncrementalProgram::Compiler::Link() {
+  auto& nodes = program_.nodes_;
+  const auto& operands = program_.operands_;
+
+  // Counts distinct parents, then fills them in place of the counts.
+  for (const Node& node : nodes) {
+    for (uint32_t i = 0; i < node.operand_count; ++i) {
+      const uint32_t operand = operands[node.operand_begin + i];
+      if (i == 0 || operand != operands[node.operand_begin + i - 1])
+        ++nodes[operand].parent_count;
+    }
+  }
+  uint32_t parent_begin = 0;
+  for (Node& node : nodes) {
+    node.parent_begin = parent_begin;
+    parent_begin += node.parent_count;
+    node.parent_count = 0;
+  }
+  program_.parents_.resize(parent_begin);
+  for (uint32_t index = 0; index < nodes.size(); ++index) {
+    const Node& node = nodes[index];
+    for (uint32_t i = 0; i < node.operand_count; ++i) {
+      const uint32_t operand = operands[node.operand_begin + i];
+      if (i == 0 || operand != operands[node.operand_begin + i - 1]) {
+        Node& child = nodes[operand];
+        program_.parents_[child.parent_begin + child.parent_count++] = index;
+      }
+    }
+  }
+
+  auto& slots = program_.slots_;
+  for (const Node& node : nodes) {
+    if (node.described && node.opcode == Opcode::Variable)
+      slots.push_back(node.slot);
+  }
+  std::sort(slots.begin(), slots.end());
+  slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+  // Variable nodes grouped by slot. A slot may have several nodes when
+  // subtree sharing is disabled.
+  auto& begin = program_.slot_nodes_begin_;
+  begin.assign(slots.empty() ? 1 : slots.back() + 2, 0);
+  for (const Node& node : nodes) {
+    if (node.described && node.opcode == Opcode::Variable)
+      ++begin[node.slot + 1];
+  }
+  for (size_t slot = 1; slot < begin.size(); ++slot)
+    begin[slot] += begin[slot - 1];
+  program_.slot_nodes_.resize(begin.back());
+  std::vector<uint32_t> filled(begin.begin(), begin.end() - 1);
+  for (uint32_t index = 0; index < nodes.size(); ++index) {
+    const Node& node = nodes[index];
+    if (node.described && node.opcode == Opcode::Variable)
+      program_.slot_nodes_[filled[node.slot]++] = index;
+  }
+}
+
+IncrementalProgram::IncrementalProgram() = default;
+
+IncrementalProgram::~IncrementalProgram() = default;
+
+IncrementalProgram::IncrementalProgram(IncrementalProgram&& source) noexcept =
+    default;
+
+IncrementalProgram& IncrementalProgram::operator=(
+    IncrementalProgram&& source) noexcept = default;
+
+// static
+IncrementalProgram IncrementalProgram::Compile(const Token& root) {
+  IncrementalProgram program;
+  Compiler compiler{program};
+  program.root_ = compiler.Add(root);
+  compiler.Link();
+  return program;
+}
+
+Value IncrementalProgram::Calculate(void* data) {
+  assert(!nodes_.empty());
+  recalculated_count_ = 0;
+  for (uint32_t index : opaque_nodes_)
+    MarkDirty(index);
+  return Evaluate(root_, data);
+}
+
+void IncrementalProgram::Invalidate(size_t slot) {
+  if (slot + 1 >= slot_nodes_begin_.size())
+    return;
+  for (uint32_t i = slot_nodes_begin_[slot]; i < slot_nodes_begin_[slot + 1];
+       ++i) {
+    MarkDirty(slot_nodes_[i]);
+  }
+}
+
+void IncrementalProgram::InvalidateAll() {
+  for (Node& node : nodes_)
+    node.dirty = true;
+}
+
+size_t IncrementalProgram::node_count() const {
+  return nodes_.size();
+}
+
+bool IncrementalProgram::dirty() const {
+  return nodes_.empty() || nodes_[root_].dirty;
+}
+
+void IncrementalProgram::MarkDirty(uint32_t index) {
+  // A node that is already dirty was not used by the clean nodes above it
+  // since it got dirty, for instance because it is in a branch an If did
+  // not take, so they do not depend on it and propagation stops.
+  dirty_nodes_.push_back(index);
+  while (!dirty_nodes_.empty()) {
+    Node& node = nodes_[dirty_nodes_.back()];
+    dirty_nodes_.pop_back();
+    if (node.dirty)
+      continue;
+    node.dirty = true;
+    dirty_nodes_.insert(dirty_nodes_.end(),
+                        parents_.begin() + node.parent_begin,
+                        parents_.begin() + node.parent_begin +
+                            node.parent_count);
+  }
+}
+
+// Recalculates the dirty nodes below |index| with an explicit stack, so
+// trees of any depth fit. Operands are evaluated in the order the tokens
+// evaluate them, skipping the branches If, And and Or do not take.
+const Value& IncrementalProgram::Evaluate(uint32_t index, void* data) {
+  if (!nodes_[index].dirty)
+    return nodes_[index].value;
+
+  frames_.push_back(Frame{index, 0});
+  while (!frames_.empty()) {
+    Frame& frame = frames_.back();
+    Node& node = nodes_[frame.index];
+    const size_t operand = NextOperand(node, frame.step);
+    if (operand != SIZE_MAX) {
+      ++frame.step;
+      const uint32_t operand_index = operands_[node.operand_begin + operand];
+      if (nodes_[operand_index].dirty)
+        frames_.push_back(Frame{operand_index, 0});
+      continue;
+    }
+
+    node.value = Recalculate(node, data);
+    node.dirty = false;
+    ++recalculated_count_;
+    frames_.pop_back();
+  }
+  return nodes_[index].value;
+}
+
+// Returns the operand evaluated after |step| others, or SIZE_MAX once the
+// node can be recalculated.
+size_t IncrementalProgram::NextOperand(const Node& node, uint32_t step) const {
+  auto value = [&](uint32_t i) -> const Value& {
+    return nodes_[operands_[node.operand_begin + i]].value;
+  };
+
+  if (!node.described || step == node.operand_count)
+    return SIZE_MAX;
+  switch (node.opcode) {
+    case Opcode::If:
+      if (step == 0)
+        return 0;
+      return step == 1 ? (static_cast<bool>(value(0)) ? 1 : 2) : SIZE_MAX;
+    case Opcode::And:
+      if (step == 1 && !static_cast<bool>(value(0)))
+        return SIZE_MAX;
+      return step;
+    case Opcode::Or:
+      if (step == 1 && static_cast<bool>(value(0)))
+        return SIZE_MAX;
+      return step;
+    default:
+      return step;
+  }
+}
+
+Value IncrementalProgram::Recalculate(const Node& node, void* data) {
+  if (!node.described)
+    return node.token->Calculate(data);
+
+  // Operands are evaluated by Evaluate first.
+  auto operand = [&](uint32_t i) -> const Value& {
+    assert(i < node.operand_count);
+    return nodes_[operands_[node.operand_begin + i]].value;
+  };
+
+  switch (node.opcode) {
+    case Opcode::Number:
+      return node.number;
+    case Opcode::String:
+      return node.string;
+    case Opcode::Variable: {
+      const auto& context = GetEvaluationContext(data);
+      if (context.values)
+        return context.values[node.slot];
+      return context.numbers[node.slot];
+    }
+    case Opcode::Negate:
+      return -operand(0);
+    case Opcode::Not:
+      return !operand(0);
+    case Opcode::Parentheses:
+      return operand(0);
+    case Opcode::If:
+      return static_cast<bool>(operand(0)) ? operand(1) : operand(2);
+    case Opcode::And:
+      if (node.operand_count == 1)
+        return operand(0);
+      if (!static_cast<bool>(operand(0)))
+        return 0.0;
+      return static_cast<bool>(operand(1)) ? 1.0 : 0.0;
+    case Opcode::Or:
+      if (node.operand_count == 1)
+        return operand(0);
+      if (static_cast<bool>(operand(0)))
+        return 1.0;
+      return static_cast<bool>(operand(1)) ? 1.0 : 0.0;
+    case Opcode::Function1:
+      return node.function1(static_cast<double>(operand(0)));
+    default:
+      break;
+  }
+
+  // Binary operations.
+  if (node.operand_count == 1)
+    return operand(0);
+  Value val = operand(0);
+  const Value& rval = operand(1);
+  switch (node.opcode) {
+    case Opcode::Add:
+      val += rval;
+      break;
+    case Opcode::Subtract:
+      val -= rval;
+      break;
+    case Opcode::Multiply:
+      val *= rval;
+      break;
+    case Opcode::Divide:
+      val /= rval;
+      break;
+    case Opcode::Power:
+      val = pow(static_cast<double>(val), static_cast<double>(rval));
+      break;
+    case Opcode::Equal:
+      val = val == rval;
+      break;
+    case Opcode::Less:
+      val = val < rval;
+      break;
+    case Opcode::Greater:
+      val = val > rval;
+      break;
+    case Opcode::LessEqual:
+      val = val <= rval;
+      break;
+    case Opcode::GreaterEqual:
+      val = val >= rval;
+      break;
+    case Opcode::Min:
+      if (rval < val)
+        val = rval;
+      break;
+    case Opcode::Max:
+      if (val < rval)
+        val = rval;
+      break;
+    case Opcode::Function2:
+      val = node.function2(static_cast<double>(val), static_cast<double>(rval));
+      break;
+    default:
+      assert(false);
+      break;
+  }
+  return val;
+}
+
+}  // namespace expression
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "express/express_export.h"
+#include "express/value.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class Token;
+
+// Token tree that caches the last value of every node for re-evaluation
+// after a few variables change. Invalidate marks the nodes reading a slot
+// and their ancestors dirty, and Calculate only recomputes dirty nodes on
+// the path it actually takes from the root; everything else returns its
+// cached value.
+//
+// Tokens that cannot describe themselves have unknown dependencies and are
+// recomputed by every Calculate. The program references tokens and literal
+// storage owned by the expression allocator and must not outlive it.
+class EXPRESS_EXPORT IncrementalProgram {
+ public:
+  IncrementalProgram();
+  ~IncrementalProgram();
+
+  IncrementalProgram(IncrementalProgram&& source) noexcept;
+  IncrementalProgram& operator=(IncrementalProgram&& source) noexcept;
+
+  IncrementalProgram(const IncrementalProgram&) = delete;
+  IncrementalProgram& operator=(const IncrementalProgram&) = delete;
+
+  // Every node starts dirty, so the first Calculate evaluates the tree.
+  static IncrementalProgram Compile(const Token& root);
+
+  // Returns the value of the expression for |data|, which must hold the
+  // same values as on the previous call except for invalidated slots.
+  Value Calculate(void* data);
+
+  // Marks the value of the variable at |slot| as changed.
+  void Invalidate(size_t slot);
+
+  // Drops every cached value.
+  void InvalidateAll();
+
+  // True if the next Calculate has to recompute the root.
+  bool dirty() const;
+
+  // Ascending SymbolTable slots the expression reads.
+  const std::vector<size_t>& slots() const { return slots_; }
+
+  size_t node_count() const;
+
+  // Number of nodes recomputed by the last Calculate.
+  size_t recalculated_count() const { return recalculated_count_; }
+
+ private:
+  struct Node;
+  struct Frame;
+  class Compiler;
+
+  void MarkDirty(uint32_t index);
+  const Value& Evaluate(uint32_t index, void* data);
+  size_t NextOperand(const Node& node, uint32_t step) const;
+  Value Recalculate(const Node& node, void* data);
+
+  std::vector<Node> nodes_;
+  // Operands and parents of every node, indexed by the node ranges.
+  std::vector<uint32_t> operands_;
+  std::vector<uint32_t> parents_;
+  // Variable nodes of every slot, indexed by |slot_nodes_begin_|.
+  std::vector<uint32_t> slot_nodes_;
+  std::vector<uint32_t> slot_nodes_begin_;
+  std::vector<size_t> slots_;
+  // Nodes without a known dependency set.
+  std::vector<uint32_t> opaque_nodes_;
+  uint32_t root_ = 0;
+  size_t recalculated_count_ = 0;
+  // Stacks of Evaluate and MarkDirty, kept between calls.
+  std::vector<Frame> frames_;
+  std::vector<uint32_t> dirty_nodes_;
+};
+
+}  // namespace expression
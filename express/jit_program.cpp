@@ -0,0 +1,658 @@
+#include "express/jit_program.h"
+
+#include "express/standard_functions.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+#include "express/type_inference.h"
+#include "express/value.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define EXPRESS_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace expression {
+
+namespace {
+
+enum Register : uint8_t {
+  kRax = 0,
+  kRbx = 3,
+  kRsp = 4,
+  kRdi = 7,
+};
+
+// Scalar double in the low lane of an SSE register.
+enum Xmm : uint8_t {
+  kXmm0 = 0,
+  kXmm1 = 1,
+  kXmm2 = 2,
+  kXmm3 = 3,
+};
+
+// CMPSD predicates.
+enum Predicate : uint8_t {
+  kLessThan = 1,
+  kLessEqual = 2,
+  kNotLessThan = 5,
+};
+
+constexpr uint8_t kSd = 0xF2;
+constexpr uint8_t kPd = 0x66;
+
+constexpr uint64_t kAbsMask = 0x7FFFFFFFFFFFFFFF;
+constexpr uint64_t kSignMask = 0x8000000000000000;
+
+uint8_t ModRM(uint8_t mod, uint8_t reg, uint8_t rm) {
+  return static_cast<uint8_t>((mod << 6) | (reg << 3) | rm);
+}
+
+uint64_t Bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Encoder for the few x86-64 instructions the compiler uses. Memory operands
+// are a base register and a 32-bit displacement.
+class Assembler {
+ public:
+  const std::vector<uint8_t>& code() const { return code_; }
+  size_t position() const { return code_.size(); }
+
+  void Bytes(std::initializer_list<uint8_t> bytes) {
+    code_.insert(code_.end(), bytes.begin(), bytes.end());
+  }
+
+  void Int32(int32_t value) { Append(&value, sizeof(value)); }
+  void Int64(uint64_t value) { Append(&value, sizeof(value)); }
+
+  // Register to register SSE instruction.
+  void Sse(uint8_t prefix, uint8_t opcode, Xmm dst, Xmm src) {
+    Bytes({prefix, 0x0F, opcode, ModRM(3, dst, src)});
+  }
+
+  // SSE instruction with a [base + disp32] operand.
+  void SseMemory(uint8_t prefix,
+                 uint8_t opcode,
+                 Xmm xmm,
+                 Register base,
+                 int32_t disp) {
+    Bytes({prefix, 0x0F, opcode, ModRM(2, xmm, base)});
+    if (base == kRsp)
+      Bytes({0x24});
+    Int32(disp);
+  }
+
+  void Load(Xmm dst, Register base, int32_t disp) {
+    SseMemory(kSd, 0x10, dst, base, disp);
+  }
+  void Store(Register base, int32_t disp, Xmm src) {
+    SseMemory(kSd, 0x11, src, base, disp);
+  }
+  void Move(Xmm dst, Xmm src) { Sse(kPd, 0x28, dst, src); }
+  void Add(Xmm dst, Xmm src) { Sse(kSd, 0x58, dst, src); }
+  void Multiply(Xmm dst, Xmm src) { Sse(kSd, 0x59, dst, src); }
+  void Subtract(Xmm dst, Xmm src) { Sse(kSd, 0x5C, dst, src); }
+  void Divide(Xmm dst, Xmm src) { Sse(kSd, 0x5E, dst, src); }
+  void Sqrt(Xmm dst, Xmm src) { Sse(kSd, 0x51, dst, src); }
+  void And(Xmm dst, Xmm src) { Sse(kPd, 0x54, dst, src); }
+  // dst = ~dst & src.
+  void AndNot(Xmm dst, Xmm src) { Sse(kPd, 0x55, dst, src); }
+  void Or(Xmm dst, Xmm src) { Sse(kPd, 0x56, dst, src); }
+  void Xor(Xmm dst, Xmm src) { Sse(kPd, 0x57, dst, src); }
+
+  // dst = predicate(dst, src) ? all ones : zero.
+  void Compare(Xmm dst, Xmm src, Predicate predicate) {
+    Sse(kSd, 0xC2, dst, src);
+    Bytes({predicate});
+  }
+
+  // Loads raw bits through rax.
+  void LoadBits(Xmm dst, uint64_t bits) {
+    Bytes({0x48, 0xB8});
+    Int64(bits);
+    Bytes({kPd, 0x48, 0x0F, 0x6E, ModRM(3, dst, kRax)});
+  }
+  void LoadConstant(Xmm dst, double value) { LoadBits(dst, Bits(value)); }
+
+  // Sets the zero flag if the low lane of |mask| is zero.
+  void TestMask(Xmm mask) {
+    Bytes({kPd, 0x48, 0x0F, 0x7E, ModRM(3, mask, kRax)});
+    Bytes({0x48, 0x85, ModRM(3, kRax, kRax)});
+  }
+
+  // Jumps return the position of their displacement for Bind.
+  size_t JumpIfZero() { return Jump({0x0F, 0x84}); }
+  size_t JumpIfNotZero() { return Jump({0x0F, 0x85}); }
+  size_t Jump() { return Jump({0xE9}); }
+
+  // Makes the jump at |position| land on the next instruction.
+  void Bind(size_t position) {
+    Patch(position, static_cast<int32_t>(code_.size() - position - 4));
+  }
+
+  void Patch(size_t position, int32_t value) {
+    memcpy(code_.data() + position, &value, sizeof(value));
+  }
+
+  void Call(const void* function) {
+    Bytes({0x48, 0xB8});
+    Int64(reinterpret_cast<uint64_t>(function));
+    Bytes({0xFF, ModRM(3, 2, kRax)});
+  }
+
+  // cmp qword [rsp + disp], 0.
+  void CompareStackZero(int32_t disp) {
+    Bytes({0x48, 0x83, ModRM(2, 7, kRsp), 0x24});
+    Int32(disp);
+    Bytes({0x00});
+  }
+
+  // mov qword [rsp + disp], value.
+  void StoreStackInt(int32_t disp, int32_t value) {
+    Bytes({0x48, 0xC7, ModRM(2, 0, kRsp), 0x24});
+    Int32(disp);
+    Int32(value);
+  }
+
+ private:
+  void Append(const void* data, size_t size) {
+    auto* bytes = static_cast<const uint8_t*>(data);
+    code_.insert(code_.end(), bytes, bytes + size);
+  }
+
+  size_t Jump(std::initializer_list<uint8_t> opcode) {
+    Bytes(opcode);
+    Int32(0);
+    return code_.size() - 4;
+  }
+
+  std::vector<uint8_t> code_;
+};
+
+// Bytes of temporaries and shared values kept in the stack frame of the
+// generated function.
+constexpr size_t kMaxFrameBytes = 256 * 1024;
+
+int32_t Displacement(size_t offset) {
+  if (offset > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+    throw std::runtime_error{"expression is too large"};
+  return static_cast<int32_t>(offset);
+}
+
+}  // namespace
+
+// Emits a function taking the variables in rdi and returning the value in
+// xmm0. Every node leaves its value in xmm0; the left operand of a binary
+// node waits in a stack temporary while the right one is evaluated. The
+// frame holds the shared node values, their computed flags and then the
+// temporaries.
+class JitProgram::Compiler {
+ public:
+  explicit Compiler(Assembler& assembler) : assembler_{assembler} {}
+
+  // Finds the nodes referenced more than once and assigns them slots.
+  void CountReferences(const Token& root);
+
+  void EmitFunction(const Token& root);
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described);
+  void Next(const Token& token, const TokenInfo& info, size_t operand);
+  void Leave(const Token& token, const TokenInfo& info);
+
+  bool reads_variables() const { return reads_variables_; }
+
+  // False if a token has no native translation, in which case the emitted
+  // code must not run.
+  bool supported() const { return supported_; }
+
+ private:
+  int32_t SharedOffset(size_t slot) const { return Displacement(slot * 8); }
+  int32_t FlagOffset(size_t slot) const {
+    return Displacement((shared_count_ + slot) * 8);
+  }
+  int32_t TemporaryOffset(size_t depth) const {
+    return Displacement((shared_count_ * 2 + depth) * 8);
+  }
+
+  // Token whose operands are being emitted.
+  struct Frame {
+    // Shared node slot, or SIZE_MAX.
+    size_t slot = SIZE_MAX;
+    // Jump taken when the shared node was already computed.
+    size_t computed = 0;
+    // Jump past an operand, bound once the operand is emitted.
+    size_t jump = 0;
+    // Temporary holding the left operand of a binary operation.
+    size_t depth = 0;
+  };
+
+  // True for tokens taking their left operand in xmm0 and their right one in
+  // xmm1.
+  static bool HasOperandPair(const TokenInfo& info) {
+    return info.operand_count == 2 && info.opcode != Opcode::And &&
+           info.opcode != Opcode::Or;
+  }
+
+  bool CountReference(const Token& token,
+                      const TokenInfo& info,
+                      bool described);
+  // Emits the code following the operands of the token.
+  void EmitToken(const TokenInfo& info, const Frame& frame);
+  void StoreShared(const Frame& frame);
+
+  // xmm1 = fabs(xmm0) >= kPrecision ? all ones : zero. Clobbers xmm0.
+  void EmitTruthMask();
+
+  // xmm0 = mask ? xmm1 : xmm0 with |mask| in xmm2.
+  void EmitSelect();
+  void EmitSign();
+
+  Assembler& assembler_;
+  std::unordered_map<const Token*, size_t> references_;
+  std::unordered_map<const Token*, size_t> shared_slots_;
+  size_t shared_count_ = 0;
+  size_t depth_ = 0;
+  size_t max_depth_ = 0;
+  bool reads_variables_ = false;
+  bool supported_ = true;
+  std::vector<Frame> frames_;
+};
+
+void JitProgram::Compiler::CountReferences(const Token& root) {
+  struct Counter {
+    Compiler& compiler;
+
+    bool Enter(const Token& token, const TokenInfo& info, bool described) {
+      return compiler.CountReference(token, info, described);
+    }
+    void Next(const Token&, const TokenInfo&, size_t) {}
+    void Leave(const Token&, const TokenInfo&) {}
+  };
+
+  Counter counter{*this};
+  WalkTokens(root, counter);
+}
+
+bool JitProgram::Compiler::CountReference(const Token& token,
+                                          const TokenInfo& info,
+                                          bool described) {
+  if (described &&
+      (info.opcode == Opcode::Number || info.opcode == Opcode::Variable)) {
+    return false;
+  }
+
+  const size_t references = ++references_[&token];
+  if (references == 2)
+    shared_slots_.emplace(&token, shared_count_++);
+  return references == 1 && described;
+}
+
+void JitProgram::Compiler::EmitFunction(const Token& root) {
+  auto& a = assembler_;
+  // push rbx; sub rsp, frame; mov rbx, rdi. The return address and rbx
+  // leave rsp 16-byte aligned for calls.
+  a.Bytes({0x53, 0x48, 0x81, ModRM(3, 5, kRsp)});
+  const size_t frame_size = a.position();
+  a.Int32(0);
+  a.Bytes({0x48, 0x89, ModRM(3, kRdi, kRbx)});
+  for (size_t slot = 0; slot < shared_count_; ++slot)
+    a.StoreStackInt(FlagOffset(slot), 0);
+
+  WalkTokens(root, *this);
+
+  const size_t frame = (shared_count_ * 2 + max_depth_) * 8;
+  // The frame is on the stack of the calling thread.
+  if (frame > kMaxFrameBytes)
+    throw std::runtime_error{"expression is nested too deeply"};
+  const int32_t aligned_frame = Displacement((frame + 15) / 16 * 16);
+  a.Patch(frame_size, aligned_frame);
+  // add rsp, frame; pop rbx; ret.
+  a.Bytes({0x48, 0x81, ModRM(3, 0, kRsp)});
+  a.Int32(aligned_frame);
+  a.Bytes({0x5B, 0xC3});
+}
+
+bool JitProgram::Compiler::Enter(const Token& token,
+                                 const TokenInfo& /*info*/,
+                                 bool described) {
+  Frame frame;
+  auto i = shared_slots_.find(&token);
+  if (i != shared_slots_.end()) {
+    // The first reference executed computes the value and sets the flag, so
+    // references skipped by conditionals stay correct.
+    frame.slot = i->second;
+    assembler_.CompareStackZero(FlagOffset(frame.slot));
+    frame.computed = assembler_.JumpIfNotZero();
+  }
+
+  if (!described) {
+    supported_ = false;
+    StoreShared(frame);
+    return false;
+  }
+
+  frames_.push_back(frame);
+  return true;
+}
+
+void JitProgram::Compiler::Next(const Token& /*token*/,
+                                const TokenInfo& info,
+                                size_t operand) {
+  auto& a = assembler_;
+  Frame& frame = frames_.back();
+  if (HasOperandPair(info)) {
+    frame.depth = depth_++;
+    if (depth_ > max_depth_)
+      max_depth_ = depth_;
+    a.Store(kRsp, TemporaryOffset(frame.depth), kXmm0);
+    return;
+  }
+
+  switch (info.opcode) {
+    case Opcode::And:
+    case Opcode::Or:
+      EmitTruthMask();
+      a.TestMask(kXmm1);
+      frame.jump =
+          info.opcode == Opcode::And ? a.JumpIfZero() : a.JumpIfNotZero();
+      break;
+    case Opcode::If:
+      if (operand == 1) {
+        EmitTruthMask();
+        a.TestMask(kXmm1);
+        frame.jump = a.JumpIfZero();
+      } else {
+        const size_t done = a.Jump();
+        a.Bind(frame.jump);
+        frame.jump = done;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void JitProgram::Compiler::Leave(const Token& /*token*/,
+                                 const TokenInfo& info) {
+  const Frame frame = frames_.back();
+  frames_.pop_back();
+  EmitToken(info, frame);
+  StoreShared(frame);
+}
+
+void JitProgram::Compiler::StoreShared(const Frame& frame) {
+  if (frame.slot == SIZE_MAX)
+    return;
+  auto& a = assembler_;
+  a.Store(kRsp, SharedOffset(frame.slot), kXmm0);
+  a.StoreStackInt(FlagOffset(frame.slot), 1);
+  const size_t done = a.Jump();
+  a.Bind(frame.computed);
+  a.Load(kXmm0, kRsp, SharedOffset(frame.slot));
+  a.Bind(done);
+}
+
+void JitProgram::Compiler::EmitTruthMask() {
+  auto& a = assembler_;
+  a.LoadBits(kXmm2, kAbsMask);
+  a.And(kXmm0, kXmm2);
+  a.LoadConstant(kXmm1, Value::kPrecision);
+  a.Compare(kXmm1, kXmm0, kLessEqual);
+}
+
+void JitProgram::Compiler::EmitToken(const TokenInfo& info,
+                                     const Frame& frame) {
+  auto& a = assembler_;
+  if (HasOperandPair(info)) {
+    // Leaves the left operand in xmm0 and the right one in xmm1.
+    --depth_;
+    a.Move(kXmm1, kXmm0);
+    a.Load(kXmm0, kRsp, TemporaryOffset(frame.depth));
+  }
+
+  switch (info.opcode) {
+    case Opcode::Number:
+      a.LoadConstant(kXmm0, info.number);
+      break;
+    case Opcode::Variable:
+      a.Load(kXmm0, kRbx, Displacement(info.slot * 8));
+      reads_variables_ = true;
+      break;
+    case Opcode::Negate:
+      a.LoadBits(kXmm1, kSignMask);
+      a.Xor(kXmm0, kXmm1);
+      break;
+    case Opcode::Not:
+      EmitTruthMask();
+      a.LoadConstant(kXmm2, 1.0);
+      a.AndNot(kXmm1, kXmm2);
+      a.Move(kXmm0, kXmm1);
+      break;
+    case Opcode::Add:
+      a.Add(kXmm0, kXmm1);
+      break;
+    case Opcode::Subtract:
+      a.Subtract(kXmm0, kXmm1);
+      break;
+    case Opcode::Multiply:
+      a.Multiply(kXmm0, kXmm1);
+      break;
+    case Opcode::Divide:
+      a.Divide(kXmm0, kXmm1);
+      break;
+    case Opcode::Power:
+      a.Call(reinterpret_cast<const void*>(
+          static_cast<double (*)(double, double)>(&std::pow)));
+      break;
+    case Opcode::Equal:
+      // fabs(a - b) < kPrecision.
+      a.Subtract(kXmm0, kXmm1);
+      a.LoadBits(kXmm2, kAbsMask);
+      a.And(kXmm0, kXmm2);
+      a.LoadConstant(kXmm1, Value::kPrecision);
+      a.Compare(kXmm0, kXmm1, kLessThan);
+      a.LoadConstant(kXmm1, 1.0);
+      a.And(kXmm0, kXmm1);
+      break;
+    case Opcode::Less:
+      a.Compare(kXmm0, kXmm1, kLessThan);
+      a.LoadConstant(kXmm1, 1.0);
+      a.And(kXmm0, kXmm1);
+      break;
+    case Opcode::Greater:
+      // b < a.
+      a.Compare(kXmm1, kXmm0, kLessThan);
+      a.LoadConstant(kXmm0, 1.0);
+      a.And(kXmm0, kXmm1);
+      break;
+    case Opcode::LessEqual:
+      // !(b < a).
+      a.Compare(kXmm1, kXmm0, kNotLessThan);
+      a.LoadConstant(kXmm0, 1.0);
+      a.And(kXmm0, kXmm1);
+      break;
+    case Opcode::GreaterEqual:
+      // !(a < b).
+      a.Compare(kXmm0, kXmm1, kNotLessThan);
+      a.LoadConstant(kXmm1, 1.0);
+      a.And(kXmm0, kXmm1);
+      break;
+    case Opcode::Parentheses:
+      break;
+    case Opcode::If:
+      a.Bind(frame.jump);
+      break;
+    case Opcode::And:
+    case Opcode::Or: {
+      // Single argument folds evaluate to the argument itself.
+      if (info.operand_count == 1)
+        break;
+      EmitTruthMask();
+      a.LoadConstant(kXmm0, 1.0);
+      a.And(kXmm0, kXmm1);
+      const size_t done = a.Jump();
+      a.Bind(frame.jump);
+      a.LoadConstant(kXmm0, info.opcode == Opcode::And ? 0.0 : 1.0);
+      a.Bind(done);
+      break;
+    }
+    case Opcode::Min:
+      // b < a ? b : a.
+      if (info.operand_count == 1)
+        break;
+      a.Move(kXmm2, kXmm1);
+      a.Compare(kXmm2, kXmm0, kLessThan);
+      EmitSelect();
+      break;
+    case Opcode::Max:
+      // a < b ? b : a.
+      if (info.operand_count == 1)
+        break;
+      a.Move(kXmm2, kXmm0);
+      a.Compare(kXmm2, kXmm1, kLessThan);
+      EmitSelect();
+      break;
+    case Opcode::Function1:
+      // Functions with inline code are recognized by their pointers, so
+      // custom functions reusing a standard name are called.
+      if (info.function1 == functions::abs_) {
+        a.LoadBits(kXmm1, kAbsMask);
+        a.And(kXmm0, kXmm1);
+      } else if (info.function1 == functions::sign) {
+        EmitSign();
+      } else if (info.function1 == static_cast<double (*)(double)>(sqrt)) {
+        a.Sqrt(kXmm0, kXmm0);
+      } else {
+        a.Call(reinterpret_cast<const void*>(info.function1));
+      }
+      break;
+    case Opcode::Function2:
+      a.Call(reinterpret_cast<const void*>(info.function2));
+      break;
+    default:
+      supported_ = false;
+      break;
+  }
+}
+
+void JitProgram::Compiler::EmitSelect() {
+  auto& a = assembler_;
+  a.And(kXmm1, kXmm2);
+  a.AndNot(kXmm2, kXmm0);
+  a.Or(kXmm2, kXmm1);
+  a.Move(kXmm0, kXmm2);
+}
+
+void JitProgram::Compiler::EmitSign() {
+  // fabs(a) < kPrecision ? 0 : (0 < a ? 1 : -1).
+  auto& a = assembler_;
+  a.Move(kXmm1, kXmm0);
+  a.LoadBits(kXmm2, kAbsMask);
+  a.And(kXmm1, kXmm2);
+  a.LoadConstant(kXmm2, Value::kPrecision);
+  a.Compare(kXmm1, kXmm2, kLessThan);
+  a.Xor(kXmm2, kXmm2);
+  a.Compare(kXmm2, kXmm0, kLessThan);
+  a.LoadConstant(kXmm3, 1.0);
+  a.And(kXmm3, kXmm2);
+  a.LoadConstant(kXmm0, -1.0);
+  a.AndNot(kXmm2, kXmm0);
+  a.Or(kXmm2, kXmm3);
+  a.AndNot(kXmm1, kXmm2);
+  a.Move(kXmm0, kXmm1);
+}
+
+JitProgram::JitProgram() = default;
+
+JitProgram::~JitProgram() {
+  Release();
+}
+
+JitProgram::JitProgram(JitProgram&& source) noexcept
+    : code_{std::exchange(source.code_, nullptr)},
+      mapped_size_{std::exchange(source.mapped_size_, 0)},
+      code_size_{std::exchange(source.code_size_, 0)},
+      function_{std::exchange(source.function_, nullptr)},
+      reads_variables_{source.reads_variables_} {}
+
+JitProgram& JitProgram::operator=(JitProgram&& source) noexcept {
+  if (this == &source)
+    return *this;
+
+  Release();
+  code_ = std::exchange(source.code_, nullptr);
+  mapped_size_ = std::exchange(source.mapped_size_, 0);
+  code_size_ = std::exchange(source.code_size_, 0);
+  function_ = std::exchange(source.function_, nullptr);
+  reads_variables_ = source.reads_variables_;
+  return *this;
+}
+
+// static
+bool JitProgram::IsAvailable() {
+#if defined(EXPRESS_JIT)
+  return true;
+#else
+  return false;
+#endif
+}
+
+// static
+JitProgram JitProgram::Compile(const Token& root) {
+  if (!IsAvailable())
+    throw std::runtime_error{"native code generation is not available"};
+  if (InferType(root) != StaticType::Number)
+    throw std::runtime_error{"expression is not numeric"};
+
+  Assembler assembler;
+  Compiler compiler{assembler};
+  compiler.CountReferences(root);
+  compiler.EmitFunction(root);
+  if (!compiler.supported())
+    throw std::runtime_error{"expression has no native translation"};
+  const auto& code = assembler.code();
+
+  JitProgram program;
+#if defined(EXPRESS_JIT)
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t mapped_size = (code.size() + page_size - 1) / page_size * page_size;
+  void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    throw std::runtime_error{"cannot allocate memory for native code"};
+  program.code_ = memory;
+  program.mapped_size_ = mapped_size;
+  memcpy(memory, code.data(), code.size());
+  if (mprotect(memory, mapped_size, PROT_READ | PROT_EXEC) != 0)
+    throw std::runtime_error{"cannot make native code executable"};
+  program.code_size_ = code.size();
+  program.function_ = reinterpret_cast<Function>(memory);
+#endif
+  program.reads_variables_ = compiler.reads_variables();
+  return program;
+}
+
+void JitProgram::Release() noexcept {
+#if defined(EXPRESS_JIT)
+  if (code_)
+    munmap(code_, mapped_size_);
+#endif
+  code_ = nullptr;
+}
+
+}  // namespace expression
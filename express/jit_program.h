@@ -0,0 +1,61 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <cstddef>
+
+namespace expression {
+
+class Token;
+
+// Native machine code generated for a numeric token tree. Each node is
+// translated to SSE2 scalar instructions with the same semantics as
+// Program::CalculateNumber, functions without an inline translation are
+// called through their pointers, and subtrees shared by the parser are
+// computed at most once per call.
+//
+// Code generation is available on x86-64 Linux only. The program references
+// functions and must not outlive the tokens' arena.
+class EXPRESS_EXPORT JitProgram {
+ public:
+  JitProgram();
+  ~JitProgram();
+
+  JitProgram(JitProgram&& source) noexcept;
+  JitProgram& operator=(JitProgram&& source) noexcept;
+
+  JitProgram(const JitProgram&) = delete;
+  JitProgram& operator=(const JitProgram&) = delete;
+
+  // True if this build can generate native code.
+  static bool IsAvailable();
+
+  // Throws std::runtime_error if native code is not available, the tree is
+  // not proven numeric by type inference or it has tokens without a native
+  // translation. No code is mapped in that case.
+  static JitProgram Compile(const Token& root);
+
+  // Evaluates the expression reading variables from |numbers|, indexed by
+  // SymbolTable slot.
+  double Calculate(const double* numbers) const { return function_(numbers); }
+
+  // False if Calculate does not read |numbers|.
+  bool reads_variables() const { return reads_variables_; }
+
+  size_t code_size() const { return code_size_; }
+
+ private:
+  using Function = double (*)(const double* numbers);
+
+  class Compiler;
+
+  void Release() noexcept;
+
+  void* code_ = nullptr;
+  size_t mapped_size_ = 0;
+  size_t code_size_ = 0;
+  Function function_ = nullptr;
+  bool reads_variables_ = false;
+};
+
+}  // namespace expression
@@ -68,6 +68,8 @@ repeat:
       buf_++;
       goto repeat;
     case '\0':
+      // Stays at the end, so reading past it keeps returning LEX_END.
+      return Lexem(*buf_);
     case '(':
     case ')':
     case ',':
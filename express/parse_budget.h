@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace expression {
+
+constexpr size_t kUnlimited = std::numeric_limits<size_t>::max();
+
+// Limits for parsing untrusted formulas. Bytes count the arena chunks of the
+// expression, nodes every token the parser asks the delegate for, shared or
+// not.
+struct ParseBudget {
+  size_t max_bytes = kUnlimited;
+  size_t max_nodes = kUnlimited;
+};
+
+struct ParseUsage {
+  size_t bytes = 0;
+  size_t nodes = 0;
+};
+
+// Thrown when parsing would exceed a budget. The partial tree is discarded.
+class BudgetExceededError : public std::runtime_error {
+ public:
+  BudgetExceededError(const std::string& what, ParseUsage usage)
+      : std::runtime_error{what}, usage_{usage} {}
+
+  // What was used when parsing stopped.
+  const ParseUsage& usage() const { return usage_; }
+
+ private:
+  ParseUsage usage_;
+};
+
+}  // namespace expression
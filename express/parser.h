@@ -1,16 +1,80 @@
 #pragma once
 
+#include "express/arena_pool.h"
 #include "express/parser_delegate.h"
 #include "express/standard_tokens.h"
 #include "express/token.h"
 
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 namespace expression {
 
+// Recursive descent parser. Parse() runs the same grammar with explicit
+// stacks instead, so deeply nested formulas and long unary chains cannot
+// overflow the call stack. It makes the same delegate calls in the same
+// order as MakeBinaryOperator(0), so trees and Format output are identical.
+// The stacks and argument lists live in a ScratchArena, so parsing allocates
+// no heap memory once the scratch pool of the thread is warm. Parse() rejects
+// trees deeper than max_depth(), kMaxDepth unless raised, counting every
+// level including literals and folded subtrees.
+
+// Detects delegates that want to know when a formula is done.
+template <class Delegate, class = void>
+struct HasEndParse : std::false_type {};
+
+template <class Delegate>
+struct HasEndParse<Delegate,
+                   std::void_t<decltype(std::declval<Delegate&>().EndParse())>>
+    : std::true_type {};
+
+// Detects delegates that take function arguments as an array. Delegates
+// written for the std::vector signature are still called with a vector.
+template <class Delegate, class BasicToken, class = void>
+struct HasArgumentArray : std::false_type {};
+
+template <class Delegate, class BasicToken>
+struct HasArgumentArray<
+    Delegate,
+    BasicToken,
+    std::void_t<decltype(std::declval<Delegate&>().MakeFunctionToken(
+        std::string_view{}, std::declval<BasicToken*>(), size_t{}))>>
+    : std::true_type {};
+
+// Moves from |arguments|.
+template <class BasicToken, class Delegate>
+BasicToken MakeDelegateFunctionToken(Delegate& delegate,
+                                     std::string_view name,
+                                     BasicToken* arguments,
+                                     size_t argument_count) {
+  if constexpr (HasArgumentArray<Delegate, BasicToken>::value) {
+    return delegate.MakeFunctionToken(name, arguments, argument_count);
+  } else {
+    return delegate.MakeFunctionToken(
+        name,
+        std::vector<BasicToken>{
+            std::make_move_iterator(arguments),
+            std::make_move_iterator(arguments + argument_count)});
+  }
+}
+
 template <class BasicLexer, class Delegate>
 class BasicParser {
  public:
   using Lexem = typename BasicLexer::Lexem;
 
+  // Deepest tree Parse() makes by default. Token::Calculate, Format and
+  // Traverse recurse, and fit in the default 8 MB stack of a thread for such
+  // a tree.
+  static constexpr size_t kMaxDepth = 10000;
+
   BasicParser(BasicLexer& lexer, Delegate& delegate);
 
   BasicParser(const BasicParser&) = delete;
@@ -31,11 +95,51 @@ class BasicParser {
   const Lexem& next_lexem() const { return next_lexem_; }
   void ReadLexem();
 
+  // Callers that only walk trees with WalkTokens and compiled programs may
+  // raise the limit. Tokens that do not describe themselves are walked
+  // through their recursive virtuals, so their subtrees stay within
+  // kMaxDepth.
+  size_t max_depth() const { return max_depth_; }
+  void set_max_depth(size_t max_depth) { max_depth_ = max_depth; }
+
+  // Depth of the tree made by the last Parse().
+  size_t depth() const { return depth_; }
+
  private:
+  // Operator or group waiting for its operands in MakeExpression.
+  struct Frame {
+    enum Kind { kUnary, kBinary, kParentheses, kFunction };
+
+    Kind kind = kUnary;
+    char oper = 0;
+    int priority = 0;
+    // Operands on the stack before the group.
+    size_t first_operand = 0;
+    std::string_view name = {};
+  };
+
+  template <class BasicToken>
+  BasicToken MakeExpression();
+
+  template <class BasicToken>
+  void ReduceBinaryOperators(std::pmr::vector<Frame>& frames,
+                             std::pmr::vector<BasicToken>& operands,
+                             std::pmr::vector<size_t>& depths,
+                             int priority);
+
+  template <class BasicToken>
+  void PushOperand(std::pmr::vector<BasicToken>& operands,
+                   std::pmr::vector<size_t>& depths,
+                   BasicToken token,
+                   size_t depth) const;
+
   BasicLexer& lexer_;
   Delegate& delegate_;
+  ScratchArena scratch_;
 
   Lexem next_lexem_{LEX_END};
+  size_t max_depth_ = kMaxDepth;
+  size_t depth_ = 0;
 };
 
 template <class BasicLexer, class Delegate>
@@ -99,13 +203,189 @@ inline BasicToken BasicParser<BasicLexer, Delegate>::MakeBinaryOperator(
 template <class BasicLexer, class Delegate>
 template <class BasicToken>
 inline BasicToken BasicParser<BasicLexer, Delegate>::Parse() {
-  ReadLexem();
+  if constexpr (HasEndParse<Delegate>::value) {
+    // Also ends the parse when it throws.
+    struct ParseScope {
+      ~ParseScope() { delegate.EndParse(); }
+      Delegate& delegate;
+    } scope{delegate_};
+    ReadLexem();
+    return MakeExpression<BasicToken>();
+  } else {
+    ReadLexem();
+    return MakeExpression<BasicToken>();
+  }
+}
+
+template <class BasicLexer, class Delegate>
+template <class BasicToken>
+inline BasicToken BasicParser<BasicLexer, Delegate>::MakeExpression() {
+  std::pmr::vector<Frame> frames{&scratch_};
+  std::pmr::vector<BasicToken> operands{&scratch_};
+  // Depth of the subtree of each operand.
+  std::pmr::vector<size_t> depths{&scratch_};
+  for (;;) {
+    // Primary position, as in MakePrimaryToken.
+    auto lexem = next_lexem_;
+    ReadLexem();
+
+    if (lexem.type & OPER_UNA) {
+      assert(!(lexem.lexem & LEX_UNA));
+      frames.push_back({Frame::kUnary, static_cast<char>(lexem.lexem)});
+      continue;
+    }
+
+    bool has_operand = true;
+    switch (lexem.lexem) {
+      case LEX_NAME:
+        if (next_lexem_.lexem == LEX_LP) {
+          frames.push_back({Frame::kFunction, 0, 0, operands.size(),
+                            lexem._string});
+          ReadLexem();
+          has_operand = next_lexem_.lexem == LEX_RP;
+        } else {
+          PushOperand(operands, depths,
+                      delegate_.MakeCustomToken(lexem, *this), 1);
+        }
+        break;
+      case LEX_DBL:
+        PushOperand(operands, depths,
+                    delegate_.MakeDoubleToken(lexem._double), 1);
+        break;
+      case LEX_STR:
+        PushOperand(operands, depths,
+                    delegate_.MakeStringToken(lexem._string), 1);
+        break;
+      case LEX_LP:
+        frames.push_back({Frame::kParentheses, 0, 0, operands.size()});
+        has_operand = false;
+        break;
+      default:
+        PushOperand(operands, depths, delegate_.MakeCustomToken(lexem, *this),
+                    1);
+        break;
+    }
+    if (!has_operand)
+      continue;
+
+    // An operand is complete: apply unary operators, then continue with a
+    // binary operator or close groups until one continues.
+    for (;;) {
+      // Functions without arguments are closed right away.
+      if (frames.empty() || frames.back().kind != Frame::kFunction ||
+          frames.back().first_operand != operands.size()) {
+        while (!frames.empty() && frames.back().kind == Frame::kUnary) {
+          BasicToken operand = std::move(operands.back());
+          operands.pop_back();
+          const size_t depth = depths.back() + 1;
+          depths.pop_back();
+          PushOperand(operands, depths,
+                      delegate_.MakeUnaryOperatorToken(frames.back().oper,
+                                                       std::move(operand)),
+                      depth);
+          frames.pop_back();
+        }
+
+        if (next_lexem_.type & OPER_BIN && next_lexem_.priority >= 0) {
+          ReduceBinaryOperators(frames, operands, depths,
+                                next_lexem_.priority);
+          frames.push_back({Frame::kBinary,
+                            static_cast<char>(next_lexem_.lexem),
+                            next_lexem_.priority});
+          ReadLexem();
+          break;
+        }
+
+        ReduceBinaryOperators(frames, operands, depths, 0);
+        if (frames.empty()) {
+          if (next_lexem_.lexem != LEX_END)
+            throw std::runtime_error{"End of expression is expected"};
+          assert(operands.size() == 1);
+          depth_ = depths.back();
+          return std::move(operands.back());
+        }
 
-  auto root_token = MakeBinaryOperator<BasicToken>(0);
-  if (next_lexem_.lexem != LEX_END)
-    throw std::runtime_error{"End of expression is expected"};
+        if (frames.back().kind == Frame::kFunction &&
+            next_lexem_.lexem == LEX_COMMA) {
+          ReadLexem();
+          break;
+        }
+        if (next_lexem_.lexem != LEX_RP)
+          throw std::runtime_error("missing ')'");
+      }
+      ReadLexem();
+
+      const Frame group = frames.back();
+      frames.pop_back();
+      if (group.kind == Frame::kParentheses) {
+        BasicToken nested_token = std::move(operands.back());
+        operands.pop_back();
+        const size_t depth = depths.back() + 1;
+        depths.pop_back();
+        PushOperand(operands, depths,
+                    delegate_.MakeParenthesesToken(std::move(nested_token)),
+                    depth);
+      } else {
+        BasicToken token = MakeDelegateFunctionToken(
+            delegate_, group.name, operands.data() + group.first_operand,
+            operands.size() - group.first_operand);
+        size_t depth = 1;
+        for (size_t i = group.first_operand; i < depths.size(); ++i)
+          depth = std::max(depth, depths[i] + 1);
+        operands.erase(operands.begin() + group.first_operand, operands.end());
+        depths.erase(depths.begin() + group.first_operand, depths.end());
+        PushOperand(operands, depths, std::move(token), depth);
+      }
+    }
+  }
+}
+
+// Makes the binary operators on top of |frames| with at least |priority|.
+// Operators of equal priority are left associative.
+template <class BasicLexer, class Delegate>
+template <class BasicToken>
+inline void BasicParser<BasicLexer, Delegate>::ReduceBinaryOperators(
+    std::pmr::vector<Frame>& frames,
+    std::pmr::vector<BasicToken>& operands,
+    std::pmr::vector<size_t>& depths,
+    int priority) {
+  while (!frames.empty() && frames.back().kind == Frame::kBinary &&
+         frames.back().priority >= priority) {
+    BasicToken right = std::move(operands.back());
+    operands.pop_back();
+    BasicToken left = std::move(operands.back());
+    operands.pop_back();
+    const size_t right_depth = depths.back();
+    depths.pop_back();
+    const size_t depth = std::max(depths.back(), right_depth) + 1;
+    depths.pop_back();
+    PushOperand(operands, depths,
+                delegate_.MakeBinaryOperatorToken(
+                    frames.back().oper, std::move(left), std::move(right)),
+                depth);
+    frames.pop_back();
+  }
+}
 
-  return root_token;
+template <class BasicLexer, class Delegate>
+template <class BasicToken>
+inline void BasicParser<BasicLexer, Delegate>::PushOperand(
+    std::pmr::vector<BasicToken>& operands,
+    std::pmr::vector<size_t>& depths,
+    BasicToken token,
+    size_t depth) const {
+  bool too_deep = depth > max_depth_;
+  if constexpr (HasTokenAccessor<BasicToken>::value) {
+    TokenInfo info;
+    if (!too_deep && depth > kMaxDepth)
+      too_deep = !token.token()->Describe(info);
+  } else {
+    too_deep = too_deep || depth > kMaxDepth;
+  }
+  if (too_deep)
+    throw std::runtime_error{"expression is nested too deeply"};
+  operands.emplace_back(std::move(token));
+  depths.push_back(depth);
 }
 
 template <class BasicLexer, class Delegate>
@@ -118,7 +398,7 @@ template <class BasicToken>
 inline BasicToken BasicParser<BasicLexer, Delegate>::MakeFunctionToken(
     std::string_view name) {
   // read parameters
-  std::vector<BasicToken> arguments;
+  std::pmr::vector<BasicToken> arguments{&scratch_};
   ReadLexem();
   if (next_lexem_.lexem != LEX_RP) {
     for (;;) {
@@ -133,7 +413,8 @@ inline BasicToken BasicParser<BasicLexer, Delegate>::MakeFunctionToken(
 
   ReadLexem();
 
-  return delegate_.MakeFunctionToken(name, std::move(arguments));
+  return MakeDelegateFunctionToken(delegate_, name, arguments.data(),
+                                   arguments.size());
 }
 
 }  // namespace expression
@@ -1,16 +1,25 @@
 #pragma once
 
+#include "express/arena_pool.h"
 #include "express/arena_token.h"
 #include "express/function.h"
+#include "express/lexem.h"
+#include "express/parse_budget.h"
 #include "express/standard_functions.h"
 #include "express/standard_tokens.h"
-
-#include <string_view>
-
-namespace expression {
-
-class Allocator;
-
+#include "express/symbol_table.h"
+#include "express/token_interner.h"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class Allocator;
+
 template <class BasicToken>
 class BasicParserDelegate {
  public:
@@ -19,74 +28,323 @@ class BasicParserDelegate {
                 "BasicToken must satisfy the arena token contract.");
   explicit BasicParserDelegate(Allocator& allocator) : allocator_{allocator} {}
   virtual ~BasicParserDelegate() = default;
-
-  BasicToken MakeDoubleToken(double value) {
-    return BasicToken{CreateToken<ValueToken<double>>(allocator_, value)};
-  }
-
-  BasicToken MakeStringToken(std::string_view str) {
-    return BasicToken{
-        CreateToken<StringValueToken>(allocator_, str, allocator_)};
-  }
-
-  template <class OperandToken>
-  BasicToken MakeUnaryOperatorToken(char oper, OperandToken&& operand_token) {
-    return BasicToken{CreateToken<BasicUnaryOperatorToken<OperandToken>>(
-        allocator_, oper, std::forward<OperandToken>(operand_token))};
-  }
-
-  template <class NestedToken>
-  BasicToken MakeParenthesesToken(NestedToken&& nested_token) {
-    return BasicToken{CreateToken<ParenthesesToken<NestedToken>>(
-        allocator_, std::forward<NestedToken>(nested_token))};
-  }
-
-  template <class LeftOperand, class RightOperand>
-  BasicToken MakeBinaryOperatorToken(char oper,
-                                     LeftOperand&& left_operand,
-                                     RightOperand&& right_operand) {
-    return BasicToken{CreateToken<BasicBinaryOperatorToken<BasicToken>>(
-        allocator_, oper, std::forward<LeftOperand>(left_operand),
-        std::forward<RightOperand>(right_operand))};
-  }
-
+
+  // Subtrees over literals are folded into a single constant token unless
+  // disabled. Folding keeps Format and Traverse output unchanged.
+  void set_fold_constants(bool fold_constants) {
+    fold_constants_ = fold_constants;
+  }
+
+  // Identical standard subtrees are made once and shared unless disabled.
+  // Custom tokens are never shared by the delegate, but subtrees over a
+  // custom token are shared when MakeCustomToken returns the same token for
+  // the same name. Only compiled programs evaluate a shared subtree once per
+  // call; walking the tree evaluates it once per reference.
+  void set_share_subtrees(bool share_subtrees) {
+    share_subtrees_ = share_subtrees;
+  }
+
+  // Subtrees are shared within one formula unless set, in which case they
+  // are also shared with the formulas parsed earlier. The allocator must then
+  // keep those formulas alive until ResetSharing. Within one formula the
+  // sharing table lives in a scratch arena of the parsing thread; across
+  // parses it lives on the heap, where it only grows with distinct subtrees.
+  void set_share_across_parses(bool share_across_parses) {
+    if (share_across_parses_ == share_across_parses)
+      return;
+    ResetSharing();
+    share_across_parses_ = share_across_parses;
+  }
+
+  // Forgets the subtrees made so far, so later tokens are not shared with
+  // them, and gives the scratch arena back. Required after resetting or
+  // replacing the allocator of a delegate that shares across parses.
+  void ResetSharing() {
+    interner_.reset();
+    scratch_.reset();
+  }
+
+  // Called by BasicParser when a formula is done, parsed or not.
+  void EndParse() {
+    if (!share_across_parses_)
+      ResetSharing();
+  }
+
+  // Names that are not functions are bound to |symbol_table| slots. Without a
+  // symbol table they are passed to MakeCustomToken.
+  void set_symbol_table(SymbolTable* symbol_table) {
+    symbol_table_ = symbol_table;
+  }
+
+  // Making more than |node_limit| tokens throws BudgetExceededError.
+  void set_node_limit(size_t node_limit) { node_limit_ = node_limit; }
+
+  // Tokens asked for so far, shared or not.
+  size_t node_count() const { return node_count_; }
+
+  BasicToken MakeDoubleToken(double value) {
+    return Share(MakeLiteralKey(Opcode::Number, value, {}), [&] {
+      return BasicToken{CreateToken<ValueToken<double>>(allocator_, value)};
+    });
+  }
+
+  BasicToken MakeStringToken(std::string_view str) {
+    return Share(MakeLiteralKey(Opcode::String, 0, str), [&] {
+      return BasicToken{
+          CreateToken<StringValueToken>(allocator_, str, allocator_)};
+    });
+  }
+
+  template <class OperandToken>
+  BasicToken MakeUnaryOperatorToken(char oper, OperandToken&& operand_token) {
+    return Share(
+        MakeOperatorKey(GetUnaryOperatorOpcode(oper), operand_token), [&] {
+          const bool constant = IsConstant(operand_token);
+          BasicToken token{CreateToken<BasicUnaryOperatorToken<OperandToken>>(
+              allocator_, oper, std::forward<OperandToken>(operand_token))};
+          return constant ? Fold(std::move(token)) : token;
+        });
+  }
+
+  template <class NestedToken>
+  BasicToken MakeParenthesesToken(NestedToken&& nested_token) {
+    return Share(MakeOperatorKey(Opcode::Parentheses, nested_token), [&] {
+      const bool constant = IsConstant(nested_token);
+      BasicToken token{CreateToken<ParenthesesToken<NestedToken>>(
+          allocator_, std::forward<NestedToken>(nested_token))};
+      return constant ? Fold(std::move(token)) : token;
+    });
+  }
+
+  template <class LeftOperand, class RightOperand>
+  BasicToken MakeBinaryOperatorToken(char oper,
+                                     LeftOperand&& left_operand,
+                                     RightOperand&& right_operand) {
+    return Share(
+        MakeOperatorKey(GetBinaryOperatorOpcode(oper), left_operand,
+                        right_operand),
+        [&] {
+          const bool constant =
+              IsConstant(left_operand) && IsConstant(right_operand);
+          BasicToken token{CreateToken<BasicBinaryOperatorToken<BasicToken>>(
+              allocator_, oper, std::forward<LeftOperand>(left_operand),
+              std::forward<RightOperand>(right_operand))};
+          return constant ? Fold(std::move(token)) : token;
+        });
+  }
+
+  // Moves from |arguments|.
   BasicToken MakeFunctionToken(std::string_view name,
-                               std::vector<BasicToken> arguments) {
-    // function
-    const auto* function = FindBasicFunction(name);
-    if (!function) {
-      throw std::runtime_error{std::string{"function was not found: "} +
-                               std::string{name}};
-    }
-
-    if (function->params != -1 &&
-        static_cast<size_t>(function->params) != arguments.size()) {
-      throw std::runtime_error{std::string{"parameters expected: "} +
-                               std::to_string(function->params)};
-    }
-
-    if (function->params == -1 && arguments.empty()) {
+                               BasicToken* arguments,
+                               size_t argument_count) {
+    // function
+    const auto* function = FindBasicFunction(name);
+    if (!function) {
+      throw std::runtime_error{std::string{"function was not found: "} +
+                               std::string{name}};
+    }
+
+    if (function->params != -1 &&
+        static_cast<size_t>(function->params) != argument_count) {
+      throw std::runtime_error{std::string{"parameters expected: "} +
+                               std::to_string(function->params)};
+    }
+
+    if (function->params == -1 && argument_count == 0) {
       throw std::runtime_error{"no parameters provided"};
     }
 
-    if (function->SupportsFoldedArguments())
-      return function->MakeFoldedToken(allocator_, std::move(arguments));
+    return Share(MakeFunctionKey(function, arguments, argument_count), [&] {
+      const bool constant =
+          std::all_of(arguments, arguments + argument_count,
+                      [this](const BasicToken& argument) {
+                        return IsConstant(argument);
+                      });
 
-    return function->MakeToken(allocator_, arguments.data(), arguments.size());
+      BasicToken token =
+          function->SupportsFoldedArguments()
+              ? function->MakeFoldedToken(allocator_, arguments,
+                                          argument_count)
+              : function->MakeToken(allocator_, arguments, argument_count);
+      return constant ? Fold(std::move(token)) : token;
+    });
+  }
+
+  // Deprecated: use the overload taking an argument array.
+  BasicToken MakeFunctionToken(std::string_view name,
+                               std::vector<BasicToken> arguments) {
+    return MakeFunctionToken(name, arguments.data(), arguments.size());
   }
-
-  template <class Lexem, class Parser>
-  BasicToken MakeCustomToken(const Lexem& lexem, Parser& parser) {
-    throw std::runtime_error{"unexpected token"};
-  }
-
+
+  BasicToken MakeVariableToken(std::string_view name) {
+    assert(symbol_table_);
+    const size_t slot = symbol_table_->Resolve(name);
+    return Share(
+        MakeLiteralKey(Opcode::Variable, static_cast<double>(slot), {}), [&] {
+          return BasicToken{CreateToken<VariableToken>(
+              allocator_, name, slot, symbol_table_->type(slot), allocator_)};
+        });
+  }
+
+  template <class Lexem, class Parser>
+  BasicToken MakeCustomToken(const Lexem& lexem, Parser& parser) {
+    if (symbol_table_ && lexem.lexem == LEX_NAME)
+      return MakeVariableToken(lexem._string);
+    throw std::runtime_error{"unexpected token"};
+  }
+
   virtual const BasicFunction<BasicToken>* FindBasicFunction(
       std::string_view name) {
     return functions::FindDefaultFunction<BasicToken>(name);
   }
-
- protected:
-  Allocator& allocator_;
-};
-
-}  // namespace expression
+
+ protected:
+  // Returns the token made earlier for |key|, or makes a new one and
+  // remembers it. Tokens that cannot describe themselves, such as custom
+  // function tokens, may have side effects and are not remembered.
+  template <class MakeToken>
+  BasicToken Share(std::optional<SubtreeKey> key, MakeToken&& make_token) {
+    if (node_count_ == node_limit_) {
+      throw BudgetExceededError{"node budget exceeded",
+                                ParseUsage{allocator_.capacity(), node_count_}};
+    }
+    ++node_count_;
+
+    if (!key.has_value())
+      return make_token();
+
+    if (!interner_)
+      interner_.emplace(key_resource());
+    if (auto token = interner_->Find(*key))
+      return *token;
+
+    BasicToken token = make_token();
+    if constexpr (HasTokenAccessor<BasicToken>::value) {
+      TokenInfo info;
+      if (token.token()->Describe(info)) {
+        // The key must not reference the formula text.
+        if (key->opcode == Opcode::String)
+          key->string = info.string;
+        interner_->Insert(std::move(*key), token);
+      }
+    }
+    return token;
+  }
+
+  // Keys and the sharing table are stored in the scratch arena while it only
+  // lasts for one parse, otherwise on the heap.
+  std::pmr::memory_resource* key_resource() {
+    if (share_across_parses_)
+      return std::pmr::new_delete_resource();
+    if (!scratch_)
+      scratch_.emplace();
+    return &*scratch_;
+  }
+
+  std::optional<SubtreeKey> MakeLiteralKey(Opcode opcode,
+                                           double number,
+                                           std::string_view string) {
+    if constexpr (HasTokenAccessor<BasicToken>::value) {
+      if (!share_subtrees_)
+        return std::nullopt;
+
+      SubtreeKey key{key_resource()};
+      key.opcode = opcode;
+      key.number = number;
+      key.string = string;
+      return key;
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  template <class... Operands>
+  std::optional<SubtreeKey> MakeOperatorKey(Opcode opcode,
+                                            const Operands&... operands) {
+    if constexpr ((HasTokenAccessor<Operands>::value && ...)) {
+      if (!share_subtrees_)
+        return std::nullopt;
+
+      SubtreeKey key{key_resource()};
+      key.opcode = opcode;
+      key.operands = {operands.token()...};
+      return key;
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  std::optional<SubtreeKey> MakeFunctionKey(
+      const BasicFunction<BasicToken>* function,
+      const BasicToken* arguments,
+      size_t argument_count) {
+    if constexpr (HasTokenAccessor<BasicToken>::value) {
+      if (!share_subtrees_)
+        return std::nullopt;
+
+      SubtreeKey key{key_resource()};
+      key.function = function;
+      key.operands.reserve(argument_count);
+      for (size_t i = 0; i < argument_count; ++i)
+        key.operands.emplace_back(arguments[i].token());
+      return key;
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  // Returns true for literals and folded subtrees.
+  template <class OperandToken>
+  bool IsConstant(const OperandToken& token) const {
+    if (!fold_constants_)
+      return false;
+
+    if constexpr (HasTokenAccessor<OperandToken>::value) {
+      TokenInfo info;
+      return token.token()->Describe(info) &&
+             (info.opcode == Opcode::Number || info.opcode == Opcode::String);
+    } else {
+      return false;
+    }
+  }
+
+  // Replaces a standard token over constant operands by its value. Custom
+  // tokens and subtrees that fail to evaluate, e.g. on a type mismatch or an
+  // exception thrown by a user function, are kept so the error surfaces from
+  // Calculate as before.
+  BasicToken Fold(BasicToken token) {
+    if constexpr (HasTokenAccessor<BasicToken>::value) {
+      const Token& source = *token.token();
+      TokenInfo info;
+      if (!source.Describe(info))
+        return token;
+
+      std::optional<Value> value;
+      try {
+        value = source.Calculate(nullptr);
+      } catch (...) {
+        return token;
+      }
+
+      return BasicToken{
+          CreateToken<ConstantToken>(allocator_, *value, source, allocator_)};
+    } else {
+      return token;
+    }
+  }
+
+  Allocator& allocator_;
+  bool fold_constants_ = true;
+  bool share_subtrees_ = true;
+  bool share_across_parses_ = false;
+  SymbolTable* symbol_table_ = nullptr;
+  size_t node_limit_ = kUnlimited;
+  size_t node_count_ = 0;
+  // Taken from the scratch pool of the parsing thread on the first key and
+  // given back at the end of the parse.
+  std::optional<ScratchArena> scratch_;
+  // Destroyed before the arena it may live in.
+  std::optional<BasicTokenInterner<BasicToken>> interner_;
+};
+
+}  // namespace expression
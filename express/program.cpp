@@ -0,0 +1,753 @@
+#include "express/program.h"
+
+#include "express/evaluation_context.h"
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+#include "express/type_inference.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+enum class Code : unsigned char {
+  PushNumber,
+  PushString,
+  // Pushes the EvaluationContext variable at the slot.
+  LoadVariable,
+  CalculateToken,
+  Negate,
+  Not,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Equal,
+  Less,
+  Greater,
+  LessEqual,
+  GreaterEqual,
+  Min,
+  Max,
+  Call1,
+  Call2,
+  ToBool,
+  Jump,
+  // Pops the condition and jumps when it is false.
+  JumpIfFalse,
+  // Pops the left operand. If it decides the result, pushes the result and
+  // jumps past the right operand.
+  AndJump,
+  OrJump,
+  // If the shared node was already evaluated, pushes its value and jumps past
+  // the code evaluating it.
+  LoadShared,
+  // Copies the top of the stack into the shared node slot.
+  StoreShared,
+  // Pops the value of a root into the result at the index.
+  StoreResult,
+};
+
+// Uninitialized storage for the evaluation stack and shared node slots of a
+// single Calculate call. Small programs keep it inline so evaluation does not
+// allocate. Elements are constructed and destroyed by the interpreter loop.
+template <class T, size_t kInlineCapacity>
+class ScratchStorage {
+ public:
+  explicit ScratchStorage(size_t capacity)
+      : data_{capacity <= kInlineCapacity
+                  ? reinterpret_cast<T*>(inline_storage_)
+                  : static_cast<T*>(::operator new(capacity * sizeof(T)))} {}
+
+  ~ScratchStorage() {
+    if (data_ != reinterpret_cast<T*>(inline_storage_))
+      ::operator delete(data_);
+  }
+
+  ScratchStorage(const ScratchStorage&) = delete;
+  ScratchStorage& operator=(const ScratchStorage&) = delete;
+
+  T* data() const { return data_; }
+
+ private:
+  T* const data_;
+  alignas(T) unsigned char inline_storage_[kInlineCapacity * sizeof(T)];
+};
+
+inline bool IsTrue(double value) {
+  return fabs(value) >= Value::kPrecision;
+}
+
+// Numbers own no storage, so they are dropped without running ~Value.
+inline void Destroy(Value& value) {
+  if (value.is_string())
+    value.~Value();
+}
+
+}  // namespace
+
+struct Program::Instruction {
+  Code code;
+  // Jump target or string index.
+  uint32_t index = 0;
+  union {
+    double number;
+    const Token* token;
+    double (*function1)(double);
+    double (*function2)(double, double);
+    size_t slot;
+  };
+};
+
+// Walks the trees with an explicit stack, so trees of any depth compile.
+class Program::Compiler {
+ public:
+  explicit Compiler(Program& program) : program_{program} {}
+
+  // Finds the nodes referenced more than once and assigns them slots.
+  void CountReferences(const Token& root);
+
+  void Emit(const Token& root) { WalkTokens(root, *this); }
+
+  // Emits |root| followed by the store of its value into result |index|.
+  void EmitResult(const Token& root, size_t index) {
+    Emit(root);
+    auto position = Append(Code::StoreResult, -1);
+    program_.instructions_[position].index = static_cast<uint32_t>(index);
+  }
+
+  bool Enter(const Token& token, const TokenInfo& info, bool described);
+  void Next(const Token& token, const TokenInfo& info, size_t operand);
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  // Token whose operands are being emitted.
+  struct Frame {
+    // LoadShared of a shared node, or SIZE_MAX.
+    size_t load = SIZE_MAX;
+    // Jump past an operand, patched once the operand is emitted.
+    size_t jump = 0;
+  };
+
+  size_t Append(Code code, int stack_effect) {
+    depth_ += stack_effect;
+    if (depth_ > program_.max_stack_depth_)
+      program_.max_stack_depth_ = depth_;
+    auto& instruction = program_.instructions_.emplace_back();
+    instruction.code = code;
+    instruction.number = 0;
+    return program_.instructions_.size() - 1;
+  }
+
+  void PatchJump(size_t position) {
+    program_.instructions_[position].index =
+        static_cast<uint32_t>(program_.instructions_.size());
+  }
+
+  bool CountReference(const Token& token,
+                      const TokenInfo& info,
+                      bool described);
+  void EmitToken(const TokenInfo& info, size_t jump);
+  void StoreShared(size_t load);
+
+  Program& program_;
+  size_t depth_ = 0;
+  std::unordered_map<const Token*, size_t> references_;
+  std::unordered_map<const Token*, size_t> shared_slots_;
+  std::vector<Frame> frames_;
+};
+
+void Program::Compiler::CountReferences(const Token& root) {
+  struct Counter {
+    Compiler& compiler;
+
+    bool Enter(const Token& token, const TokenInfo& info, bool described) {
+      return compiler.CountReference(token, info, described);
+    }
+    void Next(const Token&, const TokenInfo&, size_t) {}
+    void Leave(const Token&, const TokenInfo&) {}
+  };
+
+  Counter counter{*this};
+  WalkTokens(root, counter);
+}
+
+bool Program::Compiler::CountReference(const Token& token,
+                                       const TokenInfo& info,
+                                       bool described) {
+  // Literals and variables are cheaper to push again than to cache.
+  if (described &&
+      (info.opcode == Opcode::Number || info.opcode == Opcode::String ||
+       info.opcode == Opcode::Variable)) {
+    return false;
+  }
+
+  const size_t references = ++references_[&token];
+  if (references == 2)
+    shared_slots_.emplace(&token, program_.shared_count_++);
+  return references == 1 && described;
+}
+
+bool Program::Compiler::Enter(const Token& token,
+                              const TokenInfo& /*info*/,
+                              bool described) {
+  Frame frame;
+  auto i = shared_slots_.find(&token);
+  if (i != shared_slots_.end()) {
+    // Every reference keeps its own copy of the code, and the first one
+    // executed stores the value. This stays correct when some references
+    // are skipped by conditionals or short-circuit evaluation.
+    frame.load = Append(Code::LoadShared, 0);
+    program_.instructions_[frame.load].slot = i->second;
+  }
+
+  if (!described) {
+    auto position = Append(Code::CalculateToken, 1);
+    program_.instructions_[position].token = &token;
+    StoreShared(frame.load);
+    return false;
+  }
+
+  frames_.push_back(frame);
+  return true;
+}
+
+void Program::Compiler::Next(const Token& /*token*/,
+                             const TokenInfo& info,
+                             size_t operand) {
+  Frame& frame = frames_.back();
+  switch (info.opcode) {
+    case Opcode::And:
+      frame.jump = Append(Code::AndJump, -1);
+      break;
+    case Opcode::Or:
+      frame.jump = Append(Code::OrJump, -1);
+      break;
+    case Opcode::If:
+      if (operand == 1) {
+        frame.jump = Append(Code::JumpIfFalse, -1);
+      } else {
+        auto jump = Append(Code::Jump, 0);
+        // Only one branch leaves its value on the stack.
+        --depth_;
+        PatchJump(frame.jump);
+        frame.jump = jump;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void Program::Compiler::Leave(const Token& /*token*/, const TokenInfo& info) {
+  const Frame frame = frames_.back();
+  frames_.pop_back();
+  EmitToken(info, frame.jump);
+  StoreShared(frame.load);
+}
+
+void Program::Compiler::StoreShared(size_t load) {
+  if (load == SIZE_MAX)
+    return;
+  auto store = Append(Code::StoreShared, 0);
+  program_.instructions_[store].slot = program_.instructions_[load].slot;
+  PatchJump(load);
+}
+
+// Emits the code following the operands of the token.
+void Program::Compiler::EmitToken(const TokenInfo& info, size_t jump) {
+  switch (info.opcode) {
+    case Opcode::Number: {
+      auto position = Append(Code::PushNumber, 1);
+      program_.instructions_[position].number = info.number;
+      break;
+    }
+    case Opcode::String: {
+      auto position = Append(Code::PushString, 1);
+      program_.instructions_[position].index =
+          static_cast<uint32_t>(program_.strings_.size());
+      program_.strings_.emplace_back(info.string);
+      break;
+    }
+    case Opcode::Variable: {
+      auto position = Append(Code::LoadVariable, 1);
+      program_.instructions_[position].slot = info.slot;
+      break;
+    }
+    case Opcode::Negate:
+      Append(Code::Negate, 0);
+      break;
+    case Opcode::Not:
+      Append(Code::Not, 0);
+      break;
+    case Opcode::Add:
+      Append(Code::Add, -1);
+      break;
+    case Opcode::Subtract:
+      Append(Code::Subtract, -1);
+      break;
+    case Opcode::Multiply:
+      Append(Code::Multiply, -1);
+      break;
+    case Opcode::Divide:
+      Append(Code::Divide, -1);
+      break;
+    case Opcode::Power:
+      Append(Code::Power, -1);
+      break;
+    case Opcode::Equal:
+      Append(Code::Equal, -1);
+      break;
+    case Opcode::Less:
+      Append(Code::Less, -1);
+      break;
+    case Opcode::Greater:
+      Append(Code::Greater, -1);
+      break;
+    case Opcode::LessEqual:
+      Append(Code::LessEqual, -1);
+      break;
+    case Opcode::GreaterEqual:
+      Append(Code::GreaterEqual, -1);
+      break;
+    case Opcode::Parentheses:
+      break;
+    case Opcode::If:
+      PatchJump(jump);
+      break;
+    case Opcode::And:
+    case Opcode::Or:
+      // Single argument folds evaluate to the argument itself.
+      if (info.operand_count == 2) {
+        Append(Code::ToBool, 0);
+        PatchJump(jump);
+      }
+      break;
+    case Opcode::Min:
+      if (info.operand_count == 2)
+        Append(Code::Min, -1);
+      break;
+    case Opcode::Max:
+      if (info.operand_count == 2)
+        Append(Code::Max, -1);
+      break;
+    case Opcode::Function1: {
+      auto position = Append(Code::Call1, 0);
+      program_.instructions_[position].function1 = info.function1;
+      break;
+    }
+    case Opcode::Function2: {
+      auto position = Append(Code::Call2, -1);
+      program_.instructions_[position].function2 = info.function2;
+      break;
+    }
+    default:
+      assert(false);
+      break;
+  }
+}
+
+Program::Program() = default;
+
+Program::~Program() = default;
+
+Program::Program(Program&& source) noexcept = default;
+
+Program& Program::operator=(Program&& source) noexcept = default;
+
+// static
+Program Program::Compile(const Token& root) {
+  Program program;
+  Compiler compiler{program};
+  compiler.CountReferences(root);
+  compiler.Emit(root);
+  program.numeric_ = InferType(root) == StaticType::Number;
+  return program;
+}
+
+// static
+Program Program::Compile(const Token* const* roots, size_t root_count) {
+  Program program;
+  Compiler compiler{program};
+  for (size_t i = 0; i < root_count; ++i)
+    compiler.CountReferences(*roots[i]);
+  program.numeric_ = true;
+  for (size_t i = 0; i < root_count; ++i) {
+    compiler.EmitResult(*roots[i], i);
+    if (InferType(*roots[i]) != StaticType::Number)
+      program.numeric_ = false;
+  }
+  program.result_count_ = root_count;
+  return program;
+}
+
+size_t Program::instruction_count() const {
+  return instructions_.size();
+}
+
+Value Program::Calculate(void* data) const {
+  assert(result_count_ == 0);
+  if (numeric_)
+    return CalculateNumber(data);
+  return Run(data, nullptr);
+}
+
+void Program::CalculateAll(void* data, Value* results) const {
+  assert(result_count_ != 0);
+  if (!numeric_) {
+    Run(data, results);
+    return;
+  }
+
+  ScratchStorage<double, 64> numbers{result_count_};
+  RunNumber(data, numbers.data());
+  for (size_t i = 0; i < result_count_; ++i)
+    results[i] = numbers.data()[i];
+}
+
+double Program::CalculateNumber(void* data) const {
+  assert(numeric_);
+  assert(result_count_ == 0);
+  return RunNumber(data, nullptr);
+}
+
+void Program::CalculateAllNumbers(void* data, double* results) const {
+  assert(numeric_);
+  assert(result_count_ != 0);
+  RunNumber(data, results);
+}
+
+Value Program::Run(void* data, Value* results) const {
+
+  ScratchStorage<Value, 16> storage{max_stack_depth_ + shared_count_};
+  Value* const base = storage.data();
+  // One past the top of the stack.
+  Value* top = base;
+  Value* const shared = base + max_stack_depth_;
+  ScratchStorage<bool, 16> computed{shared_count_};
+  std::fill_n(computed.data(), shared_count_, false);
+  auto destroy_shared = [&] {
+    for (size_t slot = 0; slot < shared_count_; ++slot) {
+      if (computed.data()[slot])
+        Destroy(shared[slot]);
+    }
+  };
+
+  try {
+    const Instruction* instructions = instructions_.data();
+    const size_t count = instructions_.size();
+    for (size_t i = 0; i < count; ++i) {
+      const Instruction& instruction = instructions[i];
+      switch (instruction.code) {
+        case Code::PushNumber:
+          new (top) Value(instruction.number);
+          ++top;
+          break;
+        case Code::PushString:
+          new (top) Value(strings_[instruction.index]);
+          ++top;
+          break;
+        case Code::LoadVariable: {
+          const auto& context = GetEvaluationContext(data);
+          if (context.values)
+            new (top) Value(context.values[instruction.slot]);
+          else
+            new (top) Value(context.numbers[instruction.slot]);
+          ++top;
+          break;
+        }
+        case Code::CalculateToken:
+          new (top) Value(instruction.token->Calculate(data));
+          ++top;
+          break;
+        case Code::Negate:
+          top[-1] = -top[-1];
+          break;
+        case Code::Not:
+          top[-1] = !top[-1];
+          break;
+        case Code::Add:
+          if (top[-2].is_number() && top[-1].is_number()) {
+            static_cast<double&>(top[-2]) += static_cast<double>(top[-1]);
+          } else {
+            top[-2] += top[-1];
+          }
+          Destroy(*--top);
+          break;
+        case Code::Subtract:
+          top[-2] -= top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Multiply:
+          top[-2] *= top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Divide:
+          top[-2] /= top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Power:
+          top[-2] = pow(static_cast<double>(top[-2]),
+                        static_cast<double>(top[-1]));
+          Destroy(*--top);
+          break;
+        case Code::Equal:
+          top[-2] = top[-2] == top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Less:
+          top[-2] = top[-2] < top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Greater:
+          top[-2] = top[-2] > top[-1];
+          Destroy(*--top);
+          break;
+        case Code::LessEqual:
+          top[-2] = top[-2] <= top[-1];
+          Destroy(*--top);
+          break;
+        case Code::GreaterEqual:
+          top[-2] = top[-2] >= top[-1];
+          Destroy(*--top);
+          break;
+        case Code::Min:
+          if (top[-1] < top[-2])
+            top[-2] = std::move(top[-1]);
+          Destroy(*--top);
+          break;
+        case Code::Max:
+          if (top[-2] < top[-1])
+            top[-2] = std::move(top[-1]);
+          Destroy(*--top);
+          break;
+        case Code::Call1:
+          top[-1] = instruction.function1(static_cast<double>(top[-1]));
+          break;
+        case Code::Call2:
+          top[-2] = instruction.function2(static_cast<double>(top[-2]),
+                                          static_cast<double>(top[-1]));
+          Destroy(*--top);
+          break;
+        case Code::ToBool:
+          top[-1] = static_cast<bool>(top[-1]) ? 1.0 : 0.0;
+          break;
+        case Code::Jump:
+          i = instruction.index - 1;
+          break;
+        case Code::JumpIfFalse: {
+          const bool condition = static_cast<bool>(top[-1]);
+          Destroy(*--top);
+          if (!condition)
+            i = instruction.index - 1;
+          break;
+        }
+        case Code::AndJump: {
+          const bool left = static_cast<bool>(top[-1]);
+          if (!left) {
+            top[-1] = 0.0;
+            i = instruction.index - 1;
+          } else {
+            Destroy(*--top);
+          }
+          break;
+        }
+        case Code::OrJump: {
+          const bool left = static_cast<bool>(top[-1]);
+          if (left) {
+            top[-1] = 1.0;
+            i = instruction.index - 1;
+          } else {
+            Destroy(*--top);
+          }
+          break;
+        }
+        case Code::LoadShared:
+          if (computed.data()[instruction.slot]) {
+            new (top) Value(shared[instruction.slot]);
+            ++top;
+            i = instruction.index - 1;
+          }
+          break;
+        case Code::StoreShared:
+          new (&shared[instruction.slot]) Value(top[-1]);
+          computed.data()[instruction.slot] = true;
+          break;
+        case Code::StoreResult:
+          results[instruction.index] = std::move(top[-1]);
+          Destroy(*--top);
+          break;
+      }
+    }
+  } catch (...) {
+    while (top != base)
+      Destroy(*--top);
+    destroy_shared();
+    throw;
+  }
+
+  destroy_shared();
+  if (results) {
+    assert(top == base);
+    return Value{};
+  }
+  assert(top == base + 1);
+  Value result = std::move(base[0]);
+  Destroy(base[0]);
+  return result;
+}
+
+double Program::RunNumber(void* data, double* results) const {
+  assert(numeric_);
+
+  ScratchStorage<double, 64> storage{max_stack_depth_ + shared_count_};
+  double* top = storage.data();
+  double* const shared = storage.data() + max_stack_depth_;
+  ScratchStorage<bool, 16> computed{shared_count_};
+  std::fill_n(computed.data(), shared_count_, false);
+
+  // Mirrors the Value operators for numbers, including the precision used by
+  // equality and truthiness.
+  const Instruction* instructions = instructions_.data();
+  const size_t count = instructions_.size();
+  for (size_t i = 0; i < count; ++i) {
+    const Instruction& instruction = instructions[i];
+    switch (instruction.code) {
+      case Code::PushNumber:
+        *top++ = instruction.number;
+        break;
+      case Code::LoadVariable: {
+        const auto& context = GetEvaluationContext(data);
+        *top++ = context.numbers
+                     ? context.numbers[instruction.slot]
+                     : static_cast<double>(context.values[instruction.slot]);
+        break;
+      }
+      case Code::Negate:
+        top[-1] = -top[-1];
+        break;
+      case Code::Not:
+        top[-1] = IsTrue(top[-1]) ? 0.0 : 1.0;
+        break;
+      case Code::Add:
+        top[-2] += top[-1];
+        --top;
+        break;
+      case Code::Subtract:
+        top[-2] -= top[-1];
+        --top;
+        break;
+      case Code::Multiply:
+        top[-2] *= top[-1];
+        --top;
+        break;
+      case Code::Divide:
+        top[-2] /= top[-1];
+        --top;
+        break;
+      case Code::Power:
+        top[-2] = pow(top[-2], top[-1]);
+        --top;
+        break;
+      case Code::Equal:
+        top[-2] = fabs(top[-2] - top[-1]) < Value::kPrecision ? 1.0 : 0.0;
+        --top;
+        break;
+      case Code::Less:
+        top[-2] = top[-2] < top[-1] ? 1.0 : 0.0;
+        --top;
+        break;
+      case Code::Greater:
+        top[-2] = top[-1] < top[-2] ? 1.0 : 0.0;
+        --top;
+        break;
+      case Code::LessEqual:
+        top[-2] = !(top[-1] < top[-2]) ? 1.0 : 0.0;
+        --top;
+        break;
+      case Code::GreaterEqual:
+        top[-2] = !(top[-2] < top[-1]) ? 1.0 : 0.0;
+        --top;
+        break;
+      case Code::Min:
+        if (top[-1] < top[-2])
+          top[-2] = top[-1];
+        --top;
+        break;
+      case Code::Max:
+        if (top[-2] < top[-1])
+          top[-2] = top[-1];
+        --top;
+        break;
+      case Code::Call1:
+        top[-1] = instruction.function1(top[-1]);
+        break;
+      case Code::Call2:
+        top[-2] = instruction.function2(top[-2], top[-1]);
+        --top;
+        break;
+      case Code::ToBool:
+        top[-1] = IsTrue(top[-1]) ? 1.0 : 0.0;
+        break;
+      case Code::Jump:
+        i = instruction.index - 1;
+        break;
+      case Code::JumpIfFalse:
+        if (!IsTrue(*--top))
+          i = instruction.index - 1;
+        break;
+      case Code::AndJump:
+        if (!IsTrue(top[-1])) {
+          top[-1] = 0.0;
+          i = instruction.index - 1;
+        } else {
+          --top;
+        }
+        break;
+      case Code::OrJump:
+        if (IsTrue(top[-1])) {
+          top[-1] = 1.0;
+          i = instruction.index - 1;
+        } else {
+          --top;
+        }
+        break;
+      case Code::LoadShared:
+        if (computed.data()[instruction.slot]) {
+          *top++ = shared[instruction.slot];
+          i = instruction.index - 1;
+        }
+        break;
+      case Code::StoreShared:
+        shared[instruction.slot] = top[-1];
+        computed.data()[instruction.slot] = true;
+        break;
+      case Code::StoreResult:
+        results[instruction.index] = *--top;
+        break;
+      case Code::PushString:
+      case Code::CalculateToken:
+        // Excluded by type inference.
+        assert(false);
+        break;
+    }
+  }
+
+  if (results) {
+    assert(top == storage.data());
+    return 0;
+  }
+  return top[-1];
+}
+
+}  // namespace expression
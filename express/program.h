@@ -0,0 +1,79 @@
+#pragma once
+
+#include "express/express_export.h"
+#include "express/value.h"
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+class Token;
+
+// Flat instruction array lowered from a token tree and executed by a stack
+// machine. Tokens that cannot describe themselves stay in the program as
+// calls to Token::Calculate, so custom tokens keep working unchanged.
+//
+// The program references tokens and literal storage owned by the expression
+// allocator and must not outlive it.
+class EXPRESS_EXPORT Program {
+ public:
+  Program();
+  ~Program();
+
+  Program(Program&& source) noexcept;
+  Program& operator=(Program&& source) noexcept;
+
+  Program(const Program&) = delete;
+  Program& operator=(const Program&) = delete;
+
+  static Program Compile(const Token& root);
+
+  // Lowers several roots into one program evaluated by CalculateAll. Nodes
+  // shared between roots are evaluated once per call.
+  static Program Compile(const Token* const* roots, size_t root_count);
+
+  Value Calculate(void* data) const;
+
+  // Writes the value of every root of a program compiled from several roots
+  // into |results|.
+  void CalculateAll(void* data, Value* results) const;
+
+  // True if type inference proved that the program only handles numbers.
+  bool is_numeric() const { return numeric_; }
+
+  // Evaluates a numeric program on a stack of doubles, without constructing
+  // Values or checking types. Requires is_numeric().
+  double CalculateNumber(void* data) const;
+
+  void CalculateAllNumbers(void* data, double* results) const;
+
+  size_t instruction_count() const;
+  size_t max_stack_depth() const { return max_stack_depth_; }
+
+  // Number of nodes referenced more than once, such as subtrees shared by the
+  // parser. Each of them is evaluated at most once per Calculate.
+  size_t shared_count() const { return shared_count_; }
+
+  // Number of roots, zero for a program compiled from a single root.
+  size_t result_count() const { return result_count_; }
+
+ private:
+  struct Instruction;
+  class Compiler;
+
+  // Runs the program and returns the value left on the stack, or stores the
+  // value of every root into |results| when it is not null.
+  Value Run(void* data, Value* results) const;
+  double RunNumber(void* data, double* results) const;
+
+  std::vector<Instruction> instructions_;
+  std::vector<std::string_view> strings_;
+  size_t max_stack_depth_ = 0;
+  size_t shared_count_ = 0;
+  size_t result_count_ = 0;
+  bool numeric_ = false;
+};
+
+}  // namespace expression
@@ -0,0 +1,378 @@
+#include "express/serialization.h"
+
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace expression {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x52505845;  // "EXPR" in little endian.
+
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t node_count;
+  uint32_t operand_count;
+  uint32_t string_size;
+  uint32_t reserved;
+};
+
+// |payload| holds the number bits, the string offset of literals and
+// variables, or the first operand in the low half and the name offset in the
+// high half.
+struct NodeRecord {
+  uint8_t kind;
+  char oper;
+  uint16_t reserved;
+  uint32_t count;
+  uint64_t payload;
+};
+
+static_assert(sizeof(ImageHeader) == 24 && sizeof(NodeRecord) == 16);
+
+using Kind = SerializedExpression::Kind;
+
+bool IsBinaryOperatorChar(char oper) {
+  return oper != 0 && std::strchr("+-*/^=<>lg", oper);
+}
+
+[[noreturn]] void ThrowInvalidImage() {
+  throw std::runtime_error("invalid expression image");
+}
+
+// Writes operands before the tokens using them, walking the tree with an
+// explicit stack.
+class Writer {
+ public:
+  void Write(const Token& root) { WalkTokens(root, *this); }
+
+  std::string Finish() const;
+
+  bool Enter(const Token& token, TokenInfo& info, bool described);
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token& token, const TokenInfo& info);
+
+ private:
+  // Token being written, one per level of the walk.
+  struct Group {
+    // Start of the operand indices in |values_|.
+    size_t first_value = 0;
+    bool folded_constant = false;
+    // Nested binary folds of the same function are written as arguments of
+    // the outermost one, the way they format.
+    bool flattens_folds = false;
+    bool inline_fold = false;
+    Opcode fold_opcode = Opcode::Number;
+    std::string_view fold_name;
+  };
+
+  uint32_t WriteToken(const TokenInfo& info,
+                      const uint32_t* operands,
+                      size_t operand_count);
+  uint32_t AddNode(Kind kind, char oper, uint32_t count, uint64_t payload);
+  uint32_t AddString(std::string_view str);
+  uint32_t AddOperands(const uint32_t* operands, size_t count);
+
+  std::unordered_map<const Token*, uint32_t> indices_;
+  std::vector<NodeRecord> nodes_;
+  std::vector<uint32_t> operands_;
+  std::string strings_;
+  std::vector<Group> groups_;
+  std::vector<uint32_t> values_;
+};
+
+bool Writer::Enter(const Token& token, TokenInfo& info, bool described) {
+  if (described && !groups_.empty()) {
+    const Group& parent = groups_.back();
+    if (parent.flattens_folds && info.opcode == parent.fold_opcode &&
+        info.operand_count == 2 && info.string == parent.fold_name) {
+      Group group = parent;
+      group.inline_fold = true;
+      groups_.push_back(group);
+      return true;
+    }
+  }
+
+  auto i = indices_.find(&token);
+  if (i != indices_.end()) {
+    values_.push_back(i->second);
+    return false;
+  }
+  if (!described)
+    throw std::runtime_error("token cannot be serialized");
+
+  Group group;
+  group.first_value = values_.size();
+  if (info.folded_source) {
+    // Folded constants are written as the subtree they were folded from;
+    // the delegate folds it again on load.
+    info.operands[0] = info.folded_source;
+    info.operand_count = 1;
+    group.folded_constant = true;
+  } else if ((info.opcode == Opcode::And || info.opcode == Opcode::Or ||
+              info.opcode == Opcode::Min || info.opcode == Opcode::Max) &&
+             info.operand_count == 2) {
+    // Single argument folds are arguments of their own.
+    group.flattens_folds = true;
+    group.fold_opcode = info.opcode;
+    group.fold_name = info.string;
+  }
+  groups_.push_back(group);
+  return true;
+}
+
+void Writer::Leave(const Token& token, const TokenInfo& info) {
+  const Group group = groups_.back();
+  groups_.pop_back();
+  if (group.inline_fold)
+    return;
+
+  const uint32_t* operands = values_.data() + group.first_value;
+  const size_t operand_count = values_.size() - group.first_value;
+  const uint32_t index = group.folded_constant
+                             ? operands[0]
+                             : WriteToken(info, operands, operand_count);
+  values_.resize(group.first_value);
+  values_.push_back(index);
+  indices_.emplace(&token, index);
+}
+
+uint32_t Writer::WriteToken(const TokenInfo& info,
+                            const uint32_t* operands,
+                            size_t operand_count) {
+  switch (info.opcode) {
+    case Opcode::Number: {
+      uint64_t bits;
+      std::memcpy(&bits, &info.number, sizeof(bits));
+      return AddNode(Kind::Number, 0, 0, bits);
+    }
+    case Opcode::String:
+      return AddNode(Kind::String, 0, 0, AddString(info.string));
+    case Opcode::Variable:
+      return AddNode(Kind::Variable, 0, 0, AddString(info.string));
+    case Opcode::Negate:
+    case Opcode::Not:
+      return AddNode(Kind::UnaryOperator, GetOperatorChar(info.opcode), 1,
+                     AddOperands(operands, 1));
+    case Opcode::Add:
+    case Opcode::Subtract:
+    case Opcode::Multiply:
+    case Opcode::Divide:
+    case Opcode::Power:
+    case Opcode::Equal:
+    case Opcode::Less:
+    case Opcode::Greater:
+    case Opcode::LessEqual:
+    case Opcode::GreaterEqual:
+      return AddNode(Kind::BinaryOperator, GetOperatorChar(info.opcode), 2,
+                     AddOperands(operands, 2));
+    case Opcode::Parentheses:
+      return AddNode(Kind::Parentheses, 0, 1, AddOperands(operands, 1));
+    case Opcode::If:
+    case Opcode::Function1:
+    case Opcode::Function2:
+    // The delegate folds the arguments as written into the same shape.
+    case Opcode::And:
+    case Opcode::Or:
+    case Opcode::Min:
+    case Opcode::Max: {
+      const uint64_t first = AddOperands(operands, operand_count);
+      const uint64_t name =
+          AddString(info.opcode == Opcode::If ? "If" : info.string);
+      return AddNode(Kind::Function, 0, static_cast<uint32_t>(operand_count),
+                     first | name << 32);
+    }
+  }
+
+  assert(false);
+  return 0;
+}
+
+uint32_t Writer::AddNode(Kind kind, char oper, uint32_t count,
+                         uint64_t payload) {
+  NodeRecord record{};
+  record.kind = static_cast<uint8_t>(kind);
+  record.oper = oper;
+  record.count = count;
+  record.payload = payload;
+  nodes_.push_back(record);
+  return static_cast<uint32_t>(nodes_.size() - 1);
+}
+
+uint32_t Writer::AddString(std::string_view str) {
+  const auto offset = static_cast<uint32_t>(strings_.size());
+  const auto size = static_cast<uint32_t>(str.size());
+  strings_.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  strings_.append(str);
+  return offset;
+}
+
+uint32_t Writer::AddOperands(const uint32_t* operands, size_t count) {
+  const auto first = static_cast<uint32_t>(operands_.size());
+  operands_.insert(operands_.end(), operands, operands + count);
+  return first;
+}
+
+std::string Writer::Finish() const {
+  ImageHeader header{};
+  header.magic = kMagic;
+  header.version = kSerializationVersion;
+  header.node_count = static_cast<uint32_t>(nodes_.size());
+  header.operand_count = static_cast<uint32_t>(operands_.size());
+  header.string_size = static_cast<uint32_t>(strings_.size());
+
+  std::string image;
+  image.reserve(sizeof(header) + nodes_.size() * sizeof(NodeRecord) +
+                operands_.size() * sizeof(uint32_t) + strings_.size());
+  image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  image.append(reinterpret_cast<const char*>(nodes_.data()),
+               nodes_.size() * sizeof(NodeRecord));
+  image.append(reinterpret_cast<const char*>(operands_.data()),
+               operands_.size() * sizeof(uint32_t));
+  image += strings_;
+  return image;
+}
+
+template <class T>
+T ReadAt(std::string_view image, size_t offset) {
+  T value;
+  std::memcpy(&value, image.data() + offset, sizeof(T));
+  return value;
+}
+
+}  // namespace
+
+std::string SerializeExpression(const Token& root) {
+  Writer writer;
+  // Operands are written first, so the root is the last node.
+  writer.Write(root);
+  return writer.Finish();
+}
+
+SerializedExpression::SerializedExpression(std::string_view image)
+    : image_{image} {
+  if (image.size() < sizeof(ImageHeader))
+    ThrowInvalidImage();
+  const auto header = ReadAt<ImageHeader>(image, 0);
+  if (header.magic != kMagic)
+    ThrowInvalidImage();
+  if (header.version != kSerializationVersion) {
+    throw std::runtime_error("unsupported expression image version " +
+                             std::to_string(header.version));
+  }
+  const uint64_t size = sizeof(ImageHeader) +
+                        uint64_t{header.node_count} * sizeof(NodeRecord) +
+                        uint64_t{header.operand_count} * sizeof(uint32_t) +
+                        header.string_size;
+  if (header.node_count == 0 || size != image.size())
+    ThrowInvalidImage();
+  node_count_ = header.node_count;
+  operand_count_ = header.operand_count;
+
+  // Checks every record so loading can trust the image.
+  for (size_t i = 0; i < node_count_; ++i) {
+    const Node node = this->node(i);
+    size_t operand_count = 0;
+    switch (node.kind) {
+      case Kind::Number:
+        break;
+      case Kind::Variable:
+        has_variables_ = true;
+        break;
+      case Kind::String:
+        break;
+      case Kind::UnaryOperator:
+        if (node.oper != '-' && node.oper != '!')
+          ThrowInvalidImage();
+        operand_count = 1;
+        break;
+      case Kind::BinaryOperator:
+        if (!IsBinaryOperatorChar(node.oper))
+          ThrowInvalidImage();
+        operand_count = 2;
+        break;
+      case Kind::Parentheses:
+        operand_count = 1;
+        break;
+      case Kind::Function:
+        operand_count = node.operand_count;
+        break;
+      default:
+        ThrowInvalidImage();
+    }
+    if (node.operand_count != operand_count ||
+        node.first_operand + operand_count > operand_count_) {
+      ThrowInvalidImage();
+    }
+    for (size_t j = 0; j < operand_count; ++j) {
+      if (operand(node, j) >= i)
+        ThrowInvalidImage();
+    }
+  }
+}
+
+SerializedExpression::Node SerializedExpression::node(size_t index) const {
+  assert(index < node_count_);
+  const auto record = ReadAt<NodeRecord>(
+      image_, sizeof(ImageHeader) + index * sizeof(NodeRecord));
+
+  Node node;
+  node.kind = static_cast<Kind>(record.kind);
+  node.oper = record.oper;
+  node.operand_count = record.count;
+  uint64_t string_offset = 0;
+  bool has_string = false;
+  switch (node.kind) {
+    case Kind::Number:
+      std::memcpy(&node.number, &record.payload, sizeof(node.number));
+      node.operand_count = 0;
+      break;
+    case Kind::String:
+    case Kind::Variable:
+      string_offset = record.payload;
+      has_string = true;
+      node.operand_count = 0;
+      break;
+    case Kind::Function:
+      node.first_operand = static_cast<uint32_t>(record.payload);
+      string_offset = record.payload >> 32;
+      has_string = true;
+      break;
+    default:
+      node.first_operand = static_cast<uint32_t>(record.payload);
+      break;
+  }
+
+  if (has_string) {
+    const size_t strings = sizeof(ImageHeader) +
+                           node_count_ * sizeof(NodeRecord) +
+                           operand_count_ * sizeof(uint32_t);
+    const size_t string_size = image_.size() - strings;
+    if (string_offset + sizeof(uint32_t) > string_size)
+      ThrowInvalidImage();
+    const auto length =
+        ReadAt<uint32_t>(image_, strings + static_cast<size_t>(string_offset));
+    const size_t start = strings + string_offset + sizeof(uint32_t);
+    if (length > image_.size() - start)
+      ThrowInvalidImage();
+    node.string = image_.substr(start, length);
+  }
+  return node;
+}
+
+size_t SerializedExpression::operand(const Node& node, size_t index) const {
+  assert(index < node.operand_count);
+  return ReadAt<uint32_t>(image_, sizeof(ImageHeader) +
+                                      node_count_ * sizeof(NodeRecord) +
+                                      (node.first_operand + index) *
+                                          sizeof(uint32_t));
+}
+
+}  // namespace expression
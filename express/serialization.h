@@ -0,0 +1,139 @@
+#pragma once
+
+#include "express/arena_pool.h"
+#include "express/express_export.h"
+#include "express/parser.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace expression {
+
+class Token;
+
+// Versioned binary image of a parsed expression: a header, one fixed-size
+// record per parser step in post order, 32-bit operand indices and a string
+// table, in native byte order. Loading replays the steps through a parser
+// delegate, so the tree gets the same folded constants, shared subtrees,
+// Format and Traverse output as parsing the text, without running the lexer
+// or the parser.
+//
+// Images of trees with tokens that cannot describe themselves, such as
+// custom tokens, cannot be made.
+constexpr uint32_t kSerializationVersion = 1;
+
+// Throws std::runtime_error if a token cannot be serialized.
+EXPRESS_EXPORT std::string SerializeExpression(const Token& root);
+
+// Validated read-only view of an image. Records are read in place, so the
+// image may live in a memory-mapped file and needs no particular alignment.
+class EXPRESS_EXPORT SerializedExpression {
+ public:
+  enum class Kind : uint8_t {
+    Number,
+    String,
+    Variable,
+    UnaryOperator,
+    BinaryOperator,
+    Parentheses,
+    Function,
+  };
+
+  struct Node {
+    Kind kind = Kind::Number;
+    // Operator character as passed to the parser delegate.
+    char oper = 0;
+    double number = 0;
+    // Literal, variable name or function name.
+    std::string_view string;
+    size_t operand_count = 0;
+    size_t first_operand = 0;
+  };
+
+  // Throws std::runtime_error if |image| is not a valid image of this
+  // version.
+  explicit SerializedExpression(std::string_view image);
+
+  size_t node_count() const { return node_count_; }
+  bool has_variables() const { return has_variables_; }
+
+  Node node(size_t index) const;
+
+  // Index of an earlier node.
+  size_t operand(const Node& node, size_t index) const;
+
+ private:
+  std::string_view image_;
+  size_t node_count_ = 0;
+  size_t operand_count_ = 0;
+  bool has_variables_ = false;
+};
+
+// Rebuilds the tree of |image| through |delegate|, which must have a symbol
+// table if the image has variables. Sets |depth| to the depth of the tree,
+// counted as BasicParser counts it, when given.
+template <class BasicToken, class Delegate>
+BasicToken DeserializeExpression(const SerializedExpression& image,
+                                 Delegate& delegate,
+                                 size_t* depth = nullptr) {
+  using Kind = SerializedExpression::Kind;
+
+  ScratchArena scratch;
+  std::pmr::vector<BasicToken> tokens{&scratch};
+  tokens.reserve(image.node_count());
+  std::pmr::vector<size_t> depths{&scratch};
+  if (depth)
+    depths.reserve(image.node_count());
+  for (size_t i = 0; i < image.node_count(); ++i) {
+    const auto node = image.node(i);
+    if (depth) {
+      size_t node_depth = 1;
+      for (size_t j = 0; j < node.operand_count; ++j)
+        node_depth = std::max(node_depth, depths[image.operand(node, j)] + 1);
+      depths.push_back(node_depth);
+    }
+    switch (node.kind) {
+      case Kind::Number:
+        tokens.emplace_back(delegate.MakeDoubleToken(node.number));
+        break;
+      case Kind::String:
+        tokens.emplace_back(delegate.MakeStringToken(node.string));
+        break;
+      case Kind::Variable:
+        tokens.emplace_back(delegate.MakeVariableToken(node.string));
+        break;
+      case Kind::UnaryOperator:
+        tokens.emplace_back(delegate.MakeUnaryOperatorToken(
+            node.oper, BasicToken{tokens[image.operand(node, 0)]}));
+        break;
+      case Kind::BinaryOperator:
+        tokens.emplace_back(delegate.MakeBinaryOperatorToken(
+            node.oper, BasicToken{tokens[image.operand(node, 0)]},
+            BasicToken{tokens[image.operand(node, 1)]}));
+        break;
+      case Kind::Parentheses:
+        tokens.emplace_back(delegate.MakeParenthesesToken(
+            BasicToken{tokens[image.operand(node, 0)]}));
+        break;
+      case Kind::Function: {
+        std::pmr::vector<BasicToken> arguments{&scratch};
+        arguments.reserve(node.operand_count);
+        for (size_t j = 0; j < node.operand_count; ++j)
+          arguments.emplace_back(tokens[image.operand(node, j)]);
+        tokens.emplace_back(MakeDelegateFunctionToken(
+            delegate, node.string, arguments.data(), arguments.size()));
+        break;
+      }
+    }
+  }
+  if (depth)
+    *depth = depths.back();
+  return std::move(tokens.back());
+}
+
+}  // namespace expression
@@ -1,30 +1,51 @@
-#pragma once
-
-#include "express/token.h"
-
-namespace expression {
-
-template <class T>
-class ValueToken : public Token {
- public:
-  template <class U>
-  explicit ValueToken(U&& value) : value_{std::forward<U>(value)} {}
-
-  virtual Value Calculate(void* data) const override { return value_; }
-
-  virtual void Traverse(TraverseCallback callback, void* param) const {
-    callback(this, param);
-  }
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const override {
-    delegate.AppendDouble(str, value_);
-  }
-
- private:
-  const T value_;
-};
-
+#pragma once
+
+#include "express/evaluation_context.h"
+#include "express/token.h"
+
+namespace expression {
+
+// Copies |str| into allocator-owned storage with a terminating zero.
+inline std::string_view AllocateLiteralStorage(std::string_view str,
+                                               Allocator& allocator) {
+  auto* storage =
+      static_cast<char*>(allocator.allocate(str.size() + 1, alignof(char)));
+  memcpy(storage, str.data(), str.size());
+  storage[str.size()] = '\0';
+  return std::string_view(storage, str.size());
+}
+
+template <class T>
+class ValueToken : public Token {
+ public:
+  template <class U>
+  explicit ValueToken(U&& value) : value_{std::forward<U>(value)} {}
+
+  virtual Value Calculate(void* data) const override { return value_; }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const {
+    callback(this, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    delegate.AppendDouble(str, value_);
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    info.opcode = Opcode::Number;
+    info.number = static_cast<double>(value_);
+    return true;
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    return CreateToken<ValueToken>(cloner.allocator(), value_);
+  }
+
+ private:
+  const T value_;
+};
+
 class StringValueToken : public Token {
  public:
   StringValueToken(std::string_view str, Allocator& allocator)
@@ -45,177 +66,325 @@ class StringValueToken : public Token {
     str += '"';
   }
 
+  virtual bool Describe(TokenInfo& info) const override {
+    info.opcode = Opcode::String;
+    info.string = str_;
+    return true;
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    return CreateToken<StringValueToken>(cloner.allocator(), str_,
+                                         cloner.allocator());
+  }
+
  private:
-  static std::string_view AllocateLiteralStorage(std::string_view str,
-                                                 Allocator& allocator) {
-    auto* storage =
-        static_cast<char*>(allocator.allocate(str.size() + 1, alignof(char)));
-    memcpy(storage, str.data(), str.size());
-    storage[str.size()] = '\0';
-    return std::string_view(storage, str.size());
+  const std::string_view str_;
+};
+
+// Variable bound to a SymbolTable slot. Reads its value from the
+// EvaluationContext passed as Calculate data.
+class VariableToken : public Token {
+ public:
+  VariableToken(std::string_view name,
+                size_t slot,
+                StaticType type,
+                Allocator& allocator)
+      : name_{AllocateLiteralStorage(name, allocator)},
+        slot_{slot},
+        type_{type} {}
+
+  virtual Value Calculate(void* data) const override {
+    const auto& context = GetEvaluationContext(data);
+    if (context.values)
+      return context.values[slot_];
+    return context.numbers[slot_];
   }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const override {
+    callback(this, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    str.append(name_.data(), name_.size());
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    info.opcode = Opcode::Variable;
+    info.string = name_;
+    info.slot = slot_;
+    info.type = type_;
+    return true;
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    return CreateToken<VariableToken>(cloner.allocator(), name_, slot_, type_,
+                                      cloner.allocator());
+  }
+
+  std::string_view name() const { return name_; }
+  size_t slot() const { return slot_; }
+
+ private:
+  const std::string_view name_;
+  const size_t slot_;
+  const StaticType type_;
+};
+
+// Value of a subtree that only depends on literals, computed at parse time.
+// Formats and traverses as the subtree it was folded from.
+class ConstantToken : public Token {
+ public:
+  ConstantToken(const Value& value, const Token& source, Allocator& allocator)
+      : type_{value.type()},
+        number_{value.is_number() ? static_cast<double>(value) : 0.0},
+        str_{value.is_string()
+                 ? AllocateLiteralStorage(value.string_view(), allocator)
+                 : std::string_view{}},
+        source_{source} {}
+
+  virtual Value Calculate(void* /*data*/) const override {
+    return type_ == Value::Type::Number ? Value{number_} : Value{str_};
+  }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const override {
+    source_.Traverse(callback, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    source_.Format(delegate, str);
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    if (type_ == Value::Type::Number) {
+      info.opcode = Opcode::Number;
+      info.number = number_;
+    } else {
+      info.opcode = Opcode::String;
+      info.string = str_;
+    }
+    info.folded_source = &source_;
+    return true;
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    const Value value = type_ == Value::Type::Number ? Value{number_}
+                                                     : Value{str_};
+    return CreateToken<ConstantToken>(cloner.allocator(), value,
+                                      cloner.Clone(source_),
+                                      cloner.allocator());
+  }
+
+  const Token& source() const { return source_; }
+
+ private:
+  const Value::Type type_;
+  const double number_;
   const std::string_view str_;
+  const Token& source_;
 };
-
-template <class OperandToken>
-class BasicUnaryOperatorToken : public Token {
- public:
-  template <class U>
-  BasicUnaryOperatorToken(char oper, U&& operand)
-      : operator_{oper}, operand_{std::forward<U>(operand)} {}
-
-  virtual Value Calculate(void* data) const override {
-    auto val = operand_.Calculate(data);
-    switch (operator_) {
-      case '-':
-        val = -val;
-        break;
-      case '!':
-        val = !val;
-        break;
-      default:
-        assert(false);
-        break;
-    }
-    return val;
-  }
-
-  virtual void Traverse(TraverseCallback callback, void* param) const override {
-    callback(this, param);
-    operand_.Traverse(callback, param);
-  }
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const override {
-    str += operator_;
-    operand_.Format(delegate, str);
-  }
-
- private:
-  const char operator_;
-  const OperandToken operand_;
-};
-
-template <class OperandToken>
-class BasicBinaryOperatorToken : public Token {
- public:
-  template <class L, class R>
-  BasicBinaryOperatorToken(char oper, L&& left, R&& right)
-      : operator_{oper},
-        left_{std::forward<L>(left)},
-        right_{std::forward<R>(right)} {}
-
-  virtual Value Calculate(void* data) const override {
-    auto val = left_.Calculate(data);
-    auto rval = right_.Calculate(data);
-
-    switch (operator_) {
-      case '+':
-        val += rval;
-        break;
-      case '-':
-        val -= rval;
-        break;
-      case '*':
-        val *= rval;
-        break;
-      case '/':
-        val /= rval;
-        break;
-      case '^':
-        val = pow((double)val, (double)rval);
-        break;
-      case '=':
-        val = val == rval;
-        break;
-      case '<':
-        val = val < rval;
-        break;
-      case '>':
-        val = val > rval;
-        break;
-      case 'l':
-        val = val <= rval;
-        break;
-      case 'g':
-        val = val >= rval;
-        break;
-      default:
-        assert(false);
-        break;
-    }
-
-    return val;
-  }
-
-  virtual void Traverse(TraverseCallback callback, void* param) const override {
-    callback(this, param);
-    left_.Traverse(callback, param);
-    right_.Traverse(callback, param);
-  }
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const override {
-    left_.Format(delegate, str);
-    str += ' ';
-    switch (operator_) {
-      case 'l':
-        str += "<=";
-        break;
-      case 'g':
-        str += ">=";
-        break;
-      default:
-        str += operator_;
-        break;
-    }
-    str += ' ';
-    right_.Format(delegate, str);
-  }
-
- private:
-  const char operator_;
-  const OperandToken left_;
-  const OperandToken right_;
-};
-
-template <class NestedToken>
-class ParenthesesToken : public Token {
- public:
-  template <class U>
-  explicit ParenthesesToken(U&& nested_token)
-      : nested_token_{std::forward<U>(nested_token)} {}
-
-  virtual Value Calculate(void* data) const override {
-    return nested_token_.Calculate(data);
-  }
-
-  virtual void Traverse(TraverseCallback callback, void* param) const override {
-    callback(this, param);
-    nested_token_.Traverse(callback, param);
-  }
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const override {
-    str += '(';
-    nested_token_.Format(delegate, str);
-    str += ')';
-  }
-
- private:
-  const NestedToken nested_token_;
-};
-
-template <class T, class V>
-inline Token* CreateValueToken(Allocator& allocator, V&& value) {
-  return CreateToken<ValueToken<T>>(allocator, std::forward<V>(value));
-}
-
-template <class T, class V>
-inline PolymorphicToken MakePolymorphicValueToken(Allocator& allocator,
-                                                  V&& value) {
-  return PolymorphicToken{
-      *CreateValueToken<T>(allocator, std::forward<V>(value))};
-}
-
-}  // namespace expression
+
+template <class OperandToken>
+class BasicUnaryOperatorToken : public Token {
+ public:
+  template <class U>
+  BasicUnaryOperatorToken(char oper, U&& operand)
+      : operator_{oper}, operand_{std::forward<U>(operand)} {}
+
+  virtual Value Calculate(void* data) const override {
+    auto val = operand_.Calculate(data);
+    switch (operator_) {
+      case '-':
+        val = -val;
+        break;
+      case '!':
+        val = !val;
+        break;
+      default:
+        assert(false);
+        break;
+    }
+    return val;
+  }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const override {
+    callback(this, param);
+    operand_.Traverse(callback, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    str += operator_;
+    operand_.Format(delegate, str);
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    return DescribeToken(info, GetUnaryOperatorOpcode(operator_), operand_);
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    if constexpr (HasTokenAccessor<OperandToken>::value) {
+      return CreateToken<BasicUnaryOperatorToken>(
+          cloner.allocator(), operator_, cloner.Clone(operand_));
+    } else {
+      return nullptr;
+    }
+  }
+
+ private:
+  const char operator_;
+  const OperandToken operand_;
+};
+
+template <class OperandToken>
+class BasicBinaryOperatorToken : public Token {
+ public:
+  template <class L, class R>
+  BasicBinaryOperatorToken(char oper, L&& left, R&& right)
+      : operator_{oper},
+        left_{std::forward<L>(left)},
+        right_{std::forward<R>(right)} {}
+
+  virtual Value Calculate(void* data) const override {
+    auto val = left_.Calculate(data);
+    auto rval = right_.Calculate(data);
+
+    switch (operator_) {
+      case '+':
+        val += rval;
+        break;
+      case '-':
+        val -= rval;
+        break;
+      case '*':
+        val *= rval;
+        break;
+      case '/':
+        val /= rval;
+        break;
+      case '^':
+        val = pow((double)val, (double)rval);
+        break;
+      case '=':
+        val = val == rval;
+        break;
+      case '<':
+        val = val < rval;
+        break;
+      case '>':
+        val = val > rval;
+        break;
+      case 'l':
+        val = val <= rval;
+        break;
+      case 'g':
+        val = val >= rval;
+        break;
+      default:
+        assert(false);
+        break;
+    }
+
+    return val;
+  }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const override {
+    callback(this, param);
+    left_.Traverse(callback, param);
+    right_.Traverse(callback, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    left_.Format(delegate, str);
+    str += ' ';
+    switch (operator_) {
+      case 'l':
+        str += "<=";
+        break;
+      case 'g':
+        str += ">=";
+        break;
+      default:
+        str += operator_;
+        break;
+    }
+    str += ' ';
+    right_.Format(delegate, str);
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    return DescribeToken(info, GetBinaryOperatorOpcode(operator_), left_,
+                         right_);
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    if constexpr (HasTokenAccessor<OperandToken>::value) {
+      return CreateToken<BasicBinaryOperatorToken>(
+          cloner.allocator(), operator_, cloner.Clone(left_),
+          cloner.Clone(right_));
+    } else {
+      return nullptr;
+    }
+  }
+
+ private:
+  const char operator_;
+  const OperandToken left_;
+  const OperandToken right_;
+};
+
+template <class NestedToken>
+class ParenthesesToken : public Token {
+ public:
+  template <class U>
+  explicit ParenthesesToken(U&& nested_token)
+      : nested_token_{std::forward<U>(nested_token)} {}
+
+  virtual Value Calculate(void* data) const override {
+    return nested_token_.Calculate(data);
+  }
+
+  virtual void Traverse(TraverseCallback callback, void* param) const override {
+    callback(this, param);
+    nested_token_.Traverse(callback, param);
+  }
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    str += '(';
+    nested_token_.Format(delegate, str);
+    str += ')';
+  }
+
+  virtual bool Describe(TokenInfo& info) const override {
+    return DescribeToken(info, Opcode::Parentheses, nested_token_);
+  }
+
+  virtual const Token* Clone(TokenCloner& cloner) const override {
+    if constexpr (HasTokenAccessor<NestedToken>::value) {
+      return CreateToken<ParenthesesToken>(cloner.allocator(),
+                                           cloner.Clone(nested_token_));
+    } else {
+      return nullptr;
+    }
+  }
+
+ private:
+  const NestedToken nested_token_;
+};
+
+template <class T, class V>
+inline Token* CreateValueToken(Allocator& allocator, V&& value) {
+  return CreateToken<ValueToken<T>>(allocator, std::forward<V>(value));
+}
+
+template <class T, class V>
+inline PolymorphicToken MakePolymorphicValueToken(Allocator& allocator,
+                                                  V&& value) {
+  return PolymorphicToken{
+      *CreateValueToken<T>(allocator, std::forward<V>(value))};
+}
+
+}  // namespace expression
@@ -0,0 +1,541 @@
+#pragma once
+
+#include "express/lexem.h"
+#include "express/token_info.h"
+#include "express/value.h"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+namespace expression {
+
+namespace static_parsing {
+
+// Standard functions with a single or two number arguments.
+enum class StaticFunction : unsigned char {
+  None,
+  Abs,
+  Not,
+  Sign,
+  Sqrt,
+  Sin,
+  Cos,
+  Tan,
+  ASin,
+  ACos,
+  ATan,
+  ATan2,
+  BitXor,
+};
+
+struct StaticFunctionInfo {
+  std::string_view name;
+  // -1 for functions taking any positive number of arguments.
+  int params;
+  Opcode opcode;
+  StaticFunction function;
+};
+
+// Same names and parameters as functions::FindDefaultFunction.
+constexpr StaticFunctionInfo kStaticFunctions[] = {
+    {"Or", -1, Opcode::Or, StaticFunction::None},
+    {"And", -1, Opcode::And, StaticFunction::None},
+    {"Min", -1, Opcode::Min, StaticFunction::None},
+    {"Max", -1, Opcode::Max, StaticFunction::None},
+    {"Abs", 1, Opcode::Function1, StaticFunction::Abs},
+    {"Not", 1, Opcode::Function1, StaticFunction::Not},
+    {"Sign", 1, Opcode::Function1, StaticFunction::Sign},
+    {"Sqrt", 1, Opcode::Function1, StaticFunction::Sqrt},
+    {"Sin", 1, Opcode::Function1, StaticFunction::Sin},
+    {"Cos", 1, Opcode::Function1, StaticFunction::Cos},
+    {"Tan", 1, Opcode::Function1, StaticFunction::Tan},
+    {"ASin", 1, Opcode::Function1, StaticFunction::ASin},
+    {"ACos", 1, Opcode::Function1, StaticFunction::ACos},
+    {"ATan", 1, Opcode::Function1, StaticFunction::ATan},
+    {"ATan2", 2, Opcode::Function2, StaticFunction::ATan2},
+    {"BitXor", 2, Opcode::Function2, StaticFunction::BitXor},
+    {"If", 3, Opcode::If, StaticFunction::None},
+};
+
+struct StaticNode {
+  Opcode opcode = Opcode::Number;
+  StaticFunction function = StaticFunction::None;
+  double number = 0;
+  size_t slot = 0;
+  std::array<size_t, 3> operands{};
+};
+
+// Nodes in post order, so the root is the last node. Variables are numbered
+// in the order they first appear.
+template <size_t N>
+struct StaticTree {
+  std::array<StaticNode, N> nodes{};
+  size_t node_count = 0;
+  std::array<std::string_view, N> variables{};
+  size_t variable_count = 0;
+};
+
+constexpr bool IsAlpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+constexpr bool IsAlnum(char c) {
+  return IsAlpha(c) || (c >= '0' && c <= '9');
+}
+
+constexpr char ToLower(char c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool EqualsNoCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (ToLower(a[i]) != ToLower(b[i]))
+      return false;
+  }
+  return true;
+}
+
+// Compile-time counterpart of Lexer and BasicParser with the standard parser
+// delegate. Every node consumes at least one character of the formula, so N
+// nodes are enough for a formula of fewer than N characters. Errors throw,
+// which fails constant evaluation at the offending check.
+template <size_t N>
+class StaticParser {
+ public:
+  constexpr explicit StaticParser(std::string_view buf) : buf_{buf} {}
+
+  constexpr StaticTree<N> Parse() {
+    ReadLexem();
+    MakeBinaryOperator(0);
+    if (next_lexem_.lexem != LEX_END)
+      throw std::runtime_error{"End of expression is expected"};
+    return tree_;
+  }
+
+ private:
+  struct StaticLexem {
+    LexemType lexem = LEX_END;
+    int type = 0;
+    int priority = 0;
+    double number = 0;
+    std::string_view string;
+  };
+
+  constexpr char Peek() const { return pos_ < buf_.size() ? buf_[pos_] : '\0'; }
+
+  constexpr void ReadLexem() { next_lexem_ = ReadNextLexem(); }
+
+  constexpr StaticLexem ReadNextLexem() {
+    StaticLexem lexem;
+    for (;;) {
+      const char c = Peek();
+      switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+          ++pos_;
+          continue;
+        case '\0':
+          return lexem;
+        case '(':
+        case ')':
+        case ',':
+          ++pos_;
+          lexem.lexem = static_cast<LexemType>(c);
+          return lexem;
+        case '!':
+          ++pos_;
+          lexem.lexem = static_cast<LexemType>(c);
+          lexem.type = OPER_UNA;
+          return lexem;
+        case '=':
+        case '>':
+        case '<':
+          ++pos_;
+          lexem.lexem = static_cast<LexemType>(c);
+          lexem.type = OPER_BIN;
+          if (c != '=' && Peek() == '=') {
+            lexem.lexem = c == '>' ? LEX_GE : LEX_LE;
+            ++pos_;
+          }
+          return lexem;
+        case '-':
+        case '+':
+        case '*':
+        case '/':
+        case '^':
+          ++pos_;
+          lexem.lexem = static_cast<LexemType>(c);
+          lexem.type = c == '-' ? OPER_BIN | OPER_UNA : OPER_BIN;
+          lexem.priority = c == '^' ? 3 : c == '*' || c == '/' ? 2 : 1;
+          return lexem;
+        case '"':
+          throw std::runtime_error{"static expressions are numeric"};
+        default:
+          if (ReadNumber(lexem) || ReadStandardName(lexem))
+            return lexem;
+          throw std::runtime_error{"Wrong lexem"};
+      }
+    }
+  }
+
+  // Same arithmetic as Lexer::ReadNumber, so literals get the same bits.
+  constexpr bool ReadNumber(StaticLexem& lexem) {
+    bool res = false;
+    double num = 0;
+    double exp = 0;
+    for (;; ++pos_) {
+      const char c = Peek();
+      if (c == '.') {
+        if (exp)
+          throw std::runtime_error{"bad number"};
+        exp = 1;
+      } else {
+        const int digit = int(c) - int('0');
+        if (digit < 0 || digit > 9)
+          break;
+        num = num * 10 + digit;
+        exp *= 10;
+        res = true;
+      }
+    }
+    if (!res)
+      return false;
+
+    lexem.lexem = LEX_DBL;
+    lexem.number = exp ? num / exp : num;
+    return true;
+  }
+
+  constexpr bool ReadStandardName(StaticLexem& lexem) {
+    if (!IsAlpha(Peek()))
+      return false;
+
+    const size_t start = pos_;
+    do {
+      ++pos_;
+    } while (IsAlnum(Peek()));
+    lexem.lexem = LEX_NAME;
+    lexem.string = buf_.substr(start, pos_ - start);
+    return true;
+  }
+
+  constexpr size_t AddNode(const StaticNode& node) {
+    tree_.nodes[tree_.node_count] = node;
+    return tree_.node_count++;
+  }
+
+  constexpr size_t AddOperator(Opcode opcode, size_t left, size_t right) {
+    StaticNode node;
+    node.opcode = opcode;
+    node.operands = {left, right, 0};
+    return AddNode(node);
+  }
+
+  constexpr size_t MakePrimaryToken() {
+    const StaticLexem lexem = next_lexem_;
+    ReadLexem();
+
+    if (lexem.type & OPER_UNA) {
+      StaticNode node;
+      node.opcode = GetUnaryOperatorOpcode(static_cast<char>(lexem.lexem));
+      node.operands[0] = MakePrimaryToken();
+      return AddNode(node);
+    }
+
+    switch (lexem.lexem) {
+      case LEX_NAME:
+        if (next_lexem_.lexem == LEX_LP)
+          return MakeFunctionToken(lexem.string);
+        return MakeVariableToken(lexem.string);
+      case LEX_DBL: {
+        StaticNode node;
+        node.number = lexem.number;
+        return AddNode(node);
+      }
+      case LEX_LP: {
+        // Parentheses only group; they evaluate to the nested value.
+        const size_t nested = MakeBinaryOperator(0);
+        if (next_lexem_.lexem != LEX_RP)
+          throw std::runtime_error{"missing ')'"};
+        ReadLexem();
+        return nested;
+      }
+    }
+
+    throw std::runtime_error{"unexpected token"};
+  }
+
+  constexpr size_t MakeBinaryOperator(int priority) {
+    size_t left = MakePrimaryToken();
+    while (next_lexem_.type & OPER_BIN && next_lexem_.priority >= priority) {
+      const char oper = static_cast<char>(next_lexem_.lexem);
+      const int priority2 = next_lexem_.priority;
+      ReadLexem();
+      const size_t right = MakeBinaryOperator(priority2 + 1);
+      left = AddOperator(GetBinaryOperatorOpcode(oper), left, right);
+    }
+    return left;
+  }
+
+  constexpr size_t MakeVariableToken(std::string_view name) {
+    StaticNode node;
+    node.opcode = Opcode::Variable;
+    while (node.slot < tree_.variable_count &&
+           tree_.variables[node.slot] != name) {
+      ++node.slot;
+    }
+    if (node.slot == tree_.variable_count)
+      tree_.variables[tree_.variable_count++] = name;
+    return AddNode(node);
+  }
+
+  constexpr size_t MakeFunctionToken(std::string_view name) {
+    const StaticFunctionInfo* function = nullptr;
+    for (const auto& info : kStaticFunctions) {
+      if (EqualsNoCase(info.name, name)) {
+        function = &info;
+        break;
+      }
+    }
+    if (!function)
+      throw std::runtime_error{"function was not found"};
+
+    // Arguments are kept on a stack shared by nested calls.
+    const size_t first = argument_count_;
+    ReadLexem();
+    if (next_lexem_.lexem != LEX_RP) {
+      for (;;) {
+        const size_t argument = MakeBinaryOperator(0);
+        arguments_[argument_count_++] = argument;
+        if (next_lexem_.lexem != LEX_COMMA)
+          break;
+        ReadLexem();
+      }
+      if (next_lexem_.lexem != LEX_RP)
+        throw std::runtime_error{"missing ')'"};
+    }
+    ReadLexem();
+
+    const size_t count = argument_count_ - first;
+    const size_t* arguments = &arguments_[first];
+    argument_count_ = first;
+    if (function->params != -1 &&
+        static_cast<size_t>(function->params) != count) {
+      throw std::runtime_error{"parameters expected"};
+    }
+    if (count == 0)
+      throw std::runtime_error{"no parameters provided"};
+
+    if (function->params == -1) {
+      // Folded like BasicBinaryFoldFunction: a single argument is the value
+      // itself, And and Or nest to the right, Min and Max to the left.
+      if (count == 1)
+        return arguments[0];
+      if (function->opcode == Opcode::And || function->opcode == Opcode::Or) {
+        size_t folded = AddOperator(function->opcode, arguments[count - 2],
+                                    arguments[count - 1]);
+        for (size_t i = count - 2; i-- > 0;)
+          folded = AddOperator(function->opcode, arguments[i], folded);
+        return folded;
+      }
+      size_t folded = AddOperator(function->opcode, arguments[0], arguments[1]);
+      for (size_t i = 2; i < count; ++i)
+        folded = AddOperator(function->opcode, folded, arguments[i]);
+      return folded;
+    }
+
+    StaticNode node;
+    node.opcode = function->opcode;
+    node.function = function->function;
+    for (size_t i = 0; i < count; ++i)
+      node.operands[i] = arguments[i];
+    return AddNode(node);
+  }
+
+  std::string_view buf_;
+  size_t pos_ = 0;
+  StaticLexem next_lexem_;
+  StaticTree<N> tree_;
+  std::array<size_t, N> arguments_{};
+  size_t argument_count_ = 0;
+};
+
+// |x| for comparisons with Value::kPrecision; usable in constant
+// expressions, unlike std::fabs.
+constexpr double Magnitude(double x) {
+  return x < 0 ? -x : x;
+}
+
+constexpr bool IsTrue(double x) {
+  return Magnitude(x) >= Value::kPrecision;
+}
+
+constexpr double FromBool(bool b) {
+  return b ? 1.0 : 0.0;
+}
+
+}  // namespace static_parsing
+
+// Formula parsed at compile time. |Source| provides the formula through
+// `static constexpr std::string_view text()`; EXPRESS_STATIC_EXPRESSION
+// makes one for a string literal.
+//
+// The syntax and standard functions are those of the runtime parser and the
+// results those of Program::CalculateNumber, with every node inlined into
+// Calculate. Formulas are numeric: string literals fail to compile.
+// Variables are numbered in the order they first appear and read from
+// Calculate's |numbers|. Formulas without transcendental functions can be
+// calculated in constant expressions.
+template <class Source>
+class StaticExpression {
+ public:
+  static constexpr std::string_view text() { return Source::text(); }
+
+  static constexpr size_t variable_count() { return kTree.variable_count; }
+
+  static constexpr std::string_view variable_name(size_t slot) {
+    return kTree.variables[slot];
+  }
+
+  static constexpr std::optional<size_t> Find(std::string_view name) {
+    for (size_t slot = 0; slot < kTree.variable_count; ++slot) {
+      if (kTree.variables[slot] == name)
+        return slot;
+    }
+    return std::nullopt;
+  }
+
+  constexpr double Calculate(const double* numbers = nullptr) const {
+    return Evaluate<kTree.node_count - 1>(numbers);
+  }
+
+ private:
+  using Opcode = expression::Opcode;
+  using StaticFunction = static_parsing::StaticFunction;
+
+  static constexpr auto kTree =
+      static_parsing::StaticParser<Source::text().size() + 1>{Source::text()}
+          .Parse();
+
+  template <size_t I>
+  static constexpr double Evaluate(const double* numbers) {
+    using namespace static_parsing;
+    constexpr StaticNode node = kTree.nodes[I];
+    constexpr size_t a = node.operands[0];
+    constexpr size_t b = node.operands[1];
+
+    if constexpr (node.opcode == Opcode::Number) {
+      return node.number;
+    } else if constexpr (node.opcode == Opcode::Variable) {
+      return numbers[node.slot];
+    } else if constexpr (node.opcode == Opcode::Negate) {
+      return -Evaluate<a>(numbers);
+    } else if constexpr (node.opcode == Opcode::Not) {
+      return FromBool(!IsTrue(Evaluate<a>(numbers)));
+    } else if constexpr (node.opcode == Opcode::Add) {
+      return Evaluate<a>(numbers) + Evaluate<b>(numbers);
+    } else if constexpr (node.opcode == Opcode::Subtract) {
+      return Evaluate<a>(numbers) - Evaluate<b>(numbers);
+    } else if constexpr (node.opcode == Opcode::Multiply) {
+      return Evaluate<a>(numbers) * Evaluate<b>(numbers);
+    } else if constexpr (node.opcode == Opcode::Divide) {
+      return Evaluate<a>(numbers) / Evaluate<b>(numbers);
+    } else if constexpr (node.opcode == Opcode::Power) {
+      return std::pow(Evaluate<a>(numbers), Evaluate<b>(numbers));
+    } else if constexpr (node.opcode == Opcode::Equal) {
+      return FromBool(Magnitude(Evaluate<a>(numbers) - Evaluate<b>(numbers)) <
+                      Value::kPrecision);
+    } else if constexpr (node.opcode == Opcode::Less) {
+      return FromBool(Evaluate<a>(numbers) < Evaluate<b>(numbers));
+    } else if constexpr (node.opcode == Opcode::Greater) {
+      return FromBool(Evaluate<b>(numbers) < Evaluate<a>(numbers));
+    } else if constexpr (node.opcode == Opcode::LessEqual) {
+      return FromBool(!(Evaluate<b>(numbers) < Evaluate<a>(numbers)));
+    } else if constexpr (node.opcode == Opcode::GreaterEqual) {
+      return FromBool(!(Evaluate<a>(numbers) < Evaluate<b>(numbers)));
+    } else if constexpr (node.opcode == Opcode::If) {
+      return IsTrue(Evaluate<a>(numbers)) ? Evaluate<b>(numbers)
+                                          : Evaluate<node.operands[2]>(numbers);
+    } else if constexpr (node.opcode == Opcode::And) {
+      return IsTrue(Evaluate<a>(numbers)) && IsTrue(Evaluate<b>(numbers))
+                 ? 1.0
+                 : 0.0;
+    } else if constexpr (node.opcode == Opcode::Or) {
+      return IsTrue(Evaluate<a>(numbers)) || IsTrue(Evaluate<b>(numbers))
+                 ? 1.0
+                 : 0.0;
+    } else if constexpr (node.opcode == Opcode::Min) {
+      const double left = Evaluate<a>(numbers);
+      const double right = Evaluate<b>(numbers);
+      return right < left ? right : left;
+    } else if constexpr (node.opcode == Opcode::Max) {
+      const double left = Evaluate<a>(numbers);
+      const double right = Evaluate<b>(numbers);
+      return left < right ? right : left;
+    } else if constexpr (node.opcode == Opcode::Function1) {
+      return Call<node.function>(Evaluate<a>(numbers));
+    } else {
+      static_assert(node.opcode == Opcode::Function2);
+      const double left = Evaluate<a>(numbers);
+      const double right = Evaluate<b>(numbers);
+      if constexpr (node.function == StaticFunction::ATan2) {
+        return std::atan2(left, right);
+      } else {
+        static_assert(node.function == StaticFunction::BitXor);
+        return FromBool((Magnitude(left) < Value::kPrecision) !=
+                        (Magnitude(right) < Value::kPrecision));
+      }
+    }
+  }
+
+  // Same results as the standard functions of standard_functions.h.
+  template <StaticFunction F>
+  static constexpr double Call(double x) {
+    using namespace static_parsing;
+    if constexpr (F == StaticFunction::Abs) {
+      return Magnitude(x);
+    } else if constexpr (F == StaticFunction::Not) {
+      return FromBool(Magnitude(x) < Value::kPrecision);
+    } else if constexpr (F == StaticFunction::Sign) {
+      return Magnitude(x) < Value::kPrecision ? 0.0 : x > 0.0 ? 1.0 : -1.0;
+    } else if constexpr (F == StaticFunction::Sqrt) {
+      return std::sqrt(x);
+    } else if constexpr (F == StaticFunction::Sin) {
+      return std::sin(x);
+    } else if constexpr (F == StaticFunction::Cos) {
+      return std::cos(x);
+    } else if constexpr (F == StaticFunction::Tan) {
+      return std::tan(x);
+    } else if constexpr (F == StaticFunction::ASin) {
+      return std::asin(x);
+    } else if constexpr (F == StaticFunction::ACos) {
+      return std::acos(x);
+    } else {
+      static_assert(F == StaticFunction::ATan);
+      return std::atan(x);
+    }
+  }
+};
+
+}  // namespace expression
+
+// Expression object for the formula string literal |formula|, parsed while
+// compiling:
+//
+//   constexpr auto area = EXPRESS_STATIC_EXPRESSION("width * height");
+//   double numbers[] = {2, 3};
+//   double value = area.Calculate(numbers);
+#define EXPRESS_STATIC_EXPRESSION(formula)                          \
+  ([] {                                                             \
+    struct Source {                                                 \
+      static constexpr std::string_view text() { return formula; } \
+    };                                                              \
+    return ::expression::StaticExpression<Source>{};                \
+  }())
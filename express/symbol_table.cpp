@@ -0,0 +1,37 @@
+#include "express/symbol_table.h"
+
+namespace expression {
+
+SymbolTable::SymbolTable() = default;
+
+SymbolTable::~SymbolTable() = default;
+
+SymbolTable::SymbolTable(SymbolTable&& source) noexcept = default;
+
+SymbolTable& SymbolTable::operator=(SymbolTable&& source) noexcept = default;
+
+size_t SymbolTable::Resolve(std::string_view name) {
+  if (auto slot = Find(name))
+    return *slot;
+
+  const size_t slot = symbols_.size();
+  auto& symbol = symbols_.emplace_back();
+  symbol.name = std::string{name};
+  slots_.emplace(symbol.name, slot);
+  return slot;
+}
+
+size_t SymbolTable::Declare(std::string_view name, StaticType type) {
+  const size_t slot = Resolve(name);
+  symbols_[slot].type = type;
+  return slot;
+}
+
+std::optional<size_t> SymbolTable::Find(std::string_view name) const {
+  auto i = slots_.find(name);
+  if (i == slots_.end())
+    return std::nullopt;
+  return i->second;
+}
+
+}  // namespace expression
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "express/express_export.h"
+#include "express/type_inference.h"
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace expression {
+
+// Dense numbering of the variables of one or more expressions. The parser
+// binds every name that is not a function to a slot, and evaluation reads the
+// variable from an EvaluationContext at that slot.
+class EXPRESS_EXPORT SymbolTable {
+ public:
+  SymbolTable();
+  ~SymbolTable();
+
+  SymbolTable(SymbolTable&& source) noexcept;
+  SymbolTable& operator=(SymbolTable&& source) noexcept;
+
+  SymbolTable(const SymbolTable&) = delete;
+  SymbolTable& operator=(const SymbolTable&) = delete;
+
+  // Returns the slot of |name|, adding the name with an unknown type.
+  size_t Resolve(std::string_view name);
+
+  // Adds |name| or changes its type. Variables declared as numbers let type
+  // inference keep expressions over them on the double-only path. The type
+  // is captured when an expression is parsed.
+  size_t Declare(std::string_view name, StaticType type);
+
+  std::optional<size_t> Find(std::string_view name) const;
+
+  size_t size() const { return symbols_.size(); }
+
+  std::string_view name(size_t slot) const { return symbols_[slot].name; }
+  StaticType type(size_t slot) const { return symbols_[slot].type; }
+
+ private:
+  struct Symbol {
+    std::string name;
+    StaticType type = StaticType::Unknown;
+  };
+
+  // Deque keeps the names in place for the views used as map keys.
+  std::deque<Symbol> symbols_;
+  std::unordered_map<std::string_view, size_t> slots_;
+};
+
+}  // namespace expression
@@ -0,0 +1,100 @@
+#include "express/thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+namespace expression {
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  threads_.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; ++i)
+    threads_.emplace_back([this] { Work(); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock{mutex_};
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+void ThreadPool::ParallelFor(size_t count,
+                             size_t grain,
+                             ParallelForCallback callback,
+                             void* param) {
+  if (count == 0)
+    return;
+
+  {
+    std::lock_guard lock{mutex_};
+    assert(!callback_);
+    callback_ = callback;
+    param_ = param;
+    count_ = count;
+    grain_ = std::max<size_t>(grain, 1);
+    next_.store(0, std::memory_order_relaxed);
+    error_ = nullptr;
+    ++active_;
+    ++generation_;
+  }
+  if (count > grain)
+    wake_.notify_all();
+
+  RunRanges();
+
+  std::exception_ptr error;
+  {
+    std::unique_lock lock{mutex_};
+    --active_;
+    done_.wait(lock, [this] { return active_ == 0; });
+    // Workers waking up after this point find no callback and go back to
+    // sleep.
+    callback_ = nullptr;
+    error = std::exchange(error_, nullptr);
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void ThreadPool::Work() {
+  uint64_t generation = 0;
+  std::unique_lock lock{mutex_};
+  for (;;) {
+    wake_.wait(lock,
+               [&] { return stopping_ || generation != generation_; });
+    if (stopping_)
+      return;
+    generation = generation_;
+    if (!callback_)
+      continue;
+
+    ++active_;
+    lock.unlock();
+    RunRanges();
+    lock.lock();
+    if (--active_ == 0)
+      done_.notify_all();
+  }
+}
+
+void ThreadPool::RunRanges() {
+  for (;;) {
+    const size_t begin = next_.fetch_add(grain_, std::memory_order_relaxed);
+    if (begin >= count_)
+      return;
+    try {
+      callback_(begin, std::min(begin + grain_, count_), param_);
+    } catch (...) {
+      std::lock_guard lock{mutex_};
+      if (!error_)
+        error_ = std::current_exception();
+      next_.store(count_, std::memory_order_relaxed);
+    }
+  }
+}
+
+}  // namespace expression
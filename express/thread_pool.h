@@ -0,0 +1,70 @@
+#pragma once
+
+#include "express/express_export.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace expression {
+
+using ParallelForCallback = void (*)(size_t begin, size_t end, void* param);
+
+// Fixed set of worker threads running one ParallelFor at a time.
+class EXPRESS_EXPORT ThreadPool {
+ public:
+  // Starts |thread_count| workers. The thread calling ParallelFor works too.
+  explicit ThreadPool(size_t thread_count);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t thread_count() const { return threads_.size(); }
+
+  // Calls |callback| on consecutive ranges of at most |grain| indices
+  // covering [0, count) and returns once every call finished. Rethrows the
+  // first exception thrown by a callback; ranges not started yet are
+  // skipped.
+  void ParallelFor(size_t count,
+                   size_t grain,
+                   ParallelForCallback callback,
+                   void* param);
+
+  template <class Body>
+  void ParallelFor(size_t count, size_t grain, const Body& body) {
+    ParallelFor(
+        count, grain,
+        [](size_t begin, size_t end, void* param) {
+          (*static_cast<const Body*>(param))(begin, end);
+        },
+        const_cast<Body*>(&body));
+  }
+
+ private:
+  void Work();
+  void RunRanges();
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+
+  // Current ParallelFor, published under |mutex_|.
+  ParallelForCallback callback_ = nullptr;
+  void* param_ = nullptr;
+  size_t count_ = 0;
+  size_t grain_ = 1;
+  std::atomic<size_t> next_{0};
+  uint64_t generation_ = 0;
+  size_t active_ = 0;
+  std::exception_ptr error_;
+  bool stopping_ = false;
+};
+
+}  // namespace expression
@@ -1,28 +1,44 @@
-#pragma once
-
-#include "express/allocator.h"
-#include "express/formatter_delegate.h"
-#include "express/value.h"
-
-#include <string>
-
-namespace expression {
-
-class Allocator;
-class Token;
-
-using TraverseCallback = bool (*)(const Token* token, void* param);
-
-class EXPRESS_EXPORT Token {
- public:
-  virtual Value Calculate(void* data) const = 0;
-
-  virtual void Traverse(TraverseCallback callback, void* param) const = 0;
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const = 0;
-};
-
+#pragma once
+
+#include "express/allocator.h"
+#include "express/formatter_delegate.h"
+#include "express/token_info.h"
+#include "express/value.h"
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+namespace expression {
+
+class Allocator;
+class Token;
+class TokenCloner;
+
+using TraverseCallback = bool (*)(const Token* token, void* param);
+
+class EXPRESS_EXPORT Token {
+ public:
+  virtual Value Calculate(void* data) const = 0;
+
+  virtual void Traverse(TraverseCallback callback, void* param) const = 0;
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const = 0;
+
+  // Describes the token structure for compilers and analyzers. Returns false
+  // for tokens that can only be evaluated through Calculate.
+  virtual bool Describe(TokenInfo& /*info*/) const { return false; }
+
+  // Copies the token into the cloner allocator with operands cloned through
+  // |cloner|. Returns null for tokens that cannot be cloned.
+  virtual const Token* Clone(TokenCloner& /*cloner*/) const {
+    return nullptr;
+  }
+};
+
 class PolymorphicToken {
  public:
   PolymorphicToken() = default;
@@ -32,39 +48,94 @@ class PolymorphicToken {
   PolymorphicToken& operator=(const PolymorphicToken&) = default;
   PolymorphicToken(PolymorphicToken&&) = default;
   PolymorphicToken& operator=(PolymorphicToken&&) = default;
-
-  const Token* token() const { return token_; }
-
-  Value Calculate(void* data) const {
-    assert(token_);
-    return token_->Calculate(data);
-  }
-
-  void Traverse(TraverseCallback callback, void* param) const {
-    assert(token_);
-    return token_->Traverse(callback, param);
-  }
-
-  void Format(const FormatterDelegate& delegate, std::string& str) const {
-    assert(token_);
-    return token_->Format(delegate, str);
-  }
-
- private:
-  const Token* token_ = nullptr;
-};
-
+
+  const Token* token() const { return token_; }
+
+  Value Calculate(void* data) const {
+    assert(token_);
+    return token_->Calculate(data);
+  }
+
+  void Traverse(TraverseCallback callback, void* param) const {
+    assert(token_);
+    return token_->Traverse(callback, param);
+  }
+
+  void Format(const FormatterDelegate& delegate, std::string& str) const {
+    assert(token_);
+    return token_->Format(delegate, str);
+  }
+
+ private:
+  const Token* token_ = nullptr;
+};
+
+template <class BasicToken, class = void>
+struct HasTokenAccessor : std::false_type {};
+
+template <class BasicToken>
+struct HasTokenAccessor<
+    BasicToken,
+    std::void_t<decltype(std::declval<const BasicToken&>().token())>>
+    : std::true_type {};
+
+// Fills |info| with |opcode| and the tokens behind |operands|. Fails when the
+// operand type does not expose its token.
+template <class... Operands>
+inline bool DescribeToken(TokenInfo& info,
+                          Opcode opcode,
+                          const Operands&... operands) {
+  if constexpr ((HasTokenAccessor<Operands>::value && ...)) {
+    info.opcode = opcode;
+    info.operands = {operands.token()...};
+    info.operand_count = sizeof...(Operands);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+// Copies token trees into another allocator without parsing. Every token is
+// copied once, so subtrees shared by the parser stay shared in the copy.
+// Operands are copied before the tokens using them with an explicit stack,
+// so trees of any depth are copied without recursion.
+class EXPRESS_EXPORT TokenCloner {
+ public:
+  explicit TokenCloner(Allocator& allocator) : allocator_{allocator} {}
+
+  TokenCloner(const TokenCloner&) = delete;
+  TokenCloner& operator=(const TokenCloner&) = delete;
+
+  Allocator& allocator() const { return allocator_; }
+
+  // Throws std::runtime_error if a token cannot be cloned, and
+  // BudgetExceededError if the allocator runs out of its byte limit.
+  const Token& Clone(const Token& token);
+
+  template <class BasicToken>
+  BasicToken Clone(const BasicToken& token) {
+    static_assert(HasTokenAccessor<BasicToken>::value);
+    return BasicToken{&Clone(*token.token())};
+  }
+
+ private:
+  const Token& CloneToken(const Token& token);
+
+  Allocator& allocator_;
+  std::unordered_map<const Token*, const Token*> clones_;
+};
+
 template <class T, class... Args>
 inline Token* CreateToken(Allocator& allocator, Args&&... args) {
   auto* data = allocator.allocate(sizeof(T), alignof(T));
   return new (data) T(std::forward<Args>(args)...);
 }
-
-template <class T, class... Args>
-inline PolymorphicToken MakePolymorphicToken(Allocator& allocator,
-                                             Args&&... args) {
-  return PolymorphicToken{
-      CreateToken<T>(allocator, std::forward<Args>(args)...)};
-}
-
+
+template <class T, class... Args>
+inline PolymorphicToken MakePolymorphicToken(Allocator& allocator,
+                                             Args&&... args) {
+  return PolymorphicToken{
+      CreateToken<T>(allocator, std::forward<Args>(args)...)};
+}
+
 }  // namespace expression
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "express/type_inference.h"
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <string_view>
+
+namespace expression {
+
+class Token;
+
+// Operation performed by a standard token. Custom tokens do not have an
+// opcode and are only reachable through Token::Calculate.
+enum class Opcode : unsigned char {
+  Number,
+  String,
+  Variable,
+  Negate,
+  Not,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Equal,
+  Less,
+  Greater,
+  LessEqual,
+  GreaterEqual,
+  Parentheses,
+  If,
+  And,
+  Or,
+  Min,
+  Max,
+  Function1,
+  Function2,
+};
+
+// Structural description of a token filled by Token::Describe. Folded
+// functions (And, Or, Min, Max) describe a single argument call with one
+// operand, which evaluates to the argument itself.
+struct TokenInfo {
+  Opcode opcode = Opcode::Number;
+  double number = 0;
+  // String literal or function name.
+  std::string_view string;
+  double (*function1)(double) = nullptr;
+  double (*function2)(double, double) = nullptr;
+  std::array<const Token*, 3> operands{};
+  size_t operand_count = 0;
+  // Symbol table slot and declared type of a variable.
+  size_t slot = 0;
+  StaticType type = StaticType::Unknown;
+  // Subtree a folded constant was computed from, which Format and Traverse
+  // reproduce.
+  const Token* folded_source = nullptr;
+};
+
+constexpr Opcode GetBinaryOperatorOpcode(char oper) {
+  switch (oper) {
+    case '+':
+      return Opcode::Add;
+    case '-':
+      return Opcode::Subtract;
+    case '*':
+      return Opcode::Multiply;
+    case '/':
+      return Opcode::Divide;
+    case '^':
+      return Opcode::Power;
+    case '=':
+      return Opcode::Equal;
+    case '<':
+      return Opcode::Less;
+    case '>':
+      return Opcode::Greater;
+    case 'l':
+      return Opcode::LessEqual;
+    case 'g':
+      return Opcode::GreaterEqual;
+    default:
+      assert(false);
+      return Opcode::Add;
+  }
+}
+
+constexpr Opcode GetUnaryOperatorOpcode(char oper) {
+  assert(oper == '-' || oper == '!');
+  return oper == '-' ? Opcode::Negate : Opcode::Not;
+}
+
+// Inverse of GetBinaryOperatorOpcode and GetUnaryOperatorOpcode.
+constexpr char GetOperatorChar(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::Negate:
+    case Opcode::Subtract:
+      return '-';
+    case Opcode::Not:
+      return '!';
+    case Opcode::Add:
+      return '+';
+    case Opcode::Multiply:
+      return '*';
+    case Opcode::Divide:
+      return '/';
+    case Opcode::Power:
+      return '^';
+    case Opcode::Equal:
+      return '=';
+    case Opcode::Less:
+      return '<';
+    case Opcode::Greater:
+      return '>';
+    case Opcode::LessEqual:
+      return 'l';
+    case Opcode::GreaterEqual:
+      return 'g';
+    default:
+      assert(false);
+      return 0;
+  }
+}
+
+}  // namespace expression
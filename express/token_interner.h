@@ -0,0 +1,84 @@
+#pragma once
+
+#include "express/token_info.h"
+
+#include <cstddef>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace expression {
+
+class Token;
+
+// Structural identity of a standard token. Operands are interned before
+// their parents, so comparing them by address compares whole subtrees.
+struct SubtreeKey {
+  SubtreeKey() = default;
+
+  // Operands are stored in |resource|.
+  explicit SubtreeKey(std::pmr::memory_resource* resource)
+      : operands{resource} {}
+
+  Opcode opcode = Opcode::Number;
+  double number = 0;
+  std::string_view string;
+  // Function the token was made by, null for operators and literals.
+  const void* function = nullptr;
+  std::pmr::vector<const Token*> operands;
+
+  bool operator==(const SubtreeKey& other) const {
+    return opcode == other.opcode && number == other.number &&
+           string == other.string && function == other.function &&
+           operands == other.operands;
+  }
+};
+
+struct SubtreeKeyHash {
+  size_t operator()(const SubtreeKey& key) const {
+    size_t hash = std::hash<unsigned char>{}(
+        static_cast<unsigned char>(key.opcode));
+    Combine(hash, std::hash<double>{}(key.number));
+    Combine(hash, std::hash<std::string_view>{}(key.string));
+    Combine(hash, std::hash<const void*>{}(key.function));
+    for (const Token* operand : key.operands)
+      Combine(hash, std::hash<const void*>{}(operand));
+    return hash;
+  }
+
+  static void Combine(size_t& hash, size_t value) {
+    hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+};
+
+// Hash-consing table used while parsing. Maps the structure of every pure
+// token made so far to the token, so identical subtrees of one expression
+// share a single node in the arena. The table is stored in |resource|.
+template <class BasicToken>
+class BasicTokenInterner {
+ public:
+  explicit BasicTokenInterner(std::pmr::memory_resource* resource =
+                                  std::pmr::get_default_resource())
+      : tokens_{resource} {}
+
+  std::optional<BasicToken> Find(const SubtreeKey& key) const {
+    auto i = tokens_.find(key);
+    if (i == tokens_.end())
+      return std::nullopt;
+    return i->second;
+  }
+
+  void Insert(SubtreeKey key, const BasicToken& token) {
+    tokens_.emplace(std::move(key), token);
+  }
+
+  size_t size() const { return tokens_.size(); }
+
+ private:
+  std::pmr::unordered_map<SubtreeKey, BasicToken, SubtreeKeyHash> tokens_;
+};
+
+}  // namespace expression
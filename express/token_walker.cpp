@@ -0,0 +1,222 @@
+#include "express/token_walker.h"
+
+#include <stdexcept>
+
+namespace expression {
+
+namespace {
+
+bool IsFold(Opcode opcode) {
+  return opcode == Opcode::And || opcode == Opcode::Or ||
+         opcode == Opcode::Min || opcode == Opcode::Max;
+}
+
+class Formatter {
+ public:
+  Formatter(const FormatterDelegate& delegate, std::string& str)
+      : delegate_{delegate}, str_{str} {}
+
+  bool Enter(const Token& token, TokenInfo& info, bool described) {
+    // Literals have no operands to walk.
+    if (!described || (info.operand_count == 0 && !info.folded_source)) {
+      token.Format(delegate_, str_);
+      return false;
+    }
+
+    Group group;
+    group.opcode = info.opcode;
+    group.name = info.string.data();
+    group.operand_count = info.operand_count;
+    // Folded constants format as the subtree they were folded from.
+    if (info.folded_source) {
+      info.operands[0] = info.folded_source;
+      info.operand_count = 1;
+      group.kind = Group::Kind::Constant;
+      groups_.push_back(group);
+      return true;
+    }
+
+    // Arguments that are two-argument folds of the same function are listed
+    // inline, as the fold tokens format them.
+    if (IsFold(info.opcode) && info.operand_count == 2 && !groups_.empty()) {
+      const Group& parent = groups_.back();
+      if (parent.kind != Group::Kind::Constant &&
+          parent.opcode == info.opcode && parent.operand_count == 2 &&
+          parent.name == group.name) {
+        group.kind = Group::Kind::Inline;
+        groups_.push_back(group);
+        return true;
+      }
+    }
+
+    switch (info.opcode) {
+      case Opcode::Negate:
+      case Opcode::Not:
+        str_ += GetOperatorChar(info.opcode);
+        break;
+      case Opcode::Parentheses:
+        str_ += '(';
+        group.kind = Group::Kind::Call;
+        break;
+      case Opcode::If:
+        str_ += "If(";
+        group.kind = Group::Kind::Call;
+        break;
+      case Opcode::And:
+      case Opcode::Or:
+      case Opcode::Min:
+      case Opcode::Max:
+      case Opcode::Function1:
+      case Opcode::Function2:
+        str_.append(info.string.data(), info.string.size());
+        str_ += '(';
+        group.kind = Group::Kind::Call;
+        break;
+      default:
+        break;
+    }
+    groups_.push_back(group);
+    return true;
+  }
+
+  void Next(const Token& /*token*/, const TokenInfo& info, size_t /*operand*/) {
+    if (groups_.back().kind != Group::Kind::Operator) {
+      str_ += ", ";
+      return;
+    }
+
+    str_ += ' ';
+    switch (info.opcode) {
+      case Opcode::LessEqual:
+        str_ += "<=";
+        break;
+      case Opcode::GreaterEqual:
+        str_ += ">=";
+        break;
+      default:
+        str_ += GetOperatorChar(info.opcode);
+        break;
+    }
+    str_ += ' ';
+  }
+
+  void Leave(const Token& /*token*/, const TokenInfo& /*info*/) {
+    if (groups_.back().kind == Group::Kind::Call)
+      str_ += ')';
+    groups_.pop_back();
+  }
+
+ private:
+  // Token being formatted, one per level of the walk.
+  struct Group {
+    enum class Kind {
+      // Operands separated by the operator.
+      Operator,
+      // Operands separated by commas within parentheses.
+      Call,
+      // Fold arguments listed within the call of the enclosing fold.
+      Inline,
+      // Folded constant formatted as its source.
+      Constant,
+    };
+
+    Kind kind = Kind::Operator;
+    Opcode opcode = Opcode::Number;
+    const char* name = nullptr;
+    size_t operand_count = 0;
+  };
+
+  const FormatterDelegate& delegate_;
+  std::string& str_;
+  std::vector<Group> groups_;
+};
+
+class Traverser {
+ public:
+  Traverser(TraverseCallback callback, void* param)
+      : callback_{callback}, param_{param} {}
+
+  bool Enter(const Token& token, TokenInfo& info, bool described) {
+    if (!described) {
+      token.Traverse(callback_, param_);
+      return false;
+    }
+    // Folded constants traverse as the subtree they were folded from.
+    if (info.folded_source) {
+      info.operands[0] = info.folded_source;
+      info.operand_count = 1;
+      return true;
+    }
+    callback_(&token, param_);
+    return info.operand_count != 0;
+  }
+
+  void Next(const Token&, const TokenInfo&, size_t) {}
+  void Leave(const Token&, const TokenInfo&) {}
+
+ private:
+  const TraverseCallback callback_;
+  void* const param_;
+};
+
+}  // namespace
+
+void FormatTokens(const Token& root,
+                  const FormatterDelegate& delegate,
+                  std::string& str) {
+  Formatter formatter{delegate, str};
+  WalkTokens(root, formatter);
+}
+
+void TraverseTokens(const Token& root,
+                    TraverseCallback callback,
+                    void* param) {
+  Traverser traverser{callback, param};
+  WalkTokens(root, traverser);
+}
+
+const Token& TokenCloner::Clone(const Token& root) {
+  auto i = clones_.find(&root);
+  if (i != clones_.end())
+    return *i->second;
+
+  // Token::Clone finds the operands cloned already. Tokens that do not
+  // describe themselves clone their operands through this method.
+  struct Visitor {
+    TokenCloner& cloner;
+
+    bool Enter(const Token& token, TokenInfo& info, bool described) {
+      if (cloner.clones_.count(&token))
+        return false;
+      if (!described) {
+        cloner.CloneToken(token);
+        return false;
+      }
+      if (info.folded_source) {
+        info.operands[0] = info.folded_source;
+        info.operand_count = 1;
+      }
+      return true;
+    }
+
+    void Next(const Token&, const TokenInfo&, size_t) {}
+
+    void Leave(const Token& token, const TokenInfo&) {
+      cloner.CloneToken(token);
+    }
+  };
+
+  Visitor visitor{*this};
+  WalkTokens(root, visitor);
+  return *clones_.at(&root);
+}
+
+const Token& TokenCloner::CloneToken(const Token& token) {
+  const Token* clone = token.Clone(*this);
+  if (!clone)
+    throw std::runtime_error("token cannot be cloned");
+  clones_.emplace(&token, clone);
+  return *clone;
+}
+
+}  // namespace expression
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "express/express_export.h"
+#include "express/formatter_delegate.h"
+#include "express/token.h"
+#include "express/token_info.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace expression {
+
+// Walks the tree below |root| depth first with an explicit stack instead of
+// recursion, so passes over trees of any depth cannot overflow the call
+// stack. |visitor| has the members
+//
+//   bool Enter(const Token& token, TokenInfo& info, bool described);
+//   void Next(const Token& token, const TokenInfo& info, size_t operand);
+//   void Leave(const Token& token, const TokenInfo& info);
+//
+// Enter sees every token first and returns false to skip its operands and
+// Leave. It may change |info| to walk other operands. Next is called before
+// every operand but the first, and Leave after the last one. Tokens that do
+// not describe themselves have no operands unless Enter gives them some.
+template <class Visitor>
+void WalkTokens(const Token& root, Visitor& visitor) {
+  struct Frame {
+    const Token* token;
+    TokenInfo info;
+    size_t next_operand = 0;
+  };
+
+  std::vector<Frame> frames;
+  auto enter = [&](const Token& token) {
+    Frame frame{&token};
+    const bool described = token.Describe(frame.info);
+    if (visitor.Enter(token, frame.info, described))
+      frames.push_back(frame);
+  };
+
+  enter(root);
+  while (!frames.empty()) {
+    Frame& frame = frames.back();
+    if (frame.next_operand == frame.info.operand_count) {
+      visitor.Leave(*frame.token, frame.info);
+      frames.pop_back();
+      continue;
+    }
+    const size_t operand = frame.next_operand++;
+    if (operand != 0)
+      visitor.Next(*frame.token, frame.info, operand);
+    enter(*frame.info.operands[operand]);
+  }
+}
+
+// Same output as |root|.Format(). Described tokens are formatted from their
+// description, and the others through Token::Format.
+EXPRESS_EXPORT void FormatTokens(const Token& root,
+                                 const FormatterDelegate& delegate,
+                                 std::string& str);
+
+// Same callbacks as |root|.Traverse(). Tokens that do not describe
+// themselves are traversed through Token::Traverse.
+EXPRESS_EXPORT void TraverseTokens(const Token& root,
+                                   TraverseCallback callback,
+                                   void* param);
+
+}  // namespace expression
@@ -0,0 +1,117 @@
+#include "express/type_inference.h"
+
+#include "express/token.h"
+#include "express/token_info.h"
+#include "express/token_walker.h"
+
+#include <vector>
+
+namespace expression {
+
+namespace {
+
+StaticType Unify(StaticType a, StaticType b) {
+  return a == b ? a : StaticType::Unknown;
+}
+
+bool AllAre(const StaticType* types, size_t count, StaticType type) {
+  for (size_t i = 0; i < count; ++i) {
+    if (types[i] != type)
+      return false;
+  }
+  return true;
+}
+
+StaticType InferTokenType(const TokenInfo& info, const StaticType* operands) {
+  switch (info.opcode) {
+    case Opcode::Number:
+      return StaticType::Number;
+
+    case Opcode::String:
+      return StaticType::String;
+
+    case Opcode::Variable:
+      return info.type;
+
+    // Strings concatenate; other arithmetic requires numbers.
+    case Opcode::Add:
+    // Folds preserve the type of their operands.
+    case Opcode::Min:
+    case Opcode::Max:
+    case Opcode::Parentheses: {
+      StaticType type = operands[0];
+      for (size_t i = 1; i < info.operand_count; ++i)
+        type = Unify(type, operands[i]);
+      return type;
+    }
+
+    case Opcode::If:
+      if (operands[0] != StaticType::Number)
+        return StaticType::Unknown;
+      return Unify(operands[1], operands[2]);
+
+    case Opcode::And:
+    case Opcode::Or:
+      // A single argument fold evaluates to the argument itself.
+      if (info.operand_count == 1)
+        return operands[0];
+      return AllAre(operands, info.operand_count, StaticType::Number)
+                 ? StaticType::Number
+                 : StaticType::Unknown;
+
+    // Comparisons of strings produce numbers, but the tree still has to be
+    // evaluated with strings.
+    case Opcode::Negate:
+    case Opcode::Not:
+    case Opcode::Subtract:
+    case Opcode::Multiply:
+    case Opcode::Divide:
+    case Opcode::Power:
+    case Opcode::Equal:
+    case Opcode::Less:
+    case Opcode::Greater:
+    case Opcode::LessEqual:
+    case Opcode::GreaterEqual:
+    case Opcode::Function1:
+    case Opcode::Function2:
+      return AllAre(operands, info.operand_count, StaticType::Number)
+                 ? StaticType::Number
+                 : StaticType::Unknown;
+  }
+
+  return StaticType::Unknown;
+}
+
+// Keeps the types of the operands walked so far on a stack.
+class TypeInferrer {
+ public:
+  bool Enter(const Token&, const TokenInfo&, bool described) {
+    if (!described)
+      types_.push_back(StaticType::Unknown);
+    return described;
+  }
+
+  void Next(const Token&, const TokenInfo&, size_t) {}
+
+  void Leave(const Token&, const TokenInfo& info) {
+    const size_t first = types_.size() - info.operand_count;
+    const StaticType type = InferTokenType(info, types_.data() + first);
+    types_.resize(first);
+    types_.push_back(type);
+  }
+
+  StaticType type() const { return types_.back(); }
+
+ private:
+  std::vector<StaticType> types_;
+};
+
+}  // namespace
+
+StaticType InferType(const Token& token) {
+  TypeInferrer inferrer;
+  WalkTokens(token, inferrer);
+  return inferrer.type();
+}
+
+}  // namespace expression
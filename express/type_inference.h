@@ -0,0 +1,22 @@
+#pragma once
+
+#include "express/express_export.h"
+
+namespace expression {
+
+class Token;
+
+// Type a token tree is statically proven to be evaluated in.
+enum class StaticType {
+  // The token and all of its operands produce numbers, so the tree can be
+  // evaluated with doubles only.
+  Number,
+  // The token produces a string.
+  String,
+  // The type depends on custom tokens or the tree mixes types.
+  Unknown,
+};
+
+EXPRESS_EXPORT StaticType InferType(const Token& token);
+
+}  // namespace expression
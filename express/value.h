@@ -69,6 +69,12 @@ class Value {
       _bad_type();
     return string_data();
   }
+  // String with its length, which may include NUL characters.
+  std::string_view string_view() const {
+    if (type_ != Type::String)
+      _bad_type();
+    return std::string_view(string_data(), static_cast<size_t>(string_length_));
+  }
   operator double&() {
     if (type_ != Type::Number)
       _bad_type();
@@ -184,10 +190,6 @@ class Value {
   bool operator!() const { return !(bool)*this; }
 
  private:
-  std::string_view string_view() const noexcept {
-    return std::string_view(string_data(), static_cast<size_t>(string_length_));
-  }
-
   const char* string_data() const noexcept {
     return string_is_inline_ ? inline_string_ : heap_string_;
   }
@@ -0,0 +1,148 @@
+// Counting replacements of the global operator new and delete family, shared
+// by the tests and benchmarks. They live in their own source file so the
+// compiler does not pair the malloc and free inside them with the new and
+// delete expressions of the callers.
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+// Global operator new calls of the current thread.
+thread_local size_t heap_allocation_count = 0;
+
+namespace {
+
+void* Allocate(size_t size) noexcept {
+  ++heap_allocation_count;
+  return std::malloc(size ? size : 1);
+}
+
+void* AllocateAligned(size_t size, std::align_val_t alignment) noexcept {
+  ++heap_allocation_count;
+  const auto align = static_cast<size_t>(alignment);
+  // aligned_alloc needs a size that is a multiple of the alignment.
+  size = (size + align - 1) / align * align;
+#if defined(_WIN32)
+  return _aligned_malloc(size ? size : align, align);
+#else
+  return std::aligned_alloc(align, size ? size : align);
+#endif
+}
+
+void Free(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void FreeAligned(void* ptr) noexcept {
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  if (void* ptr = Allocate(size))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new[](size_t size) {
+  if (void* ptr = Allocate(size))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  if (void* ptr = AllocateAligned(size, alignment))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  if (void* ptr = AllocateAligned(size, alignment))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new(size_t size,
+                   std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return AllocateAligned(size, alignment);
+}
+
+void* operator new[](size_t size,
+                     std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return AllocateAligned(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+  Free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  Free(ptr);
+}
+
+void operator delete(void* ptr, [[maybe_unused]] size_t size) noexcept {
+  Free(ptr);
+}
+
+void operator delete[](void* ptr, [[maybe_unused]] size_t size) noexcept {
+  Free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  Free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  Free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  FreeAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  FreeAligned(ptr);
+}
+
+void operator delete(void* ptr,
+                     [[maybe_unused]] size_t size,
+                     std::align_val_t) noexcept {
+  FreeAligned(ptr);
+}
+
+void operator delete[](void* ptr,
+                       [[maybe_unused]] size_t size,
+                       std::align_val_t) noexcept {
+  FreeAligned(ptr);
+}
+
+void operator delete(void* ptr,
+                     std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  FreeAligned(ptr);
+}
+
+void operator delete[](void* ptr,
+                       std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  FreeAligned(ptr);
+}
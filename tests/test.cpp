@@ -1,80 +1,108 @@
-#include "express/express.h"
-
-#include "express/lexer.h"
+#include "express/express.h"
+
+#include "express/arena_pool.h"
+#include "express/batch_kernels.h"
+#include "express/code_generator.h"
+#include "express/expression_set.h"
+#include "express/filter_program.h"
+#include "express/flat_tree.h"
+#include "express/formula_graph.h"
+#include "express/formula_registry.h"
+#include "express/huge_page_resource.h"
+#include "express/incremental_program.h"
+#include "express/jit_program.h"
+#include "express/lexer.h"
 #include "express/lexer_delegate.h"
 #include "express/parser.h"
 #include "express/parser_delegate.h"
+#include "express/serialization.h"
+#include "express/static_expression.h"
 #include "express/strings.h"
+#include "express/thread_pool.h"
+#include "express/type_inference.h"
 
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstring>
 #include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory_resource>
 #include <string>
 #include <type_traits>
 #include <unordered_map>
-
-namespace expression {
-
-namespace {
-
-class TestFormatterDelegate : public FormatterDelegate {
- public:
-  virtual void AppendDouble(std::string& str, double value) const override {
-    str.append(std::to_string(static_cast<int>(value)));
-  }
-};
-
-class TestVariableToken : public Token {
- public:
-  TestVariableToken(std::string_view name, const Value& value)
-      : name_{name}, value_{value} {}
-
-  virtual Value Calculate(void* data) const override { return value_; }
-
-  virtual void Traverse(TraverseCallback callb, void* param) const {}
-
-  virtual void Format(const FormatterDelegate& delegate,
-                      std::string& str) const override {
-    str += name_;
-  }
-
- private:
-  std::string_view name_;
-  const Value& value_;
-};
-
-using TestVariables = std::unordered_map<std::string_view, Value>;
-
+#include <vector>
+
+// Defined by the source generated from generated_formulas.txt.
+void RegisterTestFormulas(expression::FormulaRegistry& registry);
+
+// Global operator new calls of the current thread, counted by
+// heap_counter.cpp.
+extern thread_local size_t heap_allocation_count;
+
+namespace expression {
+
+namespace {
+
+class TestFormatterDelegate : public FormatterDelegate {
+ public:
+  virtual void AppendDouble(std::string& str, double value) const override {
+    str.append(std::to_string(static_cast<int>(value)));
+  }
+};
+
+class TestVariableToken : public Token {
+ public:
+  TestVariableToken(std::string_view name, const Value& value)
+      : name_{name}, value_{value} {}
+
+  virtual Value Calculate(void* data) const override { return value_; }
+
+  virtual void Traverse(TraverseCallback callb, void* param) const {}
+
+  virtual void Format(const FormatterDelegate& delegate,
+                      std::string& str) const override {
+    str += name_;
+  }
+
+ private:
+  std::string_view name_;
+  const Value& value_;
+};
+
+using TestVariables = std::unordered_map<std::string_view, Value>;
+
 class TestParserDelegate : public BasicParserDelegate<PolymorphicToken> {
  public:
-  TestParserDelegate(Allocator& allocator, TestVariables variables)
-      : BasicParserDelegate<PolymorphicToken>{allocator},
-        variables_{std::move(variables)} {}
-
-  PolymorphicToken MakeCustomToken(
-      const Lexem& lexem,
-      BasicParser<Lexer, TestParserDelegate>& parser) {
-    if (lexem.lexem == LEX_NAME)
-      return MakeVariableToken(lexem._string);
-    throw std::runtime_error{"Unexpected token"};
-  }
-
-  const BasicFunction<PolymorphicToken>* FindBasicFunction(
-      std::string_view name) {
-    return functions::FindDefaultFunction<PolymorphicToken>(name);
-  }
-
- private:
-  PolymorphicToken MakeVariableToken(std::string_view name) {
-    auto i = variables_.find(name);
-    if (i == variables_.end())
-      throw std::runtime_error{"Unknown variable name"};
-
-    return expression::MakePolymorphicToken<TestVariableToken>(
-        allocator_, i->first, i->second);
-  }
-
+  TestParserDelegate(Allocator& allocator, TestVariables variables)
+      : BasicParserDelegate<PolymorphicToken>{allocator},
+        variables_{std::move(variables)} {}
+
+  PolymorphicToken MakeCustomToken(
+      const Lexem& lexem,
+      BasicParser<Lexer, TestParserDelegate>& parser) {
+    if (lexem.lexem == LEX_NAME)
+      return MakeVariableToken(lexem._string);
+    throw std::runtime_error{"Unexpected token"};
+  }
+
+  const BasicFunction<PolymorphicToken>* FindBasicFunction(
+      std::string_view name) {
+    return functions::FindDefaultFunction<PolymorphicToken>(name);
+  }
+
+ private:
+  PolymorphicToken MakeVariableToken(std::string_view name) {
+    auto i = variables_.find(name);
+    if (i == variables_.end())
+      throw std::runtime_error{"Unknown variable name"};
+
+    return expression::MakePolymorphicToken<TestVariableToken>(
+        allocator_, i->first, i->second);
+  }
+
   const TestVariables variables_;
 };
 
@@ -232,25 +260,59 @@ class LogicalParserDelegate : public BasicParserDelegate<PolymorphicToken> {
   const LogicalOperands operands_;
 };
 
+// Returns the same token for every reference to an operand, so subtrees over
+// it are shared.
+class SharedOperandParserDelegate
+    : public BasicParserDelegate<PolymorphicToken> {
+ public:
+  SharedOperandParserDelegate(Allocator& allocator, LogicalOperands operands)
+      : BasicParserDelegate<PolymorphicToken>{allocator},
+        operands_{std::move(operands)} {}
+
+  PolymorphicToken MakeCustomToken(
+      const Lexem& lexem,
+      BasicParser<Lexer, SharedOperandParserDelegate>&) {
+    if (lexem.lexem != LEX_NAME)
+      throw std::runtime_error{"Unexpected token"};
+
+    if (auto token = tokens_.find(lexem._string); token != tokens_.end())
+      return token->second;
+
+    auto i = operands_.find(lexem._string);
+    if (i == operands_.end())
+      throw std::runtime_error{"Unknown operand"};
+
+    auto token = expression::MakePolymorphicToken<LogicalOperandToken>(
+        allocator_, i->first, i->second);
+    tokens_.emplace(i->first, token);
+    return token;
+  }
+
+ private:
+  const LogicalOperands operands_;
+  std::unordered_map<std::string_view, PolymorphicToken> tokens_;
+};
+
 }  // namespace
 
 void Validate(Value expected_result,
               const char* formula,
               TestVariables variables = {}) {
-  Expression ex;
-  LexerDelegate lexer_delegate;
-  Lexer lexer{formula, lexer_delegate, 0};
-  Allocator allocator;
-  TestParserDelegate parser_delegate{allocator, std::move(variables)};
-  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
-  ex.Parse(parser, allocator);
-  TestFormatterDelegate formatter_delegate;
+  Expression ex;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  TestParserDelegate parser_delegate{allocator, std::move(variables)};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  ex.Parse(parser, allocator);
+  TestFormatterDelegate formatter_delegate;
   EXPECT_EQ(formula, ex.Format(formatter_delegate));
   EXPECT_EQ(expected_result, ex.Calculate());
 }
 
 Value CalculateLogicalFormula(const char* formula,
-                             LogicalOperands operands = {}) {
+                             LogicalOperands operands = {},
+                             bool compile = false) {
   Expression ex;
   LexerDelegate lexer_delegate;
   Lexer lexer{formula, lexer_delegate, 0};
@@ -258,6 +320,24 @@ Value CalculateLogicalFormula(const char* formula,
   LogicalParserDelegate parser_delegate{allocator, std::move(operands)};
   BasicParser<Lexer, LogicalParserDelegate> parser{lexer, parser_delegate};
   ex.Parse(parser, allocator);
+  if (compile)
+    ex.Compile();
+  return ex.Calculate();
+}
+
+Value CalculateSharedFormula(const char* formula,
+                             LogicalOperands operands,
+                             bool compile) {
+  Expression ex;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  SharedOperandParserDelegate parser_delegate{allocator, std::move(operands)};
+  BasicParser<Lexer, SharedOperandParserDelegate> parser{lexer,
+                                                         parser_delegate};
+  ex.Parse(parser, allocator);
+  if (compile)
+    ex.Compile();
   return ex.Calculate();
 }
 
@@ -275,39 +355,78 @@ void ValidateUtf8(Value expected_result,
   EXPECT_EQ(formula, ex.Format(formatter_delegate));
   EXPECT_EQ(expected_result, ex.Calculate());
 }
-
-TEST(Express, Test) {
-  Validate(2, "5 - 3");
-  Validate(3, "6 - 2 - 1");
-  Validate(7, "9 - 4 + 2");
-  Validate(32, "2 + 3 * 10");
-  Validate(3, "Min(5, 4, 6, 8, 3, 10)");
-  Validate(9, "If(2 - 1 - 1, 4 + 2, 3 * 3)");
-  Validate(28, "(2 + 5) * 4");
-  Validate(6, "(10 - (5 + 3)) * 3");
-  Validate("Hello, World!", "\"Hello, \" + \"World!\"");
-  const std::string kLongString(100, '#');
-  Validate(kLongString, ("\"" + kLongString + "\"").c_str());
-  Validate(17, "a + b * c", {{"a", 5}, {"b", 4}, {"c", 3}});
-  Validate(true, "Or(a, b)", {{"a", true}, {"b", false}});
-  Validate(false, "And(a, b)", {{"a", true}, {"b", false}});
-  Validate(true, "Or(c, And(a, b))", {{"a", true}, {"b", true}, {"c", false}});
-}
-
-bool TokenCountCallback(const Token* token, void* param) {
-  auto& token_count = *static_cast<int*>(param);
-  ++token_count;
-  return true;
-}
-
-int GetTokenCount(const char* formula) {
-  Expression e;
-  e.Parse(formula);
-  int token_count = 0;
-  e.Traverse(&TokenCountCallback, &token_count);
-  return token_count;
-}
-
+
+struct ValidatedFormula {
+  Value expected_result;
+  std::string formula;
+  TestVariables variables;
+};
+
+// The formulas of Express.Test, for checking the other evaluators.
+std::vector<ValidatedFormula> GetValidatedFormulas() {
+  const std::string kLongString(100, '#');
+  return {
+      {2, "5 - 3"},
+      {3, "6 - 2 - 1"},
+      {7, "9 - 4 + 2"},
+      {32, "2 + 3 * 10"},
+      {3, "Min(5, 4, 6, 8, 3, 10)"},
+      {9, "If(2 - 1 - 1, 4 + 2, 3 * 3)"},
+      {28, "(2 + 5) * 4"},
+      {6, "(10 - (5 + 3)) * 3"},
+      {"Hello, World!", "\"Hello, \" + \"World!\""},
+      {kLongString, "\"" + kLongString + "\""},
+      {17, "a + b * c", {{"a", 5}, {"b", 4}, {"c", 3}}},
+      {true, "Or(a, b)", {{"a", true}, {"b", false}}},
+      {false, "And(a, b)", {{"a", true}, {"b", false}}},
+      {true, "Or(c, And(a, b))", {{"a", true}, {"b", true}, {"c", false}}},
+  };
+}
+
+// The variable tokens refer to the values held by |parser_delegate|, which
+// must outlive the expression.
+void ParseValidatedFormula(Expression& ex,
+                           const std::string& formula,
+                           TestParserDelegate& parser_delegate,
+                           Allocator& allocator) {
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula.c_str(), lexer_delegate, 0};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  ex.Parse(parser, allocator);
+}
+
+TEST(Express, Test) {
+  Validate(2, "5 - 3");
+  Validate(3, "6 - 2 - 1");
+  Validate(7, "9 - 4 + 2");
+  Validate(32, "2 + 3 * 10");
+  Validate(3, "Min(5, 4, 6, 8, 3, 10)");
+  Validate(9, "If(2 - 1 - 1, 4 + 2, 3 * 3)");
+  Validate(28, "(2 + 5) * 4");
+  Validate(6, "(10 - (5 + 3)) * 3");
+  Validate("Hello, World!", "\"Hello, \" + \"World!\"");
+  const std::string kLongString(100, '#');
+  Validate(kLongString, ("\"" + kLongString + "\"").c_str());
+  Validate(17, "a + b * c", {{"a", 5}, {"b", 4}, {"c", 3}});
+  Validate(true, "Or(a, b)", {{"a", true}, {"b", false}});
+  Validate(false, "And(a, b)", {{"a", true}, {"b", false}});
+  Validate(true, "Or(c, And(a, b))", {{"a", true}, {"b", true}, {"c", false}});
+}
+
+bool TokenCountCallback(const Token* token, void* param) {
+  auto& token_count = *static_cast<int*>(param);
+  ++token_count;
+  return true;
+}
+
+int GetTokenCount(const char* formula) {
+  Expression e;
+  e.Parse(formula);
+  int token_count = 0;
+  e.Traverse(&TokenCountCallback, &token_count);
+  return token_count;
+}
+
 TEST(Express, Traverse) {
   EXPECT_EQ(9, GetTokenCount("1 + 2 + 3 + 4 + 5"));
 }
@@ -448,6 +567,1783 @@ TEST(Express, AndShortCircuitsLeftToRight) {
                std::runtime_error);
 }
 
+// Parses without constant folding so analyses and the interpreter see the
+// full tree.
+void ParseUnfolded(Expression& expression, const char* formula) {
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_fold_constants(false);
+  BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+      lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+}
+
+TEST(Program, ShortCircuitsAndConditionals) {
+  int false_count = 0;
+  int true_count = 0;
+  int explode_count = 0;
+
+  EXPECT_NO_THROW({
+    EXPECT_EQ(Value(true), CalculateLogicalFormula(
+                               "Or(f, t, explode)",
+                               {{"f", {false, false, &false_count}},
+                                {"t", {true, false, &true_count}},
+                                {"explode", {false, true, &explode_count}}},
+                               true));
+    EXPECT_EQ(Value(false), CalculateLogicalFormula(
+                                "And(f, explode)",
+                                {{"f", {false, false, &false_count}},
+                                 {"explode", {false, true, &explode_count}}},
+                                true));
+    EXPECT_EQ(Value(2), CalculateLogicalFormula(
+                            "If(f, explode, 2)",
+                            {{"f", {false, false, &false_count}},
+                             {"explode", {false, true, &explode_count}}},
+                            true));
+  });
+
+  EXPECT_EQ(3, false_count);
+  EXPECT_EQ(1, true_count);
+  EXPECT_EQ(0, explode_count);
+}
+
+TEST(Program, MatchesTreeEvaluation) {
+  const char* const kFormulas[] = {
+      "1 + 2 * 3 ^ 2 / 4",
+      "-(3 - 5) + !0",
+      "(1 < 2) + (2 <= 2) + (3 > 4) + (4 >= 4) + (5 = 5)",
+      "Min(7, 3, 9) + Max(1, 8, 2)",
+      "If(0, 1, If(1, 2, 3))",
+      "And(1, 2) + Or(0, 0) + And(5) + Or(0, 7)",
+      "Sqrt(16) + Abs(-2) + Sign(-3) + ATan2(0, 1) + BitXor(1, 0)",
+      "\"abc\" + \"def\"",
+      "Min(\"b\", \"a\", \"c\")",
+      "\"abc\" < \"abd\"",
+  };
+
+  for (const char* formula : kFormulas) {
+    Expression tree;
+    ParseUnfolded(tree, formula);
+    Expression compiled;
+    ParseUnfolded(compiled, formula);
+    ASSERT_TRUE(compiled.Compile());
+    EXPECT_TRUE(compiled.is_compiled());
+    EXPECT_EQ(tree.Calculate(), compiled.Calculate()) << formula;
+  }
+}
+
+TEST(Program, CalculatesValidatedFormulas) {
+  for (const ValidatedFormula& formula : GetValidatedFormulas()) {
+    Allocator allocator;
+    TestParserDelegate parser_delegate{allocator, formula.variables};
+    Expression ex;
+    ParseValidatedFormula(ex, formula.formula, parser_delegate, allocator);
+    ASSERT_TRUE(ex.Compile()) << formula.formula;
+    EXPECT_EQ(formula.expected_result, ex.Calculate()) << formula.formula;
+  }
+}
+
+TEST(Program, PropagatesTypeErrors) {
+  Expression expression;
+  ParseUnfolded(expression, "\"abc\" - 1");
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_THROW(expression.Calculate(), std::runtime_error);
+}
+
+StaticType InferFormulaType(const char* formula) {
+  Expression expression;
+  ParseUnfolded(expression, formula);
+  return InferType(*expression.root_token().token());
+}
+
+TEST(TypeInference, ProvesNumericAndStringTrees) {
+  EXPECT_EQ(StaticType::Number, InferFormulaType("1 + 2 * (3 - 4) ^ 2"));
+  EXPECT_EQ(StaticType::Number, InferFormulaType("If(1 < 2, Sqrt(4), -1)"));
+  EXPECT_EQ(StaticType::Number, InferFormulaType("And(1, 0) + Min(3, 2)"));
+  EXPECT_EQ(StaticType::String, InferFormulaType("\"a\" + \"b\""));
+  EXPECT_EQ(StaticType::String, InferFormulaType("If(1, \"a\", \"b\")"));
+  EXPECT_EQ(StaticType::String, InferFormulaType("Min(\"a\")"));
+  EXPECT_EQ(StaticType::Unknown, InferFormulaType("If(1, \"a\", 2)"));
+  EXPECT_EQ(StaticType::Unknown, InferFormulaType("\"a\" < \"b\""));
+  EXPECT_EQ(StaticType::Unknown, InferFormulaType("\"a\" + 1"));
+}
+
+TEST(Program, EvaluatesNumericTreesWithDoubles) {
+  const char* const kFormulas[] = {
+      "1 + 2 * 3 ^ 2 / 4",
+      "-(3 - 5) + !0 + !2",
+      "(1 < 2) + (2 <= 2) + (3 > 4) + (4 >= 4) + (5 = 5) + (5 = 6)",
+      "Min(7, 3, 9) + Max(1, 8, 2)",
+      "If(0, 1, If(1, 2, 3))",
+      "And(1, 2) + Or(0, 0) + And(5) + Or(0, 7)",
+      "Sqrt(16) + Abs(-2) + Sign(-3) + ATan2(0, 1) + BitXor(1, 0)",
+  };
+
+  for (const char* formula : kFormulas) {
+    Expression tree;
+    ParseUnfolded(tree, formula);
+    Expression compiled;
+    ParseUnfolded(compiled, formula);
+    ASSERT_TRUE(compiled.Compile());
+    ASSERT_TRUE(compiled.is_numeric()) << formula;
+    EXPECT_EQ(tree.Calculate(), compiled.CalculateNumber()) << formula;
+    EXPECT_EQ(tree.Calculate(), compiled.Calculate()) << formula;
+  }
+}
+
+TEST(Program, KeepsValuePathForStringsAndCustomTokens) {
+  Expression strings;
+  ParseUnfolded(strings, "\"abc\" + \"def\"");
+  ASSERT_TRUE(strings.Compile());
+  EXPECT_FALSE(strings.is_numeric());
+
+  Expression variables;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"a + 1", lexer_delegate, 0};
+  Allocator allocator;
+  TestParserDelegate parser_delegate{allocator, {{"a", 1}}};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  variables.Parse(parser, allocator);
+  ASSERT_TRUE(variables.Compile());
+  EXPECT_FALSE(variables.is_numeric());
+  EXPECT_EQ(Value(2), variables.Calculate());
+}
+
+TEST(ConstantFolding, FoldsLiteralSubtreesAndPreservesFormat) {
+  const char* const kFormulas[] = {
+      "(10 - (5 + 3)) * 3",
+      "If(2 - 1 - 1, 4 + 2, 3 * 3)",
+      "-Min(5, 4, 6) + Sqrt(16)",
+      "\"Hello, \" + \"World!\"",
+  };
+
+  TestFormatterDelegate formatter_delegate;
+  for (const char* formula : kFormulas) {
+    Expression expression;
+    expression.Parse(formula);
+    EXPECT_NE(nullptr,
+              dynamic_cast<const ConstantToken*>(expression.root_token().token()))
+        << formula;
+    EXPECT_EQ(formula, expression.Format(formatter_delegate));
+    ASSERT_TRUE(expression.Compile());
+  }
+
+  Expression expression;
+  expression.Parse("(10 - (5 + 3)) * 3");
+  EXPECT_EQ(Value(6), expression.Calculate());
+  EXPECT_EQ(9, GetTokenCount("1 + 2 + 3 + 4 + 5"));
+}
+
+TEST(ConstantFolding, KeepsFailingAndCustomSubtrees) {
+  Expression type_error;
+  type_error.Parse("1 + (\"a\" - 1)");
+  EXPECT_EQ(nullptr,
+            dynamic_cast<const ConstantToken*>(type_error.root_token().token()));
+  EXPECT_THROW(type_error.Calculate(), std::runtime_error);
+
+  ValidateUtf8(7, "Абс(-7)");
+  Validate(9, "a + 2 * 3", {{"a", 3}});
+}
+
+double ThrowOutOfRange(double) {
+  throw std::out_of_range{"argument out of range"};
+}
+
+double ThrowInt(double) {
+  throw 42;
+}
+
+TEST(ConstantFolding, KeepsUserExceptionsAndEmbeddedNuls) {
+  class ThrowingParserDelegate : public BasicParserDelegate<PolymorphicToken> {
+   public:
+    using BasicParserDelegate<PolymorphicToken>::BasicParserDelegate;
+
+    const BasicFunction<PolymorphicToken>* FindBasicFunction(
+        std::string_view name) override {
+      static functions::BasicMathFunction1<PolymorphicToken> throwing{
+          "Throwing", &ThrowOutOfRange};
+      static functions::BasicMathFunction1<PolymorphicToken> throwing_int{
+          "ThrowingInt", &ThrowInt};
+      if (name == throwing.name)
+        return &throwing;
+      if (name == throwing_int.name)
+        return &throwing_int;
+      return BasicParserDelegate<PolymorphicToken>::FindBasicFunction(name);
+    }
+  };
+
+  // Whatever a user function throws leaves the subtree unfolded, and the
+  // exception surfaces from Calculate.
+  const auto parse = [](Expression& expression, const char* formula) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{formula, lexer_delegate, 0};
+    Allocator allocator;
+    ThrowingParserDelegate parser_delegate{allocator};
+    BasicParser<Lexer, ThrowingParserDelegate> parser{lexer, parser_delegate};
+    expression.Parse(parser, allocator);
+  };
+  Expression expression;
+  parse(expression, "Throwing(1 + 2)");
+  EXPECT_EQ(nullptr,
+            dynamic_cast<const ConstantToken*>(expression.root_token().token()));
+  EXPECT_THROW(expression.Calculate(), std::out_of_range);
+  Expression non_standard;
+  parse(non_standard, "ThrowingInt(1 + 2)");
+  EXPECT_THROW(non_standard.Calculate(), int);
+
+  const std::string_view kString{"a\0b", 3};
+  Allocator allocator;
+  StringValueToken source{kString, allocator};
+  ConstantToken constant{Value{kString}, source, allocator};
+  EXPECT_EQ(kString, constant.Calculate(nullptr).string_view());
+  TokenInfo info;
+  ASSERT_TRUE(constant.Describe(info));
+  EXPECT_EQ(&source, info.folded_source);
+}
+
+TEST(SharedSubtrees, SharesIdenticalSubtrees) {
+  Expression expression;
+  ParseUnfolded(expression, "Sqrt(3 * 3 + 4 * 4) + Sqrt(3 * 3 + 4 * 4)");
+  TokenInfo info;
+  ASSERT_TRUE(expression.root_token().token()->Describe(info));
+  ASSERT_EQ(2u, info.operand_count);
+  EXPECT_EQ(info.operands[0], info.operands[1]);
+
+  TestFormatterDelegate formatter_delegate;
+  EXPECT_EQ("Sqrt(3 * 3 + 4 * 4) + Sqrt(3 * 3 + 4 * 4)",
+            expression.Format(formatter_delegate));
+  EXPECT_EQ(Value(10), expression.Calculate());
+
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_EQ(1u, expression.program().shared_count());
+  EXPECT_EQ(10, expression.CalculateNumber());
+  EXPECT_EQ(Value(10), expression.Calculate());
+}
+
+TEST(SharedSubtrees, EvaluatesSharedNodesOncePerCalculate) {
+  int x_count = 0;
+  LogicalOperands operands = {{"c", {false}}, {"x", {2, false, &x_count}}};
+
+  EXPECT_EQ(Value(4), CalculateSharedFormula("x * x", operands, true));
+  EXPECT_EQ(1, x_count);
+
+  // The first reference is skipped, the second one evaluates the node.
+  x_count = 0;
+  EXPECT_EQ(Value(3), CalculateSharedFormula(
+                          "If(c, x + 1, 0) + If(c, 0, x + 1) + And(c, x)",
+                          operands, true));
+  EXPECT_EQ(1, x_count);
+
+  // Walking the tree evaluates the node once per reference.
+  x_count = 0;
+  EXPECT_EQ(Value(4), CalculateSharedFormula("x * x", operands, false));
+  EXPECT_EQ(2, x_count);
+}
+
+TEST(SharedSubtrees, KeepsCustomFunctionsAndCanBeDisabled) {
+  ValidateUtf8(14, "Абс(-7) + Абс(-7)");
+
+  Expression expression;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"(1 - 2) * (1 - 2)", lexer_delegate, 0};
+  Allocator allocator;
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_fold_constants(false);
+  parser_delegate.set_share_subtrees(false);
+  BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+      lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+  TokenInfo info;
+  ASSERT_TRUE(expression.root_token().token()->Describe(info));
+  EXPECT_NE(info.operands[0], info.operands[1]);
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_EQ(0u, expression.program().shared_count());
+  EXPECT_EQ(Value(1), expression.Calculate());
+}
+
+TEST(SharedSubtrees, ForgetsSubtreesOfEarlierParses) {
+  Allocator allocator;
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_fold_constants(false);
+  auto parse = [&](const char* formula) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{formula, lexer_delegate, 0};
+    BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+        lexer, parser_delegate};
+    return parser.Parse<PolymorphicToken>();
+  };
+
+  // Reusing the delegate after resetting its allocator makes new tokens.
+  const PolymorphicToken first = parse("7 + 7");
+  allocator.reset();
+  std::memset(allocator.allocate(256), 0xff, 256);
+  const PolymorphicToken second = parse("7 + 7");
+  ASSERT_NE(first.token(), second.token());
+  EXPECT_EQ(Value(14), second.Calculate(nullptr));
+
+  // Sharing across parses keeps the tokens until ResetSharing.
+  parser_delegate.set_share_across_parses(true);
+  const PolymorphicToken third = parse("7 + 7");
+  EXPECT_EQ(third.token(), parse("7 + 7").token());
+  parser_delegate.ResetSharing();
+  EXPECT_NE(third.token(), parse("7 + 7").token());
+}
+
+TEST(SharedSubtrees, HoldsScratchArenaOnlyWhileParsing) {
+  ArenaPool* pool = ArenaPool::ForScratch();
+  ASSERT_TRUE(pool);
+  Expression warm;
+  warm.Parse("(1 + 2) * (1 + 2)");
+  const size_t pooled = pool->size();
+  ASSERT_GT(pooled, 0u);
+
+  // Every parse gives back what it took.
+  Allocator allocator;
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_fold_constants(false);
+  auto parse = [&](const char* formula) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{formula, lexer_delegate, 0};
+    BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+        lexer, parser_delegate};
+    return parser.Parse<PolymorphicToken>();
+  };
+  parse("(1 + 2) * (1 + 2)");
+  EXPECT_EQ(pooled, pool->size());
+
+  // Sharing across parses keeps the table on the heap instead.
+  parser_delegate.set_share_across_parses(true);
+  const PolymorphicToken first = parse("(1 + 2) * (1 + 2)");
+  EXPECT_EQ(pooled, pool->size());
+  EXPECT_EQ(first.token(), parse("(1 + 2) * (1 + 2)").token());
+}
+
+TEST(SymbolTable, BindsNamesToSlots) {
+  SymbolTable symbol_table;
+  Expression first;
+  first.Parse("a * a + b", symbol_table);
+  Expression second;
+  second.Parse("b - c", symbol_table);
+
+  ASSERT_EQ(3u, symbol_table.size());
+  EXPECT_EQ(0u, symbol_table.Find("a"));
+  EXPECT_EQ(1u, symbol_table.Find("b"));
+  EXPECT_EQ(2u, symbol_table.Find("c"));
+  EXPECT_EQ(std::nullopt, symbol_table.Find("d"));
+  EXPECT_EQ("c", symbol_table.name(2));
+
+  TestFormatterDelegate formatter_delegate;
+  EXPECT_EQ("a * a + b", first.Format(formatter_delegate));
+
+  const Value values[] = {3, 4, "x"};
+  EvaluationContext context;
+  context.values = values;
+  EXPECT_EQ(Value(13), first.Calculate(context));
+  EXPECT_THROW(second.Calculate(context), std::runtime_error);
+
+  ASSERT_TRUE(first.Compile());
+  EXPECT_FALSE(first.is_numeric());
+  EXPECT_EQ(Value(13), first.Calculate(context));
+
+  Expression unbound;
+  EXPECT_THROW(unbound.Parse("a + 1"), std::runtime_error);
+}
+
+TEST(SymbolTable, ThrowsWithoutEvaluationContext) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  Expression expression;
+  expression.Parse("x * 2 + 1", symbol_table);
+  EXPECT_THROW(expression.Calculate(), std::runtime_error);
+  EXPECT_THROW(expression.Calculate(EvaluationContext{}), std::runtime_error);
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_THROW(expression.Calculate(), std::runtime_error);
+  EXPECT_THROW(expression.CalculateNumber(), std::runtime_error);
+  expression.CompileNative();
+  EXPECT_THROW(expression.Calculate(), std::runtime_error);
+
+  const double numbers[] = {3};
+  EvaluationContext context;
+  context.numbers = numbers;
+  EXPECT_EQ(Value(7), expression.Calculate(context));
+}
+
+TEST(SymbolTable, EvaluatesRowsWithNumberSlots) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("price", StaticType::Number);
+  symbol_table.Declare("quantity", StaticType::Number);
+  symbol_table.Declare("name", StaticType::String);
+
+  Expression total;
+  total.Parse("If(quantity > 10, price * quantity * 0.5, price * quantity)",
+              symbol_table);
+  ASSERT_TRUE(total.Compile());
+  ASSERT_TRUE(total.is_numeric());
+
+  Expression label;
+  label.Parse("name + \"!\"", symbol_table);
+  ASSERT_TRUE(label.Compile());
+  EXPECT_FALSE(label.is_numeric());
+
+  // Refills a single row buffer and evaluates against it.
+  double row[2] = {};
+  EvaluationContext context;
+  context.numbers = row;
+  const double kRows[][2] = {{2, 3}, {4, 20}, {1.5, 10}};
+  for (const auto& source : kRows) {
+    std::copy(std::begin(source), std::end(source), row);
+    const double expected = source[0] * source[1] * (source[1] > 10 ? 0.5 : 1);
+    EXPECT_EQ(expected, total.CalculateNumber(context));
+    EXPECT_EQ(Value(expected), total.Calculate(context));
+  }
+
+  const Value values[] = {2, 3, "total"};
+  EvaluationContext value_context;
+  value_context.values = values;
+  EXPECT_EQ(Value("total!"), label.Calculate(value_context));
+  EXPECT_EQ(6, total.CalculateNumber(value_context));
+}
+
+TEST(BatchProgram, MatchesRowEvaluation) {
+  const char* const kFormulas[] = {
+      "x + y * 2 - x / (y + 1)",
+      "-x + !y + x ^ 2",
+      "(x < y) + (x <= y) * 2 + (x > y) * 4 + (x >= y) * 8 + (x = y) * 16",
+      "Min(x, y, 3) + Max(x, 1, y)",
+      "If(x > y, x - y, If(y, y / x, 7))",
+      "And(x, y) + Or(x, 0) * 2 + And(y) + Or(0, y, x)",
+      "Sqrt(Abs(x)) + Sign(y) + ATan2(x, y) + BitXor(x, y)",
+      "Sqrt(x * x + y * y) + Sqrt(x * x + y * y) / 2",
+      "3 * 4",
+      "y",
+  };
+
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+
+  // Spans several blocks and ends with a partial one.
+  const size_t kRowCount = BatchProgram::kBlockSize * 2 + 17;
+  std::vector<double> x(kRowCount);
+  std::vector<double> y(kRowCount);
+  for (size_t i = 0; i < kRowCount; ++i) {
+    x[i] = static_cast<double>(i % 7) - 3;
+    y[i] = static_cast<double>(i % 5) * 0.5 - 1;
+  }
+  const double* const columns[] = {x.data(), y.data()};
+
+  for (const char* formula : kFormulas) {
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    ASSERT_TRUE(expression.Compile());
+    ASSERT_TRUE(expression.is_numeric()) << formula;
+    ASSERT_TRUE(expression.CompileBatch()) << formula;
+
+    std::vector<double> results(kRowCount);
+    expression.CalculateBatch(columns, kRowCount, results.data());
+    for (size_t i = 0; i < kRowCount; ++i) {
+      const double row[] = {x[i], y[i]};
+      EvaluationContext context;
+      context.numbers = row;
+      const double expected = expression.CalculateNumber(context);
+      if (std::isnan(expected))
+        EXPECT_TRUE(std::isnan(results[i])) << formula << " row " << i;
+      else
+        EXPECT_EQ(expected, results[i]) << formula << " row " << i;
+    }
+  }
+
+  Expression strings;
+  ParseUnfolded(strings, "\"a\" + \"b\"");
+  EXPECT_THROW(BatchProgram::Compile(*strings.root_token().token()),
+               std::runtime_error);
+}
+
+double Triple(double value) {
+  return value * 3;
+}
+
+// Binds names to |symbol_table| and replaces the standard Abs and Sqrt by
+// functions of the same names that triple their argument.
+void ParseWithCustomAbsAndSqrt(Expression& expression,
+                               const char* formula,
+                               SymbolTable& symbol_table) {
+  class CustomParserDelegate : public BasicParserDelegate<PolymorphicToken> {
+   public:
+    using BasicParserDelegate<PolymorphicToken>::BasicParserDelegate;
+
+    const BasicFunction<PolymorphicToken>* FindBasicFunction(
+        std::string_view name) override {
+      static functions::BasicMathFunction1<PolymorphicToken> abs{"Abs",
+                                                                 &Triple};
+      static functions::BasicMathFunction1<PolymorphicToken> sqrt{"Sqrt",
+                                                                  &Triple};
+      if (name == abs.name)
+        return &abs;
+      if (name == sqrt.name)
+        return &sqrt;
+      return BasicParserDelegate<PolymorphicToken>::FindBasicFunction(name);
+    }
+  };
+
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  CustomParserDelegate parser_delegate{allocator};
+  parser_delegate.set_symbol_table(&symbol_table);
+  BasicParser<Lexer, CustomParserDelegate> parser{lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+}
+
+// Written against the std::vector signatures of MakeFoldedToken and
+// MakeFunctionToken.
+class VectorMaxFunction : public BasicFunction<PolymorphicToken> {
+ public:
+  VectorMaxFunction() : BasicFunction<PolymorphicToken>{"Largest", -1} {}
+
+  PolymorphicToken MakeToken(Allocator& allocator,
+                             PolymorphicToken* arguments,
+                             size_t argument_count) const override {
+    return functions::FindDefaultFunction<PolymorphicToken>("Max")->MakeToken(
+        allocator, arguments, argument_count);
+  }
+
+  bool SupportsFoldedArguments() const override { return true; }
+
+  PolymorphicToken MakeFoldedToken(
+      Allocator& allocator,
+      std::vector<PolymorphicToken> arguments) const override {
+    ++folded_calls;
+    return MakeToken(allocator, arguments.data(), arguments.size());
+  }
+
+  mutable int folded_calls = 0;
+};
+
+class VectorParserDelegate : public BasicParserDelegate<PolymorphicToken> {
+ public:
+  using BasicParserDelegate<PolymorphicToken>::BasicParserDelegate;
+
+  PolymorphicToken MakeFunctionToken(
+      std::string_view name,
+      std::vector<PolymorphicToken> arguments) {
+    ++function_calls;
+    return BasicParserDelegate<PolymorphicToken>::MakeFunctionToken(
+        name, arguments.data(), arguments.size());
+  }
+
+  const BasicFunction<PolymorphicToken>* FindBasicFunction(
+      std::string_view name) override {
+    if (name == function.name)
+      return &function;
+    return BasicParserDelegate<PolymorphicToken>::FindBasicFunction(name);
+  }
+
+  VectorMaxFunction function;
+  int function_calls = 0;
+};
+
+TEST(Parser, CallsVectorSignaturesOfDelegatesAndFunctions) {
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"Largest(1, 5, 3) + Min(2, 4)", lexer_delegate, 0};
+  Allocator allocator;
+  VectorParserDelegate parser_delegate{allocator};
+  BasicParser<Lexer, VectorParserDelegate> parser{lexer, parser_delegate};
+  Expression expression;
+  expression.Parse(parser, allocator);
+  EXPECT_EQ(Value(7), expression.Calculate(nullptr));
+  EXPECT_EQ(2, parser_delegate.function_calls);
+  EXPECT_EQ(1, parser_delegate.function.folded_calls);
+}
+
+TEST(BatchProgram, IsBuiltOnlyByCompileBatch) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  Expression expression;
+  expression.Parse("x * 2 + 1", symbol_table);
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_FALSE(expression.is_batch_compiled());
+  ASSERT_TRUE(expression.CompileBatch());
+  EXPECT_TRUE(expression.is_batch_compiled());
+
+  // Recompiling drops the batch program until it is asked for again.
+  ASSERT_TRUE(expression.Compile());
+  EXPECT_FALSE(expression.is_batch_compiled());
+
+  Expression strings;
+  strings.Parse("x + \"a\"", symbol_table);
+  EXPECT_FALSE(strings.CompileBatch());
+  EXPECT_FALSE(strings.is_batch_compiled());
+}
+
+TEST(BatchProgram, CallsCustomFunctionsWithStandardNames) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  Expression expression;
+  ParseWithCustomAbsAndSqrt(expression, "Abs(x) + Sqrt(x)", symbol_table);
+  ASSERT_TRUE(expression.CompileBatch());
+  ASSERT_TRUE(expression.is_numeric());
+
+  const double x[] = {-2, 4};
+  const double* const columns[] = {x};
+  double results[2] = {};
+  expression.CalculateBatch(columns, 2, results);
+  EXPECT_EQ(-12, results[0]);
+  EXPECT_EQ(24, results[1]);
+}
+
+// Compares numbers bit by bit, treating all NaNs as equal.
+bool SameNumber(double a, double b) {
+  if (std::isnan(a) || std::isnan(b))
+    return std::isnan(a) && std::isnan(b);
+  return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+TEST(BatchKernels, VectorKernelsMatchScalar) {
+  const double kInfinity = std::numeric_limits<double>::infinity();
+  const double kSpecial[] = {0.0,
+                             -0.0,
+                             1.0,
+                             -1.0,
+                             2.5,
+                             -3.75,
+                             Value::kPrecision,
+                             -Value::kPrecision,
+                             Value::kPrecision / 2,
+                             1.0 + Value::kPrecision,
+                             1e300,
+                             kInfinity,
+                             -kInfinity,
+                             std::numeric_limits<double>::quiet_NaN()};
+  constexpr size_t kSpecialCount = std::size(kSpecial);
+
+  // Every pair of special values, in a count that leaves a scalar tail.
+  std::vector<double> left;
+  std::vector<double> right;
+  std::vector<double> condition;
+  for (size_t i = 0; i < kSpecialCount; ++i) {
+    for (size_t j = 0; j < kSpecialCount; ++j) {
+      left.emplace_back(kSpecial[i]);
+      right.emplace_back(kSpecial[j]);
+      condition.emplace_back(kSpecial[(i + j) % kSpecialCount]);
+    }
+  }
+  left.emplace_back(7);
+  right.emplace_back(-7);
+  condition.emplace_back(1);
+  const size_t count = left.size();
+
+  const UnaryKernel BatchKernels::*const kUnary[] = {
+      &BatchKernels::negate, &BatchKernels::logical_not, &BatchKernels::abs,
+      &BatchKernels::sign, &BatchKernels::sqrt};
+  const BinaryKernel BatchKernels::*const kBinary[] = {
+      &BatchKernels::add,         &BatchKernels::subtract,
+      &BatchKernels::multiply,    &BatchKernels::divide,
+      &BatchKernels::power,       &BatchKernels::equal,
+      &BatchKernels::less,        &BatchKernels::greater,
+      &BatchKernels::less_equal,  &BatchKernels::greater_equal,
+      &BatchKernels::min,         &BatchKernels::max,
+      &BatchKernels::logical_and, &BatchKernels::logical_or};
+
+  const BatchKernels& scalar = GetScalarBatchKernels();
+  for (const BatchKernels* kernels :
+       {GetSse2BatchKernels(), GetAvx2BatchKernels(), &GetBatchKernels()}) {
+    if (!kernels)
+      continue;
+
+    std::vector<double> expected(count);
+    std::vector<double> actual(count);
+    for (size_t k = 0; k < std::size(kUnary); ++k) {
+      (scalar.*kUnary[k])(left.data(), expected.data(), count);
+      (kernels->*kUnary[k])(left.data(), actual.data(), count);
+      for (size_t i = 0; i < count; ++i) {
+        EXPECT_TRUE(SameNumber(expected[i], actual[i]))
+            << kernels->name << " unary " << k << " of " << left[i];
+      }
+    }
+    for (size_t k = 0; k < std::size(kBinary); ++k) {
+      (scalar.*kBinary[k])(left.data(), right.data(), expected.data(), count);
+      (kernels->*kBinary[k])(left.data(), right.data(), actual.data(), count);
+      for (size_t i = 0; i < count; ++i) {
+        EXPECT_TRUE(SameNumber(expected[i], actual[i]))
+            << kernels->name << " binary " << k << " of " << left[i] << ", "
+            << right[i];
+      }
+    }
+    scalar.blend(condition.data(), left.data(), right.data(), expected.data(),
+                 count);
+    kernels->blend(condition.data(), left.data(), right.data(), actual.data(),
+                   count);
+    for (size_t i = 0; i < count; ++i)
+      EXPECT_TRUE(SameNumber(expected[i], actual[i])) << kernels->name;
+  }
+}
+
+TEST(BatchProgram, ReusesRegisterBlocks) {
+  Expression expression;
+  ParseUnfolded(expression, "((((1 + 2) + 3) + 4) + 5) + (6 + 7)");
+  auto program = BatchProgram::Compile(*expression.root_token().token());
+  EXPECT_EQ(6u, program.instruction_count());
+  EXPECT_EQ(3u, program.register_count());
+  double result = 0;
+  program.Calculate(nullptr, 1, &result);
+  EXPECT_EQ(28, result);
+}
+
+int counted_calls = 0;
+
+double CountedIdentity(double value) {
+  ++counted_calls;
+  return value;
+}
+
+// Binds names to |symbol_table| and adds a Counted function that counts the
+// rows it is evaluated for.
+void ParseCounted(Expression& expression,
+                  const char* formula,
+                  SymbolTable& symbol_table) {
+  class CountedParserDelegate : public BasicParserDelegate<PolymorphicToken> {
+   public:
+    using BasicParserDelegate<PolymorphicToken>::BasicParserDelegate;
+
+    const BasicFunction<PolymorphicToken>* FindBasicFunction(
+        std::string_view name) override {
+      static functions::BasicMathFunction1<PolymorphicToken> counted{
+          "Counted", &CountedIdentity};
+      if (name == counted.name)
+        return &counted;
+      return BasicParserDelegate<PolymorphicToken>::FindBasicFunction(name);
+    }
+  };
+
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  CountedParserDelegate parser_delegate{allocator};
+  parser_delegate.set_symbol_table(&symbol_table);
+  BasicParser<Lexer, CountedParserDelegate> parser{lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+}
+
+TEST(FilterProgram, SelectsRowsLikeRowEvaluation) {
+  const char* const kFormulas[] = {
+      "And(x > 5, y < 3)",
+      "Or(x < 2, And(y > 1, !(x = 4)), y = 0)",
+      "!Or(x, y)",
+      "And(x >= 1, Or(y, x = 9), !(y > 3), x < 8)",
+      "x - 3",
+      "Or(0)",
+  };
+
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+
+  // More rows than one chunk.
+  const size_t kRowCount = 5000;
+  std::vector<double> x(kRowCount);
+  std::vector<double> y(kRowCount);
+  for (size_t i = 0; i < kRowCount; ++i) {
+    x[i] = static_cast<double>(i * 7 % 11);
+    y[i] = static_cast<double>(i * 3 % 5);
+  }
+  const double* const columns[] = {x.data(), y.data()};
+
+  for (const char* formula : kFormulas) {
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    ASSERT_TRUE(expression.Compile());
+
+    std::vector<uint32_t> expected;
+    for (size_t i = 0; i < kRowCount; ++i) {
+      const double row[] = {x[i], y[i]};
+      EvaluationContext context;
+      context.numbers = row;
+      if (expression.Calculate(context))
+        expected.emplace_back(static_cast<uint32_t>(i));
+    }
+
+    auto filter = FilterProgram::Compile(*expression.root_token().token());
+    std::vector<uint32_t> selection(kRowCount);
+    selection.resize(filter.Select(columns, kRowCount, selection.data()));
+    EXPECT_EQ(expected, selection) << formula;
+  }
+}
+
+TEST(FilterProgram, EvaluatesOperandsOnlyForUndecidedRows) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+
+  const size_t kRowCount = 1000;
+  std::vector<double> x(kRowCount);
+  std::vector<double> y(kRowCount, 1);
+  for (size_t i = 0; i < kRowCount; ++i)
+    x[i] = static_cast<double>(i % 10);
+  const double* const columns[] = {x.data(), y.data()};
+  std::vector<uint32_t> selection(kRowCount);
+
+  Expression conjunction;
+  ParseCounted(conjunction, "And(x > 6, Counted(y) < 3, x < 8)",
+               symbol_table);
+  auto and_filter = FilterProgram::Compile(*conjunction.root_token().token());
+  EXPECT_EQ(3u, and_filter.predicate_count());
+  counted_calls = 0;
+  EXPECT_EQ(100u, and_filter.Select(columns, kRowCount, selection.data()));
+  EXPECT_EQ(300, counted_calls);
+  EXPECT_EQ(7u, selection[0]);
+
+  Expression disjunction;
+  ParseCounted(disjunction, "Or(x > 6, Counted(y) > 3)", symbol_table);
+  auto or_filter = FilterProgram::Compile(*disjunction.root_token().token());
+  counted_calls = 0;
+  EXPECT_EQ(300u, or_filter.Select(columns, kRowCount, selection.data()));
+  EXPECT_EQ(700, counted_calls);
+}
+
+TEST(FilterProgram, DropsRowsFromTheMiddleOfTheSelection) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  const double x[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  const double* const columns[] = {x};
+  uint32_t selection[10] = {};
+
+  const std::pair<const char*, std::vector<uint32_t>> kCases[] = {
+      {"Or(x = 4, x = 5, Or(x = 2, x = 7))", {2, 4, 5, 7}},
+      {"!Or(x = 3, x = 6)", {0, 1, 2, 4, 5, 7, 8, 9}},
+      {"And(x > 1, !(x = 5), x < 9)", {2, 3, 4, 6, 7, 8}},
+      {"Or(And(x > 2, !(x = 4)), x = 1)", {1, 3, 5, 6, 7, 8, 9}},
+  };
+  for (const auto& [formula, expected] : kCases) {
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    auto filter = FilterProgram::Compile(*expression.root_token().token());
+    const size_t count = filter.Select(columns, std::size(x), selection);
+    EXPECT_EQ(expected, std::vector<uint32_t>(selection, selection + count))
+        << formula;
+  }
+}
+
+TEST(IncrementalProgram, MatchesFullEvaluationAfterUpdates) {
+  SymbolTable symbol_table;
+  Expression expression;
+  expression.Parse(
+      "If(x > y, Sqrt(x * x + z), Min(y, z) - x) + And(z, x < 5) * "
+      "Max(x, y, z)",
+      symbol_table);
+  auto program = IncrementalProgram::Compile(*expression.root_token().token());
+  EXPECT_EQ((std::vector<size_t>{0, 1, 2}), program.slots());
+
+  double row[] = {1, 2, 3};
+  EvaluationContext context;
+  context.numbers = row;
+  EXPECT_TRUE(program.dirty());
+  EXPECT_EQ(expression.Calculate(context), program.Calculate(&context));
+  EXPECT_FALSE(program.dirty());
+
+  uint32_t state = 1;
+  for (int step = 0; step < 200; ++step) {
+    state = state * 1103515245 + 12345;
+    const size_t slot = (state >> 16) % 3;
+    row[slot] = static_cast<double>((state >> 8) % 11) - 3;
+    program.Invalidate(slot);
+    EXPECT_TRUE(SameNumber(expression.Calculate(context),
+                           program.Calculate(&context)))
+        << "step " << step;
+  }
+}
+
+TEST(IncrementalProgram, RecomputesOnlyDirtyPath) {
+  SymbolTable symbol_table;
+  Expression sum;
+  ParseCounted(sum, "Counted(x) * 2 + Counted(y) * 3", symbol_table);
+  auto program = IncrementalProgram::Compile(*sum.root_token().token());
+
+  double row[] = {1, 2, 3};
+  EvaluationContext context;
+  context.numbers = row;
+  counted_calls = 0;
+  EXPECT_EQ(Value(8), program.Calculate(&context));
+  EXPECT_EQ(2, counted_calls);
+
+  row[1] = 4;
+  program.Invalidate(1);
+  EXPECT_EQ(Value(14), program.Calculate(&context));
+  EXPECT_EQ(3, counted_calls);
+  // y, Counted(y), the product and the sum.
+  EXPECT_EQ(4u, program.recalculated_count());
+
+  program.Invalidate(2);
+  EXPECT_EQ(Value(14), program.Calculate(&context));
+  EXPECT_EQ(0u, program.recalculated_count());
+
+  // Updates below the branch If did not take are picked up once it does.
+  Expression conditional;
+  ParseCounted(conditional, "If(x > 0, Counted(y), Counted(z))", symbol_table);
+  auto branch = IncrementalProgram::Compile(*conditional.root_token().token());
+  counted_calls = 0;
+  EXPECT_EQ(Value(4), branch.Calculate(&context));
+  row[2] = 5;
+  branch.Invalidate(2);
+  EXPECT_FALSE(branch.dirty());
+  EXPECT_EQ(Value(4), branch.Calculate(&context));
+  EXPECT_EQ(1, counted_calls);
+  row[0] = 0;
+  branch.Invalidate(0);
+  EXPECT_EQ(Value(5), branch.Calculate(&context));
+  EXPECT_EQ(2, counted_calls);
+}
+
+TEST(ExpressionSet, SharesSubtreesAndLiteralsAcrossFormulas) {
+  SymbolTable symbol_table;
+  for (const char* name : {"a", "b", "c"})
+    symbol_table.Declare(name, StaticType::Number);
+  ExpressionSet set{symbol_table};
+  const char* const formulas[] = {
+      "Max(a, b, c) * 2",
+      "Max(a, b, c) + Sqrt(a * a + b * b)",
+      "If(Sqrt(a * a + b * b) > c, a, b)",
+  };
+  for (const char* formula : formulas)
+    set.Add(formula);
+  EXPECT_EQ(3u, set.size());
+
+  TokenInfo product;
+  TokenInfo sum;
+  ASSERT_TRUE(set.root_token(0).token()->Describe(product));
+  ASSERT_TRUE(set.root_token(1).token()->Describe(sum));
+  EXPECT_EQ(product.operands[0], sum.operands[0]);
+
+  ExpressionSet strings;
+  strings.parser_delegate().set_fold_constants(false);
+  strings.Add("\"long literal\" + \"a\"");
+  strings.Add("\"long literal\" + \"b\"");
+  TokenInfo first;
+  TokenInfo second;
+  ASSERT_TRUE(strings.root_token(0).token()->Describe(first));
+  ASSERT_TRUE(strings.root_token(1).token()->Describe(second));
+  EXPECT_EQ(first.operands[0], second.operands[0]);
+
+  EXPECT_TRUE(set.Compile());
+  EXPECT_TRUE(set.is_numeric());
+  EXPECT_EQ(2u, set.program().shared_count());
+  EXPECT_EQ(3u, set.program().result_count());
+
+  double row[] = {3, 4, 2};
+  EvaluationContext context;
+  context.numbers = row;
+  Value values[3];
+  double numbers[3];
+  set.CalculateAll(context, values);
+  set.CalculateAllNumbers(context, numbers);
+  for (size_t i = 0; i < set.size(); ++i) {
+    Expression expression;
+    expression.Parse(formulas[i], symbol_table);
+    const Value expected = expression.Calculate(context);
+    EXPECT_EQ(expected, set.Calculate(i, &context)) << formulas[i];
+    EXPECT_EQ(expected, values[i]) << formulas[i];
+    EXPECT_EQ(static_cast<double>(expected), numbers[i]) << formulas[i];
+  }
+
+  strings.Compile();
+  Value concatenations[2];
+  strings.CalculateAll(nullptr, concatenations);
+  EXPECT_EQ(Value("long literala"), concatenations[0]);
+  EXPECT_EQ(Value("long literalb"), concatenations[1]);
+}
+
+TEST(FormulaGraph, EvaluatesReferencesOnceInTopologicalOrder) {
+  SymbolTable symbol_table;
+  FormulaGraph graph{symbol_table};
+  graph.Define("ratio", "margin / revenue");
+  graph.Define("margin", "revenue - cost");
+  graph.Define("doubled", "margin * 2");
+  graph.Define("summary", "ratio + doubled");
+  graph.Define("fixed", "cost * 3");
+  graph.Build();
+
+  ASSERT_EQ(3u, graph.level_count());
+  EXPECT_EQ((std::vector<size_t>{1, 4}), graph.level(0));
+  EXPECT_EQ((std::vector<size_t>{0, 2}), graph.level(1));
+  EXPECT_EQ((std::vector<size_t>{3}), graph.level(2));
+
+  std::vector<Value> values(symbol_table.size());
+  values[*symbol_table.Find("revenue")] = 10;
+  values[*symbol_table.Find("cost")] = 6;
+  graph.Calculate(values.data());
+  EXPECT_EQ(Value(4), values[graph.slot(1)]);
+  EXPECT_EQ(Value(0.4), values[graph.slot(0)]);
+  EXPECT_EQ(Value(8.4), values[graph.slot(3)]);
+  EXPECT_EQ(Value(18), values[graph.slot(4)]);
+
+  ThreadPool pool{3};
+  values[*symbol_table.Find("cost")] = 2;
+  graph.Calculate(values.data(), &pool);
+  EXPECT_EQ(Value(16.8), values[graph.slot(3)]);
+
+  EXPECT_THROW(graph.Define("margin", "1"), std::runtime_error);
+}
+
+TEST(FormulaGraph, ReportsReferenceCycles) {
+  SymbolTable symbol_table;
+  FormulaGraph graph{symbol_table};
+  graph.Define("input", "x + 1");
+  graph.Define("a", "b + input");
+  graph.Define("b", "c * 2");
+  graph.Define("c", "If(input, a, 0)");
+  try {
+    graph.Build();
+    FAIL() << "cycle not detected";
+  } catch (const std::runtime_error& error) {
+    EXPECT_STREQ("circular formula reference: a -> b -> c -> a", error.what());
+  }
+}
+
+TEST(ThreadPool, CoversRangeAndRethrows) {
+  ThreadPool pool{4};
+  std::vector<int> hits(1000);
+  pool.ParallelFor(hits.size(), 7, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ++hits[i];
+  });
+  EXPECT_EQ(1000, std::count(hits.begin(), hits.end(), 1));
+
+  EXPECT_THROW(pool.ParallelFor(100, 1,
+                                [](size_t begin, size_t /*end*/) {
+                                  if (begin == 42)
+                                    throw std::runtime_error("failed");
+                                }),
+               std::runtime_error);
+}
+
+TEST(JitProgram, MatchesNumericProgram) {
+  if (!JitProgram::IsAvailable())
+    GTEST_SKIP() << "native code generation is not available";
+
+  SymbolTable symbol_table;
+  for (const char* name : {"x", "y", "z"})
+    symbol_table.Declare(name, StaticType::Number);
+  const char* const formulas[] = {
+      "x + y * z - x / y",
+      "-x ^ 2 + Sqrt(Abs(y)) - Sign(z)",
+      "(x = y) + (x < y) * 2 + (x > y) * 4 + (x <= y) * 8 + (x >= y) * 16",
+      "If(x > y, x - y, If(z, y - x, 0.5))",
+      "And(x, y) + Or(y, z) * 2 + !z * 4 + And(x, y, z) * 8",
+      "Min(x, y, z) * 10 + Max(x, y, z)",
+      "Sqrt(x * x + y * y) + If(z < 0, Sqrt(x * x + y * y), 1)",
+      "Sin(x) + ATan2(y, z) + Abs(z) ^ 0.5",
+  };
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double samples[] = {0, 1, -2.5, 1e-12, 3, nan, -0.0, 7.25};
+
+  for (const char* formula : formulas) {
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    ASSERT_TRUE(expression.Compile()) << formula;
+    ASSERT_TRUE(expression.is_numeric()) << formula;
+    auto jit = JitProgram::Compile(*expression.root_token().token());
+    EXPECT_TRUE(jit.reads_variables());
+    for (double x : samples) {
+      for (double y : samples) {
+        for (double z : {1.0, 0.0, -3.0, nan}) {
+          double row[] = {x, y, z};
+          EvaluationContext context;
+          context.numbers = row;
+          EXPECT_TRUE(SameNumber(expression.CalculateNumber(context),
+                                 jit.Calculate(row)))
+              << formula << " x=" << x << " y=" << y << " z=" << z;
+        }
+      }
+    }
+  }
+}
+
+TEST(JitProgram, EvaluatesSharedNodesOnceAndFallsBack) {
+  if (!JitProgram::IsAvailable())
+    GTEST_SKIP() << "native code generation is not available";
+
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+  Expression expression;
+  ParseCounted(expression, "If(x > 0, Counted(y) * Counted(y), 0)",
+               symbol_table);
+  EXPECT_TRUE(expression.CompileNative());
+  EXPECT_TRUE(expression.is_native());
+
+  double row[] = {1, 3};
+  EvaluationContext context;
+  context.numbers = row;
+  counted_calls = 0;
+  EXPECT_EQ(Value(9), expression.Calculate(context));
+  EXPECT_EQ(1, counted_calls);
+  row[0] = 0;
+  EXPECT_EQ(0, expression.CalculateNumber(context));
+  EXPECT_EQ(1, counted_calls);
+
+  Expression constant;
+  constant.Parse("Max(1, 2) * 3");
+  EXPECT_TRUE(constant.CompileNative());
+  EXPECT_EQ(Value(6), constant.Calculate());
+
+  Expression strings;
+  strings.Parse("\"a\" + \"b\"");
+  EXPECT_FALSE(strings.CompileNative());
+  EXPECT_TRUE(strings.is_compiled());
+  EXPECT_EQ(Value("ab"), strings.Calculate());
+  EXPECT_THROW(JitProgram::Compile(*strings.root_token().token()),
+               std::runtime_error);
+}
+
+TEST(JitProgram, CallsCustomFunctionsWithStandardNames) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  Expression custom;
+  ParseWithCustomAbsAndSqrt(custom, "Abs(x) + Sqrt(x)", symbol_table);
+  EXPECT_EQ(JitProgram::IsAvailable(), custom.CompileNative());
+  const double row[] = {-2};
+  EvaluationContext context;
+  context.numbers = row;
+  EXPECT_EQ(-12, custom.CalculateNumber(context));
+}
+
+TEST(CodeGenerator, GeneratedFormulasMatchNumericProgram) {
+  FormulaRegistry registry;
+  RegisterTestFormulas(registry);
+
+  // Same order as generated_formulas.txt, so variables get the same slots.
+  const char* const formulas[] = {
+      "x + y * z - x / y",
+      "-x ^ 2 + Sqrt(Abs(y)) - Sign(z)",
+      "(x = y) + (x < y) * 2 + (x > y) * 4 + (x <= y) * 8 + (x >= y) * 16",
+      "If(x > y, x - y, If(z, y - x, 0.5))",
+      "And(x, y) + Or(y, z) * 2 + !z * 4 + And(x, y, z) * 8",
+      "Min(x, y, z) * 10 + Max(x, y, z)",
+      "Sqrt(x * x + y * y) + If(z < 0, Sqrt(x * x + y * y), 1)",
+      "Sin(x) + ATan2(y, z) + Abs(z) ^ 0.5 + Not(x) * BitXor(y, z)",
+      "1 / 0 + Cos(0.25) * -3",
+  };
+  ASSERT_EQ(std::size(formulas), registry.size());
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double samples[] = {0, 1, -2.5, 1e-12, 3, nan, -0.0, 7.25};
+
+  SymbolTable symbol_table;
+  for (const char* name : {"x", "y", "z"})
+    symbol_table.Declare(name, StaticType::Number);
+  for (const char* formula : formulas) {
+    const GeneratedFormula* generated = registry.Find(formula);
+    ASSERT_NE(nullptr, generated) << formula;
+    EXPECT_EQ(generated, registry.FindHash(HashFormula(formula)));
+
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    ASSERT_TRUE(expression.Compile()) << formula;
+    for (double x : samples) {
+      for (double y : samples) {
+        for (double z : {1.0, 0.0, -3.0, nan}) {
+          double row[] = {x, y, z};
+          EvaluationContext context;
+          context.numbers = row;
+          EXPECT_TRUE(SameNumber(expression.CalculateNumber(context),
+                                 generated->function(row)))
+              << formula << " x=" << x << " y=" << y << " z=" << z;
+        }
+      }
+    }
+  }
+
+  EXPECT_EQ(nullptr, registry.Find("x + y"));
+  EXPECT_THROW(RegisterTestFormulas(registry), std::runtime_error);
+}
+
+TEST(CodeGenerator, SharesSubtreesAndRejectsUntranslatableFormulas) {
+  SymbolTable symbol_table;
+  CodeGenerator generator{symbol_table};
+  EXPECT_EQ(0u, generator.Add("Sqrt(a * b) + Sqrt(a * b) * 2"));
+  EXPECT_EQ(1u, generator.Add("a - 1"));
+  EXPECT_EQ(0u, generator.Add("Sqrt(a * b) + Sqrt(a * b) * 2"));
+  EXPECT_EQ(2u, generator.size());
+
+  const std::string source = generator.Generate("RegisterShared");
+  EXPECT_NE(std::string::npos,
+            source.find("const double t0 = std::sqrt((numbers[0] * "
+                        "numbers[1]));\n  return (t0 + (t0 * 0x1p+1));"))
+      << source;
+  EXPECT_NE(std::string::npos,
+            source.find("void RegisterShared(expression::FormulaRegistry& "
+                        "registry)"));
+
+  EXPECT_THROW(generator.Add("a + \"b\""), std::runtime_error);
+  EXPECT_THROW(generator.Add("a +"), std::runtime_error);
+  EXPECT_EQ(2u, generator.size());
+}
+
+TEST(StaticExpression, ParsesAtCompileTime) {
+  constexpr auto choice =
+      EXPRESS_STATIC_EXPRESSION("If(2 - 1 - 1, 4 + 2, 3 * 3)");
+  static_assert(choice.Calculate() == 9);
+  static_assert(EXPRESS_STATIC_EXPRESSION("-2 ^ 2").Calculate() == 4);
+  static_assert(EXPRESS_STATIC_EXPRESSION("max(1, 5, 3) - .5").Calculate() ==
+                4.5);
+  static_assert(EXPRESS_STATIC_EXPRESSION("1 < 2 = 1").Calculate() == 1);
+  static_assert(EXPRESS_STATIC_EXPRESSION("Abs(-3) + Abs(2)").Calculate() == 5);
+
+  constexpr auto area = EXPRESS_STATIC_EXPRESSION("width * height + width");
+  static_assert(area.variable_count() == 2);
+  static_assert(area.variable_name(0) == "width");
+  static_assert(area.Find("height") == 1);
+  static_assert(!area.Find("depth").has_value());
+  constexpr double numbers[] = {2, 3};
+  static_assert(area.Calculate(numbers) == 8);
+  EXPECT_EQ(8, area.Calculate(numbers));
+}
+
+// Evaluates |formula| against the compiled runtime expression over
+// combinations of samples for its variables.
+template <class StaticFormula>
+void ExpectStaticMatchesRuntime(const StaticFormula& formula) {
+  SymbolTable symbol_table;
+  for (size_t slot = 0; slot < formula.variable_count(); ++slot)
+    symbol_table.Declare(formula.variable_name(slot), StaticType::Number);
+  const std::string text{formula.text()};
+  Expression expression;
+  expression.Parse(text.c_str(), symbol_table);
+  ASSERT_EQ(formula.variable_count(), symbol_table.size()) << text;
+  ASSERT_TRUE(expression.Compile());
+
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double samples[] = {0, 1, -2.5, 1e-17, 3, nan, -0.0};
+  const size_t sample_count = std::size(samples);
+  std::vector<double> row(formula.variable_count());
+  size_t combinations = 1;
+  for (size_t slot = 0; slot < row.size(); ++slot)
+    combinations *= sample_count;
+  for (size_t combination = 0; combination < combinations; ++combination) {
+    for (size_t slot = 0, rest = combination; slot < row.size(); ++slot) {
+      row[slot] = samples[rest % sample_count];
+      rest /= sample_count;
+    }
+    EvaluationContext context;
+    context.numbers = row.data();
+    EXPECT_TRUE(SameNumber(expression.CalculateNumber(context),
+                           formula.Calculate(row.data())))
+        << text << " combination " << combination;
+  }
+}
+
+TEST(StaticExpression, MatchesRuntimeParser) {
+  ExpectStaticMatchesRuntime(EXPRESS_STATIC_EXPRESSION("x + y * z - x / y"));
+  ExpectStaticMatchesRuntime(
+      EXPRESS_STATIC_EXPRESSION("-x ^ 2 + Sqrt(Abs(y)) - Sign(z) - --x"));
+  ExpectStaticMatchesRuntime(EXPRESS_STATIC_EXPRESSION(
+      "(x = y) + (x < y) * 2 + (x > y) * 4 + (x <= y) * 8 + (x >= y) * 16"));
+  ExpectStaticMatchesRuntime(
+      EXPRESS_STATIC_EXPRESSION("If(x > y, x - y, if(z, y - x, 0.5))"));
+  ExpectStaticMatchesRuntime(EXPRESS_STATIC_EXPRESSION(
+      "And(x, y) + Or(y, z) * 2 + !z * 4 + And(x, y, z) * 8 + Or(z)"));
+  ExpectStaticMatchesRuntime(
+      EXPRESS_STATIC_EXPRESSION("Min(x, y, z) * 10 + Max(x, y, z) + Min(y)"));
+  ExpectStaticMatchesRuntime(EXPRESS_STATIC_EXPRESSION(
+      "Sin(x) + Cos(y) * Tan(z) + ASin(x) - ACos(y) + ATan(z) + ATan2(y, z)"));
+  ExpectStaticMatchesRuntime(EXPRESS_STATIC_EXPRESSION(
+      "Not(x) * BitXor(y, z) + x ^ y ^ z + 1.25 * (2 - 3 - 4) / 7"));
+}
+
+TEST(Serialization, RoundTripsFormatTraversalAndValues) {
+  const char* const formulas[] = {
+      "1 + 2 * 3",
+      "(10 - (5 + 3)) * 3",
+      "If(2 - 1 - 1, Min(5, 4, 6, 8, 3, 10), Or(0, 1))",
+      "Min(x, Min(y), Max(x, 2, y)) + And(x, y, 1) - Or(y)",
+      "-x ^ 2 + !y + Sqrt(Abs(x)) * ATan2(y, x) + (x <= y) + (x >= 1)",
+      "Sqrt(x * x + y * y) + If(y < 0, Sqrt(x * x + y * y), 1)",
+      "\"alpha\" + \"beta\" = \"alphabeta\"",
+  };
+
+  FormatterDelegate formatter_delegate;
+  for (const char* formula : formulas) {
+    SymbolTable symbol_table;
+    Expression parsed;
+    parsed.Parse(formula, symbol_table);
+    const std::string image = parsed.Serialize();
+
+    Expression loaded;
+    loaded.Deserialize(image, symbol_table);
+    EXPECT_EQ(parsed.Format(formatter_delegate),
+              loaded.Format(formatter_delegate));
+    int parsed_tokens = 0;
+    int loaded_tokens = 0;
+    parsed.Traverse(&TokenCountCallback, &parsed_tokens);
+    loaded.Traverse(&TokenCountCallback, &loaded_tokens);
+    EXPECT_EQ(parsed_tokens, loaded_tokens) << formula;
+    EXPECT_EQ(image, loaded.Serialize()) << formula;
+
+    Value values[] = {Value(3), Value(-0.5)};
+    EvaluationContext context;
+    context.values = values;
+    EXPECT_EQ(parsed.Calculate(context), loaded.Calculate(context)) << formula;
+  }
+}
+
+TEST(Serialization, RejectsInvalidImages) {
+  SymbolTable symbol_table;
+  Expression expression;
+  expression.Parse("Max(a, 1) + 2", symbol_table);
+  const std::string image = expression.Serialize();
+
+  Expression loaded;
+  EXPECT_THROW(loaded.Deserialize(image), std::runtime_error);
+  EXPECT_THROW(loaded.Deserialize(image.substr(0, image.size() - 1),
+                                  symbol_table),
+               std::runtime_error);
+  std::string version = image;
+  version[4] = 2;
+  EXPECT_THROW(loaded.Deserialize(version, symbol_table), std::runtime_error);
+  EXPECT_THROW(loaded.Deserialize("", symbol_table), std::runtime_error);
+
+  Expression counted;
+  ParseCounted(counted, "Counted(a) + 1", symbol_table);
+  const std::string counted_image = counted.Serialize();
+  // The standard delegate does not know the custom function.
+  EXPECT_THROW(loaded.Deserialize(counted_image, symbol_table),
+               std::runtime_error);
+}
+
+// Returns the Format output and image of |formula|, or the error message,
+// and the number of tokens asked for.
+std::string ParseForComparison(const char* formula,
+                               bool recursive,
+                               size_t& node_count) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("A", StaticType::Number);
+  symbol_table.Declare("B", StaticType::Number);
+  LexerDelegate lexer_delegate;
+  Lexer lexer{formula, lexer_delegate, 0};
+  Allocator allocator;
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  parser_delegate.set_symbol_table(&symbol_table);
+  BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+      lexer, parser_delegate};
+  std::string result;
+  try {
+    std::optional<PolymorphicToken> root_token;
+    if (recursive) {
+      parser.ReadLexem();
+      root_token = parser.MakeBinaryOperator<PolymorphicToken>(0);
+      if (parser.next_lexem().lexem != LEX_END)
+        throw std::runtime_error{"End of expression is expected"};
+    } else {
+      root_token = parser.Parse<PolymorphicToken>();
+    }
+    root_token->Format(TestFormatterDelegate{}, result);
+    result += "|" + SerializeExpression(*root_token->token());
+  } catch (const std::runtime_error& error) {
+    result = std::string{"error: "} + error.what();
+  }
+  node_count = parser_delegate.node_count();
+  return result;
+}
+
+TEST(Parser, IterativeParseMatchesRecursiveDescent) {
+  std::string nested = "A";
+  for (int i = 0; i < 300; ++i)
+    nested = i % 2 ? "(" + nested + " + B)" : "Max(- " + nested + ", 1)";
+
+  const std::vector<std::string> formulas = {
+      "1",
+      "A + B * 2 - A / B ^ 2",
+      "A - B - 1 + 2 * A * B / 4",
+      "- - - A",
+      "-A ^ 2 + !B",
+      "-(A + B) * (A - B)",
+      "1 + 2 * 3 = 7",
+      "A <= B + 1 = (A >= 2)",
+      "If(A > B, Min(A, B, 3), Max(A - 1, -B))",
+      "Min(Max(A, 1), If(B, 2, 3)) + Min(A)",
+      "\"a\" + \"b\"",
+      "(((((A)))))",
+      nested,
+      "",
+      "()",
+      "(A + B",
+      "Min(A, B",
+      "Min(A B)",
+      "A B",
+      "A +",
+      "A + * B",
+      "1)",
+      "Min(A,)",
+      "Min()",
+      "Unknown(A)",
+      "C + 1",
+  };
+  for (const auto& formula : formulas) {
+    size_t recursive_nodes = 0;
+    size_t iterative_nodes = 0;
+    EXPECT_EQ(ParseForComparison(formula.c_str(), true, recursive_nodes),
+              ParseForComparison(formula.c_str(), false, iterative_nodes))
+        << formula;
+    EXPECT_EQ(recursive_nodes, iterative_nodes) << formula;
+  }
+}
+
+TEST(Parser, ParsesDeepNestingWithoutRecursion) {
+  constexpr int kDepth = 100000;
+  std::string unary(kDepth * 2, ' ');
+  for (int i = 0; i < kDepth; ++i)
+    unary[i * 2] = '-';
+  unary += "1";
+  Expression expression;
+  expression.Parse(unary.c_str());
+  EXPECT_EQ(Value(1), expression.Calculate(nullptr));
+
+  const std::string nested =
+      std::string(kDepth, '(') + "2" + std::string(kDepth, ')');
+  expression.Parse(nested.c_str());
+  EXPECT_EQ(Value(2), expression.Calculate(nullptr));
+}
+
+TEST(Expression, WalksDeepTreesWithoutRecursion) {
+  constexpr int kDepth = 100000;
+  std::string unary(kDepth * 2, ' ');
+  for (int i = 0; i < kDepth; ++i)
+    unary[i * 2] = '-';
+  unary += "1";
+  const std::string nested =
+      std::string(kDepth, '(') + "2" + std::string(kDepth, ')');
+  const std::pair<std::string, std::string> formulas[] = {
+      {unary, std::string(kDepth, '-') + "1"},
+      {nested, nested},
+  };
+
+  FormatterDelegate formatter_delegate;
+  for (const auto& [formula, formatted] : formulas) {
+    Expression expression;
+    expression.Parse(formula.c_str());
+    EXPECT_EQ(formatted, expression.Format(formatter_delegate));
+    int token_count = 0;
+    expression.Traverse(&TokenCountCallback, &token_count);
+    EXPECT_EQ(kDepth + 1, token_count);
+
+    const FlatTree flat_tree = expression.Flatten();
+    std::string flat_formatted;
+    flat_tree.Format(formatter_delegate, flat_formatted);
+    EXPECT_EQ(formatted, flat_formatted);
+    EXPECT_EQ(expression.Calculate(nullptr), flat_tree.Calculate(nullptr));
+
+    Expression deserialized;
+    deserialized.Deserialize(expression.Serialize());
+    EXPECT_EQ(formatted, deserialized.Format(formatter_delegate));
+
+    Expression clone;
+    expression.Clone(clone);
+    EXPECT_EQ(formatted, clone.Format(formatter_delegate));
+    EXPECT_TRUE(clone.Compact());
+    EXPECT_EQ(formatted, clone.Format(formatter_delegate));
+  }
+}
+
+TEST(Parser, LimitsDepthOfTreesOverVariables) {
+  constexpr size_t kMaxDepth =
+      BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>>::kMaxDepth;
+  // The variable is the deepest level.
+  const auto make_chain = [](size_t depth, const char* operand) {
+    std::string chain;
+    for (size_t i = 1; i < depth; ++i)
+      chain += "- ";
+    return chain + operand;
+  };
+  SymbolTable symbol_table;
+  const auto parse = [&symbol_table](const std::string& formula) {
+    LexerDelegate lexer_delegate;
+    Lexer lexer{formula.c_str(), lexer_delegate, 0};
+    Allocator allocator;
+    BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+    parser_delegate.set_symbol_table(&symbol_table);
+    BasicParser<Lexer, decltype(parser_delegate)> parser{lexer,
+                                                         parser_delegate};
+    parser.template Parse<PolymorphicToken>();
+    return parser.depth();
+  };
+
+  EXPECT_EQ(kMaxDepth, parse(make_chain(kMaxDepth, "x")));
+  EXPECT_THROW(parse(make_chain(kMaxDepth + 1, "x")), std::runtime_error);
+  // Folded constants are as deep as the subtrees they format as.
+  EXPECT_THROW(parse(make_chain(kMaxDepth + 1, "1")), std::runtime_error);
+  EXPECT_THROW(parse(std::string(kMaxDepth, '(') + "1" +
+                     std::string(kMaxDepth, ')')),
+               std::runtime_error);
+}
+
+TEST(Expression, ParsesTreesDeeperThanParserLimit) {
+  constexpr size_t kMaxDepth =
+      BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>>::kMaxDepth;
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  Value values[] = {Value(3)};
+  EvaluationContext context;
+  context.values = values;
+  FormatterDelegate formatter_delegate;
+
+  std::string chain;
+  for (size_t i = 0; i < kMaxDepth; ++i)
+    chain += "- ";
+  chain += "x";
+  Expression expression;
+  expression.Parse(chain.c_str() + 2, symbol_table);
+  EXPECT_FALSE(expression.is_compiled());
+  EXPECT_EQ(Value(kMaxDepth % 2 ? 3 : -3), expression.Calculate(&context));
+
+  // Deeper trees calculate through their compiled program.
+  expression.Parse(chain.c_str(), symbol_table);
+  EXPECT_TRUE(expression.is_compiled());
+  EXPECT_EQ(Value(kMaxDepth % 2 ? -3 : 3), expression.Calculate(&context));
+
+  // Left-deep operator chains are as deep as they are long.
+  constexpr int kTerms = 200000;
+  std::string sum = "x";
+  for (int i = 1; i < kTerms; ++i)
+    sum += " + x";
+  expression.Parse(sum.c_str(), symbol_table);
+  EXPECT_TRUE(expression.is_compiled());
+  EXPECT_EQ(Value(3.0 * kTerms), expression.Calculate(&context));
+  EXPECT_EQ(sum, expression.Format(formatter_delegate));
+  int token_count = 0;
+  expression.Traverse(&TokenCountCallback, &token_count);
+  EXPECT_EQ(kTerms * 2 - 1, token_count);
+  EXPECT_EQ(Value(3.0 * kTerms), expression.Flatten().Calculate(&context));
+
+  Expression clone;
+  expression.Clone(clone);
+  EXPECT_TRUE(clone.is_compiled());
+  EXPECT_EQ(Value(3.0 * kTerms), clone.Calculate(&context));
+
+  Expression deserialized;
+  deserialized.Deserialize(expression.Serialize(), symbol_table);
+  EXPECT_TRUE(deserialized.is_compiled());
+  EXPECT_EQ(Value(3.0 * kTerms), deserialized.Calculate(&context));
+
+  // Native code falls back to the program when the frame gets too large.
+  expression.CompileNative();
+  EXPECT_EQ(Value(3.0 * kTerms), expression.Calculate(&context));
+  EXPECT_TRUE(expression.CompileBatch());
+  const double column[] = {3};
+  const double* const columns[] = {column};
+  double result = 0;
+  expression.CalculateBatch(columns, 1, &result);
+  EXPECT_EQ(3.0 * kTerms, result);
+}
+
+TEST(Expression, CloneCopiesTreeWithoutSource) {
+  const char* const formulas[] = {
+      "(10 - (5 + 3)) * 3",
+      "If(2 - 1 - 1, Min(5, 4, 6, 8, 3, 10), Or(0, 1))",
+      "Min(x, Min(y), Max(x, 2, y)) + And(x, y, 1) - Or(y)",
+      "Sqrt(x * x + y * y) + If(y < 0, Sqrt(x * x + y * y), 1)",
+      "\"alpha\" + \"beta\" = \"alphabeta\"",
+  };
+
+  FormatterDelegate formatter_delegate;
+  for (const char* formula : formulas) {
+    SymbolTable symbol_table;
+    Expression clone;
+    std::string format;
+    int tokens = 0;
+    size_t nodes = 0;
+    Value value;
+    Value values[] = {Value(3), Value(-0.5)};
+    EvaluationContext context;
+    context.values = values;
+    {
+      Expression expression;
+      expression.Parse(formula, symbol_table);
+      expression.Compile();
+      expression.Clone(clone);
+      format = expression.Format(formatter_delegate);
+      expression.Traverse(&TokenCountCallback, &tokens);
+      nodes = expression.Flatten().node_count();
+      value = expression.Calculate(context);
+    }
+
+    EXPECT_TRUE(clone.is_compiled());
+    EXPECT_EQ(format, clone.Format(formatter_delegate));
+    int clone_tokens = 0;
+    clone.Traverse(&TokenCountCallback, &clone_tokens);
+    EXPECT_EQ(tokens, clone_tokens) << formula;
+    // Shared subtrees stay shared.
+    EXPECT_EQ(nodes, clone.Flatten().node_count()) << formula;
+    EXPECT_EQ(value, clone.Calculate(context)) << formula;
+  }
+}
+
+TEST(Expression, CloneRejectsCustomTokens) {
+  Expression expression;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"a * 2 + 1", lexer_delegate, 0};
+  Allocator allocator;
+  TestParserDelegate parser_delegate{allocator, {{"a", 4}}};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+  Expression clone;
+  clone.Parse("1");
+  EXPECT_THROW(expression.Clone(clone), std::runtime_error);
+  EXPECT_EQ(Value(1), clone.Calculate());
+}
+
+TEST(Expression, CompactFreesArenaSlack) {
+  const char* formula =
+      "If(x > 1, Min(x, 2, y), Sqrt(x * x + y * y)) * 1000000.125 + "
+      "(\"a long string literal\" = \"a long string literal\")";
+  SymbolTable symbol_table;
+  Expression expression;
+  expression.Parse(formula, symbol_table);
+  expression.Compile();
+  const size_t size = expression.allocator().size();
+  EXPECT_GT(expression.allocator().capacity(), size + 64);
+
+  FormatterDelegate formatter_delegate;
+  const std::string format = expression.Format(formatter_delegate);
+  Value values[] = {Value(3), Value(-0.5)};
+  EvaluationContext context;
+  context.values = values;
+  const Value value = expression.Calculate(context);
+
+  EXPECT_TRUE(expression.Compact());
+  EXPECT_TRUE(expression.is_compiled());
+  EXPECT_LE(expression.allocator().size(), size);
+  EXPECT_LT(expression.allocator().capacity(),
+            expression.allocator().size() + alignof(std::max_align_t));
+  EXPECT_EQ(format, expression.Format(formatter_delegate));
+  EXPECT_EQ(value, expression.Calculate(context));
+
+  Expression compacted;
+  compacted.set_compact_on_parse(true);
+  compacted.Parse(formula, symbol_table);
+  EXPECT_EQ(expression.allocator().capacity(),
+            compacted.allocator().capacity());
+
+  Expression custom;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"a * 2 + 1", lexer_delegate, 0};
+  Allocator allocator;
+  TestParserDelegate parser_delegate{allocator, {{"a", 4}}};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  custom.Parse(parser, allocator);
+  EXPECT_FALSE(custom.Compact());
+  EXPECT_EQ(Value(9), custom.Calculate());
+}
+
+bool FlatNodeCountCallback(const FlatTree& /*tree*/,
+                           size_t /*node*/,
+                           void* param) {
+  ++*static_cast<int*>(param);
+  return true;
+}
+
+TEST(FlatTree, MatchesTokenTree) {
+  const char* const formulas[] = {
+      "1 + 2 * 3",
+      "(10 - (5 + 3)) * 3",
+      "If(2 - 1 - 1, Min(5, 4, 6, 8, 3, 10), Or(0, 1))",
+      "Min(x, Min(y), Max(x, 2, y)) + And(x, y, 1) - Or(y)",
+      "-x ^ 2 + !y + Sqrt(Abs(x)) * ATan2(y, x) + (x <= y) + (x >= 1)",
+      "If(y, x / y, 0) + And(y, 1 / y) + Or(x, y) * Max(x, y)",
+      "\"alpha\" + \"beta\" = \"alphabeta\"",
+  };
+
+  FormatterDelegate formatter_delegate;
+  for (const char* formula : formulas) {
+    SymbolTable symbol_table;
+    Expression expression;
+    expression.Parse(formula, symbol_table);
+    const FlatTree flat_tree = expression.Flatten();
+
+    std::string flat_formula;
+    flat_tree.Format(formatter_delegate, flat_formula);
+    EXPECT_EQ(expression.Format(formatter_delegate), flat_formula);
+    int tokens = 0;
+    int nodes = 0;
+    expression.Traverse(&TokenCountCallback, &tokens);
+    flat_tree.Traverse(&FlatNodeCountCallback, &nodes);
+    EXPECT_EQ(tokens, nodes) << formula;
+
+    for (double y : {-0.5, 0.0, 2.0}) {
+      Value values[] = {Value(3), Value(y)};
+      EvaluationContext context;
+      context.values = values;
+      EXPECT_EQ(expression.Calculate(context), flat_tree.Calculate(&context))
+          << formula;
+    }
+  }
+}
+
+TEST(FlatTree, RoundTripsValidatedFormulas) {
+  TestFormatterDelegate formatter_delegate;
+  for (const ValidatedFormula& formula : GetValidatedFormulas()) {
+    Allocator allocator;
+    TestParserDelegate parser_delegate{allocator, formula.variables};
+    Expression ex;
+    ParseValidatedFormula(ex, formula.formula, parser_delegate, allocator);
+    const FlatTree flat_tree = ex.Flatten();
+    std::string flat_formula;
+    flat_tree.Format(formatter_delegate, flat_formula);
+    EXPECT_EQ(formula.formula, flat_formula);
+    EXPECT_EQ(formula.expected_result, flat_tree.Calculate(nullptr))
+        << formula.formula;
+  }
+}
+
+TEST(FlatTree, SharesSubtreesAndStoresOperandsFirst) {
+  SymbolTable symbol_table;
+  Expression expression;
+  expression.Parse("Sqrt(x * x + y * y) + If(y < 0, Sqrt(x * x + y * y), 1)",
+                   symbol_table);
+  const FlatTree flat_tree = expression.Flatten();
+
+  int nodes = 0;
+  flat_tree.Traverse(&FlatNodeCountCallback, &nodes);
+  EXPECT_EQ(22, nodes);
+  EXPECT_EQ(11u, flat_tree.node_count());
+  // Nodes and operand indices, then names and functions.
+  EXPECT_GT(flat_tree.memory_usage(), 16 * flat_tree.node_count() + 4 * 14);
+
+  for (size_t node = 0; node < flat_tree.node_count(); ++node) {
+    for (size_t i = 0; i < flat_tree.operand_count(node); ++i)
+      EXPECT_LT(flat_tree.operand(node, i), node);
+  }
+  EXPECT_EQ(Opcode::Add, flat_tree.opcode(flat_tree.root()));
+  const size_t condition = flat_tree.operand(
+      flat_tree.operand(flat_tree.root(), 1), 0);
+  EXPECT_EQ(Opcode::Less, flat_tree.opcode(condition));
+  const size_t y = flat_tree.operand(condition, 0);
+  EXPECT_EQ("y", flat_tree.string(y));
+  EXPECT_EQ(*symbol_table.Find("y"), flat_tree.slot(y));
+}
+
+TEST(FlatTree, KeepsFoldedConstantsAndCustomTokens) {
+  Expression expression;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"a * (2 + 3) + Max(a, 1)", lexer_delegate, 0};
+  Allocator allocator;
+  TestParserDelegate parser_delegate{allocator, {{"a", 4}}};
+  BasicParser<Lexer, TestParserDelegate> parser{lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+  const FlatTree flat_tree = expression.Flatten();
+
+  std::string flat_formula;
+  flat_tree.Format(TestFormatterDelegate{}, flat_formula);
+  EXPECT_EQ("a * (2 + 3) + Max(a, 1)", flat_formula);
+  EXPECT_EQ(Value(24), flat_tree.Calculate(nullptr));
+
+  const size_t product = flat_tree.operand(flat_tree.root(), 0);
+  EXPECT_TRUE(flat_tree.is_custom(flat_tree.operand(product, 0)));
+  const size_t constant = flat_tree.operand(product, 1);
+  EXPECT_TRUE(flat_tree.is_constant(constant));
+  EXPECT_EQ(5, flat_tree.number(constant));
+}
+
 TEST(Express, FoldedVariadicFunctionsChangeTraversalShape) {
   EXPECT_EQ(5, GetTokenCount("Min(5, 6, 4)"));
   EXPECT_EQ(7, GetTokenCount("Or(0, 0, 1, 0)"));
@@ -484,6 +2380,8 @@ TEST(Expression, CustomExpression) {
   BasicExpression<CustomToken> e;
   e.Parse("5 + 6");
   EXPECT_EQ(11, e.Calculate(nullptr));
+  EXPECT_FALSE(e.Compile());
+  EXPECT_EQ(11, e.Calculate(nullptr));
 
   BasicExpression<CustomToken> variadic_expression;
   variadic_expression.Parse("Min(5, 6, 4)");
@@ -540,6 +2438,433 @@ TEST(Allocator, ReserveBytesCanUpgradeAlignmentAfterExistingAllocations) {
             reinterpret_cast<std::uintptr_t>(ptr) % alignof(WideAlignedStorage));
 }
 
+TEST(Allocator, GrowsGeometricallyAndReportsStats) {
+  Allocator allocator;
+  allocator.allocate(1, 1);
+  allocator.allocate(8, 8);
+  AllocatorStats stats = allocator.stats();
+  EXPECT_EQ(9u, stats.requested_bytes);
+  EXPECT_EQ(7u, stats.alignment_waste);
+  EXPECT_EQ(1u, stats.chunk_count);
+  EXPECT_EQ(64u, stats.reserved_bytes);
+
+  // Each overflow doubles the last chunk.
+  for (int i = 0; i < 10; ++i)
+    allocator.allocate(48, 8);
+  stats = allocator.stats();
+  EXPECT_EQ(4u, stats.chunk_count);
+  EXPECT_EQ(64u + 128u + 256u + 512u, stats.reserved_bytes);
+  EXPECT_EQ(489u, stats.requested_bytes);
+  EXPECT_EQ(allocator.size(), stats.requested_bytes + stats.alignment_waste);
+
+  // Larger allocations get a chunk of their own size.
+  allocator.allocate(5000);
+  EXPECT_EQ(5000u, allocator.stats().reserved_bytes - stats.reserved_bytes);
+}
+
+TEST(Allocator, ResetKeepsLargestChunk) {
+  Allocator allocator;
+  allocator.reserve_bytes(64);
+  allocator.allocate(64);
+  allocator.reserve_bytes(1024);
+  allocator.allocate(512);
+  allocator.allocate(1024);
+  EXPECT_EQ(3u, allocator.stats().chunk_count);
+
+  allocator.reset();
+  AllocatorStats stats = allocator.stats();
+  EXPECT_EQ(1u, stats.chunk_count);
+  EXPECT_EQ(2048u, stats.reserved_bytes);
+  EXPECT_EQ(0u, stats.requested_bytes);
+  EXPECT_EQ(0u, allocator.size());
+  allocator.allocate(16);
+
+  allocator.clear();
+  EXPECT_EQ(0u, allocator.stats().chunk_count);
+}
+
+TEST(Allocator, ExpressionReusesArenaAfterClear) {
+  ArenaPool& pool = *ArenaPool::ForThread();
+  pool.clear();
+
+  Expression expression;
+  expression.Parse("If(8 - 3, Min(5, 9, 4), 1 + 2)");
+  const AllocatorStats parsed = expression.allocator().stats();
+  EXPECT_GT(parsed.requested_bytes, 0u);
+
+  // The arena goes back to the pool with its largest chunk.
+  expression.Clear();
+  EXPECT_EQ(0u, expression.allocator().stats().chunk_count);
+  ASSERT_EQ(1u, pool.size());
+
+  expression.Parse("1 + 2");
+  EXPECT_EQ(Value(3), expression.Calculate());
+  EXPECT_EQ(0u, pool.size());
+  EXPECT_EQ(1u, expression.allocator().stats().chunk_count);
+  EXPECT_LE(expression.allocator().stats().reserved_bytes,
+            parsed.reserved_bytes);
+
+  // Failed parses and replaced trees give their arenas back too.
+  Expression failed;
+  EXPECT_THROW(failed.Parse("1 +"), std::runtime_error);
+  EXPECT_EQ(1u, pool.size());
+  expression.Parse("2 + 3");
+  EXPECT_EQ(1u, pool.size());
+}
+
+TEST(Allocator, ParsesWithoutHeapAllocationOnceWarm) {
+  SymbolTable symbol_table;
+  symbol_table.Declare("x", StaticType::Number);
+  symbol_table.Declare("y", StaticType::Number);
+  const char* const kFormula =
+      "If(x > 2, Max(x, y, 3) * (y - 1), Min(4, x + y, 2 ^ 3)) + -x / 5";
+
+  // The first parses fill the arena pools of the thread.
+  Expression expression;
+  for (int i = 0; i < 3; ++i)
+    expression.Parse(kFormula, symbol_table);
+
+  const size_t allocations = heap_allocation_count;
+  expression.Parse(kFormula, symbol_table);
+  EXPECT_EQ(allocations, heap_allocation_count);
+
+  Expression other;
+  other.Parse(kFormula, symbol_table);
+  other.Clear();
+  EXPECT_EQ(allocations, heap_allocation_count);
+}
+
+TEST(Allocator, AllocatesOnlyToFoldLongStrings) {
+  const auto count_allocations = [](const char* formula) {
+    Expression expression;
+    for (int i = 0; i < 3; ++i)
+      expression.Parse(formula);
+    const size_t allocations = heap_allocation_count;
+    expression.Parse(formula);
+    return heap_allocation_count - allocations;
+  };
+
+  // Literals are copied to the arena, folded strings up to
+  // Value::kInlineStringCapacity characters stay inline in the Values.
+  static_assert(Value::kInlineStringCapacity == 23);
+  EXPECT_EQ(0u, count_allocations("\"a literal past the inline capacity\""));
+  EXPECT_EQ(0u, count_allocations("\"ab\" + \"cd\" = \"abcd\""));
+  EXPECT_EQ(0u, count_allocations("\"abcdefghijk\" + \"lmnopqrstuvw\""));
+  // One more character puts the folded string on the heap.
+  EXPECT_LT(0u, count_allocations("\"abcdefghijk\" + \"lmnopqrstuvwx\""));
+}
+
+TEST(ArenaPool, KeepsArenasWithinCaps) {
+  ArenaPool pool;
+  pool.set_max_arenas(2);
+  pool.set_max_arena_bytes(1024);
+
+  for (size_t size : {64, 128, 256, 2048}) {
+    Allocator allocator;
+    allocator.allocate(size);
+    pool.Release(std::move(allocator));
+  }
+  // The arena over 1024 bytes is freed, the third one does not fit.
+  EXPECT_EQ(2u, pool.size());
+  pool.Release(Allocator{});
+  EXPECT_EQ(2u, pool.size());
+
+  Allocator allocator = pool.Acquire();
+  EXPECT_EQ(128u, allocator.capacity());
+  EXPECT_EQ(0u, allocator.size());
+  pool.set_max_arena_bytes(32);
+  EXPECT_EQ(0u, pool.size());
+  EXPECT_EQ(0u, pool.Acquire().capacity());
+}
+
+TEST(Allocator, ServesBufferBeforeChunks) {
+  alignas(std::max_align_t) std::byte buffer[64];
+  Allocator allocator{buffer, sizeof(buffer)};
+  EXPECT_EQ(buffer, allocator.allocate(32));
+  EXPECT_EQ(1u, allocator.stats().chunk_count);
+
+  // The first chunk grows from the buffer size.
+  allocator.allocate(64);
+  EXPECT_EQ(2u, allocator.stats().chunk_count);
+  EXPECT_EQ(64u + 128u, allocator.capacity());
+
+  allocator.reset();
+  EXPECT_EQ(nullptr, allocator.buffer());
+  EXPECT_EQ(128u, allocator.capacity());
+}
+
+TEST(Allocator, ReservesOnlyBeyondBuffer) {
+  alignas(std::max_align_t) std::byte buffer[64];
+  Allocator allocator{buffer, sizeof(buffer)};
+  allocator.reserve_beyond_buffer(512);
+  EXPECT_EQ(1u, allocator.stats().chunk_count);
+  EXPECT_EQ(buffer, allocator.allocate(64));
+
+  // The first chunk holds the rest of the reservation.
+  allocator.allocate(32);
+  EXPECT_EQ(2u, allocator.stats().chunk_count);
+  EXPECT_EQ(64u + 448u, allocator.capacity());
+}
+
+TEST(Expression, ParsesSmallFormulasIntoInlineArena) {
+  BasicExpression<PolymorphicToken, 512> expression;
+  expression.Parse("Min(4, 2) + 3");
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_EQ(1u, expression.allocator().stats().chunk_count);
+  EXPECT_EQ(512u, expression.allocator().capacity());
+  EXPECT_EQ(Value(5), expression.Calculate(nullptr));
+  EXPECT_EQ("Min(4, 2) + 3", expression.Format(TestFormatterDelegate{}));
+
+  // The inline arena holds the old tree while the new one is parsed.
+  expression.Parse("1 + 2");
+  EXPECT_FALSE(expression.uses_inline_arena());
+  EXPECT_EQ(Value(3), expression.Calculate(nullptr));
+  expression.Parse("2 * 5");
+  EXPECT_TRUE(expression.uses_inline_arena());
+
+  // Swapping moves the inline tree to the heap first.
+  BasicExpression<PolymorphicToken, 512> other;
+  other.Parse("7");
+  other.swap(expression);
+  EXPECT_FALSE(other.uses_inline_arena());
+  EXPECT_FALSE(expression.uses_inline_arena());
+  EXPECT_EQ(Value(10), other.Calculate(nullptr));
+  EXPECT_EQ(Value(7), expression.Calculate(nullptr));
+
+  // Long formulas whose trees fit stay inline.
+  const std::string padded = std::string(80, ' ') + "42";
+  expression.Parse(padded.c_str());
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_EQ(1u, expression.allocator().stats().chunk_count);
+  EXPECT_EQ(512u, expression.allocator().capacity());
+  EXPECT_EQ(Value(42), expression.Calculate(nullptr));
+
+  // Larger trees continue in heap chunks.
+  expression.Parse("7");
+  std::string formula = "1";
+  for (int i = 0; i < 100; ++i)
+    formula += " + " + std::to_string(i);
+  expression.Parse(formula.c_str());
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_GT(expression.allocator().stats().chunk_count, 1u);
+  EXPECT_EQ(Value(4951), expression.Calculate(nullptr));
+}
+
+TEST(Expression, CompactKeepsInlineArena) {
+  BasicExpression<PolymorphicToken, 512> expression;
+  expression.Parse("Min(4, 2) + 3");
+  EXPECT_TRUE(expression.Compact());
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_EQ(Value(5), expression.Calculate(nullptr));
+
+  // Trees on the heap move into the free inline arena when they fit.
+  expression.Parse("1 + 2");
+  EXPECT_FALSE(expression.uses_inline_arena());
+  EXPECT_TRUE(expression.Compact());
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_EQ(1u, expression.allocator().stats().chunk_count);
+  EXPECT_EQ(Value(3), expression.Calculate(nullptr));
+
+  // Clones are made in the inline arena of the copy.
+  BasicExpression<PolymorphicToken, 512> clone;
+  expression.Clone(clone);
+  EXPECT_TRUE(clone.uses_inline_arena());
+  EXPECT_EQ(Value(3), clone.Calculate(nullptr));
+
+  // Larger trees move into one heap block.
+  expression.Parse("7");
+  std::string formula = "1";
+  for (int i = 0; i < 100; ++i)
+    formula += " + " + std::to_string(i);
+  expression.Parse(formula.c_str());
+  EXPECT_TRUE(expression.uses_inline_arena());
+  EXPECT_GT(expression.allocator().stats().chunk_count, 1u);
+  EXPECT_TRUE(expression.Compact());
+  EXPECT_FALSE(expression.uses_inline_arena());
+  EXPECT_EQ(1u, expression.allocator().stats().chunk_count);
+  EXPECT_EQ(Value(4951), expression.Calculate(nullptr));
+}
+
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  size_t allocated_bytes = 0;
+  size_t allocation_count = 0;
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    allocated_bytes += bytes;
+    ++allocation_count;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override {
+    allocated_bytes -= bytes;
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST(Allocator, TakesChunksFromUpstreamResource) {
+  CountingResource resource;
+  {
+    Allocator allocator{&resource};
+    allocator.allocate(100);
+    allocator.allocate(16, 64);
+    EXPECT_EQ(allocator.capacity(), resource.allocated_bytes);
+    EXPECT_EQ(2u, resource.allocation_count);
+
+    Allocator moved{std::move(allocator)};
+    EXPECT_EQ(&resource, moved.upstream());
+    moved.reset();
+    EXPECT_EQ(moved.capacity(), resource.allocated_bytes);
+  }
+  EXPECT_EQ(0u, resource.allocated_bytes);
+
+  // Expressions parse and clone into the resource, past the arena pool.
+  const size_t pooled_arenas = ArenaPool::ForThread()->size();
+  Expression expression;
+  expression.set_memory_resource(&resource);
+  expression.Parse("Min(4, 2) + 3");
+  EXPECT_EQ(expression.allocator().capacity(), resource.allocated_bytes);
+  Expression clone;
+  clone.set_memory_resource(&resource);
+  expression.Clone(clone);
+  EXPECT_EQ(expression.allocator().capacity() + clone.allocator().capacity(),
+            resource.allocated_bytes);
+  expression.Clear();
+  clone.Clear();
+  EXPECT_EQ(0u, resource.allocated_bytes);
+  EXPECT_EQ(pooled_arenas, ArenaPool::ForThread()->size());
+}
+
+TEST(HugePageResource, MapsLargeBlocksAndForwardsSmallOnes) {
+  CountingResource upstream;
+  HugePageResource resource{&upstream};
+  const size_t huge_page_size = resource.huge_page_size();
+
+  void* small = resource.allocate(256);
+  EXPECT_EQ(256u, upstream.allocated_bytes);
+  resource.deallocate(small, 256);
+  EXPECT_EQ(0u, upstream.allocated_bytes);
+
+  void* large = resource.allocate(huge_page_size / 2 + 1);
+  if (!HugePageResource::IsAvailable()) {
+    EXPECT_EQ(huge_page_size / 2 + 1, upstream.allocated_bytes);
+    resource.deallocate(large, huge_page_size / 2 + 1);
+    return;
+  }
+  EXPECT_EQ(0u, upstream.allocated_bytes);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(large) % 4096);
+  std::memset(large, 1, huge_page_size / 2 + 1);
+  const HugePageStats stats = resource.stats();
+  EXPECT_EQ(huge_page_size, stats.mapped_bytes);
+  EXPECT_EQ(1u, stats.hugetlb_mappings + stats.advised_mappings);
+  resource.deallocate(large, huge_page_size / 2 + 1);
+  EXPECT_EQ(0u, resource.stats().mapped_bytes);
+
+  // Arenas reserved in huge pages parse like any other.
+  Allocator allocator{&resource};
+  allocator.reserve_bytes(huge_page_size);
+  EXPECT_EQ(huge_page_size, resource.stats().mapped_bytes);
+  Expression expression;
+  LexerDelegate lexer_delegate;
+  Lexer lexer{"If(8 - 3, Min(5, 9, 4), 1 + 2)", lexer_delegate, 0};
+  BasicParserDelegate<PolymorphicToken> parser_delegate{allocator};
+  BasicParser<Lexer, BasicParserDelegate<PolymorphicToken>> parser{
+      lexer, parser_delegate};
+  expression.Parse(parser, allocator);
+  EXPECT_EQ(Value(4), expression.Calculate(nullptr));
+  expression.Clear();
+  EXPECT_EQ(0u, resource.stats().mapped_bytes);
+}
+
+TEST(Allocator, StaysWithinByteLimit) {
+  Allocator allocator;
+  allocator.set_byte_limit(200);
+  allocator.allocate(100);
+  // The next chunk shrinks to the bytes left.
+  allocator.allocate(50);
+  EXPECT_EQ(200u, allocator.capacity());
+  allocator.allocate(32);
+  try {
+    allocator.allocate(60);
+    FAIL() << "the allocation must exceed the limit";
+  } catch (const BudgetExceededError& error) {
+    EXPECT_EQ(200u, error.usage().bytes);
+  }
+
+  Allocator reserved;
+  reserved.set_byte_limit(300);
+  reserved.reserve_bytes(1000);
+  EXPECT_EQ(300u, reserved.capacity());
+}
+
+TEST(Expression, RejectsFormulasOverBudget) {
+  std::string formula = "0";
+  for (int i = 1; i <= 200; ++i)
+    formula += " + " + std::to_string(i);
+
+  Expression expression;
+  expression.Parse("1 + 2");
+  EXPECT_EQ(3u, expression.usage().nodes);
+
+  expression.set_budget({kUnlimited, 50});
+  try {
+    expression.Parse(formula.c_str());
+    FAIL() << "the formula must exceed the node budget";
+  } catch (const BudgetExceededError& error) {
+    EXPECT_EQ(50u, error.usage().nodes);
+  }
+  // Failed parses keep the current tree.
+  EXPECT_EQ(Value(3), expression.Calculate(nullptr));
+
+  expression.set_budget({1024, kUnlimited});
+  try {
+    expression.Parse(formula.c_str());
+    FAIL() << "the formula must exceed the byte budget";
+  } catch (const BudgetExceededError& error) {
+    EXPECT_LE(error.usage().bytes, 1024u);
+    EXPECT_GT(error.usage().nodes, 0u);
+  }
+  expression.Parse("Min(4, 2) + 3");
+  EXPECT_EQ(Value(5), expression.Calculate(nullptr));
+  EXPECT_LE(expression.usage().bytes, 1024u);
+
+  // Images are checked before anything is loaded.
+  Expression large;
+  large.Parse(formula.c_str());
+  const std::string image = large.Serialize();
+  expression.set_budget({kUnlimited, 100});
+  try {
+    expression.Deserialize(image);
+    FAIL() << "the image must exceed the node budget";
+  } catch (const BudgetExceededError& error) {
+    EXPECT_EQ(large.usage().nodes, error.usage().nodes);
+    EXPECT_EQ(0u, error.usage().bytes);
+  }
+  expression.set_budget({});
+  expression.Deserialize(image);
+  EXPECT_EQ(Value(20100), expression.Calculate(nullptr));
+  EXPECT_EQ(large.usage().nodes, expression.usage().nodes);
+
+  // Clones stay within the budget of the copy, which keeps its tree when
+  // they fail.
+  Expression clone;
+  clone.Parse("7");
+  clone.set_budget({kUnlimited, 100});
+  EXPECT_THROW(large.Clone(clone), BudgetExceededError);
+  clone.set_budget({1024, kUnlimited});
+  EXPECT_THROW(large.Clone(clone), BudgetExceededError);
+  EXPECT_EQ(Value(7), clone.Calculate(nullptr));
+  clone.set_budget({});
+  large.Clone(clone);
+  EXPECT_EQ(Value(20100), clone.Calculate(nullptr));
+}
+
 TEST(Allocator, ReserveDoesNotChangeParseBehavior) {
   constexpr const char* kFormula =
       "If(8 - 3, Min(5, 9, 4), 1 + 2)";
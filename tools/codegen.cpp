@@ -0,0 +1,53 @@
+// Generates C++ source for the formulas of a text file, one formula per
+// line. Empty lines and lines starting with '#' are skipped. Variables get
+// symbol table slots in the order they first appear.
+//
+// Usage: express_codegen <formulas> <output> [register-function]
+
+#include "express/code_generator.h"
+#include "express/symbol_table.h"
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+  if (argc < 3 || argc > 4) {
+    std::cerr << "usage: " << argv[0]
+              << " <formulas> <output> [register-function]\n";
+    return 2;
+  }
+  const char* register_function =
+      argc == 4 ? argv[3] : "RegisterGeneratedFormulas";
+
+  std::ifstream input{argv[1]};
+  if (!input) {
+    std::cerr << "cannot read " << argv[1] << "\n";
+    return 1;
+  }
+
+  expression::SymbolTable symbol_table;
+  expression::CodeGenerator generator{symbol_table};
+  std::string line;
+  for (size_t number = 1; std::getline(input, line); ++number) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line[0] == '#')
+      continue;
+    try {
+      generator.Add(line);
+    } catch (const std::exception& e) {
+      std::cerr << argv[1] << ":" << number << ": " << e.what() << "\n";
+      return 1;
+    }
+  }
+
+  std::ofstream output{argv[2]};
+  output << generator.Generate(register_function);
+  if (!output.flush()) {
+    std::cerr << "cannot write " << argv[2] << "\n";
+    return 1;
+  }
+  return 0;
+}